@@ -2,24 +2,43 @@
 #define ANTENNASIM_H
 
 #include <list>
+#include <vector>
+#include <random>
 #include <unistd.h>
 #include "exceptions.h"
 #include "DronePlotDB.h"
+#include "SimClock.h"
+
+// Settings for the synthetic load mode (see AntennaSim's second constructor)
+struct synth_config {
+    unsigned int num_drones = 1000;
+    double plots_per_sec = 1000.0;                    // Sim time, all drones together
+    simtime_t burst_interval = 100 * simtime_per_ms;  // Real time between injection bursts
+    unsigned int node_id = 1;                         // Also keeps drone IDs unique per node
+};
 
 // Simulates an antenna receiving drone information and populates the DronePlotDB class as it "receives"
-// information.
+// information. It either replays a recorded source file or, for load testing, generates plots
+// from a fleet of synthetic drones at a set rate.
 //
 // Students should not change anything with this class
 
 class AntennaSim
 {
 public:
-    AntennaSim(DronePlotDB &dpdb, const char *source_filename, float time_mult,
-               int verbosity);
+    // Only plots due before replay_end (raw file timestamp, before the clock offset) are loaded
+    AntennaSim(DronePlotDB &dpdb, const char *source_filename, SimClock &clock,
+               int verbosity, simtime_t replay_end = simtime_max);
+
+    // Synthetic load - config.num_drones drones flying straight tracks, orbits or waypoint
+    // routes around the sample data's area, together reporting config.plots_per_sec. Plots are
+    // injected in bursts until the sim is terminated, with no per-plot output
+    AntennaSim(DronePlotDB &dpdb, const synth_config &config, SimClock &clock, int verbosity);
     virtual ~AntennaSim();
 
-    // Load the data that will be fed to the accessible DB to simulate drone updates
-    void loadSourceDB(const char *filename);
+    // Load the data that will be fed to the accessible DB to simulate drone updates. Plot
+    // archives (.pda) only decode the blocks before end_time, raw .bin files are read whole
+    int loadSourceDB(const char *filename, simtime_t end_time = simtime_max);
 
     // Run the simulation (usually in a thread)
     void simulate();
@@ -30,11 +49,38 @@ public:
     // Are we in the process of exiting the simulation?
     bool isExiting() { return _exiting; };
 
-    int getOffset();
+    // The random skew applied to this antenna's clock
+    simtime_t getOffset() { return _clock.getOffset(); };
 
 private:
 
-    double getAdjustedTime();
+    // How each synthetic drone moves
+    enum motion_model { mm_straight, mm_orbit, mm_waypoint };
+
+    // A synthetic drone's state. Positions are meters east (x) and north (y) of the area center
+    struct synth_drone {
+        unsigned int drone_id;
+        motion_model model;
+        double x, y;
+        double heading;        // Radians counterclockwise from east
+        double speed;          // Meters/sec
+        double center_x, center_y, radius;    // mm_orbit
+        double target_x, target_y;            // mm_waypoint
+    };
+
+    // Skews our clock by a random offset, up to max_clock_offset either way
+    void setRandomOffset();
+
+    // Gives the servers a few seconds to come online before injecting
+    void startDelay();
+
+    // Replays the source database / generates synthetic plots until done or terminated
+    void simulateReplay();
+    void simulateSynthetic();
+
+    // Sets up the synthetic fleet and moves a drone forward secs of sim time
+    void initDrones();
+    void moveDrone(synth_drone &drone, double secs);
 
     // Simulation checks periodically to know when to exit the thread
     bool _exiting;
@@ -42,13 +88,15 @@ private:
     DronePlotDB &_to_db;
     DronePlotDB _source_db;
 
-    float _time_mult;
-    int _time_offset;
+    // Shared with the replication server--the antenna skews it by a random offset
+    SimClock &_clock;
     int _verbosity;
 
-    pthread_mutex_t _offset_mutex;
-
-    time_t _start_time;
+    // Synthetic load mode
+    bool _synthetic;
+    synth_config _synth;
+    std::vector<synth_drone> _drones;
+    std::mt19937 _rng;
 };
 
 
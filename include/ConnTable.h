@@ -0,0 +1,73 @@
+#ifndef CONNTABLE_H
+#define CONNTABLE_H
+
+#include <vector>
+#include <memory>
+#include <stdint.h>
+#include "TCPConn.h"
+
+// Names one connection in a ConnTable. Stays valid until the connection is erased, after
+// which the table no longer resolves it (the slot index is in the low 32 bits, the slot's
+// generation in the high 32, and the generation moves on when the slot is freed)
+typedef uint64_t conn_handle;
+const conn_handle no_conn = 0;
+
+/******************************************************************************************
+ * ConnTable - the connections a TCPServer owns, kept in a dense slot map. Connections sit
+ *             contiguously for iteration, with handles resolving through a slot array in
+ *             O(1), and erasing swaps the last connection into the hole.
+ *
+ *             Two indexes sit on top: socket fd to handle, so a poll event goes straight to
+ *             its connection, and the active list of connections that need handling on
+ *             the next pass whether or not their socket has input.
+ ******************************************************************************************/
+class ConnTable
+{
+public:
+   ConnTable();
+   virtual ~ConnTable();
+
+   // Takes ownership. New connections start out active
+   conn_handle insert(TCPConn *conn);
+   void erase(conn_handle handle);
+
+   // NULL if the connection has been erased
+   TCPConn *get(conn_handle handle);
+
+   // Must be called whenever the connection opens a new socket (insert does it for the
+   // socket it has then). Closed sockets need nothing--lookups check the fd still matches
+   void indexFD(conn_handle handle);
+   conn_handle findFD(int fd);
+
+   // Connections to handle on the next pass. Marking twice only lists it once
+   void markActive(conn_handle handle);
+   void markAllActive();
+   bool hasActive() { return !_active.empty(); };
+   const std::vector<conn_handle> &getActive() { return _active; };
+
+   // Hands over the active list and starts a new, empty one
+   void takeActive(std::vector<conn_handle> &active);
+
+   // Every connection, in no particular order (erase reorders them)
+   size_t size() { return _dense.size(); };
+   TCPConn *at(size_t i) { return _dense[i].get(); };
+
+private:
+   struct slot {
+      uint32_t dense;         // position in _dense while in use, next free slot otherwise
+      uint32_t generation;
+      bool active;
+   };
+
+   uint32_t getSlot(conn_handle handle);
+
+   std::vector<std::unique_ptr<TCPConn>> _dense;
+   std::vector<uint32_t> _dense_slot;       // which slot each _dense entry belongs to
+   std::vector<slot> _slots;
+   uint32_t _free;                          // head of the free slot list
+
+   std::vector<conn_handle> _by_fd;
+   std::vector<conn_handle> _active;
+};
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef CONNTASK_H
+#define CONNTASK_H
+
+#include <coroutine>
+#include <exception>
+#include <utility>
+
+/******************************************************************************************
+ * ConnTask - the coroutine a connection's protocol runs as (see TCPConn). It does not start
+ *            until first resumed, and stops at its end instead of destroying itself, so the
+ *            owner can tell it has finished. An exception that escapes the coroutine is held
+ *            and rethrown from resume, as if the protocol had been called directly.
+ *            Destroying (or replacing) the task destroys a coroutine still suspended in it,
+ *            which must not happen from inside the coroutine itself.
+ *
+ ******************************************************************************************/
+class ConnTask
+{
+public:
+   struct promise_type {
+      std::exception_ptr error;
+
+      ConnTask get_return_object() {
+         return ConnTask(std::coroutine_handle<promise_type>::from_promise(*this));
+      };
+      std::suspend_always initial_suspend() noexcept { return {}; };
+      std::suspend_always final_suspend() noexcept { return {}; };
+      void return_void() {};
+      void unhandled_exception() { error = std::current_exception(); };
+   };
+
+   ConnTask() {};
+   ConnTask(ConnTask &&other) noexcept:_handle(std::exchange(other._handle, nullptr)) {};
+   ~ConnTask() { reset(); };
+
+   ConnTask &operator=(ConnTask &&other) noexcept {
+      if (this != &other) {
+         reset();
+         _handle = std::exchange(other._handle, nullptr);
+      }
+      return *this;
+   };
+
+   ConnTask(const ConnTask &) = delete;
+   ConnTask &operator=(const ConnTask &) = delete;
+
+   // True while there is a coroutine that has not run to its end
+   bool isRunning() { return _handle && !_handle.done(); };
+
+   // Runs the coroutine until it next suspends or finishes
+   void resume() {
+      _handle.resume();
+      if (_handle.done() && _handle.promise().error)
+         std::rethrow_exception(std::exchange(_handle.promise().error, nullptr));
+   };
+
+   void reset() {
+      if (_handle)
+         _handle.destroy();
+      _handle = nullptr;
+   };
+
+private:
+   explicit ConnTask(std::coroutine_handle<promise_type> handle):_handle(handle) {};
+
+   std::coroutine_handle<promise_type> _handle;
+};
+
+#endif
@@ -3,9 +3,15 @@
 
 #include <list>
 #include <vector>
+#include <set>
+#include <atomic>
+#include <memory>
 #include <unistd.h>
 #include <pthread.h>
 #include "exceptions.h"
+#include "SimClock.h"
+#include "FileDesc.h"
+#include "IOUring.h"
 
 
 // Flags for the DronePlot object. The first two are already coded in and
@@ -18,12 +24,15 @@
 #define DBFLAG_USER3    0x16  // Change as needed
 #define DBFLAG_USER4    0x32
 
+// Longest line DronePlot::writeCSV can write, including the newline
+const unsigned int csv_max_line = 96;
+
 // Manages the drone plot database for a particular node.
 class DronePlot
 {
 public:
    DronePlot();
-   DronePlot(int in_droneid, int in_nodeid, int in_timestamp, float in_latitude, float in_longitude);
+   DronePlot(int in_droneid, int in_nodeid, simtime_t in_timestamp, float in_latitude, float in_longitude);
    virtual ~DronePlot();
 
    // Function to serialize, or convert this data into a binary stream in a vector class and back
@@ -34,7 +43,17 @@ public:
    int readCSV(std::string &buf);
    void writeCSV(std::string &buf);
 
+   // Parses one CSV line (without its newline) in place, no allocations. -1 for failure
+   int readCSV(const char *str, const char *end);
+
+   // Formats the CSV line into buf (needs room for csv_max_line chars, no terminator added) and
+   // returns a pointer just past the newline
+   char *writeCSV(char *buf);
+
    static size_t getDataSize();   // Num of bytes required to store the data (for serialization)
+
+   // 64 bit hash of the plot's data (not flags), identifies the same plot across servers
+   uint64_t getHash();
   
    // Flag manipulation -- pass in a define above as in setFlags(DBFLAG_NEW); 
    void setFlags(unsigned short flags);
@@ -44,7 +63,7 @@ public:
    // attributes - freely accessible to modify as needed 
    unsigned int drone_id;
    unsigned int node_id;
-   time_t timestamp;
+   simtime_t timestamp;    // Nanoseconds of sim time
    float latitude;
    float longitude;
    
@@ -66,15 +85,47 @@ public:
    virtual ~DronePlotDB();
 
    // Add a plot to the database with the given attributes (mutex'd)
-   void addPlot(int drone_id, int node_id, time_t timestamp, float lattitude, float longitude);
-
-   // Load or write the database to/from a CSV file, 
-   int loadCSVFile(const char *filename);
+   void addPlot(int drone_id, int node_id, simtime_t timestamp, float lattitude, float longitude);
+
+   // Adds count plots with flags set on each, taking the mutex once. The copies are made
+   // before locking and spliced on, so readers never see a plot without its flags. Returns
+   // the first added plot (they stay contiguous at the end), or end() if count is 0
+   std::list<DronePlot>::iterator addPlots(const DronePlot *plots, size_t count,
+                                           unsigned short flags = 0);
+   std::list<DronePlot>::iterator addPlots(std::vector<DronePlot> &plots, unsigned short flags = 0)
+                                          { return addPlots(plots.data(), plots.size(), flags); };
+
+   // An eventfd that becomes readable when plots are added with DBFLAG_NEW, so an event loop
+   // can wait on the database together with its sockets. Call clearNotify before scanning for
+   // the new plots--anything added after that signals again
+   int getNotifyFD() { return _notify_fd; };
+   void clearNotify();
+
+   // Load or write the database to/from a CSV file. Loading parses newline-aligned chunks of the
+   // file on up to max_threads threads (0 = one per core)
+   int loadCSVFile(const char *filename, unsigned int max_threads = 0);
    int writeCSVFile(const char *filename);
 
-   // Direct binary load/write to/from the specified file
+   // Appends only the plots added since the last CSV write or append. Falls back to rewriting
+   // the whole file if plots were removed or reordered since then
+   int appendCSVFile(const char *filename);
+
+   // Write CSV exports through an io_uring, formatting the next chunk while the last is
+   // written (default off). Plain writes are used if the kernel has no io_uring
+   void setIOUring(bool use_ring) { _csv_ring = use_ring; };
+
+   // Direct binary load/write to/from the specified file. The .bin format stores timestamps in
+   // whole seconds
    int loadBinaryFile(const char *filename);
    int writeBinaryFile(const char *filename);
+
+   // Compressed columnar archive (see PlotArchive.h). Loading keeps only plots with
+   // start_time <= timestamp < end_time from the given nodes (empty for all), using the
+   // archive's footer index to skip whole blocks that hold none of them
+   int loadArchiveFile(const char *filename, simtime_t start_time = simtime_min,
+                       simtime_t end_time = simtime_max,
+                       const std::set<unsigned int> &nodes = std::set<unsigned int>());
+   int writeArchiveFile(const char *filename);
    
    // Sort the database in order of timestamp 
    void sortByTime();
@@ -100,9 +151,30 @@ public:
    void clear();
 
 private:
+   // Writes plots from start through last (inclusive) to the file in large chunks
+   int writeCSVPlots(FileFD &outfile, std::list<DronePlot>::iterator start,
+                                      std::list<DronePlot>::iterator last);
+
+   // The ring for an export if setIOUring is on and the kernel can give us one, else NULL
+   IOUring *openCSVRing(std::unique_ptr<IOUring> &ring);
+
    std::list<DronePlot> _dbdata;
 
+   // The last plot written out by the CSV exporter (end() if none). Only trusted while
+   // _csv_valid, which anything that removes or reorders plots clears
+   std::list<DronePlot>::iterator _csv_last;
+   bool _csv_valid;
+
+   // Reusable formatting buffer for CSV export, and whether exports go through a ring
+   std::vector<char> _csvbuf;
+   bool _csv_ring;
+
    pthread_mutex_t _mutex; 
+
+   // New-plot notification. _notified is set while a signal is outstanding, so a burst of
+   // inserts costs one eventfd write
+   int _notify_fd;
+   std::atomic<bool> _notified;
 };
 
 
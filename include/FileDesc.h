@@ -5,9 +5,13 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <vector>
+#include <deque>
+#include <stdint.h>
 #include <unistd.h>
 #include "exceptions.h"
 
+class IOUring;
+
 // Manages File Descriptors by largely simplfying their interfaces for specific purposes.
 // FileDesc provides some limited functionality and could be instantiated, but child
 // classes may provide specialized capability. These include:
@@ -15,6 +19,11 @@
 // SocketFD - Network socket FD with stored IP/port information in sockaddr_in
 // TermFD - Stdin terminal
 // FileFD - non-buffered file FD with ability to write/read binary data
+//
+// Any of them can be moved onto an io_uring with setRing. Reads then come out of a buffer
+// the ring fills (hasData never waits), writes to sockets are queued behind each other and
+// always report the full length, and writes to files go out at the file's current offset
+// without waiting--call flush to find out whether they made it.
 
 class FileDesc
 {
@@ -42,16 +51,28 @@ public:
    // Writes a single byte to the FD
    ssize_t writeByte(unsigned char data);
 
-   // Checks if the FD has data available to be read
-   bool hasData(long ms_timeout = 10);
+   // Checks if the FD has data available to be read, waiting up to usec_timeout microseconds
+   bool hasData(long usec_timeout = 10);
+
+   // Checks if a write to the FD would not block, waiting up to usec_timeout microseconds
+   bool canWrite(long usec_timeout = 10);
 
    // Checks if the FD is still open (network connections will still appear open even if lost link)
    bool isOpen();
 
    int getFD() { return _fd; };
 
+   // On a ring the descriptor is handed over and closed once the ring is done with it
    void closeFD();
 
+   // Moves this FD's I/O onto ring (NULL, the default, for plain system calls). An open FD is
+   // attached right away, and a socket opened, accepted or listened on later attaches when
+   // it is. The ring must outlive the FD
+   void setRing(IOUring *ring);
+
+   // Waits for writes queued on the ring. False if any of them failed
+   bool flush();
+
    // The code must be defined here for a template for the next two functions
    /*****************************************************************************************
     * readBytes - Template method--for an FD, reads in sizeof(T) * n bytes and stores in a
@@ -74,7 +95,7 @@ public:
       buf.clear();
 
       int results;
-      if ((results = read(_fd, bytebuf, bufsize)) < 0)
+      if ((results = readRaw(bytebuf, bufsize)) < 0)
       {
          delete bytebuf;
          return -1;
@@ -119,7 +140,7 @@ public:
       }
 
       int results;
-      results = write(_fd, bytebuf, bufsize);
+      results = writeRaw(bytebuf, bufsize);
       delete bytebuf;
       return results;
 
@@ -128,9 +149,36 @@ public:
 
  
 protected:
+   friend class IOUring;
+
+   // Waits up to usec_timeout microseconds for any of the poll events on the FD
+   bool waitFor(short events, long usec_timeout);
+
+   // read/write, or their ring equivalents once attached
+   ssize_t readRaw(void *buf, size_t len);
+   ssize_t writeRaw(const void *buf, size_t len);
+
+   // Registers the open FD with the ring. SocketFD arms its receive or accept here too
+   virtual void ringAttach();
+
+   // Called by the ring as it reaps: input that arrived, end of stream (0) or an error
+   // (-errno) that ends the FD's use, and a connection accepted on a listening socket
+   void ringData(const uint8_t *data, size_t len);
+   void ringClosed(int status);
+   virtual void ringAccepted(int fd) { close(fd); };
 
    int _fd;
- 
+
+   // Ring mode - our ID on it (0 while not attached), input not yet read, what ended the
+   // stream (0 while open, 1 for end of stream, -errno), whether we send (sockets) or write
+   // at offsets (files), and the next file write offset
+   IOUring *_ring = NULL;
+   uint32_t _ring_id = 0;
+   std::vector<uint8_t> _ring_in;
+   size_t _ring_in_pos = 0;
+   int _ring_status = 0;
+   bool _ring_stream = false;
+   off_t _ring_off = 0;
 };
 
 /********************************************************************************************
@@ -147,6 +195,9 @@ public:
    bool connectTo(const char *ip_addr, unsigned short port);
    bool connectTo(unsigned long ip_addr, unsigned short port);
    void listenFD(int backlog = 5);
+
+   // Takes the next pending connection off server. The new socket is nonblocking. On false,
+   // errno says why--EAGAIN/EWOULDBLOCK if there was nothing to accept
    bool acceptFD(SocketFD &server);
 
    // Sets this address to reusable to prevent problems when sockets don't shut down properly
@@ -156,10 +207,21 @@ public:
    void getIPAddrStr(std::string &buf); // The IP string associated with this socket
    unsigned short getPort();   // Port in little-endian (host) format
 
+protected:
+   virtual void ringAttach();
+   virtual void ringAccepted(int fd);
+
 private:
 
    sockaddr_in _fd_addr;
 
+   // What the socket is doing, so the ring knows whether to receive or accept on it
+   bool _connected = false;
+   bool _listening = false;
+
+   // Ring mode, listening - connections the ring accepted, for acceptFD
+   std::deque<int> _accepted;
+
 };
 
 /********************************************************************************************
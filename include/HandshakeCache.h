@@ -0,0 +1,56 @@
+#ifndef HANDSHAKECACHE_H
+#define HANDSHAKECACHE_H
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "SimClock.h"
+
+// How far (real time, either way) a one round-trip hello's timestamp may be from our clock.
+// Hosts need clocks this close to each other, and nonces are remembered this long
+const simtime_t replay_window = 30 * simtime_per_sec;
+
+/******************************************************************************************
+ * HandshakeCache - what TCPConn's one round-trip handshake keeps between connections, shared
+ *                  by every connection of a server:
+ *
+ *                    - Server side, the nonces of the hellos accepted within the replay
+ *                      window. The client's first flight carries data that is sealed before
+ *                      the server has said anything, so without this a recorded flight could
+ *                      be replayed to it
+ *                    - Client side, the caps each peer agreed to in its last reply, so the
+ *                      next connection can encode its data with them before hearing back
+ *
+ ******************************************************************************************/
+class HandshakeCache
+{
+public:
+   HandshakeCache(simtime_t window = replay_window);
+   virtual ~HandshakeCache();
+
+   // True if a hello stamped sent (wall clock ns, see SimClock::wallNow) is within the window
+   bool isTimely(simtime_t sent);
+
+   // True the first time a timely nonce is offered, which is then remembered until its hello
+   // can no longer be timely. False for replays and stale hellos
+   bool admitNonce(const std::vector<uint8_t> &nonce, simtime_t sent);
+
+   // Caps the peer last agreed to, 0 (plain payloads) if we have not heard from it yet
+   uint32_t getPeerCaps(const std::string &sid);
+   void setPeerCaps(const std::string &sid, uint32_t caps) { _peer_caps[sid] = caps; };
+
+private:
+   // Forgets nonces whose hellos have left the window
+   void expire(simtime_t now);
+
+   simtime_t _window;
+
+   std::set<std::vector<uint8_t>> _nonces;
+   std::multimap<simtime_t, std::vector<uint8_t>> _expiry;
+
+   std::map<std::string, uint32_t> _peer_caps;
+};
+
+#endif
@@ -0,0 +1,184 @@
+#ifndef IOURING_H
+#define IOURING_H
+
+#include <map>
+#include <vector>
+#include <stdint.h>
+#include <linux/io_uring.h>
+#include "SimClock.h"
+
+class FileDesc;
+
+// Submission queue size (the completion queue is twice this)
+const unsigned int ring_entries = 256;
+
+// Buffers the kernel picks from for multishot receives (a power of two), and their size
+const unsigned int ring_recv_bufs = 256;
+const unsigned int ring_recv_buf_size = 16384;
+
+// Registered buffers for file writes. A write larger than one is split across several
+const unsigned int ring_write_bufs = 8;
+const unsigned int ring_write_buf_size = 256 * 1024;
+
+// How long a listening socket whose accept failed (out of descriptors, say) waits before it
+// is armed again (real time)
+const simtime_t ring_accept_retry = 100 * simtime_per_ms;
+
+/******************************************************************************************
+ * IOUring - an io_uring instance that FileDescs can move their I/O onto (FileDesc::setRing),
+ *           so an event loop pays one io_uring_enter per pass for every socket's sends and
+ *           receives instead of a poll plus reads and writes for each one. Set up with the
+ *           raw system calls, no liburing.
+ *
+ *             - Sockets keep one multishot receive armed, filled from a ring of buffers the
+ *               kernel picks from. Data lands in the owner's input buffer as each completion
+ *               is reaped, so reading it costs no system call
+ *             - Listening sockets keep one multishot accept armed
+ *             - Sends are copied and queued, one in flight per socket, so they go out in
+ *               order. Short sends are resubmitted from where they stopped
+ *             - File writes are copied into registered buffers and written at explicit
+ *               offsets, several in flight at once (see flush)
+ *
+ *           Nothing is submitted until submit. Completions are handed to their owners by
+ *           reap, which notes the descriptors that got input or an accept for takeReady. The
+ *           ring's own descriptor (getFD) polls readable while completions are waiting.
+ *           Requests a completion means re-arming are queued once reap has been through them
+ *           all, and a failed accept only after ring_accept_retry.
+ *
+ *           When an owner lets go of a descriptor (detach) the ring cancels its receive or
+ *           accept, finishes any sends and writes, and only then closes it, so the number is
+ *           not reused while the kernel still holds requests against it.
+ *
+ *           Throws: runtime_error if the kernel has no io_uring (or lacks a feature we need)
+ ******************************************************************************************/
+class IOUring
+{
+public:
+   IOUring(unsigned int entries = ring_entries);
+   virtual ~IOUring();
+
+   IOUring(const IOUring &) = delete;
+   IOUring &operator=(const IOUring &) = delete;
+
+   // Registers an open descriptor and its owner. Returns the ID to pass to everything else.
+   // Streams (sockets) send, others write at offsets
+   uint32_t attach(FileDesc *owner, int fd, bool stream);
+
+   // The owner is done with the descriptor--the ring closes it once the kernel is done too
+   void detach(uint32_t id);
+
+   // Arms a multishot receive or accept on an attached socket
+   void recvMultishot(uint32_t id);
+   void acceptMultishot(uint32_t id);
+
+   // Queues a copy of the data to send on a stream, or to write at offset otherwise
+   void send(uint32_t id, const uint8_t *data, size_t len);
+   void write(uint32_t id, const uint8_t *data, size_t len, uint64_t offset);
+
+   // Waits until every write queued for id has completed
+   //
+   //    Throws: runtime_error if the ring cannot be waited on
+   void flush(uint32_t id);
+
+   // Submits everything queued in one system call, then waits for wait_nr completions if
+   // asked to. Returns the number submitted, -1 if the call failed
+   int submit(unsigned int wait_nr = 0);
+
+   // Hands every waiting completion to its owner. No system call
+   void reap();
+
+   // Descriptors that got input, hung up or had connections to accept since the last call
+   void takeReady(std::vector<int> &ready);
+
+   int getFD() { return _ring_fd; };
+
+private:
+   enum ring_op { op_recv = 1, op_accept = 2, op_send = 3, op_write = 4, op_cancel = 5 };
+
+   // What the ring knows about an attached descriptor. Kept after detach until the kernel
+   // has finished every request against it (pending)
+   struct attachment {
+      FileDesc *owner;           // NULL once detached
+      int fd;
+      bool stream;
+      unsigned int pending = 0;  // requests that have not had their final completion
+      bool recv_armed = false;
+      bool accept_armed = false;
+      unsigned int writes = 0;   // file writes in flight
+
+      // Sends - the bytes in flight (the kernel reads from this, so it is never touched
+      // until the send completes), how far through them we are, and what is queued behind
+      std::vector<uint8_t> sending;
+      size_t sent = 0;
+      std::vector<uint8_t> queued;
+   };
+
+   struct io_uring_sqe *getSQE();
+   uint64_t makeUserData(uint32_t id, ring_op op, uint32_t arg = 0);
+
+   void submitRecv(uint32_t id, attachment &a);
+   void submitAccept(uint32_t id, attachment &a);
+   void submitSend(uint32_t id, attachment &a);
+   void submitCancel(uint32_t id, attachment &a, ring_op op);
+   void submitCancelAll(uint32_t id, attachment &a);
+
+   // Queues the receive, accept or rest of a send a completion left unarmed, if still wanted
+   void rearm(uint32_t id, ring_op op);
+
+   void teardown();
+
+   void complete(const struct io_uring_cqe &cqe);
+   void completeRecv(uint32_t id, attachment *a, const struct io_uring_cqe &cqe);
+   void completeSend(uint32_t id, attachment *a, const struct io_uring_cqe &cqe);
+   void completeWrite(attachment *a, const struct io_uring_cqe &cqe);
+
+   // Closes and forgets a detached descriptor once nothing is pending on it
+   void release(std::map<uint32_t, attachment>::iterator it);
+
+   // Hands a receive buffer back to the kernel, which sees it once published (reap does so
+   // once it has been through the completions)
+   void recycleBuf(uint16_t bid);
+   void publishBufs();
+
+   int _ring_fd;
+
+   // Submission queue (the kernel's head/tail/mask/array, our unpublished tail, and how many
+   // entries are waiting to be submitted) and its entries
+   unsigned int *_sq_head, *_sq_tail, *_sq_mask, *_sq_array, *_sq_flags;
+   unsigned int _sq_entries;
+   unsigned int _sq_local_tail;
+   unsigned int _sq_unsubmitted;
+   struct io_uring_sqe *_sqes;
+
+   // Completion queue
+   unsigned int *_cq_head, *_cq_tail, *_cq_mask;
+   struct io_uring_cqe *_cqes;
+
+   void *_sq_map;
+   size_t _sq_map_size;
+   void *_cq_map;
+   size_t _cq_map_size;
+   size_t _sqes_size;
+
+   // Receive buffers and the ring that hands them to the kernel
+   void *_buf_ring;
+   size_t _buf_ring_size;
+   std::vector<uint8_t> _recv_bufs;
+   uint16_t _buf_tail;
+
+   // Registered write buffers and which are free
+   std::vector<uint8_t> _write_bufs;
+   std::vector<uint16_t> _free_slots;
+   uint32_t _slot_len[ring_write_bufs];
+
+   uint32_t _next_id;
+   std::map<uint32_t, attachment> _attached;
+   std::vector<int> _ready;
+
+   // Re-arms found going through the completions, queued once reap is done with them (getting
+   // room in a full submission queue reaps), and failed accepts with when to try them again
+   std::vector<std::pair<uint32_t, ring_op>> _rearms;
+   std::map<uint32_t, simtime_t> _accept_retry;
+};
+
+#endif
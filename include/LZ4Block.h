@@ -0,0 +1,36 @@
+#ifndef LZ4BLOCK_H
+#define LZ4BLOCK_H
+
+#include <vector>
+#include <cstddef>
+#include <stdint.h>
+
+/******************************************************************************************
+ * LZ4Block - compresses and decompresses buffers in the LZ4 block format, so replication
+ *            payloads can be compressed without another library dependency. The output is a
+ *            standard LZ4 block (no frame header) that any LZ4 decoder can read, given the
+ *            original size:
+ *
+ *               sequence: token (literal length:4, match length - 4:4), extra literal length
+ *                         bytes, literals, match offset (u16 LE), extra match length bytes
+ *
+ *            The compressor is the greedy single-pass kind (a hash of the next 4 bytes finds
+ *            the last place they were seen), which favors speed over ratio.
+ *
+ ******************************************************************************************/
+class LZ4Block
+{
+public:
+   // Appends the compressed form of src to dest
+   static void compress(const uint8_t *src, size_t size, std::vector<uint8_t> &dest);
+
+   // Appends the decompressed block to dest, which must come out to exactly raw_size bytes.
+   // Throws runtime_error if the block is corrupt
+   static void decompress(const uint8_t *src, size_t size, size_t raw_size,
+                          std::vector<uint8_t> &dest);
+
+   // Worst case compressed size (incompressible data grows slightly)
+   static size_t maxCompressedSize(size_t size) { return size + size / 255 + 16; };
+};
+
+#endif
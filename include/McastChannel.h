@@ -0,0 +1,65 @@
+#ifndef MCASTCHANNEL_H
+#define MCASTCHANNEL_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <netinet/in.h>
+#include <crypto++/secblock.h>
+#include "LogMgr.h"
+
+// The most a datagram can carry over IPv4 UDP
+const size_t mcast_max_datagram = 65507;
+
+/******************************************************************************************
+ * McastChannel - sends replication payloads once to a UDP multicast group that every
+ *                server joins, instead of once per peer over TCP. There is no connection to
+ *                authenticate, so each datagram is sealed on its own with keys derived from
+ *                the shared AES key: the sender's ID and payload are encrypted (AES CFB,
+ *                fresh IV) and the whole datagram carries an HMAC-SHA256 tag, checked before
+ *                anything else is read. Datagrams that fail it are dropped.
+ *
+ *                Delivery is best effort--datagrams can be lost, and the caller is expected
+ *                to spot the gaps and repair them some other way.
+ *
+ *                Datagram: HMAC tag (32), IV (16), encrypted { ID length (uint8), ID, payload }
+ *
+ *                Throws: runtime_error if the socket cannot be set up
+ ******************************************************************************************/
+class McastChannel
+{
+public:
+   McastChannel(LogMgr &log, CryptoPP::SecByteBlock &key, unsigned int verbosity = 1);
+   virtual ~McastChannel();
+
+   McastChannel(const McastChannel &) = delete;
+   McastChannel &operator=(const McastChannel &) = delete;
+
+   // Joins group:port (dotted string, host order port) on the interface with address if_addr
+   // (network format, 0 for the default), sending as svr_id. Our own datagrams loop back to
+   // us, so servers on one host--loopback included--all hear each other
+   void join(const char *svr_id, const char *group, unsigned short port, unsigned long if_addr);
+
+   // Sends the payload to the group. False if it does not fit in one datagram
+   bool send(const std::vector<uint8_t> &data);
+
+   // Reads the next valid datagram from another server. False once none are waiting
+   bool receive(std::string &sid, std::vector<uint8_t> &data);
+
+   int getFD() { return _fd; };
+
+private:
+   LogMgr &_log;
+   unsigned int _verbosity;
+
+   std::string _svr_id;
+   int _fd;
+   struct sockaddr_in _group_addr;
+
+   CryptoPP::SecByteBlock _enc_key;
+   CryptoPP::SecByteBlock _mac_key;
+
+   std::vector<uint8_t> _recvbuf;
+};
+
+#endif
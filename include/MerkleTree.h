@@ -0,0 +1,61 @@
+#ifndef MERKLETREE_H
+#define MERKLETREE_H
+
+#include <vector>
+#include <unordered_set>
+#include <stdint.h>
+#include "DronePlotDB.h"
+
+/******************************************************************************************
+ * MerkleTree - a fixed-depth hash tree over time-bucketed drone plots, used for anti-entropy
+ *              between replication servers. Each leaf covers a range of bucket_span sim time
+ *              (wrapping around after 2^depth buckets) and stores the sum of the hashes of
+ *              its plots, so leaf hashes do not depend on the order plots arrived in. Internal
+ *              nodes hash their two children. Two servers holding the same plots have the same
+ *              root, and walking down only the mismatched subtrees finds the divergent leaves.
+ *
+ *              Levels are numbered from the root (level 0) down to the leaves (level depth).
+ *              The tree also remembers every plot hash it has seen so merges are idempotent.
+ *
+ ******************************************************************************************/
+class MerkleTree
+{
+public:
+   MerkleTree(unsigned int depth = 10, simtime_t bucket_span = 8 * simtime_per_sec);
+   virtual ~MerkleTree();
+
+   // Add a plot to its time bucket. Returns false if it was already in the tree
+   bool insert(DronePlot &plot);
+   bool contains(DronePlot &plot);
+
+   // Which leaf a plot or timestamp falls into
+   unsigned int getLeaf(simtime_t timestamp);
+   unsigned int getLeaf(DronePlot &plot) { return getLeaf(plot.timestamp); };
+
+   // Hash of the node at the given level and index (0 for an empty subtree)
+   uint64_t getHash(unsigned int level, unsigned int index);
+   uint64_t getRoot() { return _nodes[0]; };
+
+   unsigned int getDepth() { return _depth; };
+   unsigned int getNumNodes(unsigned int level) { return 1U << level; };
+
+   // Number of distinct plots in the tree
+   size_t size() { return _plots.size(); };
+
+   void clear();
+
+private:
+
+   unsigned int nodePos(unsigned int level, unsigned int index) { return (1U << level) - 1 + index; };
+   void updatePath(unsigned int leaf);
+
+   unsigned int _depth;
+   simtime_t _bucket_span;
+
+   // Heap layout - node n has children 2n+1 and 2n+2, leaves are the last 2^depth entries
+   std::vector<uint64_t> _nodes;
+
+   std::unordered_set<uint64_t> _plots;
+};
+
+#endif
@@ -0,0 +1,137 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <string>
+#include <ostream>
+#include <pthread.h>
+#include <stdint.h>
+
+/******************************************************************************************
+ * Histogram - a lock-free, HDR-style histogram of non-negative values (nanoseconds in
+ *             practice). Values under 32 get their own bucket; above that each power of two
+ *             is split into 16 linear sub-buckets, so any value is recorded to within 1/16
+ *             (about 6%) and the whole uint64 range fits in a fixed 976 buckets. Recording is
+ *             a few relaxed atomic adds, safe from any thread.
+ *
+ ******************************************************************************************/
+class Histogram
+{
+public:
+   static const unsigned int num_buckets = 976;
+
+   Histogram();
+
+   void record(uint64_t value);
+
+   uint64_t getCount() { return _count.load(std::memory_order_relaxed); };
+   uint64_t getSum() { return _sum.load(std::memory_order_relaxed); };
+   uint64_t getMax() { return _max.load(std::memory_order_relaxed); };
+   uint64_t getBucketCount(unsigned int i) { return _buckets[i].load(std::memory_order_relaxed); };
+
+   // Value at percentile pct (0-100), the upper edge of the bucket it falls in. 0 if empty
+   uint64_t getPercentile(double pct);
+
+   // How many values were recorded up to value (to bucket precision)
+   uint64_t getCountUpTo(uint64_t value);
+
+   // Adds everything recorded in other to this histogram (e.g. to combine several servers)
+   void merge(Histogram &other);
+
+   // The bucket a value goes in, and the largest value a bucket holds
+   static unsigned int bucketIndex(uint64_t value);
+   static uint64_t bucketUpper(unsigned int i);
+
+private:
+   std::atomic<uint64_t> _buckets[num_buckets];
+   std::atomic<uint64_t> _count;
+   std::atomic<uint64_t> _sum;
+   std::atomic<uint64_t> _max;
+};
+
+/******************************************************************************************
+ * Metrics - counters, gauges and latency histograms for one replication server. The
+ *           instrumented code updates the public members directly (atomics, no locks), and
+ *           per-peer stats are created on first use and then updated the same way.
+ *           writeReport formats a snapshot, appendToFile adds one to a file and
+ *           writePrometheus formats one for metrics scrapers.
+ *
+ *           Latencies are in real (not sim) nanoseconds.
+ *
+ ******************************************************************************************/
+class Metrics
+{
+public:
+   Metrics();
+   virtual ~Metrics();
+
+   struct peer_stats {
+      std::atomic<uint64_t> bytes_sent{0};
+      std::atomic<uint64_t> bytes_received{0};
+      std::atomic<uint64_t> plots_received{0};
+      std::atomic<uint64_t> handshakes{0};
+   };
+
+   // The stats for a peer, created if needed. The reference stays valid for our lifetime
+   peer_stats &getPeer(const char *peer_id);
+
+   // Payload bytes sent to all peers together, counting multicast datagrams once
+   uint64_t getTotalBytesSent();
+
+   // Writes every metric in "name value" text lines
+   void writeReport(std::ostream &out);
+
+   // Appends a timestamped report to filename. Returns false if it could not be written
+   bool appendToFile(const char *filename);
+
+   // Writes every metric in Prometheus text format, names starting with prefix_
+   void writePrometheus(std::ostream &out, const char *prefix);
+
+   // Asks the replication loop for a report--only sets a flag, so safe in a signal handler
+   static void requestDump() { _dump_requested.store(true); };
+   static bool takeDumpRequest() { return _dump_requested.exchange(false); };
+
+   // Histograms (nanoseconds)
+   Histogram ingest_latency;      // Antenna plot injected -> queued for replication
+   Histogram repl_latency;        // Plot injected on its origin -> stored by us
+   Histogram handshake_time;      // Connect/accept -> authenticated
+   Histogram encrypt_time;
+   Histogram decrypt_time;
+   Histogram encode_time;         // PayloadCodec encode of an outgoing payload
+   Histogram decode_time;         // PayloadCodec decode of an incoming payload
+
+   // Counters
+   std::atomic<uint64_t> plots_queued;
+   std::atomic<uint64_t> plots_replicated;
+   std::atomic<uint64_t> plots_duplicate;
+   std::atomic<uint64_t> batches_sent;
+   std::atomic<uint64_t> batches_received;
+   std::atomic<uint64_t> connect_failures;
+   std::atomic<uint64_t> reconnects;
+   std::atomic<uint64_t> handshake_timeouts;
+   std::atomic<uint64_t> ack_timeouts;
+   std::atomic<uint64_t> shm_sends;          // Payloads handed to a co-located peer's ring
+   std::atomic<uint64_t> shm_fallbacks;      // Payloads for a co-located peer that went by TCP
+   std::atomic<uint64_t> mcast_bytes_sent;   // Datagram bytes sent to the multicast group
+   std::atomic<uint64_t> nacks_sent;         // Retransmission requests for missed batches
+   std::atomic<uint64_t> batches_resent;     // Batches retransmitted in answer to a NACK
+   std::atomic<uint64_t> msgs_dropped;       // Replication messages dropped as malformed
+
+   // Gauges
+   std::atomic<int64_t> queue_depth;
+   std::atomic<int64_t> connections;
+
+private:
+   void writeHistogram(std::ostream &out, const char *name, Histogram &hist);
+   void writePromHistogram(std::ostream &out, const std::string &name, const char *help,
+                           Histogram &hist);
+
+   pthread_mutex_t _peer_mutex;
+   std::map<std::string, std::unique_ptr<peer_stats>> _peers;
+
+   static std::atomic<bool> _dump_requested;
+};
+
+#endif
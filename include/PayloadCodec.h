@@ -0,0 +1,34 @@
+#ifndef PAYLOADCODEC_H
+#define PAYLOADCODEC_H
+
+#include <vector>
+#include <stdint.h>
+
+// Optional payload features two servers can agree on in the TCPConn handshake. Each side sends
+// the bits it supports and only the bits both have are used on that connection
+const uint32_t cap_compact_plots = 0x1;    // Plot batches in the delta/varint wire encoding
+const uint32_t cap_lz4 = 0x2;              // LZ4 block compression of larger payloads
+
+/******************************************************************************************
+ * PayloadCodec - interface for rewriting <REP> payloads on the wire. A connection calls
+ *                encodePayload on outgoing data with the features the peer agreed to, and
+ *                decodePayload on incoming data. Encoded payloads must describe themselves
+ *                so decoding does not depend on the negotiation.
+ *
+ ******************************************************************************************/
+class PayloadCodec
+{
+public:
+   virtual ~PayloadCodec() {};
+
+   // The cap_ bits this side can encode and decode
+   virtual uint32_t getCaps() = 0;
+
+   // Rewrites an outgoing payload in place using only the agreed caps
+   virtual void encodePayload(std::vector<uint8_t> &buf, uint32_t caps) = 0;
+
+   // Turns an incoming payload back into its plain form. Throws runtime_error if corrupt
+   virtual void decodePayload(std::vector<uint8_t> &buf) = 0;
+};
+
+#endif
@@ -0,0 +1,95 @@
+#ifndef PLOTARCHIVE_H
+#define PLOTARCHIVE_H
+
+#include <list>
+#include <vector>
+#include <string>
+#include <set>
+#include <stdint.h>
+#include "DronePlotDB.h"
+
+/******************************************************************************************
+ * PlotArchive - reads and writes the compressed, columnar plot archive format (.pda). Plots
+ *               are stored in blocks of up to block_plots plots, and each block records the
+ *               earliest and latest timestamp it holds so a time-range read can step over
+ *               blocks without decoding them. Inside a block each attribute is its own column:
+ *
+ *                 node_id, drone_id - dictionary of the distinct IDs in the block, then each
+ *                                     plot's index into it using just enough bits
+ *                 timestamp         - delta-of-delta, 1 bit when plots are evenly spaced
+ *                 latitude, longitude - XOR with the previous value (Gorilla), 1 bit when the
+ *                                     value repeats and only the changed bits otherwise
+ *
+ *               All multi-byte values are little-endian so archives move between hosts.
+ *
+ *               File:  header | block | block | ... | index | trailer
+ *               Header (16 bytes): "PDAR", version (u16), flags (u16), block_plots (u32),
+ *                                  reserved (u32)
+ *               Block (24 byte header): num_plots (u32), payload_size (u32), min_time (i64),
+ *                                  max_time (i64), then payload_size bytes of payload
+ *               Index entry, per block: block offset (u64), num_plots (u32), payload_size (u32),
+ *                                  min_time (i64), max_time (i64), node count (u16), node IDs
+ *               Trailer (16 bytes): index offset (u64), num blocks (u32), "PDAX"
+ *
+ *               A reader maps the file, reads the footer index, and decodes only the blocks
+ *               whose time range and node IDs match. Version 1 files (no index) are still
+ *               read by hopping from block header to block header.
+ *
+ ******************************************************************************************/
+
+const uint16_t archive_version = 2;
+const unsigned int archive_block_plots = 4096;
+
+class PlotArchive
+{
+public:
+   PlotArchive(const char *filename);
+   virtual ~PlotArchive();
+
+   // Writes the plots from start up to (not including) end, replacing the file. Returns the
+   // number written or -1 if the file could not be written
+   int writePlots(std::list<DronePlot>::iterator start, std::list<DronePlot>::iterator end,
+                  unsigned int block_plots = archive_block_plots);
+
+   // Appends every plot with start_time <= timestamp < end_time from the given nodes (empty
+   // for all) to plots, in file order. Returns the number read or -1 if the file could not
+   // be read or is corrupt
+   int readPlots(std::list<DronePlot> &plots, simtime_t start_time = simtime_min,
+                 simtime_t end_time = simtime_max,
+                 const std::set<unsigned int> &nodes = std::set<unsigned int>());
+
+   // True if the file starts with the archive header
+   static bool isArchive(const char *filename);
+
+   // How many blocks the last read decoded and how many it stepped over
+   unsigned int getBlocksRead() { return _blocks_read; };
+   unsigned int getBlocksSkipped() { return _blocks_skipped; };
+
+private:
+
+   // Where a block is and what it holds, from the footer index
+   struct archive_block {
+      uint64_t offset;
+      unsigned int num_plots;
+      unsigned int payload_size;
+      simtime_t min_time;
+      simtime_t max_time;
+      std::vector<unsigned int> nodes;    // Empty if unknown (version 1)
+   };
+
+   void readIndex(const uint8_t *data, size_t size, std::vector<archive_block> &blocks);
+   void scanBlocks(const uint8_t *data, size_t size, std::vector<archive_block> &blocks);
+
+   // Compress / decompress the columns of one block
+   void encodeBlock(std::vector<DronePlot *> &plots, std::vector<uint8_t> &buf,
+                    std::vector<unsigned int> &node_dict);
+   void decodeBlock(const uint8_t *data, size_t size, unsigned int num_plots,
+                    std::vector<DronePlot> &plots);
+
+   std::string _filename;
+
+   unsigned int _blocks_read;
+   unsigned int _blocks_skipped;
+};
+
+#endif
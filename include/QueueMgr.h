@@ -3,8 +3,13 @@
 
 #include <queue>
 #include <vector>
+#include <string>
+#include <unordered_map>
 #include <crypto++/secblock.h>
 #include "TCPServer.h"
+#include "ShmTransport.h"
+#include "McastChannel.h"
+#include "HandshakeCache.h"
 
 /*******************************************************************************************
  * QueueMgr - Child class of the TCPServer object, manages a Queue for a middleware/app
@@ -38,6 +43,10 @@ public:
    // Loads replication information into the Queue to transmit to servers
    void sendToAll(std::vector<uint8_t> &data);
    void sendToServer(const char *server_id, std::vector<uint8_t> &data);
+
+   // Loads data for up to fanout randomly chosen servers, skipping any in exclude (gossip)
+   unsigned int sendToRandom(std::vector<uint8_t> &data, unsigned int fanout,
+                                            std::vector<std::string> &exclude);
    
    // Overload simply to remove this server from _server_list. Calls parent funct
    void bindSvr(const char *ip_addr, unsigned short port);
@@ -46,8 +55,42 @@ public:
    // Gets the ID of this particular server
    const char *getServerID() { return _server_ID.c_str(); };
 
-   // Get the number of servers we are replicating to
+   // Entries waiting in the queue (outgoing sends plus received payloads not yet popped)
+   size_t getQueueSize() { return _queue.size(); };
+
+   // Get the number of servers we are replicating to and their IDs
    unsigned int getNumServers() { return _server_list.size(); };
+   const char *getPeerID(unsigned int i) { return std::get<0>(_server_list.at(i)).c_str(); };
+
+   // Connections stamp their handshakes and report clock skew samples to this estimator
+   void setSkewEstimator(SkewEstimator *skew) { _skew = skew; };
+
+   // Connections negotiate this codec's caps in the handshake and encode/decode payloads with it
+   void setPayloadCodec(PayloadCodec *codec) { _codec = codec; };
+
+   // Sends to servers on this host go through shared memory when they can (the default).
+   // Must be set before bindSvr
+   void setSharedMemory(bool use_shm) { _use_shm = use_shm; };
+
+   // Connections we open send their data with the one round-trip handshake (default off).
+   // Accepted connections take it either way
+   void setFastHandshake(bool fast) { _fast_handshake = fast; };
+
+   // Joins this multicast group (port in host order) so sendToGroup can reach every server
+   // at once. Must be set before bindSvr
+   void setMulticast(const char *group, unsigned short port) { _mcast_group = group;
+                                                               _mcast_port = port; };
+
+   // True once bindSvr has joined the group
+   bool hasMulticast() { return (bool) _mcast; };
+
+   // Sends the data once to every server in the group, encoded with our codec. Best
+   // effort: false if it could not go (no group, or too big for a datagram)
+   bool sendToGroup(std::vector<uint8_t> &data);
+
+   // Overloaded to add (and handle) the shared memory links' and multicast fds
+   virtual simtime_t addPollFDs(std::vector<struct pollfd> &fds, simtime_t max_wait);
+   virtual void handleEvents(const std::vector<struct pollfd> &fds);
 
    // Looks up another server based off IP address and port
    const char *getClientID(unsigned long ip_addr, unsigned short port);
@@ -55,6 +98,11 @@ public:
    // Overloaded to prevent this function from being used
    virtual void runServer();
 
+protected:
+
+   // Tells each new connection who we are and what to use for the handshake
+   virtual void initConn(TCPConn *conn);
+
 private:
 
    // Launches a connection to the other server from queue data
@@ -63,6 +111,15 @@ private:
    // Loads server information from servers.txt
    int loadServerList(const char *filename);
 
+   // Rebuilds the lookups below after _server_list changes
+   void indexServerList();
+
+   // Position of the server in _server_list, or -1 if it is not there
+   int findServer(const char *sid);
+
+   // True if the address (network format) is this host's
+   bool isLocalAddr(unsigned long ip_addr);
+
    // Set up our types for managing our queue
    enum qe_type {send, recv};
    struct queue_element {
@@ -77,10 +134,33 @@ private:
 
    std::string _server_ID;
 
+   SkewEstimator *_skew;
+   PayloadCodec *_codec;
+
+   // One round-trip handshake - whether we send with it, and the nonces and peer caps it
+   // keeps across connections
+   bool _fast_handshake;
+   HandshakeCache _handshakes;
+
+   // Links to servers on this host, set up by bindSvr unless turned off
+   bool _use_shm;
+   std::unique_ptr<ShmTransport> _shm;
+
+   // Multicast group, joined by bindSvr if one was set
+   std::string _mcast_group;
+   unsigned short _mcast_port;
+   std::unique_ptr<McastChannel> _mcast;
+   bool _mcast_ready;        // poll flagged datagrams waiting
+
    // The queue list
    std::queue<queue_element> _queue;
 
    std::vector<std::tuple<std::string, unsigned long, unsigned short>> _server_list;  
+
+   // _server_list positions by server ID, and by IP address and port (network format, IP
+   // in the high bits), so routing a send or naming a peer is one hash lookup
+   std::unordered_map<std::string, unsigned int> _server_by_id;
+   std::unordered_map<uint64_t, unsigned int> _server_by_addr;
 };
 
 
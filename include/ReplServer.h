@@ -5,21 +5,30 @@
 #include <memory>
 #include "QueueMgr.h"
 #include "DronePlotDB.h"
+#include "MerkleTree.h"
+#include "SeqTracker.h"
+#include "SimClock.h"
+#include "SkewEstimator.h"
+#include "PayloadCodec.h"
+#include "Metrics.h"
+#include "StatsServer.h"
 
 /***************************************************************************************
  * ReplServer - class that manages replication between servers. The data is automatically
  *              sent to the _plotdb and the replicate method loops, handling replication
  *              until _shutdown is set to true. The QueueMgr object does the majority of
  *              the communications. This object simply runs management loops and should
- *              do deconfliction of nodes
+ *              do deconfliction of nodes. It is also the payload codec for its
+ *              connections, packing plot batches compactly for peers that support it,
+ *              and fills in the stats page if a stats port is set
  *
  ***************************************************************************************/
-class ReplServer
+class ReplServer : public PayloadCodec, public StatsProvider
 {
 public:
-    ReplServer(DronePlotDB &plotdb, const char *ip_addr, unsigned short port, int offset,
-               float _time_mult = 1.0, unsigned int verbosity = 1);
-    ReplServer(DronePlotDB &plotdb, float _time_mult = 1.0);
+    ReplServer(DronePlotDB &plotdb, const char *ip_addr, unsigned short port, SimClock &clock,
+               unsigned int verbosity = 1);
+    ReplServer(DronePlotDB &plotdb, SimClock &clock);
     virtual ~ReplServer();
 
     // Main replication loop, continues until _shutdown is set
@@ -29,17 +38,110 @@ public:
     // Call this to shutdown the loop
     void shutdown();
 
+    // Gossip mode - send each batch to fanout random servers, which forward batches they have
+    // not seen before. 0 (default) sends every batch straight to every server
+    void setGossipFanout(unsigned int fanout) { _gossip_fanout = fanout; };
+
     // An adjusted time that accounts for "time_mult", which speeds up the clock. Any
     // attempts to check "simulator time" should use this function
-    time_t getAdjustedTime();
+    simtime_t getAdjustedTime() { return _clock.now(); };
+
+    // Payloads of at least min_size bytes are LZ4 compressed for peers that support it
+    // (default compress_min_size, 0 turns compression off)
+    void setCompression(unsigned int min_size) { _compress_min = min_size; };
+
+    // PayloadCodec - rm_plots batches go out as rm_plots_compact to peers that agreed to it,
+    // then anything big enough is compressed into an rm_lz4 message
+    virtual uint32_t getCaps();
+    virtual void encodePayload(std::vector<uint8_t> &buf, uint32_t caps);
+    virtual void decodePayload(std::vector<uint8_t> &buf);
+
+    // Latency, throughput and connection stats for this server
+    Metrics &getMetrics() { return _metrics; };
+
+    // Appends a metrics report to filename every interval real nanoseconds (0 = only when
+    // Metrics::requestDump is called, e.g. from a signal, and at shutdown)
+    void setMetricsFile(const char *filename, simtime_t interval);
+
+    // Serve live stats for scrapers on this localhost port (0, the default, to disable)
+    void setStatsPort(unsigned short port) { _stats_port = port; };
+
+    // Connections the kernel queues on our socket before refusing more (set before replicate)
+    void setListenBacklog(int backlog) { _queue.setBacklog(backlog); };
+
+    // Replicate to servers on this host through shared memory (default on, set before replicate)
+    void setSharedMemory(bool use_shm) { _queue.setSharedMemory(use_shm); };
+
+    // Run peer sockets on an io_uring rather than poll (default off, set before replicate)
+    void setIOUring(bool use_ring) { _queue.setIOUring(use_ring); };
+
+    // Send data to peers with the one round-trip handshake, which they must support (default
+    // off). Peers may use it with us either way
+    void setFastHandshake(bool fast) { _queue.setFastHandshake(fast); };
+
+    // Send our plot batches once to this multicast group (port in host order) rather than to
+    // each server, asking origins over TCP for any batches that never arrived. Every server
+    // in the cluster needs the same group. Set before replicate
+    void setMulticast(const char *group, unsigned short port) { _queue.setMulticast(group, port); };
+
+    // StatsProvider - metrics, connection states, queue and database sizes (Prometheus format)
+    virtual void writeStats(std::ostream &out);
 
 private:
 
-    void addReplDronePlots(std::vector<uint8_t> &data);
-    void addSingleDronePlot(std::vector<uint8_t> &data);
+    // Replication message types, carried in the first byte of every queued payload
+    enum repl_msg { rm_plots = 1, rm_treesum = 2, rm_pullreq = 3, rm_clockprobe = 4,
+                    rm_plots_compact = 5, rm_lz4 = 6, rm_nack = 7, rm_seqmark = 8 };
+
+    // Routes an incoming payload to the handler for its message type
+    void handleReplMsg(std::string &sid, std::vector<uint8_t> &data);
+
+    // Plot batches carry their origin server, the run it is on (epoch) and its batch sequence
+    // number
+    unsigned int beginPlotMsg(std::vector<uint8_t> &msg, uint32_t seq);
+    void handlePlotMsg(const char *sid, std::vector<uint8_t> &data);
+    SeqTracker *getSeenBatches(const std::string &origin, uint64_t epoch);
+
+    unsigned int checkPlotCount(std::vector<uint8_t> &data, unsigned int pos);
+    unsigned int addReplDronePlots(std::vector<uint8_t> &data, unsigned int pos);
+    bool acceptReplPlot(DronePlot &plot, simtime_t arrival);
+
+    // Convert plot batches to and from the compact wire encoding (never seen by handlers)
+    unsigned int plotHeaderSize(std::vector<uint8_t> &data);
+    void compactPlotMsg(std::vector<uint8_t> &data);
+    void expandPlotMsg(std::vector<uint8_t> &data);
+    void compressMsg(std::vector<uint8_t> &data);
+    void decompressMsg(std::vector<uint8_t> &data);
+
+    // Multicast repair - origins keep their recent batches; receivers track each origin's
+    // highest sequence number and NACK the gaps below it over TCP
+    void multicastBatch(uint32_t seq, std::vector<uint8_t> &batch);
+    void sendSeqMark();
+    void handleSeqMark(const char *sid, std::vector<uint8_t> &data);
+    void noteOriginSeq(const std::string &origin, uint32_t seq);
+    void sendNacks();
+    void handleNack(const char *sid, std::vector<uint8_t> &data);
+
+    // Writes a metrics report to the metrics file, or stdout if there is none
+    void dumpMetrics();
 
     unsigned int queueNewPlots();
-    void adjustSkew();
+
+    // Event loop helpers - whether a replication pass is due, and sleeping until there is work
+    bool replReady();
+    bool replDue();
+    void waitForEvents();
+
+    // Clock skew - probes open a connection so the handshake can measure a peer's clock
+    void probeClocks();
+    bool skewReady();
+
+    // Anti-entropy - exchange Merkle tree hashes with a peer and pull only divergent buckets
+    void startAntiEntropy();
+    void sendTreeSummary(const char *sid, unsigned int level, std::vector<unsigned int> &indices);
+    void handleTreeSummary(const char *sid, std::vector<uint8_t> &data);
+    void handlePullReq(const char *sid, std::vector<uint8_t> &data);
+    void sendLeafPlots(const char *sid, std::vector<unsigned int> &leaves);
 
 
     QueueMgr _queue;
@@ -47,16 +149,24 @@ private:
     // Holds our drone plot information
     DronePlotDB &_plotdb;
 
+    // Hashes of every plot we hold, bucketed by time for anti-entropy
+    MerkleTree _tree;
+
     bool _shutdown;
 
-    // How fast to run the system clock - 1.0 = normal speed, 2.0 = 2x as fast
-    float _time_mult;
+    // The sim clock, shared with the antenna simulator (includes its skew)
+    SimClock &_clock;
 
-    // System clock time of when the server started
-    time_t _start_time;
+    // Estimates of each peer's clock offset, used to correct our plots before they replicate
+    SkewEstimator _skew;
 
-    // When the last replication happened so we can know when to do another one
-    time_t _last_repl;
+    // When the last replication happened so we can know when to do another one, and whether
+    // the database has signaled new plots since
+    simtime_t _last_repl;
+    bool _new_plots;
+
+    // When we last started an anti-entropy exchange with a peer
+    simtime_t _last_sync;
 
     // How much to spam stdout with server status
     unsigned int _verbosity;
@@ -64,7 +174,37 @@ private:
     // Used to bind the server
     std::string _ip_addr;
     unsigned short _port;
-    unsigned  int priorityNode;
+
+    // How many random servers each batch goes to in gossip mode (0 = send to all)
+    unsigned int _gossip_fanout;
+
+    // When this run started (wall clock ns), which tells peers we restarted, the sequence
+    // number for our next outgoing plot batch, and the latest epoch and batches seen from each
+    // origin
+    uint64_t _epoch;
+    uint32_t _next_seq;
+    std::map<std::string, uint64_t> _origin_epoch;
+    std::map<std::string, SeqTracker> _seen_batches;
+
+    // Multicast only - our recent batches by sequence number, for retransmission, the highest
+    // sequence number heard of from each origin, and whether any of those have gaps to NACK
+    std::map<uint32_t, std::vector<uint8_t>> _sent_batches;
+    std::map<std::string, uint32_t> _origin_highest;
+    bool _seq_gaps;
+    simtime_t _last_nack;
+
+    // Smallest payload worth compressing (0 = never compress)
+    unsigned int _compress_min;
+
+    // Our stats and where/how often to write them (monotonic ns for the last dump)
+    Metrics _metrics;
+    std::string _metrics_file;
+    simtime_t _metrics_interval;
+    simtime_t _last_metrics;
+
+    // Admin listener for scrapers, created in replicate() if _stats_port is set
+    unsigned short _stats_port;
+    std::unique_ptr<StatsServer> _stats;
 };
 
 
@@ -0,0 +1,40 @@
+#ifndef SEQTRACKER_H
+#define SEQTRACKER_H
+
+#include <set>
+#include <vector>
+#include <stdint.h>
+
+/******************************************************************************************
+ * SeqTracker - remembers which sequence numbers from one origin server have been seen.
+ *              Everything at or below _base has been seen; out-of-order arrivals above it
+ *              are held in a set until the gap below them fills in, so memory only grows
+ *              with the number of outstanding gaps. Sequence numbers start at 1.
+ *
+ ******************************************************************************************/
+class SeqTracker
+{
+public:
+   SeqTracker();
+   virtual ~SeqTracker();
+
+   // Marks seq as seen. Returns true the first time a sequence number is marked
+   bool markSeen(uint32_t seq);
+   bool isSeen(uint32_t seq);
+
+   // Marks everything up to seq as seen, giving up on any gaps there
+   void skipTo(uint32_t seq);
+
+   // Lists the sequence numbers up to upto not seen yet, lowest first, at most max of them
+   void getMissing(uint32_t upto, std::vector<uint32_t> &missing, unsigned int max);
+
+   // Highest sequence number below which nothing is missing, and highest seen at all
+   uint32_t getBase() { return _base; };
+   uint32_t getHighest() { return _above.empty() ? _base : *_above.rbegin(); };
+
+private:
+   uint32_t _base;
+   std::set<uint32_t> _above;
+};
+
+#endif
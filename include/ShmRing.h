@@ -0,0 +1,73 @@
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <atomic>
+#include <vector>
+#include <stdint.h>
+#include <stddef.h>
+
+const uint32_t shm_ring_magic = 0x52504c53;      // "SLPR"
+
+// Default size of the data area (a power of two)
+const uint32_t shm_ring_size = 4 * 1024 * 1024;
+
+/******************************************************************************************
+ * ShmRing - single-producer, single-consumer ring of messages in a shared memory segment
+ *           (a memfd), for passing replication payloads between processes on one host.
+ *
+ *           The segment starts with a header holding the write and read positions, each on
+ *           its own cache line, followed by the data area. Positions only ever grow; each
+ *           message is a length word then the bytes, padded to 8. A message that would run
+ *           off the end is preceded by a wrap marker and starts again at the front. Only
+ *           one thread in one process may push, and one may pop.
+ *
+ *           Throws: runtime_error if the segment cannot be created or mapped, or is not a
+ *                   ring
+ ******************************************************************************************/
+class ShmRing
+{
+public:
+   // Creates a new segment of the given data size (rounded up to a power of two)
+   ShmRing(uint32_t capacity);
+
+   // Maps an existing segment, e.g. received from the process that created it
+   ShmRing(int memfd, bool take_fd);
+
+   virtual ~ShmRing();
+
+   ShmRing(const ShmRing &) = delete;
+   ShmRing &operator=(const ShmRing &) = delete;
+
+   // Copies a message in. False if there is not room for it right now (or ever)
+   bool push(const uint8_t *data, size_t len);
+
+   // Copies the oldest message out into buf. False if the ring is empty
+   bool pop(std::vector<uint8_t> &buf);
+
+   bool isEmpty();
+
+   // The segment, to hand to the process on the other end
+   int getFD() { return _fd; };
+   uint32_t getCapacity() { return _capacity; };
+
+private:
+   struct header {
+      uint32_t magic;
+      uint32_t capacity;
+      alignas(64) std::atomic<uint64_t> head;   // bytes ever written
+      alignas(64) std::atomic<uint64_t> tail;   // bytes ever read
+   };
+
+   static_assert(std::atomic<uint64_t>::is_always_lock_free,
+                 "ring positions must be lock free to be shared between processes");
+
+   void mapSegment(size_t size);
+
+   int _fd;
+   header *_hdr;
+   uint8_t *_data;
+   uint32_t _capacity;
+   size_t _map_size;
+};
+
+#endif
@@ -0,0 +1,97 @@
+#ifndef SHMTRANSPORT_H
+#define SHMTRANSPORT_H
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <deque>
+#include <poll.h>
+#include <sys/un.h>
+#include "ShmRing.h"
+#include "LogMgr.h"
+#include "SimClock.h"
+
+/******************************************************************************************
+ * ShmTransport - moves replication payloads between servers on the same host through
+ *                shared memory instead of the TCP loopback. Each direction between two
+ *                servers is one ShmRing plus an eventfd doorbell the sender rings after
+ *                each push.
+ *
+ *                Every server listens on an abstract unix socket named after its TCP
+ *                address. The first send to a peer creates the ring and doorbell, connects
+ *                to the peer's socket and passes both across (SCM_RIGHTS) with our server
+ *                ID. The receiver only takes links from processes running as our own
+ *                user--the ring never leaves the host, so that stands in for the AES
+ *                challenge. The socket then just stays open: either end closing it tells
+ *                the other the link is gone.
+ *
+ *                send returns false whenever the payload cannot go this way (peer not
+ *                listening, ring full, payload too big) and the caller uses TCP instead.
+ *
+ *                Throws: runtime_error if the listening socket cannot be set up
+ ******************************************************************************************/
+class ShmTransport
+{
+public:
+   ShmTransport(LogMgr &log, unsigned int verbosity = 1);
+   virtual ~ShmTransport();
+
+   // Starts listening for links from peers, as the server at ip_addr/port (network format)
+   void listen(const char *svr_id, unsigned long ip_addr, unsigned short port);
+
+   // Pushes the payload into the peer's ring, setting up the link first if needed. False
+   // means nothing was sent
+   bool send(const char *sid, unsigned long ip_addr, unsigned short port,
+                                                         const std::vector<uint8_t> &data);
+
+   // Pops the next payload received from any peer. False if all the rings are empty
+   bool receive(std::string &sid, std::vector<uint8_t> &data);
+
+   // The listening socket, each link's socket and each incoming doorbell, for poll
+   void addPollFDs(std::vector<struct pollfd> &fds);
+
+   // Takes new links, clears doorbells and drops links whose other end went away
+   void handleEvents(const std::vector<struct pollfd> &fds);
+
+   bool isListening() { return _listen_fd >= 0; };
+
+private:
+   struct link {
+      link(int in_sock):sock(in_sock), doorbell(-1) {}
+      ~link();
+
+      int sock;
+      int doorbell;
+      std::unique_ptr<ShmRing> ring;
+      std::string sid;
+   };
+
+   // Builds the abstract socket address for the server at ip_addr/port
+   static socklen_t makeAddr(struct sockaddr_un &addr, unsigned long ip_addr,
+                                                               unsigned short port);
+
+   link *openLink(const char *sid, unsigned long ip_addr, unsigned short port);
+   void acceptLinks();
+   bool readHello(link &in);
+   static void closeRights(struct msghdr &msg);
+
+   LogMgr &_log;
+   unsigned int _verbosity;
+
+   std::string _svr_id;
+   int _listen_fd;
+
+   // Links we send on, by peer ID, and when a peer that refused a link may be tried again
+   std::map<std::string, std::unique_ptr<link>> _out;
+   std::map<std::string, simtime_t> _retry_at;
+
+   // Links we receive on, including ones still waiting for their hello
+   std::vector<std::unique_ptr<link>> _in;
+   size_t _next_in;     // where receive starts looking, so one busy peer can't starve the rest
+
+   // Payloads left in the rings of links that closed, still to be received
+   std::deque<std::pair<std::string, std::vector<uint8_t>>> _leftover;
+};
+
+#endif
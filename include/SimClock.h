@@ -0,0 +1,72 @@
+#ifndef SIMCLOCK_H
+#define SIMCLOCK_H
+
+#include <atomic>
+#include <stdint.h>
+#include <time.h>
+
+// Simulation time in nanoseconds. Plot timestamps, replication timers and skew estimates all
+// use this unit so they can work below one second
+typedef int64_t simtime_t;
+
+const simtime_t simtime_per_sec = 1000000000LL;
+const simtime_t simtime_per_ms = 1000000LL;
+
+// Earliest and latest representable sim times, for open-ended time ranges
+const simtime_t simtime_min = INT64_MIN;
+const simtime_t simtime_max = INT64_MAX;
+
+inline simtime_t secsToSimTime(double secs) { return (simtime_t) (secs * (double) simtime_per_sec); }
+inline double simTimeToSecs(simtime_t t) { return (double) t / (double) simtime_per_sec; }
+
+// Converts between simtime_t and decimal seconds text ("12", "12.5", "-0.001") without going
+// through floating point. formatSimTime writes no terminator and returns the end of the text
+// (at most 21 chars). parseSimTime returns false if the text is not a number
+char *formatSimTime(char *buf, simtime_t t);
+bool parseSimTime(const char *str, const char *end, simtime_t &t);
+
+/******************************************************************************************
+ * SimClock - The simulation clock shared by the antenna simulator and the replication server.
+ *            Reads CLOCK_MONOTONIC (nanosecond resolution, immune to wall-clock changes) and
+ *            scales the elapsed time by time_mult, so at time_mult=10 one real second is ten
+ *            seconds of sim time. An offset can be set to model a skewed local clock.
+ *
+ *            sim time = (monotonic now - start) * time_mult + offset
+ *
+ ******************************************************************************************/
+class SimClock
+{
+public:
+   SimClock(double time_mult = 1.0, simtime_t offset = 0);
+   virtual ~SimClock();
+
+   // Resets the time base so now() reads the offset
+   void start();
+
+   // Current simulation time
+   simtime_t now();
+
+   // Blocks until the sim clock reaches target, but for no more than max_wait real nanoseconds
+   // (0 = no limit). Returns true if target was reached
+   bool sleepUntil(simtime_t target, simtime_t max_wait = 0);
+
+   // How long a span of sim time takes in real time
+   simtime_t toRealTime(simtime_t span) { return (simtime_t) ((double) span / _time_mult); };
+
+   void setOffset(simtime_t offset) { _offset = offset; };
+   simtime_t getOffset() { return _offset; };
+   double getTimeMult() { return _time_mult; };
+
+   // Unscaled CLOCK_MONOTONIC time in nanoseconds, for latency measurements
+   static simtime_t monoNow();
+
+   // CLOCK_REALTIME in nanoseconds since the epoch, for stamps other hosts compare to theirs
+   static simtime_t wallNow();
+
+private:
+   double _time_mult;
+   std::atomic<simtime_t> _offset;
+   simtime_t _mono_start;
+};
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef SKEWESTIMATOR_H
+#define SKEWESTIMATOR_H
+
+#include <map>
+#include <deque>
+#include <string>
+#include "SimClock.h"
+
+/******************************************************************************************
+ * SkewEstimator - tracks how far each peer server's sim clock is from ours. Samples come from
+ *                 an NTP-style timestamp exchange during the TCPConn handshake:
+ *
+ *                    t1 - we send our auth reply        t2 - peer receives it
+ *                    t4 - we receive its reply          t3 - peer sends its reply
+ *
+ *                    offset = ((t2 - t1) + (t3 - t4)) / 2    (peer clock - our clock)
+ *                    delay  = (t4 - t1) - (t3 - t2)          (round trip on the network)
+ *
+ *                 A sample's error is bounded by half its delay, so like NTP's clock filter
+ *                 we keep the last few samples per peer and trust the one with the lowest delay.
+ *
+ *                 getCorrection averages every clock we know about (ours counts as 0), giving
+ *                 the amount to add to our own timestamps to move them onto the cluster-average
+ *                 clock. Every server does the same, so all of them converge on one time base.
+ *
+ ******************************************************************************************/
+class SkewEstimator
+{
+public:
+   SkewEstimator(SimClock &clock, unsigned int filter_size = 8);
+   virtual ~SkewEstimator();
+
+   // Our local sim time, used to stamp the handshake
+   simtime_t now() { return _clock.now(); };
+
+   // Records one exchange with a peer (values in sim nanoseconds)
+   void addSample(const char *peer, simtime_t offset, simtime_t delay);
+
+   // Best estimate of peer clock - our clock. Returns false if we have no samples for it yet
+   bool getOffset(const char *peer, simtime_t &offset);
+   bool hasSample(const char *peer) { return (_peers.find(peer) != _peers.end()); };
+
+   // Add this to our own timestamps to put them on the cluster-average clock
+   simtime_t getCorrection();
+
+private:
+   struct skew_sample {
+      skew_sample(simtime_t in_offset, simtime_t in_delay): offset(in_offset), delay(in_delay) {}
+
+      simtime_t offset;
+      simtime_t delay;
+   };
+
+   SimClock &_clock;
+   unsigned int _filter_size;
+
+   // The most recent samples from each peer, oldest first
+   std::map<std::string, std::deque<skew_sample>> _peers;
+};
+
+#endif
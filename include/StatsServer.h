@@ -0,0 +1,72 @@
+#ifndef STATSSERVER_H
+#define STATSSERVER_H
+
+#include <list>
+#include <memory>
+#include <string>
+#include <ostream>
+#include <vector>
+#include <poll.h>
+#include "FileDesc.h"
+#include "SimClock.h"
+
+/******************************************************************************************
+ * StatsProvider - interface for whatever fills in the stats page. Called once per scrape on
+ *                 the thread that runs StatsServer::handleRequests
+ *
+ ******************************************************************************************/
+class StatsProvider
+{
+public:
+   virtual ~StatsProvider() {};
+
+   // Writes the current stats in Prometheus text exposition format
+   virtual void writeStats(std::ostream &out) = 0;
+};
+
+/******************************************************************************************
+ * StatsServer - a minimal HTTP listener on a localhost port for metrics scrapers. It never
+ *               blocks: handleRequests is called from an existing loop, polls the listening
+ *               socket and any clients that have not sent their request yet, and answers each
+ *               complete request (any path) with the provider's stats. A response the socket
+ *               cannot take at once is finished off as the client drains it. Clients that
+ *               stall past stats_client_timeout are dropped.
+ *
+ ******************************************************************************************/
+class StatsServer
+{
+public:
+   StatsServer(StatsProvider &provider, const char *ip_addr, unsigned short port);
+   virtual ~StatsServer();
+
+   // Accepts new clients and answers any whose request has arrived
+   void handleRequests();
+
+   // Adds the listening socket and connected clients to fds (POLLIN, or POLLOUT for a client
+   // still being written to), so an event loop can sleep until handleRequests has something
+   // to do
+   void addPollFDs(std::vector<struct pollfd> &fds);
+
+   // How many scrapes have been answered
+   unsigned long getNumServed() { return _served; };
+
+private:
+   struct stats_client {
+      SocketFD sock;
+      std::string request;
+      std::string response;      // Non-empty once answered, until the last of it is written
+      size_t sent = 0;
+      simtime_t deadline;
+   };
+
+   // Returns true once the client is done with (answered or dropped)
+   bool handleClient(stats_client &client);
+   bool writeResponse(stats_client &client);
+
+   StatsProvider &_provider;
+   SocketFD _sockfd;
+   std::list<std::unique_ptr<stats_client>> _clients;
+   unsigned long _served;
+};
+
+#endif
@@ -4,11 +4,26 @@
 #include <crypto++/secblock.h>
 #include "FileDesc.h"
 #include "LogMgr.h"
+#include "SkewEstimator.h"
+#include "PayloadCodec.h"
+#include "Metrics.h"
+#include "TimerWheel.h"
+#include "ConnTask.h"
+#include "HandshakeCache.h"
 
 const int max_attempts = 2;
 
+// Real time (monotonic ns) allowed for each step. A failed connect is retried after
+// reconnect_delay; a handshake or ACK that times out is retried up to max_attempts
+const simtime_t reconnect_delay = 5 * simtime_per_sec;
+const simtime_t handshake_timeout = 10 * simtime_per_sec;
+const simtime_t ack_timeout = 10 * simtime_per_sec;
+
 // Methods and attributes to manage a network connection, including tracking the username
-// and a buffer for user input. Status tracks what "phase" of login the user is currently in
+// and a buffer for user input. Status tracks what "phase" of login the user is currently in.
+// Each side of the protocol runs as a coroutine (runClient/runServer) that suspends whenever
+// it needs a message that has not fully arrived, and is resumed by handleConnection once the
+// socket has delivered all of it
 class TCPConn 
 {
 public:
@@ -20,27 +35,43 @@ public:
 
    statustype getStatus() { return _status; };
 
+   // Short name of a status for logs and stats ("datatx", "waitack", ...)
+   static const char *getStatusName(statustype status);
+
    bool accept(SocketFD &server);
 
-   // Primary maintenance function. Checks this connection for input and handles it
-   // depending on the state of the connection
+   // True if the connection can only move on once its socket (getFD) is ready for the events
+   // getPollEvents gives--input, or room for data still queued to send
+   bool isWaitingForInput();
+   int getFD() { return _connfd.getFD(); };
+   short getPollEvents();
+
+   // Primary maintenance function. Reads any input on this connection and, once the message
+   // the protocol is waiting on has arrived (or if it is waiting on none), runs it on
    void handleConnection();
 
    // connect - second version uses ip_addr in network format (big endian)
    void connect(const char *ip_addr, unsigned short port);
    void connect(unsigned long ip_addr, unsigned short port);
 
-   // Send data to the other end of the connection without encryption
+   // Send data to the other end of the connection without encryption. What the socket cannot
+   // take yet is queued and sent from handleConnection
    bool getData(std::vector<uint8_t> &buf);
    bool sendData(std::vector<uint8_t> &buf);
+   bool isSendQueued() { return _send_pos < _sendbuf.size(); };
+
+   // Buffers partial reads until a message ending with endcmd has fully arrived
+   bool getTaggedData(std::vector<uint8_t> &buf, std::vector<uint8_t> &endcmd);
 
    // Calls encryptData or decryptData before send or after receive
    bool getEncryptedData(std::vector<uint8_t> &buf);
    bool sendEncryptedData(std::vector<uint8_t> &buf);
 
-   // Simply encrypts or decrypts a buffer
+   // Simply encrypts or decrypts a buffer, with the shared key or the one given
    void encryptData(std::vector<uint8_t> &buf);
    void decryptData(std::vector<uint8_t> &buf);
+   void encryptData(std::vector<uint8_t> &buf, const CryptoPP::SecByteBlock &key);
+   void decryptData(std::vector<uint8_t> &buf, const CryptoPP::SecByteBlock &key);
 
    // Input data received on the socket
    bool isInputDataReady() { return _data_ready; };
@@ -55,13 +86,47 @@ public:
    // Connections can set the node or server ID of this connection
    void setNodeID(const char *new_id) { _node_id = new_id; };
    void setSvrID(const char *new_id) { _svr_id = new_id; };
-   void authClient1();
 
-    void authClient2();
+   // If set, the handshake also exchanges clock timestamps and feeds the results in here
+   void setSkewEstimator(SkewEstimator *skew) { _skew = skew; };
+
+   // If set, the handshake negotiates the codec's caps and <REP> payloads pass through it
+   void setPayloadCodec(PayloadCodec *codec) { _codec = codec; };
+
+   // The cap_ bits agreed with the other end (valid once authenticated)
+   uint32_t getPeerCaps() { return _peer_caps; };
+
+   // If set, handshake, crypto and codec timings and per-peer byte counts are recorded here
+   void setMetrics(Metrics *metrics) { _metrics = metrics; };
+
+   // If set, reconnects, handshakes and ACKs are timed on this wheel. Without one nothing
+   // times out and a failed connect may be retried right away
+   void setTimers(TimerWheel *timers) { _timers = timers; };
+
+   // If set, called after a timer fires so the owner knows to handle this connection even
+   // though its socket has no input
+   void setWakeup(std::function<void()> wakeup) { _wakeup = wakeup; };
+
+   // If set, the socket runs on this ring once it connects or is accepted (see FileDesc)
+   void setRing(IOUring *ring) { _connfd.setRing(ring); };
+
+   // If set, a connection we open sends its data with the one round-trip handshake (see
+   // runClient). Accepted connections take either handshake, but only take this one if they
+   // have a cache to check nonces against. Clients use the cache for the peer's caps
+   void setFastHandshake(bool fast) { _fast = fast; };
+   void setHandshakeCache(HandshakeCache *cache) { _hs_cache = cache; };
 
-    void authServer1();
+   // Handshake steps, each given the complete message it handles
+   void authClient1(std::vector<uint8_t> &buf);
+   void authClient2(std::vector<uint8_t> &buf);
+   void authServer1(std::vector<uint8_t> &buf);
 
-    void authServer2();
+   void addSkewSample(std::vector<uint8_t> &timcmd, simtime_t t4);
+
+   // Caps we can offer, and parsing the <CAP> command from the other end
+   uint32_t getLocalCaps();
+   uint32_t readCaps(std::vector<uint8_t> &buf);
+   void sendCaps(uint32_t caps);
 
    void createRandAuthStr();
 
@@ -73,19 +138,88 @@ public:
    // Checks if the socket FD is marked as open
    bool isConnected();
 
-   // When should we try to reconnect (prevents spam)
-   time_t reconnect;
+   // Closes the socket and waits reconnect_delay before the connect may be tried again
+   void retryLater();
+
+   // True once a connect that failed or timed out may be tried again
+   bool isRetryDue() { return _retry_due; };
 
    // Assign outgoing data and sets up the socket to manage the transmission
    void assignOutgoingData(std::vector<uint8_t> &data);
 
 protected:
-   // Functions to execute various stages of a connection 
+   // The protocol each end runs, as coroutines started by connect and accept
+   ConnTask runClient();
+   ConnTask runServer();
+
+   // Suspends the protocol until a message ending with endcmd (recvMsg), or the next len
+   // bytes (recvBytes), are in buf. Resumes with false, instead, if the connection is lost (or
+   // closed by the last step) first
+   struct MsgAwaiter {
+      TCPConn &conn;
+      std::vector<uint8_t> &buf;
+      std::vector<uint8_t> *endcmd;    // NULL when waiting for len bytes
+      size_t len;
+
+      bool await_ready() { return !conn._connected || conn.getMsg(buf, endcmd, len); };
+      void await_suspend(std::coroutine_handle<>) {
+         conn._await_buf = &buf;
+         conn._await_cmd = endcmd;
+         conn._await_len = len;
+      };
+      bool await_resume() { return conn._connected; };
+   };
+   MsgAwaiter recvMsg(std::vector<uint8_t> &buf, std::vector<uint8_t> &endcmd) {
+      return MsgAwaiter{*this, buf, &endcmd, 0};
+   };
+   MsgAwaiter recvBytes(std::vector<uint8_t> &buf, size_t len) {
+      return MsgAwaiter{*this, buf, NULL, len};
+   };
+
+   // Suspends the protocol until everything sendData queued has gone out. Resumes with false
+   // if the connection is lost first
+   struct SendAwaiter {
+      TCPConn &conn;
+
+      bool await_ready() { return !conn._connected || conn.flushSend(); };
+      void await_suspend(std::coroutine_handle<>) { conn._await_send = true; };
+      bool await_resume() { return conn._connected; };
+   };
+   SendAwaiter sendFlushed() { return SendAwaiter{*this}; };
+
+   bool getMsg(std::vector<uint8_t> &buf, std::vector<uint8_t> *endcmd, size_t len);
+   bool getSizedData(std::vector<uint8_t> &buf, size_t len);
+
+   void startProto(ConnTask proto);
+
+   // Write queued data, or as much of data as the socket takes (see sendData)
+   bool flushSend();
+   bool writeSome(const uint8_t *data, size_t len, size_t &sent);
+
+   // Functions to execute various stages of a connection, given the message they handle
    void sendSID();
-   void waitForSID();
+   void recvSID(std::vector<uint8_t> &buf);
    void transmitData();
-   void waitForData();
-   void awaitAck();
+   void recvData(std::vector<uint8_t> &buf);
+   void recvAck(std::vector<uint8_t> &buf);
+
+   // Decodes received replication data and holds it for the queue manager. Disconnects and
+   // returns false if it cannot be decoded
+   bool storeInput(std::vector<uint8_t> &buf);
+
+   // One round-trip handshake - the client's hello and sealed data, the server taking them in
+   // two parts (readHello returns the sealed data's length, 0 if it disconnected), and the
+   // client checking the reply
+   void sendHello();
+   size_t readHello(std::vector<uint8_t> &buf);
+   void recvSealedData(std::vector<uint8_t> &hello, std::vector<uint8_t> &sealed);
+   void recvHelloReply(std::vector<uint8_t> &buf);
+
+   // Clears the per-attempt handshake state before a connect (or retry)
+   void resetHandshake();
+
+   // Derives this session's key for label from the shared key and the client's nonce
+   void deriveKey(CryptoPP::SecByteBlock &key, const char *label);
 
    // Looks for commands in the data stream
    std::vector<uint8_t>::iterator findCmd(std::vector<uint8_t> &buf,
@@ -109,20 +243,37 @@ private:
 
    bool _connected = false;
 
-   std::vector<uint8_t> c_rep, c_endrep, c_auth, c_endauth, c_ack, c_sid, c_endsid, c_rand, c_endrand;
+   std::vector<uint8_t> c_rep, c_endrep, c_auth, c_endauth, c_ack, c_sid, c_endsid, c_rand, c_endrand,
+                        c_tim, c_endtim, c_cap, c_endcap, c_hel, c_endhel, c_mac, c_endmac;
 
    statustype _status = s_none;
 
    SocketFD _connfd;
+
+   // The running protocol, and the message it is suspended waiting for (_await_buf is NULL
+   // if none, _await_cmd if it waits for _await_len bytes), or whether it waits for queued
+   // data to go out instead
+   ConnTask _proto;
+   std::vector<uint8_t> *_await_buf = NULL;
+   std::vector<uint8_t> *_await_cmd = NULL;
+   size_t _await_len = 0;
+   bool _await_send = false;
  
    std::string _node_id; // The username this connection is associated with
    std::string _svr_id;  // The server ID that hosts this connection object
 
+   // Bytes read off the socket that do not yet make up a complete message
+   std::vector<uint8_t> _recvbuf;
+
+   // Bytes sendData could not write yet, from _send_pos on
+   std::vector<uint8_t> _sendbuf;
+   size_t _send_pos = 0;
+
    // Store incoming data to be read by the queue manager
    std::vector<uint8_t> _inputbuf;
    bool _data_ready;    // Is the input buffer full and data ready to be read?
 
-   // Store outgoing data to be sent over the network
+   // Store outgoing data to be sent over the network (unwrapped, not yet encoded)
    std::vector<uint8_t> _outputbuf;
 
    CryptoPP::SecByteBlock &_aes_key; // Read from a file, our shared key
@@ -131,6 +282,39 @@ private:
    unsigned int _verbosity;
 
    LogMgr &_server_log;
+
+   // Clock skew measurement - _skew_t1 is when our auth reply went out (client side)
+   SkewEstimator *_skew = NULL;
+   simtime_t _skew_t1 = 0;
+
+   // One round-trip handshake - whether we send with it, nonces and caps shared with the other
+   // connections, the client's nonce and hello stamp (wall clock), and the tag on its first
+   // flight, which the server's reply is bound to
+   bool _fast = false;
+   HandshakeCache *_hs_cache = NULL;
+   std::vector<uint8_t> _nonce;
+   simtime_t _hello_sent = 0;
+   std::vector<uint8_t> _hello_tag;
+
+   // Payload encoding and the features both ends support
+   PayloadCodec *_codec = NULL;
+   uint32_t _peer_caps = 0;
+
+   // Where to record stats, and when the connect/accept happened (monotonic ns)
+   Metrics *_metrics = NULL;
+   simtime_t _handshake_start = 0;
+
+   void recordHandshake();
+
+   // The one deadline this connection has at a time: reconnect, handshake or ACK
+   TimerWheel *_timers = NULL;
+   TimerWheel::Timer _timer;
+   bool _retry_due = false;
+   int _attempts = 0;         // handshakes/sends that timed out so far
+   std::function<void()> _wakeup;
+
+   void armTimer(simtime_t delay);
+   void handleTimeout();
 };
 
 
@@ -1,12 +1,18 @@
 #ifndef TCPSERVER_H
 #define TCPSERVER_H
 
-#include <list>
 #include <memory>
+#include <vector>
+#include <poll.h>
 #include "Server.h"
 #include "FileDesc.h"
 #include "TCPConn.h"
+#include "ConnTable.h"
 #include "LogMgr.h"
+#include "Metrics.h"
+#include "SimClock.h"
+#include "TimerWheel.h"
+#include "IOUring.h"
 #include <crypto++/secblock.h>
 
 /********************************************************************************************
@@ -15,9 +21,23 @@
  *
  *             handleConnection is the primary maintenance function. Calls all the TCPConn
  *             handleConnection functions. 
+ *
+ *             Connection timeouts and reconnects run off a timing wheel that
+ *             handleConnections advances on each pass. Each pass only handles the
+ *             connections that are active: new, just made progress, got a poll event (see
+ *             handleEvents) or had a timer fire. Connections idling on their socket or on a
+ *             retry cost nothing.
+ *
+ *             With setIOUring the listening socket and connections run on an io_uring instead:
+ *             poll watches only the ring, completions are reaped at the start of each pass
+ *             and mark their connections active, and addPollFDs submits the pass's sends and
+ *             re-armed receives in one system call.
  ********************************************************************************************/
 
-const time_t reconnect_delay = 5;
+const int default_backlog = 128;
+
+// Most connections handleSocket takes in one pass, so a storm cannot starve the rest
+const unsigned int max_accepts_per_pass = 64;
 
 class TCPServer : public Server 
 {
@@ -31,21 +51,68 @@ public:
 
    void shutdown();
 
-   TCPConn *handleSocket();
+   // Accepts the connections waiting on the listening socket, returning how many. Only looks
+   // once poll has flagged the socket (handleEvents), or on every call under runServer
+   unsigned int handleSocket();
    virtual void handleConnections();
 
+   // Marks the connections (and listening socket) that came back from poll with events
+   virtual void handleEvents(const std::vector<struct pollfd> &fds);
+
+   // Pending connections the kernel queues for us before it starts refusing them. Must be
+   // set before listenSvr, and is capped by net.core.somaxconn
+   void setBacklog(int backlog) { _backlog = backlog; };
+
+   // Run socket I/O on an io_uring (default off). Set before listenSvr, which falls back to
+   // poll if the kernel cannot give us a ring
+   void setIOUring(bool use_ring) { _use_ring = use_ring; };
+
+   // Adds the listening socket and every connection waiting on its socket to fds, for poll.
+   // Returns how long (real nanoseconds, at most max_wait) until some connection needs
+   // handling without input--0 if one does now
+   virtual simtime_t addPollFDs(std::vector<struct pollfd> &fds, simtime_t max_wait);
+
+   // Connections we opened that are still handshaking, sending or awaiting the ACK (not those
+   // waiting to retry a failed connect)
+   unsigned int getNumSending();
+
    unsigned long getIPAddr() { return _sockfd.getIPAddr(); };
    unsigned short getPort() { return _sockfd.getPort(); };
 
    // Change where the log file is writing to
    void changeLogfile(const char *newfile);
 
+   // Adds a line to the server's log file
+   void writeLog(const char *msg) { _server_log.writeLog(msg); };
+
+   // Connection counts, reconnects and per-connection stats are recorded here if set
+   void setMetrics(Metrics *metrics) { _metrics = metrics; };
+
+   // Node ID and current status of every connection in the list
+   void getConnStates(std::vector<std::pair<std::string, TCPConn::statustype>> &states);
+
 protected:
 
    void loadAESKey(const char *filename);
 
-   // List of TCPConn objects to manage connections
-   std::list<std::unique_ptr<TCPConn>> _connlist;
+   // Called for each connection handleSocket accepts, before it is handled. Subclasses set
+   // up what the handshake needs here
+   virtual void initConn(TCPConn *conn) { (void) conn; };
+
+   // Adds a connection to the table, wired up to be woken by its timers
+   conn_handle addConn(TCPConn *conn);
+
+   // Hands out completions and marks the connections (or listening socket) they were for
+   void reapRing();
+
+   // The ring the sockets below run on (NULL when using poll). Declared first to outlive them
+   std::unique_ptr<IOUring> _ring;
+
+   // Timers for the connections below, so declared first to outlive them
+   TimerWheel _timers;
+
+   // The TCPConn objects managing our connections
+   ConnTable _conns;
 
    CryptoPP::SecByteBlock _aes_key;
 
@@ -53,9 +120,19 @@ protected:
 
    unsigned int _verbosity;
 
+   Metrics *_metrics = NULL;
+
 private:
+   // True if the connection has nothing to do until its socket has input or its timer fires
+   bool isIdle(TCPConn *conn);
+
    // Class to manage the server socket
    SocketFD _sockfd;
+   int _backlog = default_backlog;
+   bool _accept_ready = true;    // the socket may have connections waiting
+
+   bool _use_ring = false;
+   std::vector<int> _ring_ready;
 
 };
 
@@ -0,0 +1,87 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <functional>
+#include <stddef.h>
+#include "SimClock.h"
+
+const unsigned int wheel_bits = 6;
+const unsigned int wheel_slots = 1 << wheel_bits;      // slots per level
+const unsigned int wheel_levels = 4;                   // 64^4 ticks, about 46 hours at 10ms
+
+const simtime_t default_timer_tick = 10 * (simtime_per_sec / 1000);
+
+/******************************************************************************************
+ * TimerWheel - hierarchical timing wheel. Level 0 holds one slot per tick for the next 64
+ *              ticks, each level above covers 64 times the span of the one below, and a
+ *              slot's timers drop a level (cascade) when the wheel reaches it. Arming and
+ *              cancelling a timer is O(1), and a slot is only looked at when its tick comes
+ *              around, so armed timers cost nothing until they are due.
+ *
+ *              Times are monotonic nanoseconds (SimClock::monoNow). The wheel is not
+ *              thread safe--it belongs to the thread running the event loop.
+ ******************************************************************************************/
+class TimerWheel
+{
+private:
+   struct link {
+      link *prev = this;
+      link *next = this;
+   };
+
+public:
+   // A timer embedded in whatever it times--arming it never allocates. Sits in at most one
+   // slot of one wheel, and unhooks itself from it if destroyed while armed
+   class Timer : private link
+   {
+   public:
+      Timer() {};
+      Timer(std::function<void()> callback):_callback(callback) {};
+      ~Timer();
+
+      Timer(const Timer &) = delete;
+      Timer &operator=(const Timer &) = delete;
+
+      void setCallback(std::function<void()> callback) { _callback = callback; };
+
+      bool isArmed() { return _wheel != NULL; };
+      simtime_t getExpiry() { return _expires; };
+
+   private:
+      friend class TimerWheel;
+
+      std::function<void()> _callback;
+      TimerWheel *_wheel = NULL;
+      simtime_t _expires = 0;
+   };
+
+   TimerWheel(simtime_t start, simtime_t tick = default_timer_tick);
+   virtual ~TimerWheel();
+
+   // Schedules the timer to fire at (or, rounded up to the tick, just after) expires.
+   // Re-arming an armed timer moves it
+   void arm(Timer &timer, simtime_t expires);
+   void cancel(Timer &timer);
+
+   // Moves the wheel up to now, running the callback of every timer that came due. Callbacks
+   // may arm or cancel any timer, including their own
+   void advance(simtime_t now);
+
+   // How long from now until advance could next have something to do, at most max_wait
+   simtime_t getWait(simtime_t now, simtime_t max_wait);
+
+   size_t size() { return _count; };
+
+private:
+   void insert(Timer &timer, uint64_t earliest);
+   void unlink(Timer &timer);
+   void cascade(unsigned int level);
+
+   link _slots[wheel_levels][wheel_slots];
+
+   simtime_t _tick;
+   uint64_t _now_tick;     // every tick up to and including this one has been run
+   size_t _count;
+};
+
+#endif
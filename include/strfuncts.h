@@ -1,4 +1,6 @@
 #include <string>
+#include <vector>
+#include <stdint.h>
 
 // Remove /r and /n from a string
 void clrNewlines(std::string &str);
@@ -17,3 +19,7 @@ int hideInput(int fd, bool hide);
 
 // Generates a random string of the assigned length
 void genRandString(std::string &buf, size_t n);
+
+// Lowercase hex text of a byte string, and back. fromHex fails on odd lengths or non-hex
+void toHex(const uint8_t *data, size_t len, std::string &hex);
+bool fromHex(const std::string &hex, std::vector<uint8_t> &data);
@@ -1,61 +1,118 @@
 #include <iostream>
+#include <cmath>
 #include <sys/time.h>
 #include "AntennaSim.h"
 #include "DronePlotDB.h"
+#include "PlotArchive.h"
+
+// Largest random skew the antenna puts on its clock, either direction
+const simtime_t max_clock_offset = 3000 * simtime_per_ms;
+
+// Synthetic drones fly within this many meters of the center of the sample data's area
+const double synth_center_lat = 39.72;
+const double synth_center_lon = -84.14;
+const double synth_area_radius = 20000.0;
+const double meters_per_deg_lat = 111320.0;
 
 /*****************************************************************************************
  * AntennaSim (constructor) - takes in a reference to the accessible database that will be
- *            populated by the simulator
+ *            populated by the simulator and sets a random offset on the clock, between -3
+ *            and +3 seconds from true, to simulate a skewed local clock
  *
  *    Params:  dpdb - a reference to the operational database to inject into
- *             time_mult - how fast to run the injects (2.0 = 2x faster)
+ *             clock - the sim clock (also used by the replication server)
+ *             replay_end - plots stamped at or after this time in the file are not loaded
+ *                          (the sim will have stopped before them)
  *****************************************************************************************/
-AntennaSim::AntennaSim(DronePlotDB &dpdb, const char *source_filename, float time_mult,
-                       int verbosity):
+AntennaSim::AntennaSim(DronePlotDB &dpdb, const char *source_filename, SimClock &clock,
+                       int verbosity, simtime_t replay_end):
+        _exiting(false),
         _to_db(dpdb),
-        _time_mult(time_mult),
-        _time_offset(0),
+        _clock(clock),
         _verbosity(verbosity),
-        _start_time(0)
+        _synthetic(false)
 {
-    pthread_mutex_lock(&_offset_mutex);
+    setRandomOffset();
 
     if (_verbosity == 3)
         std::cout << "SIM: Loading source database: " << source_filename << "\n";
 
-    if (_source_db.loadBinaryFile(source_filename) <= 0)
+    // The offset shifts injection and the end of the run alike, so the window is in file time
+    if (loadSourceDB(source_filename, replay_end) <= 0)
         throw std::runtime_error("Source database could not be opened or was empty.");
 
     if (_verbosity >= 2)
         std::cout << "SIM: Source database " << source_filename << " successfully loaded.\n";
     if (_verbosity >= 1)
-        std::cout << "SIM: simulation started, time multiplier: " << _time_mult << "\n";
+        std::cout << "SIM: simulation started, time multiplier: " << _clock.getTimeMult() << "\n";
 }
 
-// Constructor - no action right now
+/*****************************************************************************************
+ * AntennaSim (constructor) - synthetic load version. Sets up the drone fleet and the same
+ *            random clock offset as a replay
+ *
+ *    Params:  dpdb - a reference to the operational database to inject into
+ *             config - fleet size, plot rate, burst interval and node ID
+ *             clock - the sim clock (also used by the replication server)
+ *
+ *    Throws: runtime_error if the config has no drones or no rate
+ *****************************************************************************************/
+AntennaSim::AntennaSim(DronePlotDB &dpdb, const synth_config &config, SimClock &clock,
+                       int verbosity):
+        _exiting(false),
+        _to_db(dpdb),
+        _clock(clock),
+        _verbosity(verbosity),
+        _synthetic(true),
+        _synth(config)
+{
+    if ((_synth.num_drones == 0) || (_synth.plots_per_sec <= 0.0))
+        throw std::runtime_error("Synthetic load needs at least one drone and a positive rate.");
+
+    setRandomOffset();
+    initDrones();
+
+    if (_verbosity >= 1)
+        std::cout << "SIM: synthetic load started, " << _synth.num_drones << " drones, " <<
+                     _synth.plots_per_sec << " plots/sec, time multiplier: " <<
+                     _clock.getTimeMult() << "\n";
+}
+
+// Destructor - no action right now
 AntennaSim::~AntennaSim() {
 
 }
 
 /*****************************************************************************************
- * loadSourceDB - Loads in the source file in binary format
- *
+ * setRandomOffset - Sets a random offset between -3 and 3 seconds from true (in milliseconds)
+ *                   on the clock, to simulate a skewed local clock
  *****************************************************************************************/
 
-void AntennaSim::loadSourceDB(const char *filename) {
+void AntennaSim::setRandomOffset() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    srand(tv.tv_usec);
 
-    // Load our drone plots to feed to the accessible database
-    int results = _source_db.loadBinaryFile(filename);
+    simtime_t max_ms = max_clock_offset / simtime_per_ms;
+    _clock.setOffset(((rand() % (2 * max_ms + 1)) - max_ms) * simtime_per_ms);
+}
 
-    if (results < 0)
-        throw std::runtime_error("Unable to load the source data file for the simulator.");
-    if (results == 0)
-        throw std::runtime_error("Source data file for simulator was empty.");
+/*****************************************************************************************
+ * loadSourceDB - Loads in the source file, either a plot archive or the raw binary format
+ *
+ *    Params:  filename - the source file
+ *             end_time - for archives, only plots before this timestamp are decoded
+ *
+ *    Returns: number of plots loaded, -1 if the file could not be read
+ *****************************************************************************************/
 
-}
+int AntennaSim::loadSourceDB(const char *filename, simtime_t end_time) {
 
-double AntennaSim::getAdjustedTime() {
-    return static_cast<time_t>(((double) time(NULL) - (double) _start_time) * _time_mult);
+    // Load our drone plots to feed to the accessible database
+    if (PlotArchive::isArchive(filename))
+        return _source_db.loadArchiveFile(filename, simtime_min, end_time);
+
+    return _source_db.loadBinaryFile(filename);
 }
 
 /*****************************************************************************************
@@ -65,88 +122,82 @@ double AntennaSim::getAdjustedTime() {
  *****************************************************************************************/
 
 void AntennaSim::simulate() {
+    if (_synthetic)
+        simulateSynthetic();
+    else
+        simulateReplay();
+}
 
-    // Sort the database by time
-    _source_db.sortByTime();
-
-    // Set up a random offset between 1 and 3 seconds from true
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    srand(tv.tv_usec);
-
-    _time_offset = (rand() % 6) - 3;
-
-    pthread_mutex_unlock(&_offset_mutex);
+/*****************************************************************************************
+ * startDelay - reports our clock offset and waits 3 seconds so the servers can come online
+ *****************************************************************************************/
 
+void AntennaSim::startDelay() {
     if (_verbosity >= 2)
-        std::cout << "SIM: Simulator time offset: " << _time_offset << " secs\n";
+        std::cout << "SIM: Simulator time offset: " << simTimeToSecs(_clock.getOffset()) << " secs\n";
 
     if (_verbosity >= 1)
         std::cout << "SIM: Delaying 3 seconds before starting sim to let servers come online.\n";
 
     // Provide a short 3 second delay before starting
-    for (unsigned int i=3; i>0; i--) {
+    for (unsigned int i=3; (i>0) && !_exiting; i--) {
         if (_verbosity >= 2)
             std::cout << i << "\n";
         sleep(1);
     }
+}
 
-    // Initialize
-    _start_time = time(NULL) + _time_offset - 3;
+/*****************************************************************************************
+ * simulateReplay - injects the source database's plots as the sim clock reaches them
+ *****************************************************************************************/
 
-    timespec sleeptime;
-    std::list<DronePlot>::iterator diter;
+void AntennaSim::simulateReplay() {
 
-    // Change all the inject timestamps to the offset time
-    for (diter = _source_db.begin(); diter != _source_db.end(); diter++) {
-        diter->timestamp += _time_offset;
-    }
+    // Wake up at least this often (real time) to check if we should exit
+    const simtime_t max_sleep = 100 * simtime_per_ms;
 
-    // Loop through the injects, sending them as their time arrives
-    while (_source_db.size() > 0) {
+    // Sort the database by time
+    _source_db.sortByTime();
 
-        // Get the time until our next inject
-        diter = _source_db.begin();
-        double adjusted_time = getAdjustedTime();
+    simtime_t time_offset = _clock.getOffset();
+    startDelay();
 
-        // If the adjusted time is not past the timestamp on our next inject, sleep until it is
-        if (adjusted_time < (double) diter->timestamp) {
+    std::list<DronePlot>::iterator diter;
+    std::vector<DronePlot> burst;
 
-            // We need a more precise adjusted time
+    // Change all the inject timestamps to the offset time
+    for (diter = _source_db.begin(); diter != _source_db.end(); diter++) {
+        diter->timestamp += time_offset;
+    }
 
-            // timespan = how long we need to sleep (add .55 secs to prevent rounding down issues
-            double timespan = ((double) diter->timestamp - adjusted_time) / _time_mult + .55;
-            sleeptime.tv_sec = (time_t) timespan;
-            sleeptime.tv_nsec = (long) (1000000000.0 * (timespan - (double) sleeptime.tv_sec));
+    // Loop through the injects, sending them as their time arrives. We walk the source list
+    // rather than popping it, the whole list is freed at once when the sim is destroyed
+    std::list<DronePlot>::iterator next = _source_db.begin();
+    while ((next != _source_db.end()) && !_exiting) {
 
-            if (_verbosity == 3)
-                std::cout << "SIM: Sim sleeping for " << sleeptime.tv_sec << " secs, " << sleeptime.tv_nsec
-                          << " nanosecs\n";
-            nanosleep(&sleeptime, NULL);
-        }
+        // If the clock is not past the timestamp on our next inject, sleep until it is
+        if (!_clock.sleepUntil(next->timestamp, max_sleep))
+            continue;
 
         // Now inject all that have a timestamp less than the current time
-        adjusted_time = getAdjustedTime();
-        diter = _source_db.begin();
+        simtime_t cur_time = _clock.now();
 
         if (_verbosity >= 2)
-            std::cout << "SIM: Cur systime: " << (time_t) getAdjustedTime() << "\n";
+            std::cout << "SIM: Cur systime: " << simTimeToSecs(cur_time) << "\n";
 
-        while ((_source_db.size() > 0) && (diter->timestamp <= adjusted_time)) {
+        for ( ; (next != _source_db.end()) && (next->timestamp <= cur_time); next++) {
 
             if (_verbosity >= 1)
-                std::cout << "SIM: Injecting plot NodeID: " << diter->node_id << " DroneID: " <<
-                          diter->drone_id << ", Time: " << diter->timestamp << " Lat: " <<
-                          diter->latitude << ", Long: " << diter->longitude << "\n";
-
-            _to_db.addPlot(diter->drone_id, diter->node_id, diter->timestamp, diter->latitude, diter->longitude);
-            diter = _to_db.end();
-            diter--;
-            diter->setFlags(DBFLAG_NEW);
+                std::cout << "SIM: Injecting plot NodeID: " << next->node_id << " DroneID: " <<
+                          next->drone_id << ", Time: " << simTimeToSecs(next->timestamp) << " Lat: " <<
+                          next->latitude << ", Long: " << next->longitude << "\n";
 
-            _source_db.popFront();
-            diter = _source_db.begin();
+            burst.push_back(*next);
         }
+
+        // Everything that came due goes in with one lock, already flagged for replication
+        _to_db.addPlots(burst, DBFLAG_NEW);
+        burst.clear();
     }
 
     if (_verbosity >= 2) {
@@ -156,13 +207,145 @@ void AntennaSim::simulate() {
 
 }
 
-int AntennaSim::getOffset() {
+/*****************************************************************************************
+ * initDrones - creates the synthetic fleet, spread over the area, each with a random motion
+ *              model and a speed between 5 and 30 m/s
+ *****************************************************************************************/
+
+void AntennaSim::initDrones() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    _rng.seed(tv.tv_usec + _synth.node_id);
+
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    std::uniform_real_distribution<double> angle(0.0, 2.0 * M_PI);
+    std::uniform_real_distribution<double> speed(5.0, 30.0);
+    std::uniform_int_distribution<int> model(mm_straight, mm_waypoint);
+
+    _drones.resize(_synth.num_drones);
+    for (unsigned int i=0; i<_synth.num_drones; i++) {
+        synth_drone &drone = _drones[i];
+
+        // Drone IDs are unique per node, so several synthetic nodes never share a track
+        drone.drone_id = (_synth.node_id - 1) * _synth.num_drones + i + 1;
+        drone.model = (motion_model) model(_rng);
+
+        // Uniform over the area's disc (sqrt so the center is not crowded)
+        double r = synth_area_radius * sqrt(unit(_rng)), a = angle(_rng);
+        drone.x = r * cos(a);
+        drone.y = r * sin(a);
+        drone.heading = angle(_rng);
+        drone.speed = speed(_rng);
+
+        // Orbits are 200m-2km circles with the drone starting on the edge
+        drone.radius = 200.0 + 1800.0 * unit(_rng);
+        drone.center_x = drone.x - drone.radius * cos(drone.heading);
+        drone.center_y = drone.y - drone.radius * sin(drone.heading);
+
+        drone.target_x = drone.x;
+        drone.target_y = drone.y;
+    }
+}
+
+/*****************************************************************************************
+ * moveDrone - advances a drone secs along its motion model
+ *****************************************************************************************/
+
+void AntennaSim::moveDrone(synth_drone &drone, double secs) {
+    double dist = drone.speed * secs;
+
+    switch (drone.model) {
+
+        // Mostly straight with a little heading wander, turning back at the edge of the area
+        case mm_straight: {
+            std::normal_distribution<double> wander(0.0, 0.03);
+            drone.heading += wander(_rng);
+            drone.x += dist * cos(drone.heading);
+            drone.y += dist * sin(drone.heading);
+            if (drone.x * drone.x + drone.y * drone.y > synth_area_radius * synth_area_radius)
+                drone.heading = atan2(-drone.y, -drone.x);
+            break;
+        }
+
+        // Circles its center at a constant speed
+        case mm_orbit:
+            drone.heading += dist / drone.radius;
+            drone.x = drone.center_x + drone.radius * cos(drone.heading);
+            drone.y = drone.center_y + drone.radius * sin(drone.heading);
+            break;
+
+        // Flies straight to a random point in the area, then picks another
+        case mm_waypoint: {
+            double dx = drone.target_x - drone.x, dy = drone.target_y - drone.y;
+            double remaining = sqrt(dx * dx + dy * dy);
+            if (remaining <= dist) {
+                drone.x = drone.target_x;
+                drone.y = drone.target_y;
+
+                std::uniform_real_distribution<double> unit(0.0, 1.0);
+                double r = synth_area_radius * sqrt(unit(_rng)), a = 2.0 * M_PI * unit(_rng);
+                drone.target_x = r * cos(a);
+                drone.target_y = r * sin(a);
+            } else {
+                drone.x += dx / remaining * dist;
+                drone.y += dy / remaining * dist;
+            }
+            drone.heading = atan2(dy, dx);
+            break;
+        }
+    }
+}
+
+/*****************************************************************************************
+ * simulateSynthetic - injects plots from the synthetic fleet until terminated. Plot k is due
+ *                     at k / plots_per_sec sim seconds after the start and comes from drone
+ *                     k mod num_drones, so every drone reports at the same steady period.
+ *                     Each burst injects everything that has come due since the last
+ *****************************************************************************************/
+
+void AntennaSim::simulateSynthetic() {
+
+    // Wake up at least this often (real time) to check if we should exit
+    const simtime_t max_sleep = 100 * simtime_per_ms;
+
+    startDelay();
 
-    // force other threads to wait to get offset until it has been set
-    pthread_mutex_lock(&_offset_mutex);
+    double drone_period = (double) _synth.num_drones / _synth.plots_per_sec;
+    simtime_t start = _clock.now();
+    unsigned long injected = 0;
+    std::vector<DronePlot> plots;
 
-    int ret_offset = _time_offset;
+    while (!_exiting) {
+        simtime_t burst_start = SimClock::monoNow();
+        simtime_t cur_time = _clock.now();
+        unsigned long due = (unsigned long) (simTimeToSecs(cur_time - start) * _synth.plots_per_sec);
+        unsigned long burst = due - injected;
+        plots.reserve(burst);
 
-    pthread_mutex_unlock(&_offset_mutex);
-    return ret_offset;
+        for ( ; injected < due; injected++) {
+            synth_drone &drone = _drones[injected % _drones.size()];
+            moveDrone(drone, drone_period);
+
+            float lat = (float) (synth_center_lat + drone.y / meters_per_deg_lat);
+            float lon = (float) (synth_center_lon + drone.x /
+                                 (meters_per_deg_lat * cos(synth_center_lat * M_PI / 180.0)));
+            simtime_t timestamp = start + secsToSimTime((double) injected / _synth.plots_per_sec);
+
+            plots.emplace_back(drone.drone_id, _synth.node_id, timestamp, lat, lon);
+        }
+        _to_db.addPlots(plots, DBFLAG_NEW);
+        plots.clear();
+
+        if ((_verbosity >= 2) && (burst > 0))
+            std::cout << "SIM: Injected " << burst << " synthetic plots, " << injected << " total\n";
+
+        // Sleep out the rest of the interval in slices, so an exit is still noticed in time
+        simtime_t next_burst = burst_start + _synth.burst_interval;
+        for (simtime_t now = SimClock::monoNow(); (now < next_burst) && !_exiting;
+                                                                    now = SimClock::monoNow())
+            usleep(std::min(next_burst - now, max_sleep) / 1000);
+    }
+
+    if (_verbosity >= 2)
+        std::cout << "SIM: Synthetic load stopped after " << injected << " plots.\n";
 }
@@ -0,0 +1,136 @@
+#include "ConnTable.h"
+
+const uint32_t no_slot = 0xffffffff;
+
+ConnTable::ConnTable():_free(no_slot) {
+
+}
+
+ConnTable::~ConnTable() {
+
+}
+
+/*****************************************************************************************
+ * getSlot - resolves a handle to its slot index
+ *
+ *    Returns: the slot, or no_slot if the handle is stale or was never valid
+ *****************************************************************************************/
+uint32_t ConnTable::getSlot(conn_handle handle) {
+   uint32_t index = (uint32_t) handle;
+   if ((index >= _slots.size()) || (_slots[index].generation != (uint32_t) (handle >> 32)))
+      return no_slot;
+
+   // A freed slot has moved on a generation, so only slots in use get this far
+   return index;
+}
+
+/*****************************************************************************************
+ * insert - adds a connection, reusing a freed slot if there is one
+ *
+ *    Returns: the connection's handle
+ *****************************************************************************************/
+conn_handle ConnTable::insert(TCPConn *conn) {
+   uint32_t index;
+   if (_free != no_slot) {
+      index = _free;
+      _free = _slots[index].dense;
+   } else {
+      index = _slots.size();
+      _slots.push_back({0, 1, false});
+   }
+
+   _slots[index].dense = _dense.size();
+   _dense.emplace_back(conn);
+   _dense_slot.push_back(index);
+
+   conn_handle handle = ((conn_handle) _slots[index].generation << 32) | index;
+   indexFD(handle);
+   markActive(handle);
+   return handle;
+}
+
+/*****************************************************************************************
+ * erase - destroys the connection. The last connection moves into its place so the dense
+ *         array stays packed, and the slot goes on the free list a generation on, which
+ *         stales every handle to it (including any left in the active list)
+ *****************************************************************************************/
+void ConnTable::erase(conn_handle handle) {
+   uint32_t index = getSlot(handle);
+   if (index == no_slot)
+      return;
+
+   uint32_t pos = _slots[index].dense;
+   uint32_t last = _dense.size() - 1;
+   if (pos != last) {
+      _dense[pos] = std::move(_dense[last]);
+      _dense_slot[pos] = _dense_slot[last];
+      _slots[_dense_slot[pos]].dense = pos;
+   }
+   _dense.pop_back();
+   _dense_slot.pop_back();
+
+   slot &s = _slots[index];
+   s.generation = (s.generation == 0xffffffff) ? 1 : s.generation + 1;
+   s.active = false;
+   s.dense = _free;
+   _free = index;
+}
+
+TCPConn *ConnTable::get(conn_handle handle) {
+   uint32_t index = getSlot(handle);
+   if (index == no_slot)
+      return NULL;
+   return _dense[_slots[index].dense].get();
+}
+
+/*****************************************************************************************
+ * indexFD/findFD - fds are small integers, so the index is a plain array. An entry left
+ *                  behind by a closed socket is caught because the connection's fd no
+ *                  longer matches, and is overwritten when the number is handed out again
+ *****************************************************************************************/
+void ConnTable::indexFD(conn_handle handle) {
+   TCPConn *conn = get(handle);
+   if ((conn == NULL) || (conn->getFD() < 0))
+      return;
+
+   size_t fd = conn->getFD();
+   if (fd >= _by_fd.size())
+      _by_fd.resize(fd + 1, no_conn);
+   _by_fd[fd] = handle;
+}
+
+conn_handle ConnTable::findFD(int fd) {
+   if ((fd < 0) || ((size_t) fd >= _by_fd.size()))
+      return no_conn;
+
+   conn_handle handle = _by_fd[fd];
+   TCPConn *conn = get(handle);
+   if ((conn == NULL) || (conn->getFD() != fd))
+      return no_conn;
+   return handle;
+}
+
+void ConnTable::markActive(conn_handle handle) {
+   uint32_t index = getSlot(handle);
+   if ((index == no_slot) || _slots[index].active)
+      return;
+
+   _slots[index].active = true;
+   _active.push_back(handle);
+}
+
+void ConnTable::markAllActive() {
+   for (uint32_t index : _dense_slot)
+      markActive(((conn_handle) _slots[index].generation << 32) | index);
+}
+
+void ConnTable::takeActive(std::vector<conn_handle> &active) {
+   active.clear();
+   active.swap(_active);
+
+   for (conn_handle handle : active) {
+      uint32_t index = getSlot(handle);
+      if (index != no_slot)
+         _slots[index].active = false;
+   }
+}
@@ -3,15 +3,26 @@
 #include <cstring>
 #include <unistd.h>
 #include <iostream>
-#include <sstream>
-#include <fstream>
-#include <iomanip>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <thread>
+#include <charconv>
+#include <iterator>
+#include <algorithm>
 
 #include "DronePlotDB.h"
 #include "strfuncts.h"
 #include "FileDesc.h"
+#include "PlotArchive.h"
 
 
+// Size of the CSV export buffer--lines are flushed to the file in chunks of about this size
+const unsigned int csv_buf_size = 256 * 1024;
+
+// Each CSV load thread gets at least this much of the file, smaller files are parsed on fewer
+const size_t csv_min_chunk = 1024 * 1024;
+
 // Short compare function for database sort by timestamp
 bool compare_plot(const DronePlot &pp1, const DronePlot &pp2) {
    return (pp1.timestamp < pp2.timestamp);
@@ -35,7 +46,7 @@ DronePlot::DronePlot():
  * DronePlot - Constructor for a drone plot object, initialized by parameters
  *****************************************************************************************/
 
-DronePlot::DronePlot(int in_droneid, int in_nodeid, int in_timestamp, float in_latitude, float in_longitude):
+DronePlot::DronePlot(int in_droneid, int in_nodeid, simtime_t in_timestamp, float in_latitude, float in_longitude):
                drone_id(in_droneid),
                node_id(in_nodeid),
                timestamp(in_timestamp),
@@ -61,6 +72,29 @@ size_t DronePlot::getDataSize() {
                      sizeof(longitude);
 }
 
+/*****************************************************************************************
+ * getHash - hashes the plot's data attributes (FNV-1a followed by a 64 bit finalizer) so that
+ *           the same plot hashes identically on every server. Flags are not included.
+ *
+ *    Returns: the hash, never 0 so that 0 can mean "no plots" to callers
+ *****************************************************************************************/
+uint64_t DronePlot::getHash() {
+   std::vector<uint8_t> buf;
+   buf.reserve(getDataSize());
+   serialize(buf);
+
+   uint64_t h = 0xCBF29CE484222325ULL;
+   for (unsigned int i=0; i<buf.size(); i++) {
+      h ^= buf[i];
+      h *= 0x100000001B3ULL;
+   }
+   h = (h ^ (h >> 33)) * 0xFF51AFD7ED558CCDULL;
+   h = (h ^ (h >> 33)) * 0xC4CEB9FE1A85EC53ULL;
+   h ^= (h >> 33);
+
+   return (h == 0) ? 1 : h;
+}
+
 /*****************************************************************************************
  * serialize - converts the data in this object into a series of binary data and stores the
  *             bytes in a vector buffer
@@ -79,8 +113,6 @@ void DronePlot::serialize(std::vector<uint8_t> &buf) {
    uint8_t sizes[5] = {sizeof(drone_id), sizeof(node_id), sizeof(timestamp), 
                        sizeof(latitude), sizeof(longitude)};
 
-   if (drone_id == 0)
-      throw std::runtime_error("Die");
    // Loop through all our data variables and their sizes, and push to vector byte by byte
    for (unsigned int i=0; i<5; i++) { 
       for (unsigned int j=0; j < sizes[i]; j++, dataptrs[i]++)
@@ -129,59 +161,101 @@ void DronePlot::deserialize(std::vector<uint8_t> &buf, unsigned int start_pt) {
  *    Returns: -1 for failure, 0 otherwise
  *****************************************************************************************/
 int DronePlot::readCSV(std::string &buf) {
-      std::string::size_type commapos;
-      std::string data;
-      unsigned int startpos = 0;
-
-      // Loop and get the first four data points
-      for (unsigned int i=0; i<4; i++) {
-
-         // Find the next comma
-         commapos = buf.find(",", startpos);
-         if (commapos == std::string::npos)
-            return -1;
-
-         // Get the substring of our target variable
-         data = buf.substr(startpos, commapos-startpos);
-
-         // Now load the data
-         switch (i) {
-         case 0:
-            drone_id = std::stoi(data);
-            break;
-         case 1:
-            node_id = std::stoi(data);
-            break;
-         case 2:
-            timestamp = (time_t) std::stoi(data);
-            break;
-         case 3:
-            latitude = std::stof(data);
-            break;
-         default:
-            throw std::runtime_error("This should not have happened");
-            break;
-         }
-         startpos = commapos + 1;
-      }
+   return readCSV(buf.data(), buf.data() + buf.size());
+}
 
-      // Now get the final float
-      data = buf.substr(startpos, buf.size());
-      longitude = std::stof(data);
+/*****************************************************************************************
+ * parseCSVField - parses one field ending at the next delimiter (or end) with std::from_chars,
+ *                 allowing spaces and a \r around the value
+ *
+ *    Params:  str - start of the field, moved past its delimiter on success
+ *             end - end of the line
+ *             value - receives the value
+ *             last - true if this is the last field on the line (no comma after)
+ *
+ *    Returns: true if the whole field was a valid value
+ *****************************************************************************************/
+template <typename T>
+static bool parseCSVField(const char *&str, const char *end, T &value, bool last) {
+   const char *field_end = last ? end : (const char *) memchr(str, ',', end - str);
+   if (field_end == NULL)
+      return false;
+
+   while ((str < field_end) && (*str == ' '))
+      str++;
+
+   auto results = std::from_chars(str, field_end, value);
+   if (results.ec != std::errc())
+      return false;
+
+   for (str = results.ptr; (str < field_end) && ((*str == ' ') || (*str == '\r')); str++);
+   if (str != field_end)
+      return false;
+
+   if (!last)
+      str++;
+   return true;
+}
 
-      return 0;
+/*****************************************************************************************
+ * readCSV - Populates this drone entry from one line of csv text, parsing in place
+ *
+ *    Params:  str/end - the line, without its newline
+ *
+ *    Returns: -1 for failure, 0 otherwise
+ *****************************************************************************************/
+int DronePlot::readCSV(const char *str, const char *end) {
+   int in_droneid, in_nodeid;
+
+   if (!parseCSVField(str, end, in_droneid, false) || !parseCSVField(str, end, in_nodeid, false))
+      return -1;
+
+   const char *time_end = (const char *) memchr(str, ',', end - str);
+   if ((time_end == NULL) || !parseSimTime(str, time_end, timestamp))
+      return -1;
+   str = time_end + 1;
+
+   if (!parseCSVField(str, end, latitude, false) || !parseCSVField(str, end, longitude, true))
+      return -1;
+
+   drone_id = in_droneid;
+   node_id = in_nodeid;
+   return 0;
 }
 
 /*****************************************************************************************
- * writeCSV - writes this drone entry into a CSV entry (storing in buf)
+ * writeCSV - writes this drone entry into a CSV entry (storing in buf). The timestamp is
+ *            written in seconds, with a fractional part only if it is not a whole second
  *
  *****************************************************************************************/
 void DronePlot::writeCSV(std::string &buf) {
-   std::stringstream tmpbuf;
+   char line[csv_max_line];
 
-   tmpbuf << drone_id << "," << node_id << "," << timestamp << "," << std::setprecision(10) << latitude << "," <<
-                                                                      longitude << "\n";
-   buf = tmpbuf.str();
+   buf.assign(line, writeCSV(line));
+}
+
+/*****************************************************************************************
+ * writeCSV - formats this drone entry straight into a char buffer with std::to_chars, no
+ *            allocations. Coordinates use the shortest text that reads back to the same float
+ *
+ *    Params:  buf - where to write, must have room for csv_max_line chars
+ *
+ *    Returns: pointer just past the newline (no null terminator is added)
+ *****************************************************************************************/
+char *DronePlot::writeCSV(char *buf) {
+   char *end = buf + csv_max_line;
+
+   buf = std::to_chars(buf, end, drone_id).ptr;
+   *buf++ = ',';
+   buf = std::to_chars(buf, end, node_id).ptr;
+   *buf++ = ',';
+   buf = formatSimTime(buf, timestamp);
+   *buf++ = ',';
+   buf = std::to_chars(buf, end, latitude).ptr;
+   *buf++ = ',';
+   buf = std::to_chars(buf, end, longitude).ptr;
+   *buf++ = '\n';
+   return buf;
 }
 
 /*****************************************************************************************
@@ -209,15 +283,35 @@ bool DronePlot::isFlagSet(unsigned short flags) {
  * DronePlotDB - Constructor, currently initializes the mutex only
  *
  *****************************************************************************************/
-DronePlotDB::DronePlotDB() {
+DronePlotDB::DronePlotDB():
+                     _csv_valid(false),
+                     _csv_ring(false),
+                     _notified(false)
+{
 
    // Initialize our mutex for thread protection
    pthread_mutex_init(&_mutex, NULL);
+
+   _notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+   if (_notify_fd < 0)
+      throw std::runtime_error("Unable to create the database notification eventfd");
 }
 
-// No behavior for destructor yet
 DronePlotDB::~DronePlotDB() {
+   close(_notify_fd);
+}
 
+/*****************************************************************************************
+ * clearNotify - drains the notification eventfd. Draining before clearing _notified means
+ *               an insert that races with us either signals again or was made before the
+ *               caller's scan, so no new plot can be missed
+ *****************************************************************************************/
+
+void DronePlotDB::clearNotify() {
+   uint64_t count;
+   while (read(_notify_fd, &count, sizeof(count)) > 0)
+      ;
+   _notified.store(false);
 }
 
 
@@ -226,13 +320,13 @@ DronePlotDB::~DronePlotDB() {
  *
  *    Params:  drone_id - the unique integer ID of this particular drone
  *             node_id - the unique integer ID of the receiving site
- *             timestamp - the plot's time in seconds
+ *             timestamp - the plot's time in nanoseconds
  *             latitude - floating point latitude coordinate of this plot point
  *             longitude - floating point longitude coordinate of this plot point
  *             
  *****************************************************************************************/
 
-void DronePlotDB::addPlot(int drone_id, int node_id, time_t timestamp, float latitude, float longitude) {
+void DronePlotDB::addPlot(int drone_id, int node_id, simtime_t timestamp, float latitude, float longitude) {
    // First lock the mutex (blocking)
    pthread_mutex_lock(&_mutex);
 
@@ -242,49 +336,175 @@ void DronePlotDB::addPlot(int drone_id, int node_id, time_t timestamp, float lat
    pthread_mutex_unlock(&_mutex);
 }
 
+/*****************************************************************************************
+ * addPlots - Adds a batch of plots at the end of the doubly-linked list under one lock
+ *
+ *    Params:  plots - the plots to copy in
+ *             count - how many there are
+ *             flags - DBFLAG_ bits to set on every added plot (e.g. DBFLAG_NEW)
+ *
+ *    Returns: iterator to the first plot added, end() if none were
+ *****************************************************************************************/
+
+std::list<DronePlot>::iterator DronePlotDB::addPlots(const DronePlot *plots, size_t count,
+                                                     unsigned short flags) {
+   if (count == 0)
+      return _dbdata.end();
+
+   // Build the nodes outside the lock, so it is only held for the splice
+   std::list<DronePlot> batch(plots, plots + count);
+   if (flags != 0) {
+      for (auto &plot : batch)
+         plot.setFlags(flags);
+   }
+   std::list<DronePlot>::iterator first = batch.begin();
+
+   pthread_mutex_lock(&_mutex);
+   _dbdata.splice(_dbdata.end(), batch);
+   pthread_mutex_unlock(&_mutex);
+
+   // Wake whoever waits for new plots, unless a signal is already outstanding
+   if ((flags & DBFLAG_NEW) && !_notified.exchange(true)) {
+      uint64_t one = 1;
+      if (write(_notify_fd, &one, sizeof(one)) < 0)
+         _notified.store(false);
+   }
+
+   return first;
+}
+
+// One newline-aligned piece of a CSV file, parsed by its own thread
+struct csv_chunk {
+   const char *start;
+   const char *end;
+   std::list<DronePlot> plots;
+   bool failed = false;
+};
+
+/*****************************************************************************************
+ * t_parseCSV - thread function, parses every line in a csv_chunk into the chunk's own list
+ *              so threads never share anything until the results are merged
+ *****************************************************************************************/
+static void *t_parseCSV(void *data) {
+   csv_chunk *chunk = static_cast<csv_chunk *>(data);
+
+   const char *line = chunk->start;
+   while (line < chunk->end) {
+      const char *eol = (const char *) memchr(line, '\n', chunk->end - line);
+      if (eol == NULL)
+         eol = chunk->end;
+
+      // Skip blank lines
+      if ((eol > line) && !((eol - line == 1) && (*line == '\r'))) {
+         chunk->plots.emplace_back();
+         if (chunk->plots.back().readCSV(line, eol) == -1) {
+            chunk->failed = true;
+            return NULL;
+         }
+      }
+      line = eol + 1;
+   }
+   return NULL;
+}
+
 /*****************************************************************************************
  * loadCSVFile - loads in a CSV file containing the plot entries in the right order. The
  *               order should be (no spaces around commas):
  *               drone_id,node_id,timestamp,latitude,longitude
  *
+ *               The file is mmapped and split at newlines into one chunk per thread. Each
+ *               thread parses its chunk in place and the chunk lists are spliced onto the
+ *               database in file order, so the result matches a single-threaded load
+ *
  *    Params:  filename - the path/filename of the CSV file to load
+ *             max_threads - the most parsing threads to use, 0 for one per core
  *
- *    Returns: -1 if there was an issue reading the file, otherwise num read in
+ *    Returns: -1 if there was an issue reading the file or starting its threads (nothing is
+ *             added), otherwise num read in
  *
  *****************************************************************************************/
 
-int DronePlotDB::loadCSVFile(const char *filename) {
+int DronePlotDB::loadCSVFile(const char *filename, unsigned int max_threads) {
+   FileFD cfile(filename);
 
-   std::ifstream cfile;
+   if (!cfile.openFile(FileFD::readfd))
+      return -1;
 
-   // Open our file stream with default read settings
-   cfile.open(filename);
-   if (cfile.fail())
+   struct stat fileinfo;
+   if (fstat(cfile.getFD(), &fileinfo) == -1) {
+      cfile.closeFD();
       return -1;
-   
-   // Get line by line, parsing out our data
-   std::string buf, data;
+   }
+
+   size_t size = fileinfo.st_size;
+   if (size == 0) {
+      cfile.closeFD();
+      return 0;
+   }
+
+   void *mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, cfile.getFD(), 0);
+   cfile.closeFD();
+   if (mapped == MAP_FAILED)
+      return -1;
+   madvise(mapped, size, MADV_SEQUENTIAL);
+
+   const char *data = (const char *) mapped;
+   const char *data_end = data + size;
+
+   // Work out how many threads it is worth starting
+   if (max_threads == 0)
+      max_threads = std::max(1U, std::thread::hardware_concurrency());
+   size_t num_chunks = std::min<size_t>(max_threads, std::max<size_t>(1, size / csv_min_chunk));
+
+   // Split into roughly even chunks, moving each boundary to just past a newline
+   std::vector<csv_chunk> chunks(num_chunks);
+   const char *chunk_start = data;
+   for (size_t i=0; i<num_chunks; i++) {
+      const char *chunk_end = data + size * (i + 1) / num_chunks;
+      if (chunk_end < chunk_start)
+         chunk_end = chunk_start;
+      if (i == num_chunks - 1) {
+         chunk_end = data_end;
+      } else {
+         const char *eol = (const char *) memchr(chunk_end, '\n', data_end - chunk_end);
+         chunk_end = (eol == NULL) ? data_end : eol + 1;
+      }
+      chunks[i].start = chunk_start;
+      chunks[i].end = chunk_end;
+      chunk_start = chunk_end;
+   }
+
+   // Parse chunk 0 on this thread while the others run. If a thread cannot be started, the
+   // ones that were still use the chunks and the mapping, so they are waited for first
+   std::vector<pthread_t> threads(num_chunks);
+   size_t started = 1;
+   while ((started < num_chunks) &&
+                  (pthread_create(&threads[started], NULL, t_parseCSV, &chunks[started]) == 0))
+      started++;
+
+   bool failed = (started < num_chunks);
+   if (!failed)
+      t_parseCSV(&chunks[0]);
+
+   failed = failed || chunks[0].failed;
+   for (size_t i=1; i<started; i++) {
+      pthread_join(threads[i], NULL);
+      failed = failed || chunks[i].failed;
+   }
+
+   munmap(mapped, size);
+   if (failed)
+      return -1;
+
+   // Merge in file order--splicing lists moves no plots
    int count = 0;
-   std::list<DronePlot>::iterator newplot;
-  
-   while (!cfile.eof()) {
-      std::getline(cfile, buf);
-
-      if (buf.size() == 0)
-         continue;
-      
-      // Add this to the end and get an iterator pointing to it
-      _dbdata.emplace_back(-1, -1, 0, 0.0, 0.0);
-      newplot = _dbdata.end();
-      newplot--;
-
-      if (newplot->readCSV(buf) == -1)
-         return -1;
-
-      // Add it to the database 
-      count++;
+   pthread_mutex_lock(&_mutex);
+   for (size_t i=0; i<num_chunks; i++) {
+      count += chunks[i].plots.size();
+      _dbdata.splice(_dbdata.end(), chunks[i].plots);
    }
-   cfile.close();
+   pthread_mutex_unlock(&_mutex);
+
    return count;
 }
 
@@ -292,36 +512,155 @@ int DronePlotDB::loadCSVFile(const char *filename) {
  * writeCSVFile - writes the database in order to a CSV text file. The order is:
  *               drone_id,node_id,timestamp,latitude,longitude
  *
- *    Params:  filename - the path/filename of the CSV file to write to
+ *    Params:  filename - the path/filename of the CSV file to write to (replaced if it exists)
  *
- *    Returns: -1 if there was an issue reading the file, otherwise num read in
+ *    Returns: -1 if there was an issue writing the file, otherwise num written
  *
  *****************************************************************************************/
 
 int DronePlotDB::writeCSVFile(const char *filename) {
-   std::ofstream cfile;
+   std::unique_ptr<IOUring> ring;
+   FileFD outfile(filename);
+
+   if (!outfile.openFile(FileFD::writefd, true))
+      return -1;
+   outfile.setRing(openCSVRing(ring));
+
+   // Plots can be added by another thread while we write, so only go as far as the current end
+   pthread_mutex_lock(&_mutex);
+   std::list<DronePlot>::iterator last = _dbdata.end();
+   if (!_dbdata.empty())
+      last--;
+   pthread_mutex_unlock(&_mutex);
+
    int count = 0;
+   if (last != _dbdata.end())
+      count = writeCSVPlots(outfile, _dbdata.begin(), last);
+   if (!outfile.flush())
+      count = -1;
 
-   cfile.open(filename);
-   if (cfile.fail())
+   outfile.closeFD();
+   if (count < 0)
       return -1;
 
-   std::string buf;
-   std::list<DronePlot>::iterator lptr = _dbdata.begin();
-   for ( ; lptr != _dbdata.end(); lptr++) {
-      lptr->writeCSV(buf);
-      cfile << buf;
-      count++;
+   _csv_last = last;
+   _csv_valid = true;
+   return count; 
+}
+
+/*****************************************************************************************
+ * appendCSVFile - appends the plots added to the database since the last writeCSVFile or
+ *                 appendCSVFile, so periodic dumps only cost as much as the new data. If
+ *                 there was no earlier export, or plots were erased or sorted since, the
+ *                 whole file is rewritten instead
+ *
+ *    Params:  filename - the path/filename of the CSV file to add to
+ *
+ *    Returns: -1 if there was an issue writing the file, otherwise num written
+ *
+ *****************************************************************************************/
+
+int DronePlotDB::appendCSVFile(const char *filename) {
+   if (!_csv_valid)
+      return writeCSVFile(filename);
+
+   std::unique_ptr<IOUring> ring;
+   FileFD outfile(filename);
+
+   if (!outfile.openFile(FileFD::appendfd, true))
+      return -1;
+   outfile.setRing(openCSVRing(ring));
+
+   pthread_mutex_lock(&_mutex);
+   std::list<DronePlot>::iterator start = (_csv_last == _dbdata.end()) ? _dbdata.begin() :
+                                                                         std::next(_csv_last);
+   std::list<DronePlot>::iterator last = _dbdata.end();
+   if (start != _dbdata.end())
+      last--;
+   pthread_mutex_unlock(&_mutex);
+
+   int count = 0;
+   if (start != _dbdata.end())
+      count = writeCSVPlots(outfile, start, last);
+   if (!outfile.flush())
+      count = -1;
+
+   outfile.closeFD();
+   if (count < 0)
+      return -1;
+
+   if (count > 0)
+      _csv_last = last;
+   return count;
+}
+
+/*****************************************************************************************
+ * openCSVRing - sets up a ring for one export. Its registered buffers take each chunk as it
+ *               is formatted, so the export buffer is free for the next one straight away
+ *
+ *    Returns: the ring (owned by ring), or NULL for plain writes
+ *****************************************************************************************/
+
+IOUring *DronePlotDB::openCSVRing(std::unique_ptr<IOUring> &ring) {
+   if (!_csv_ring)
+      return NULL;
+
+   try {
+      ring.reset(new IOUring(ring_write_bufs * 2));
+   } catch (std::runtime_error &e) {
+      return NULL;
    }
+   return ring.get();
+}
 
-   cfile.close();
-   return count; 
+/*****************************************************************************************
+ * writeCSVPlots - formats plots into the reusable export buffer and writes it out whenever
+ *                 it fills, so the file sees a few large writes instead of one per line
+ *
+ *    Params:  outfile - an open file to write to
+ *             start, last - the first and last plots to write (inclusive). The caller takes
+ *                           last under the mutex and we never step past it, so plots being
+ *                           added at the same time are left alone
+ *
+ *    Returns: -1 if a write failed, otherwise num written
+ *
+ *****************************************************************************************/
+
+int DronePlotDB::writeCSVPlots(FileFD &outfile, std::list<DronePlot>::iterator start,
+                                                std::list<DronePlot>::iterator last) {
+   _csvbuf.resize(csv_buf_size);
+   char *bufstart = _csvbuf.data();
+   char *flushpt = bufstart + csv_buf_size - csv_max_line;
+   char *bufpos = bufstart;
+   int count = 0;
+
+   std::list<DronePlot>::iterator lptr = start;
+   while (true) {
+      bufpos = lptr->writeCSV(bufpos);
+      count++;
+
+      // Flush once there might not be room for another line, and after the last one
+      if ((bufpos > flushpt) || (lptr == last)) {
+         for (char *wptr = bufstart; wptr < bufpos; ) {
+            ssize_t results = outfile.writeFD(wptr, bufpos - wptr);
+            if (results < 0)
+               return -1;
+            wptr += results;
+         }
+         bufpos = bufstart;
+      }
+
+      if (lptr == last)
+         break;
+      lptr++;
+   }
+   return count;
 }
 
 
 /*****************************************************************************************
  * writeBinaryFile - writes the contents of the database to a file in raw binary form with
- *                   no newlines
+ *                   no newlines. Timestamps are truncated to whole seconds
  *
  *    Params:  filename - the path/filename of the output file
  *
@@ -341,10 +680,13 @@ int DronePlotDB::writeBinaryFile(const char *filename) {
    unsigned int ppsize = DronePlot::getDataSize() * _dbdata.size();
    plot.reserve(ppsize);
 
-   // Loop through all data points and write them to our binary vector
+   // Loop through all data points and write them to our binary vector, in whole seconds
+   DronePlot secs_plot;
    std::list<DronePlot>::iterator lptr = _dbdata.begin();
    for ( ; lptr != _dbdata.end(); lptr++) {
-      lptr->serialize(plot);
+      secs_plot = *lptr;
+      secs_plot.timestamp /= simtime_per_sec;
+      secs_plot.serialize(plot);
 
       count++;
    }
@@ -382,8 +724,9 @@ int DronePlotDB::loadBinaryFile(const char *filename) {
       dptr = _dbdata.end();
       dptr--;
 
-      // Deserialize
+      // Deserialize, converting the file's whole seconds to sim time
       dptr->deserialize(buf);
+      dptr->timestamp *= simtime_per_sec;
       buf.clear();
 
       count++;
@@ -398,6 +741,49 @@ int DronePlotDB::loadBinaryFile(const char *filename) {
    return count; 
 }
 
+/*****************************************************************************************
+ * loadArchiveFile - reads the plots in a time range from a compressed plot archive. Only the
+ *                   blocks the footer index says can match are decoded
+ *
+ *    Params:  filename - the path/filename of the archive
+ *             start_time, end_time - only plots in [start_time, end_time) are loaded
+ *             nodes - only plots from these node IDs are loaded, empty for all
+ *
+ *    Returns: -1 if there was an issue reading the file (nothing is added), otherwise num
+ *             read in
+ *
+ *****************************************************************************************/
+
+int DronePlotDB::loadArchiveFile(const char *filename, simtime_t start_time, simtime_t end_time,
+                                 const std::set<unsigned int> &nodes) {
+   PlotArchive archive(filename);
+   std::list<DronePlot> plots;
+
+   int count = archive.readPlots(plots, start_time, end_time, nodes);
+   if (count <= 0)
+      return count;
+
+   pthread_mutex_lock(&_mutex);
+   _dbdata.splice(_dbdata.end(), plots);
+   pthread_mutex_unlock(&_mutex);
+
+   return count;
+}
+
+/*****************************************************************************************
+ * writeArchiveFile - writes the database to a compressed plot archive, keeping full
+ *                    nanosecond timestamps (unlike the .bin format)
+ *
+ *    Returns: -1 if there was an issue writing the file, otherwise num written
+ *
+ *****************************************************************************************/
+
+int DronePlotDB::writeArchiveFile(const char *filename) {
+   PlotArchive archive(filename);
+
+   return archive.writePlots(_dbdata.begin(), _dbdata.end());
+}
+
 /*****************************************************************************************
  * popFront - removes the front element from the database 
  *
@@ -410,6 +796,7 @@ void DronePlotDB::popFront() {
    pthread_mutex_lock(&_mutex);
 
    _dbdata.pop_front();
+   _csv_valid = false;
 
    // Unlock the mutex before we exit
    pthread_mutex_unlock(&_mutex);
@@ -435,6 +822,7 @@ void DronePlotDB::erase(unsigned int i) {
    for (unsigned int x=0; x<i; x++, diter++);
 
    _dbdata.erase(diter);
+   _csv_valid = false;
 
 
    // Unlock the mutex before we exit
@@ -455,6 +843,7 @@ std::list<DronePlot>::iterator DronePlotDB::erase(std::list<DronePlot>::iterator
    pthread_mutex_lock(&_mutex);
 
     auto retptr = _dbdata.erase(dptr);
+    _csv_valid = false;
 
    // Unlock the mutex before we exit
    pthread_mutex_unlock(&_mutex);
@@ -467,6 +856,7 @@ std::list<DronePlot>::iterator DronePlotDB::erase(std::list<DronePlot>::iterator
 void DronePlotDB::removeNodeID(unsigned int node_id) {
    pthread_mutex_lock(&_mutex);
 
+   _csv_valid = false;
    auto del_iter = _dbdata.begin();
    while (del_iter != _dbdata.end()) {
       if (del_iter->node_id == node_id)
@@ -487,6 +877,7 @@ void DronePlotDB::sortByTime() {
    pthread_mutex_lock(&_mutex);
 
    _dbdata.sort(compare_plot);
+   _csv_valid = false;
 
    pthread_mutex_unlock(&_mutex);
 }
@@ -497,6 +888,7 @@ void DronePlotDB::sortByTime() {
 
 void DronePlotDB::clear() {
    _dbdata.clear();
+   _csv_valid = false;
 }
 
 
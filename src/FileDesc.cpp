@@ -2,12 +2,15 @@
 #include <strings.h>
 #include <fcntl.h>
 #include <cstring>
+#include <cerrno>
+#include <algorithm>
 #include <arpa/inet.h>
 #include <sys/socket.h>
-#include <sys/select.h>
+#include <poll.h>
 #include <unistd.h>
 
 #include "FileDesc.h"
+#include "IOUring.h"
 #include "strfuncts.h"
 
 const unsigned int bufsize = 500;
@@ -17,8 +20,10 @@ FileDesc::FileDesc() {
 }
 
 
+// On a ring the descriptor goes back to the ring, which closes it once it is done with it
 FileDesc::~FileDesc() {
-
+   if (_ring_id != 0)
+      _ring->detach(_ring_id);
 }
 
 /*****************************************************************************************
@@ -45,7 +50,7 @@ void FileDesc::setNonBlocking() {
  *    Returns: returns the results of the FD write function, 1 for success, -1 for failure
  *****************************************************************************************/
 ssize_t FileDesc::writeByte(unsigned char data) {
-   return write(_fd, &data, 1);
+   return writeRaw(&data, 1);
 }
 
 /*****************************************************************************************
@@ -57,30 +62,46 @@ ssize_t FileDesc::writeByte(unsigned char data) {
  *****************************************************************************************/
 
 ssize_t FileDesc::readByte(unsigned char &buf) {
-   return read(_fd, &buf, 1);
+   return readRaw(&buf, 1);
 }
 
 /*****************************************************************************************
- * hasData - uses the select function to poll the FD for available read data
+ * hasData - uses ppoll to check the FD for available read data. Unlike select, this works
+ *           for descriptors past FD_SETSIZE, which a busy server can reach. A socket on a
+ *           ring only has what the ring has reaped for it, so there is nothing to wait for
  *
- *    Params: ms_timeout - milliseconds to wait for data before returning if none found
+ *    Params: usec_timeout - microseconds to wait for data before returning if none found
  *
  *    Returns: true if data is available for reading, false otherwise
  *****************************************************************************************/
 
-bool FileDesc::hasData(long ms_timeout) {
-   fd_set read_fds;
-   timeval timeout;
+bool FileDesc::hasData(long usec_timeout) {
+   if ((_ring_id != 0) && _ring_stream)
+      return (_ring_in.size() > _ring_in_pos) || (_ring_status != 0);
+   return waitFor(POLLIN, usec_timeout);
+}
+
+// Writes to a ring never block
+bool FileDesc::canWrite(long usec_timeout) {
+   if (_ring_id != 0)
+      return true;
+   return waitFor(POLLOUT, usec_timeout);
+}
+
+bool FileDesc::waitFor(short events, long usec_timeout) {
+   struct pollfd pfd;
+   struct timespec timeout;
 
-   timeout.tv_sec = 0;
-   timeout.tv_usec = ms_timeout;
+   timeout.tv_sec = usec_timeout / 1000000;
+   timeout.tv_nsec = (usec_timeout % 1000000) * 1000;
 
-   FD_ZERO(&read_fds);
-   FD_SET(_fd, &read_fds);
+   pfd.fd = _fd;
+   pfd.events = events;
+   pfd.revents = 0;
 
    int n;
-   if ((n = select(_fd+1, &read_fds, NULL, NULL, &timeout)) == -1) {
-      throw socket_error("Select error on file descriptor.");
+   if ((n = ppoll(&pfd, 1, &timeout, NULL)) == -1) {
+      throw socket_error("Poll error on file descriptor.");
    }
 
    if (n == 0)
@@ -100,7 +121,7 @@ ssize_t FileDesc::readFD(std::string &buf) {
    char *readbuf = new char[bufsize];
    bzero(readbuf, sizeof(char) * bufsize);
    ssize_t amt_read = 0;
-   if ((amt_read = read(_fd, readbuf, bufsize)) < 0) {
+   if ((amt_read = readRaw(readbuf, bufsize)) < 0) {
       delete readbuf;
       return -1;
    }
@@ -127,7 +148,63 @@ ssize_t FileDesc::writeFD(const char *data) {
 }
 
 ssize_t FileDesc::writeFD(const char *data, unsigned int len) {
-   return write(_fd, data, len);
+   return writeRaw(data, len);
+}
+
+/*****************************************************************************************
+ * readRaw - reads up to len bytes. On a ring they come out of the input the ring has
+ *           reaped--with none left it is end of stream (0), the error that ended the stream,
+ *           or EAGAIN
+ *
+ *    Returns: bytes read, 0 at end of stream, -1 for failure (errno set)
+ *****************************************************************************************/
+
+ssize_t FileDesc::readRaw(void *buf, size_t len) {
+   if ((_ring_id == 0) || !_ring_stream)
+      return read(_fd, buf, len);
+
+   size_t avail = _ring_in.size() - _ring_in_pos;
+   if (avail == 0) {
+      if (_ring_status == 1)
+         return 0;
+      errno = (_ring_status < 0) ? -_ring_status : EAGAIN;
+      return -1;
+   }
+
+   size_t amt = std::min(len, avail);
+   memcpy(buf, _ring_in.data() + _ring_in_pos, amt);
+   _ring_in_pos += amt;
+   if (_ring_in_pos == _ring_in.size()) {
+      _ring_in.clear();
+      _ring_in_pos = 0;
+   }
+   return amt;
+}
+
+/*****************************************************************************************
+ * writeRaw - writes len bytes. On a ring they are queued (sockets) or written at the next
+ *            offset (files) and the full length is reported; a failure shows up on a later
+ *            call, or from flush
+ *
+ *    Returns: bytes written, -1 for failure (errno set)
+ *****************************************************************************************/
+
+ssize_t FileDesc::writeRaw(const void *buf, size_t len) {
+   if (_ring_id == 0)
+      return write(_fd, buf, len);
+
+   if (_ring_status < 0) {
+      errno = -_ring_status;
+      return -1;
+   }
+
+   if (_ring_stream) {
+      _ring->send(_ring_id, (const uint8_t *) buf, len);
+   } else {
+      _ring->write(_ring_id, (const uint8_t *) buf, len, _ring_off);
+      _ring_off += len;
+   }
+   return len;
 }
 
 /*************************************************************************************
@@ -143,10 +220,68 @@ bool FileDesc::isOpen() {
 }
 
 /***************************************************************************************
- * closeFD - closes the FD cleanly
+ * closeFD - closes the FD cleanly. The FD is then marked unused (-1) so a later close or
+ *           reconnect can never hit a number the system has handed out again
  ***************************************************************************************/
 void FileDesc::closeFD() {
-   close(_fd);
+   if (_ring_id != 0) {
+      _ring->detach(_ring_id);
+      _ring_id = 0;
+      _ring_in.clear();
+      _ring_in_pos = 0;
+      _ring_status = 0;
+   } else if (_fd >= 0) {
+      close(_fd);
+   }
+   _fd = -1;
+}
+
+void FileDesc::setRing(IOUring *ring) {
+   _ring = ring;
+   if ((_ring != NULL) && (_ring_id == 0) && (_fd >= 0))
+      ringAttach();
+}
+
+bool FileDesc::flush() {
+   if (_ring_id == 0)
+      return true;
+
+   _ring->flush(_ring_id);
+   return _ring_status >= 0;
+}
+
+/*****************************************************************************************
+ * ringAttach - files are written at explicit offsets, several at once, so an append file
+ *              starts at its end with O_APPEND cleared (it would override the offsets)
+ *****************************************************************************************/
+void FileDesc::ringAttach() {
+   int flags = fcntl(_fd, F_GETFL);
+   if ((flags >= 0) && (flags & O_APPEND)) {
+      fcntl(_fd, F_SETFL, flags & ~O_APPEND);
+      _ring_off = lseek(_fd, 0, SEEK_END);
+   } else {
+      _ring_off = lseek(_fd, 0, SEEK_CUR);
+   }
+   if (_ring_off < 0)
+      _ring_off = 0;
+
+   _ring_stream = false;
+   _ring_id = _ring->attach(this, _fd, false);
+}
+
+void FileDesc::ringData(const uint8_t *data, size_t len) {
+   // Drop what has been read once it is most of the buffer, rather than on every read
+   if ((_ring_in_pos > 0) && (_ring_in_pos >= _ring_in.size() / 2)) {
+      _ring_in.erase(_ring_in.begin(), _ring_in.begin() + _ring_in_pos);
+      _ring_in_pos = 0;
+   }
+   _ring_in.insert(_ring_in.end(), data, data + len);
+}
+
+// The first end of stream or error sticks
+void FileDesc::ringClosed(int status) {
+   if (_ring_status == 0)
+      _ring_status = (status == 0) ? 1 : status;
 }
 
 /****************************************************************************************
@@ -159,7 +294,7 @@ void FileDesc::closeFD() {
 SocketFD::SocketFD():FileDesc() {
 
    // Create the socket
-   _fd = socket(AF_INET, SOCK_STREAM, 0);
+   _fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
    if (_fd == -1) {
       throw socket_error("Socket creation failed.");
    }
@@ -167,7 +302,8 @@ SocketFD::SocketFD():FileDesc() {
 }
 
 SocketFD::~SocketFD() {
-
+   for (int fd : _accepted)
+      close(fd);
 }
 
 /*****************************************************************************************
@@ -225,7 +361,12 @@ bool SocketFD::connectTo(const char *ip_addr, unsigned short port) {
 }
 
 bool SocketFD::connectTo(unsigned long ip_addr, unsigned short port) {
-   if ((_fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+
+   // Replaces the unused socket the constructor created (or the one a failed attempt left)
+   closeFD();
+   _connected = false;
+
+   if ((_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
       throw socket_error("Socket creation failed.");
 
    // Load the socket information to prep for binding
@@ -237,6 +378,9 @@ bool SocketFD::connectTo(unsigned long ip_addr, unsigned short port) {
    if (connect(_fd, (struct sockaddr *) &_fd_addr, sizeof(_fd_addr)) != 0)
       return false;
 
+   _connected = true;
+   if (_ring != NULL)
+      ringAttach();
    return true;
 
 }
@@ -253,27 +397,71 @@ bool SocketFD::connectTo(unsigned long ip_addr, unsigned short port) {
 void SocketFD::listenFD(int backlog) {
    if (listen(_fd, backlog) != 0)
       throw socket_error("Server failed attempting to listen on port");
+
+   _listening = true;
+   if (_ring != NULL)
+      ringAttach();
 }
 
 
 /*****************************************************************************************
- * acceptFD - Given a passed-in server FD, accepts a connection and assigns to THIS FD
+ * acceptFD - Given a passed-in server FD, accepts a connection and assigns to THIS FD. The
+ *            new socket comes back nonblocking and close-on-exec in the one call. If the
+ *            server is on a ring, the ring has done the accepting and we take the next one
  *
  *    Params: server - a bound, listening server FD that has an available connection
  *
- *    Returns: false if the accept failed, true otherwise
+ *    Returns: false if the accept failed (errno is left as accept4 set it), true otherwise
  *****************************************************************************************/
 
 bool SocketFD::acceptFD(SocketFD &server) {
    socklen_t len = sizeof(_fd_addr);
 
-   _fd = accept(server.getFD(), (struct sockaddr *) &_fd_addr, &len);
-   if (_fd == -1)
-      return false;
+   int fd;
+   if (server._ring_id != 0) {
+      if (server._accepted.empty()) {
+         errno = EAGAIN;
+         return false;
+      }
+      fd = server._accepted.front();
+      server._accepted.pop_front();
+      getpeername(fd, (struct sockaddr *) &_fd_addr, &len);
+   } else {
+      fd = accept4(server.getFD(), (struct sockaddr *) &_fd_addr, &len,
+                                                            SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (fd == -1)
+         return false;
+   }
 
+   // Replaces the unused socket the constructor created
+   closeFD();
+   _fd = fd;
+   _connected = true;
+   if (_ring != NULL)
+      ringAttach();
    return true;
 }
 
+/*****************************************************************************************
+ * ringAttach - a connected socket starts receiving and a listening one accepting. One that
+ *              is neither yet attaches once it is
+ *****************************************************************************************/
+void SocketFD::ringAttach() {
+   if (!_connected && !_listening)
+      return;
+
+   _ring_stream = true;
+   _ring_id = _ring->attach(this, _fd, true);
+   if (_listening)
+      _ring->acceptMultishot(_ring_id);
+   else
+      _ring->recvMultishot(_ring_id);
+}
+
+void SocketFD::ringAccepted(int fd) {
+   _accepted.push_back(fd);
+}
+
 /*****************************************************************************************
  * getIPAddr - returns the IP address of this FD in big endian format
  *
@@ -335,7 +523,7 @@ FileFD::~FileFD() {
  *
  *    Params:  ftype - the type FD - options are:
  *                   readfd - read only
- *                   writefd - write only
+ *                   writefd - write only, truncates any existing contents
  *                   appendfd - write only, moves pointer to the end
  *             create - if the file doesn't exist, setting this true will cause it to be
  *                      created
@@ -345,7 +533,7 @@ FileFD::~FileFD() {
  ******************************************************************************************/
 
 bool FileFD::openFile(fd_file_type ftype, bool create) {
-   int file_flags[] = {O_RDONLY, O_WRONLY, O_WRONLY | O_APPEND};
+   int file_flags[] = {O_RDONLY, O_WRONLY | O_TRUNC, O_WRONLY | O_APPEND};
 
    int flags = file_flags[ftype];
    if (create)
@@ -376,7 +564,7 @@ ssize_t FileDesc::readStr(std::string &buf) {
 
    buf.clear();
 
-   while ((results = read(_fd, &readchar, 1) > 0) && (readchar != '\n')) {
+   while ((results = readRaw(&readchar, 1) > 0) && (readchar != '\n')) {
       strbuf[i++] = readchar;
 
       // If we're overflowing our buffer, dump into the std::string and clear the buffer
@@ -0,0 +1,50 @@
+#include "HandshakeCache.h"
+
+HandshakeCache::HandshakeCache(simtime_t window):_window(window)
+{
+}
+
+HandshakeCache::~HandshakeCache() {
+}
+
+/*****************************************************************************************
+ * isTimely - whether the hello's stamp is within the window of our wall clock
+ *****************************************************************************************/
+bool HandshakeCache::isTimely(simtime_t sent) {
+   simtime_t diff = SimClock::wallNow() - sent;
+   return (diff <= _window) && (diff >= -_window);
+}
+
+/*****************************************************************************************
+ * admitNonce - accepts each nonce once while its hello is timely
+ *
+ *    Returns: true if the nonce is new and sent is timely, false otherwise
+ *****************************************************************************************/
+bool HandshakeCache::admitNonce(const std::vector<uint8_t> &nonce, simtime_t sent) {
+   simtime_t now = SimClock::wallNow();
+   expire(now);
+
+   if ((now - sent > _window) || (sent - now > _window))
+      return false;
+
+   if (!_nonces.insert(nonce).second)
+      return false;
+
+   _expiry.emplace(sent + _window, nonce);
+   return true;
+}
+
+void HandshakeCache::expire(simtime_t now) {
+   while (!_expiry.empty() && (_expiry.begin()->first < now)) {
+      _nonces.erase(_expiry.begin()->second);
+      _expiry.erase(_expiry.begin());
+   }
+}
+
+/*****************************************************************************************
+ * getPeerCaps - the caps to encode with for this peer before its reply confirms them
+ *****************************************************************************************/
+uint32_t HandshakeCache::getPeerCaps(const std::string &sid) {
+   auto it = _peer_caps.find(sid);
+   return (it == _peer_caps.end()) ? 0 : it->second;
+}
@@ -0,0 +1,628 @@
+#include <stdexcept>
+#include <sstream>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "IOUring.h"
+#include "FileDesc.h"
+
+// Group ID of our receive buffers
+const uint16_t recv_buf_group = 1;
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p) {
+   return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+                                                                     unsigned int flags) {
+   return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args) {
+   return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/*****************************************************************************************
+ * IOUring (constructor) - creates the ring, maps its queues and registers the receive and
+ *                         write buffers
+ *
+ *    Throws: runtime_error if any step fails
+ *****************************************************************************************/
+IOUring::IOUring(unsigned int entries):
+                        _ring_fd(-1),
+                        _sq_local_tail(0),
+                        _sq_unsubmitted(0),
+                        _sqes((struct io_uring_sqe *) MAP_FAILED),
+                        _sq_map(MAP_FAILED),
+                        _cq_map(MAP_FAILED),
+                        _buf_ring(MAP_FAILED),
+                        _recv_bufs((size_t) ring_recv_bufs * ring_recv_buf_size),
+                        _buf_tail(0),
+                        _write_bufs((size_t) ring_write_bufs * ring_write_buf_size),
+                        _next_id(1)
+{
+   struct io_uring_params p;
+   memset(&p, 0, sizeof(p));
+
+   _ring_fd = sys_io_uring_setup(entries, &p);
+   if (_ring_fd < 0) {
+      std::stringstream msg;
+      msg << "Unable to set up an io_uring: " << strerror(errno);
+      throw std::runtime_error(msg.str().c_str());
+   }
+
+   // Sized by the kernel's offsets--older kernels map the two rings separately
+   _sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+   _cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+   bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+   if (single)
+      _sq_map_size = _cq_map_size = std::max(_sq_map_size, _cq_map_size);
+
+   _sq_map = mmap(NULL, _sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                                            _ring_fd, IORING_OFF_SQ_RING);
+   if (_sq_map != MAP_FAILED)
+      _cq_map = single ? _sq_map : mmap(NULL, _cq_map_size, PROT_READ | PROT_WRITE,
+                                       MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_CQ_RING);
+
+   _sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+   if (_cq_map != MAP_FAILED)
+      _sqes = (struct io_uring_sqe *) mmap(NULL, _sqes_size, PROT_READ | PROT_WRITE,
+                                       MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_SQES);
+   if (_sqes == MAP_FAILED) {
+      teardown();
+      throw std::runtime_error("Unable to map the io_uring queues");
+   }
+
+   uint8_t *sq = (uint8_t *) _sq_map;
+   _sq_head = (unsigned int *) (sq + p.sq_off.head);
+   _sq_tail = (unsigned int *) (sq + p.sq_off.tail);
+   _sq_mask = (unsigned int *) (sq + p.sq_off.ring_mask);
+   _sq_flags = (unsigned int *) (sq + p.sq_off.flags);
+   _sq_array = (unsigned int *) (sq + p.sq_off.array);
+   _sq_entries = p.sq_entries;
+   _sq_local_tail = *_sq_tail;
+
+   uint8_t *cq = (uint8_t *) _cq_map;
+   _cq_head = (unsigned int *) (cq + p.cq_off.head);
+   _cq_tail = (unsigned int *) (cq + p.cq_off.tail);
+   _cq_mask = (unsigned int *) (cq + p.cq_off.ring_mask);
+   _cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+   // The ring of receive buffers, filled with all of them to start
+   _buf_ring_size = ring_recv_bufs * sizeof(struct io_uring_buf);
+   _buf_ring = mmap(NULL, _buf_ring_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE,
+                                                                                    -1, 0);
+
+   struct io_uring_buf_reg reg;
+   memset(&reg, 0, sizeof(reg));
+   reg.ring_addr = (uint64_t) (uintptr_t) _buf_ring;
+   reg.ring_entries = ring_recv_bufs;
+   reg.bgid = recv_buf_group;
+
+   struct iovec iov[ring_write_bufs];
+   for (unsigned int i=0; i<ring_write_bufs; i++) {
+      iov[i].iov_base = _write_bufs.data() + (size_t) i * ring_write_buf_size;
+      iov[i].iov_len = ring_write_buf_size;
+      _free_slots.push_back(i);
+   }
+
+   if ((_buf_ring == MAP_FAILED) ||
+         (sys_io_uring_register(_ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) ||
+         (sys_io_uring_register(_ring_fd, IORING_REGISTER_BUFFERS, iov, ring_write_bufs) != 0)) {
+      std::stringstream msg;
+      msg << "Unable to register io_uring buffers: " << strerror(errno);
+      teardown();
+      throw std::runtime_error(msg.str().c_str());
+   }
+
+   for (unsigned int i=0; i<ring_recv_bufs; i++)
+      recycleBuf(i);
+   publishBufs();
+}
+
+IOUring::~IOUring() {
+   teardown();
+}
+
+/*****************************************************************************************
+ * teardown - cancels everything still outstanding (sends included--we are going away),
+ *            waits for the kernel to let go, closes the descriptors still held and unmaps
+ *            the ring. Copes with a ring the constructor only got partway through
+ *****************************************************************************************/
+void IOUring::teardown() {
+   if (_sqes != MAP_FAILED) {
+      // getSQE can reap, and a reap can release an entry, so the map is not walked while
+      // cancels go in--each ID is looked up again instead
+      std::vector<uint32_t> ids;
+      for (auto &it : _attached) {
+         it.second.owner = NULL;
+         ids.push_back(it.first);
+      }
+      for (uint32_t id : ids) {
+         auto it = _attached.find(id);
+         if (it != _attached.end())
+            submitCancelAll(id, it->second);
+      }
+
+      while (true) {
+         for (auto it = _attached.begin(); it != _attached.end(); )
+            release(it++);
+         if (_attached.empty() || ((submit(1) < 0) && (errno != EINTR)))
+            break;
+         reap();
+      }
+      for (auto &it : _attached)
+         close(it.second.fd);
+      _attached.clear();
+      munmap(_sqes, _sqes_size);
+   }
+
+   if (_buf_ring != MAP_FAILED)
+      munmap(_buf_ring, _buf_ring_size);
+   if ((_cq_map != MAP_FAILED) && (_cq_map != _sq_map))
+      munmap(_cq_map, _cq_map_size);
+   if (_sq_map != MAP_FAILED)
+      munmap(_sq_map, _sq_map_size);
+   if (_ring_fd >= 0)
+      close(_ring_fd);
+
+   _ring_fd = -1;
+   _sqes = (struct io_uring_sqe *) MAP_FAILED;
+   _sq_map = _cq_map = MAP_FAILED;
+   _buf_ring = MAP_FAILED;
+}
+
+/*****************************************************************************************
+ * getSQE - the next free submission entry, zeroed. Submits what is queued first if the
+ *          queue is full
+ *****************************************************************************************/
+struct io_uring_sqe *IOUring::getSQE() {
+   while (_sq_local_tail - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE) >= _sq_entries) {
+      // Busy means completions are backed up--making room for them lets the submit through
+      if ((submit() < 0) && (errno != EBUSY) && (errno != EAGAIN) && (errno != EINTR))
+         throw std::runtime_error("Unable to submit to the io_uring");
+      reap();
+   }
+
+   unsigned int index = _sq_local_tail & *_sq_mask;
+   struct io_uring_sqe *sqe = &_sqes[index];
+   memset(sqe, 0, sizeof(*sqe));
+   _sq_array[index] = index;
+   _sq_local_tail++;
+   _sq_unsubmitted++;
+   return sqe;
+}
+
+// The ID lives in the top half so a late completion for a detached descriptor is recognized
+uint64_t IOUring::makeUserData(uint32_t id, ring_op op, uint32_t arg) {
+   return ((uint64_t) id << 32) | ((uint64_t) (arg & 0xffffff) << 8) | op;
+}
+
+/*****************************************************************************************
+ * submit - publishes the queued entries and hands them to the kernel in one io_uring_enter
+ *
+ *    Returns: the number of entries the kernel took, -1 (errno set) if it failed
+ *****************************************************************************************/
+int IOUring::submit(unsigned int wait_nr) {
+   __atomic_store_n(_sq_tail, _sq_local_tail, __ATOMIC_RELEASE);
+
+   // The kernel holds completions it had no room for until we enter with GETEVENTS
+   unsigned int flags = 0;
+   if ((wait_nr > 0) || (__atomic_load_n(_sq_flags, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW))
+      flags |= IORING_ENTER_GETEVENTS;
+
+   if ((_sq_unsubmitted == 0) && (flags == 0))
+      return 0;
+
+   int ret = sys_io_uring_enter(_ring_fd, _sq_unsubmitted, wait_nr, flags);
+   if (ret < 0)
+      return -1;
+
+   _sq_unsubmitted -= std::min((unsigned int) ret, _sq_unsubmitted);
+   return ret;
+}
+
+/*****************************************************************************************
+ * reap - runs through the completion queue, hands the receive buffers that were used back
+ *        to the kernel in one go, then re-arms what the completions left unarmed. An owner
+ *        handed a completion may queue a request, and getting room for it can reap again
+ *        from inside the loop, so the head is read afresh for every entry
+ *****************************************************************************************/
+void IOUring::reap() {
+   uint16_t buf_tail = _buf_tail;
+   unsigned int head;
+   while ((head = __atomic_load_n(_cq_head, __ATOMIC_RELAXED)) !=
+                                             __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE)) {
+      struct io_uring_cqe cqe = _cqes[head & *_cq_mask];
+      __atomic_store_n(_cq_head, head + 1, __ATOMIC_RELEASE);
+      complete(cqe);
+   }
+
+   if (_buf_tail != buf_tail)
+      publishBufs();
+
+   std::vector<std::pair<uint32_t, ring_op>> rearms;
+   rearms.swap(_rearms);
+
+   if (!_accept_retry.empty()) {
+      simtime_t now = SimClock::monoNow();
+      for (auto rit = _accept_retry.begin(); rit != _accept_retry.end(); ) {
+         if (rit->second > now) {
+            rit++;
+            continue;
+         }
+         rearms.emplace_back(rit->first, op_accept);
+         rit = _accept_retry.erase(rit);
+      }
+   }
+
+   for (auto &r : rearms)
+      rearm(r.first, r.second);
+}
+
+void IOUring::rearm(uint32_t id, ring_op op) {
+   auto it = _attached.find(id);
+   if (it == _attached.end())
+      return;
+
+   attachment &a = it->second;
+   switch (op) {
+      case op_recv:
+         if ((a.owner != NULL) && !a.recv_armed)
+            submitRecv(id, a);
+         break;
+
+      case op_accept:
+         if ((a.owner != NULL) && !a.accept_armed)
+            submitAccept(id, a);
+         break;
+
+      // Sends carry on after a detach, until the bytes in flight are out
+      case op_send:
+         if (a.sent < a.sending.size())
+            submitSend(id, a);
+         break;
+
+      default:
+         break;
+   }
+}
+
+void IOUring::takeReady(std::vector<int> &ready) {
+   ready.swap(_ready);
+   _ready.clear();
+}
+
+/*****************************************************************************************
+ * recycleBuf, publishBufs - the buffer ring is an array of io_uring_buf whose first entry's
+ *                           resv field is the tail. It is indexed by hand, as the header's
+ *                           flexible array sits at the wrong offset when compiled as C++
+ *****************************************************************************************/
+void IOUring::recycleBuf(uint16_t bid) {
+   struct io_uring_buf *bufs = (struct io_uring_buf *) _buf_ring;
+   struct io_uring_buf &buf = bufs[_buf_tail & (ring_recv_bufs - 1)];
+   buf.addr = (uint64_t) (uintptr_t) (_recv_bufs.data() + (size_t) bid * ring_recv_buf_size);
+   buf.len = ring_recv_buf_size;
+   buf.bid = bid;
+   _buf_tail++;
+}
+
+void IOUring::publishBufs() {
+   struct io_uring_buf *bufs = (struct io_uring_buf *) _buf_ring;
+   __atomic_store_n(&bufs[0].resv, _buf_tail, __ATOMIC_RELEASE);
+}
+
+uint32_t IOUring::attach(FileDesc *owner, int fd, bool stream) {
+   uint32_t id = _next_id++;
+   if (_next_id == 0)
+      _next_id = 1;
+
+   attachment &a = _attached[id];
+   a.owner = owner;
+   a.fd = fd;
+   a.stream = stream;
+   return id;
+}
+
+/*****************************************************************************************
+ * detach - the owner has let go. A receive or accept still armed is cancelled; sends and
+ *          writes are left to finish, which is why the ring closes the descriptor
+ *****************************************************************************************/
+void IOUring::detach(uint32_t id) {
+   auto it = _attached.find(id);
+   if (it == _attached.end())
+      return;
+
+   attachment &a = it->second;
+   a.owner = NULL;
+   if (a.recv_armed)
+      submitCancel(id, a, op_recv);
+   if (a.accept_armed)
+      submitCancel(id, a, op_accept);
+   release(it);
+}
+
+void IOUring::release(std::map<uint32_t, attachment>::iterator it) {
+   attachment &a = it->second;
+   if ((a.owner != NULL) || (a.pending > 0) || !a.sending.empty())
+      return;
+
+   close(a.fd);
+   _attached.erase(it);
+}
+
+void IOUring::recvMultishot(uint32_t id) {
+   auto it = _attached.find(id);
+   if ((it != _attached.end()) && !it->second.recv_armed)
+      submitRecv(id, it->second);
+}
+
+void IOUring::acceptMultishot(uint32_t id) {
+   auto it = _attached.find(id);
+   if ((it != _attached.end()) && !it->second.accept_armed)
+      submitAccept(id, it->second);
+}
+
+void IOUring::submitRecv(uint32_t id, attachment &a) {
+   struct io_uring_sqe *sqe = getSQE();
+   sqe->opcode = IORING_OP_RECV;
+   sqe->fd = a.fd;
+   sqe->ioprio = IORING_RECV_MULTISHOT;
+   sqe->flags = IOSQE_BUFFER_SELECT;
+   sqe->buf_group = recv_buf_group;
+   sqe->user_data = makeUserData(id, op_recv);
+   a.recv_armed = true;
+   a.pending++;
+}
+
+void IOUring::submitAccept(uint32_t id, attachment &a) {
+   struct io_uring_sqe *sqe = getSQE();
+   sqe->opcode = IORING_OP_ACCEPT;
+   sqe->fd = a.fd;
+   sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+   sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+   sqe->user_data = makeUserData(id, op_accept);
+   a.accept_armed = true;
+   a.pending++;
+}
+
+void IOUring::submitSend(uint32_t id, attachment &a) {
+   struct io_uring_sqe *sqe = getSQE();
+   sqe->opcode = IORING_OP_SEND;
+   sqe->fd = a.fd;
+   sqe->addr = (uint64_t) (uintptr_t) (a.sending.data() + a.sent);
+   sqe->len = a.sending.size() - a.sent;
+   sqe->msg_flags = MSG_NOSIGNAL;
+   sqe->user_data = makeUserData(id, op_send);
+   a.pending++;
+}
+
+// Cancels the one request of the given kind, matched by its user data
+void IOUring::submitCancel(uint32_t id, attachment &a, ring_op op) {
+   struct io_uring_sqe *sqe = getSQE();
+   sqe->opcode = IORING_OP_ASYNC_CANCEL;
+   sqe->fd = -1;
+   sqe->addr = makeUserData(id, op);
+   sqe->user_data = makeUserData(id, op_cancel);
+   a.pending++;
+}
+
+// Cancels every request against the descriptor
+void IOUring::submitCancelAll(uint32_t id, attachment &a) {
+   // Counted first, so a reap inside getSQE cannot release the attachment out from under us
+   a.pending++;
+   struct io_uring_sqe *sqe = getSQE();
+   sqe->opcode = IORING_OP_ASYNC_CANCEL;
+   sqe->fd = a.fd;
+   sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+   sqe->user_data = makeUserData(id, op_cancel);
+}
+
+/*****************************************************************************************
+ * send - copies the data behind whatever the stream is already sending. If nothing is in
+ *        flight it goes out at the next submit
+ *****************************************************************************************/
+void IOUring::send(uint32_t id, const uint8_t *data, size_t len) {
+   auto it = _attached.find(id);
+   if ((it == _attached.end()) || (len == 0))
+      return;
+
+   attachment &a = it->second;
+   if (a.sending.empty()) {
+      a.sending.assign(data, data + len);
+      a.sent = 0;
+      submitSend(id, a);
+   } else {
+      a.queued.insert(a.queued.end(), data, data + len);
+   }
+}
+
+/*****************************************************************************************
+ * write - copies the data into free registered buffers and queues a fixed write for each,
+ *         waiting for earlier writes to finish if none are free
+ *****************************************************************************************/
+void IOUring::write(uint32_t id, const uint8_t *data, size_t len, uint64_t offset) {
+   auto it = _attached.find(id);
+   if (it == _attached.end())
+      return;
+
+   attachment &a = it->second;
+   while (len > 0) {
+      while (_free_slots.empty()) {
+         if ((submit(1) < 0) && (errno != EINTR))
+            throw std::runtime_error("Unable to wait on the io_uring");
+         reap();
+      }
+
+      uint16_t slot = _free_slots.back();
+      _free_slots.pop_back();
+
+      uint32_t chunk = (uint32_t) std::min(len, (size_t) ring_write_buf_size);
+      uint8_t *buf = _write_bufs.data() + (size_t) slot * ring_write_buf_size;
+      memcpy(buf, data, chunk);
+      _slot_len[slot] = chunk;
+
+      struct io_uring_sqe *sqe = getSQE();
+      sqe->opcode = IORING_OP_WRITE_FIXED;
+      sqe->fd = a.fd;
+      sqe->addr = (uint64_t) (uintptr_t) buf;
+      sqe->len = chunk;
+      sqe->off = offset;
+      sqe->buf_index = slot;
+      sqe->user_data = makeUserData(id, op_write, slot);
+      a.pending++;
+      a.writes++;
+
+      data += chunk;
+      len -= chunk;
+      offset += chunk;
+   }
+}
+
+void IOUring::flush(uint32_t id) {
+   auto it = _attached.find(id);
+   while ((it != _attached.end()) && (it->second.writes > 0)) {
+      if ((submit(1) < 0) && (errno != EINTR))
+         throw std::runtime_error("Unable to wait on the io_uring");
+      reap();
+   }
+}
+
+/*****************************************************************************************
+ * complete - routes one completion. Those for a descriptor we no longer know of still give
+ *            back what they hold (a receive buffer, a write slot or an accepted socket)
+ *****************************************************************************************/
+void IOUring::complete(const struct io_uring_cqe &cqe) {
+   uint32_t id = (uint32_t) (cqe.user_data >> 32);
+   ring_op op = (ring_op) (cqe.user_data & 0xff);
+
+   auto it = _attached.find(id);
+   attachment *a = (it != _attached.end()) ? &it->second : NULL;
+
+   switch (op) {
+      case op_recv:
+         completeRecv(id, a, cqe);
+         break;
+
+      case op_accept:
+         if (cqe.res >= 0) {
+            if ((a != NULL) && (a->owner != NULL)) {
+               a->owner->ringAccepted(cqe.res);
+               _ready.push_back(a->fd);
+            } else {
+               close(cqe.res);
+            }
+         }
+         // Armed again right away if it only ran out of buffers. Any other error (out of
+         // descriptors, say) would most likely fail straight off again, so it waits
+         if ((a != NULL) && !(cqe.flags & IORING_CQE_F_MORE)) {
+            a->accept_armed = false;
+            a->pending--;
+            if ((a->owner == NULL) || (cqe.res == -ECANCELED))
+               break;
+            if ((cqe.res >= 0) || (cqe.res == -ENOBUFS))
+               _rearms.emplace_back(id, op_accept);
+            else
+               _accept_retry[id] = SimClock::monoNow() + ring_accept_retry;
+         }
+         break;
+
+      case op_send:
+         completeSend(id, a, cqe);
+         break;
+
+      case op_write:
+         _free_slots.push_back((uint16_t) ((cqe.user_data >> 8) & 0xffffff));
+         completeWrite(a, cqe);
+         break;
+
+      case op_cancel:
+         if (a != NULL)
+            a->pending--;
+         break;
+   }
+
+   if (a != NULL)
+      release(it);
+}
+
+/*****************************************************************************************
+ * completeRecv - passes received data to the owner. The receive stays armed while the
+ *                kernel says more is coming; if it stopped because the buffers ran out it
+ *                is armed again, but end of stream or an error is reported to the owner
+ *****************************************************************************************/
+void IOUring::completeRecv(uint32_t id, attachment *a, const struct io_uring_cqe &cqe) {
+   if (cqe.flags & IORING_CQE_F_BUFFER) {
+      uint16_t bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+      if ((cqe.res > 0) && (a != NULL) && (a->owner != NULL))
+         a->owner->ringData(_recv_bufs.data() + (size_t) bid * ring_recv_buf_size, cqe.res);
+      recycleBuf(bid);
+   }
+
+   if (a == NULL)
+      return;
+
+   bool more = (cqe.flags & IORING_CQE_F_MORE) != 0;
+   if (!more) {
+      a->recv_armed = false;
+      a->pending--;
+   }
+
+   if (a->owner == NULL)
+      return;
+
+   if ((cqe.res > 0) || (cqe.res == -ENOBUFS)) {
+      if (!more)
+         _rearms.emplace_back(id, op_recv);
+   } else if (cqe.res != -ECANCELED) {
+      a->owner->ringClosed(cqe.res);
+   }
+   _ready.push_back(a->fd);
+}
+
+/*****************************************************************************************
+ * completeSend - moves through the bytes in flight, then on to whatever queued up behind
+ *                them. A failed send drops the rest and is reported to the owner
+ *****************************************************************************************/
+void IOUring::completeSend(uint32_t id, attachment *a, const struct io_uring_cqe &cqe) {
+   if (a == NULL)
+      return;
+   a->pending--;
+
+   if (cqe.res < 0) {
+      a->sending.clear();
+      a->queued.clear();
+      if (a->owner != NULL) {
+         a->owner->ringClosed(cqe.res);
+         _ready.push_back(a->fd);
+      }
+      return;
+   }
+
+   a->sent += cqe.res;
+   if (a->sent < a->sending.size()) {
+      _rearms.emplace_back(id, op_send);
+      return;
+   }
+
+   a->sending.swap(a->queued);
+   a->queued.clear();
+   a->sent = 0;
+   if (!a->sending.empty())
+      _rearms.emplace_back(id, op_send);
+}
+
+void IOUring::completeWrite(attachment *a, const struct io_uring_cqe &cqe) {
+   if (a == NULL)
+      return;
+   a->pending--;
+   a->writes--;
+
+   uint32_t slot = (cqe.user_data >> 8) & 0xffffff;
+   if ((cqe.res != (int) _slot_len[slot]) && (a->owner != NULL))
+      a->owner->ringClosed(cqe.res < 0 ? cqe.res : -EIO);
+}
@@ -0,0 +1,156 @@
+#include <stdexcept>
+#include <cstring>
+#include "LZ4Block.h"
+
+const unsigned int lz4_min_match = 4;
+const unsigned int lz4_last_literals = 5;    // The block must end with at least this many literals
+const unsigned int lz4_mf_limit = 12;        // No match may start closer than this to the end
+const unsigned int lz4_max_offset = 65535;
+const unsigned int lz4_hash_bits = 12;
+
+static uint32_t read32(const uint8_t *p) {
+   uint32_t v;
+   memcpy(&v, p, sizeof(v));
+   return v;
+}
+
+static unsigned int hash32(uint32_t v) {
+   return (v * 2654435761U) >> (32 - lz4_hash_bits);
+}
+
+// Lengths of 15 or more spill into extra bytes of 255 until the remainder fits in one
+static void writeLength(std::vector<uint8_t> &dest, size_t len) {
+   while (len >= 255) {
+      dest.push_back(255);
+      len -= 255;
+   }
+   dest.push_back((uint8_t) len);
+}
+
+static size_t readLength(const uint8_t *src, size_t size, size_t &pos) {
+   size_t len = 0;
+   uint8_t byte;
+   do {
+      if (pos >= size)
+         throw std::runtime_error("LZ4 block ran out of data prematurely");
+      byte = src[pos++];
+      len += byte;
+   } while (byte == 255);
+   return len;
+}
+
+// Writes one sequence: num_lits literals and then a match (none if match_len is 0)
+static void writeSequence(std::vector<uint8_t> &dest, const uint8_t *lits, size_t num_lits,
+                          unsigned int offset, size_t match_len) {
+   size_t mlcode = (match_len > 0) ? match_len - lz4_min_match : 0;
+   uint8_t token = (uint8_t) (((num_lits < 15) ? num_lits : 15) << 4) |
+                   (uint8_t) ((mlcode < 15) ? mlcode : 15);
+   dest.push_back(token);
+   if (num_lits >= 15)
+      writeLength(dest, num_lits - 15);
+   dest.insert(dest.end(), lits, lits + num_lits);
+
+   // The last sequence of a block is literals only
+   if (match_len == 0)
+      return;
+
+   dest.push_back((uint8_t) offset);
+   dest.push_back((uint8_t) (offset >> 8));
+   if (mlcode >= 15)
+      writeLength(dest, mlcode - 15);
+}
+
+/******************************************************************************************
+ * compress - appends src as an LZ4 block to dest
+ ******************************************************************************************/
+void LZ4Block::compress(const uint8_t *src, size_t size, std::vector<uint8_t> &dest) {
+   dest.reserve(dest.size() + maxCompressedSize(size));
+
+   size_t anchor = 0;
+   if (size > lz4_mf_limit) {
+      std::vector<int64_t> table(1 << lz4_hash_bits, -1);
+      size_t mf_limit = size - lz4_mf_limit;
+      size_t match_limit = size - lz4_last_literals;
+
+      size_t ip = 0;
+      while (ip < mf_limit) {
+         uint32_t seq = read32(src + ip);
+         unsigned int h = hash32(seq);
+         int64_t ref = table[h];
+         table[h] = (int64_t) ip;
+
+         if ((ref < 0) || (ip - ref > lz4_max_offset) || (read32(src + ref) != seq)) {
+            ip++;
+            continue;
+         }
+
+         size_t len = lz4_min_match;
+         while ((ip + len < match_limit) && (src[ref + len] == src[ip + len]))
+            len++;
+
+         writeSequence(dest, src + anchor, ip - anchor, (unsigned int) (ip - ref), len);
+         ip += len;
+         anchor = ip;
+      }
+   }
+   writeSequence(dest, src + anchor, size - anchor, 0, 0);
+}
+
+/******************************************************************************************
+ * decompress - appends the raw_size bytes held in an LZ4 block to dest
+ *
+ *    Throws: runtime_error if a length or offset runs outside the block or output
+ ******************************************************************************************/
+void LZ4Block::decompress(const uint8_t *src, size_t size, size_t raw_size,
+                          std::vector<uint8_t> &dest) {
+   size_t base = dest.size();
+   dest.resize(base + raw_size);
+   uint8_t *out = dest.data() + base;
+
+   size_t pos = 0, op = 0;
+   while (true) {
+      if (pos >= size)
+         throw std::runtime_error("LZ4 block ran out of data prematurely");
+      uint8_t token = src[pos++];
+
+      size_t num_lits = token >> 4;
+      if (num_lits == 15)
+         num_lits += readLength(src, size, pos);
+      if ((num_lits > size - pos) || (num_lits > raw_size - op))
+         throw std::runtime_error("LZ4 block literals run past the end of the data");
+      if (num_lits > 0)
+         memcpy(out + op, src + pos, num_lits);
+      pos += num_lits;
+      op += num_lits;
+
+      // Last sequence--no match follows
+      if (pos == size)
+         break;
+
+      if (size - pos < 2)
+         throw std::runtime_error("LZ4 block ran out of data prematurely");
+      size_t offset = src[pos] | ((size_t) src[pos + 1] << 8);
+      pos += 2;
+      if ((offset == 0) || (offset > op))
+         throw std::runtime_error("LZ4 block match offset is out of range");
+
+      size_t match_len = token & 0x0F;
+      if (match_len == 15)
+         match_len += readLength(src, size, pos);
+      match_len += lz4_min_match;
+      if (match_len > raw_size - op)
+         throw std::runtime_error("LZ4 block match runs past the end of the data");
+
+      // Byte at a time only if the match overlaps what it is copying
+      if (offset >= match_len) {
+         memcpy(out + op, out + op - offset, match_len);
+         op += match_len;
+      } else {
+         for (size_t i=0; i<match_len; i++, op++)
+            out[op] = out[op - offset];
+      }
+   }
+
+   if (op != raw_size)
+      throw std::runtime_error("LZ4 block did not decompress to the expected size");
+}
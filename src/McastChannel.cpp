@@ -0,0 +1,186 @@
+#include <stdexcept>
+#include <sstream>
+#include <cstring>
+#include <cerrno>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <crypto++/osrng.h>
+#include <crypto++/filters.h>
+#include <crypto++/modes.h>
+#include <crypto++/aes.h>
+#include <crypto++/sha.h>
+#include <crypto++/hmac.h>
+#include <crypto++/hkdf.h>
+#include "McastChannel.h"
+
+using namespace CryptoPP;
+
+const unsigned int mcast_tag_size = HMAC<SHA256>::DIGESTSIZE;
+const unsigned int mcast_iv_size = AES::BLOCKSIZE;
+
+// Labels that keep the derived keys apart from each other and from the TCP key
+static const char enc_label[] = "repsvr multicast encryption";
+static const char mac_label[] = "repsvr multicast authentication";
+
+/*****************************************************************************************
+ * McastChannel (constructor) - derives the channel's keys from the shared key
+ *
+ *****************************************************************************************/
+McastChannel::McastChannel(LogMgr &log, SecByteBlock &key, unsigned int verbosity):
+                                    _log(log),
+                                    _verbosity(verbosity),
+                                    _fd(-1),
+                                    _enc_key(AES::DEFAULT_KEYLENGTH),
+                                    _mac_key(SHA256::DIGESTSIZE),
+                                    _recvbuf(mcast_max_datagram)
+{
+   HKDF<SHA256> hkdf;
+   hkdf.DeriveKey(_enc_key, _enc_key.size(), key, key.size(), NULL, 0,
+                                       (const byte *) enc_label, sizeof(enc_label) - 1);
+   hkdf.DeriveKey(_mac_key, _mac_key.size(), key, key.size(), NULL, 0,
+                                       (const byte *) mac_label, sizeof(mac_label) - 1);
+   memset(&_group_addr, 0, sizeof(_group_addr));
+}
+
+McastChannel::~McastChannel() {
+   if (_fd >= 0)
+      close(_fd);
+}
+
+/*****************************************************************************************
+ * join - binds to the group's port (shared with the other servers on this host) and joins
+ *        the group
+ *
+ *    Throws: runtime_error if group is not a multicast address or any socket step fails
+ *****************************************************************************************/
+void McastChannel::join(const char *svr_id, const char *group, unsigned short port,
+                                                                     unsigned long if_addr) {
+   _svr_id = svr_id;
+
+   _group_addr.sin_family = AF_INET;
+   _group_addr.sin_port = htons(port);
+   if ((inet_pton(AF_INET, group, &_group_addr.sin_addr) != 1) ||
+                                          !IN_MULTICAST(ntohl(_group_addr.sin_addr.s_addr)))
+      throw std::runtime_error("Multicast group is not a valid IPv4 multicast address");
+
+   _fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+   if (_fd < 0)
+      throw std::runtime_error("Unable to create the multicast socket");
+
+   struct ip_mreq mreq;
+   mreq.imr_multiaddr = _group_addr.sin_addr;
+   mreq.imr_interface.s_addr = if_addr;
+
+   struct in_addr iface;
+   iface.s_addr = if_addr;
+
+   int on = 1;
+   unsigned char ttl = 1, loop = 1;
+   if ((setsockopt(_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0) ||
+       (bind(_fd, (struct sockaddr *) &_group_addr, sizeof(_group_addr)) != 0) ||
+       (setsockopt(_fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) != 0) ||
+       (setsockopt(_fd, IPPROTO_IP, IP_MULTICAST_IF, &iface, sizeof(iface)) != 0) ||
+       (setsockopt(_fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) != 0) ||
+       (setsockopt(_fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) != 0)) {
+      std::stringstream msg;
+      msg << "Unable to join multicast group " << group << ":" << port << ": " << strerror(errno);
+      close(_fd);
+      _fd = -1;
+      throw std::runtime_error(msg.str().c_str());
+   }
+}
+
+/*****************************************************************************************
+ * send - seals the payload with our ID and sends it to the group
+ *
+ *    Returns: true if sent (not that anyone got it), false if too big for a datagram
+ *
+ *    Throws: runtime_error if the socket fails
+ *****************************************************************************************/
+bool McastChannel::send(const std::vector<uint8_t> &data) {
+   size_t plain_size = 1 + _svr_id.size() + data.size();
+   if ((_fd < 0) || (mcast_tag_size + mcast_iv_size + plain_size > mcast_max_datagram))
+      return false;
+
+   std::vector<uint8_t> plain;
+   plain.reserve(plain_size);
+   plain.push_back((uint8_t) _svr_id.size());
+   plain.insert(plain.end(), _svr_id.begin(), _svr_id.end());
+   plain.insert(plain.end(), data.begin(), data.end());
+
+   std::vector<uint8_t> dgram(mcast_tag_size + mcast_iv_size);
+   AutoSeededRandomPool rnd;
+   rnd.GenerateBlock(dgram.data() + mcast_tag_size, mcast_iv_size);
+
+   CFB_Mode<AES>::Encryption encryptor;
+   encryptor.SetKeyWithIV(_enc_key, _enc_key.size(), dgram.data() + mcast_tag_size);
+
+   std::string cipher;
+   ArraySource as(plain.data(), plain.size(), true,
+            new StreamTransformationFilter(encryptor, new StringSink(cipher)));
+   dgram.insert(dgram.end(), cipher.begin(), cipher.end());
+
+   // Tag the IV and ciphertext (encrypt-then-MAC)
+   HMAC<SHA256> hmac(_mac_key, _mac_key.size());
+   hmac.CalculateDigest(dgram.data(), dgram.data() + mcast_tag_size, dgram.size() - mcast_tag_size);
+
+   if (sendto(_fd, dgram.data(), dgram.size(), 0, (struct sockaddr *) &_group_addr,
+                                                            sizeof(_group_addr)) < 0) {
+      // A full socket buffer is a lost datagram, which the receivers will ask for again
+      if ((errno == EAGAIN) || (errno == ENOBUFS))
+         return true;
+      throw std::runtime_error("Unable to send to the multicast group");
+   }
+   return true;
+}
+
+/*****************************************************************************************
+ * receive - reads datagrams until one checks out, skipping our own (looped back) and any
+ *           that fail authentication or are malformed
+ *
+ *    Returns: true with the sender's ID and payload, false when none are left
+ *****************************************************************************************/
+bool McastChannel::receive(std::string &sid, std::vector<uint8_t> &data) {
+   if (_fd < 0)
+      return false;
+
+   while (true) {
+      ssize_t got = recv(_fd, _recvbuf.data(), _recvbuf.size(), 0);
+      if (got < 0) {
+         if ((errno == EAGAIN) || (errno == EINTR))
+            return false;
+         throw std::runtime_error("Unable to read from the multicast group");
+      }
+
+      if ((size_t) got < mcast_tag_size + mcast_iv_size + 1)
+         continue;
+
+      HMAC<SHA256> hmac(_mac_key, _mac_key.size());
+      if (!hmac.VerifyDigest(_recvbuf.data(), _recvbuf.data() + mcast_tag_size,
+                                                                  got - mcast_tag_size)) {
+         if (_verbosity >= 2)
+            _log.writeLog("Dropped a multicast datagram that failed authentication.");
+         continue;
+      }
+
+      CFB_Mode<AES>::Decryption decryptor;
+      decryptor.SetKeyWithIV(_enc_key, _enc_key.size(), _recvbuf.data() + mcast_tag_size);
+
+      std::string plain;
+      size_t header = mcast_tag_size + mcast_iv_size;
+      ArraySource as(_recvbuf.data() + header, got - header, true,
+               new StreamTransformationFilter(decryptor, new StringSink(plain)));
+
+      size_t idlen = (uint8_t) plain[0];
+      if (plain.size() < 1 + idlen)
+         continue;
+
+      sid.assign(plain, 1, idlen);
+      if (sid == _svr_id)
+         continue;
+
+      data.assign(plain.begin() + 1 + idlen, plain.end());
+      return true;
+   }
+}
@@ -0,0 +1,98 @@
+#include <stdexcept>
+#include <algorithm>
+#include "MerkleTree.h"
+
+// Mixes the two child hashes of an internal node (splitmix64 finalizer)
+static uint64_t combine_hash(uint64_t left, uint64_t right) {
+   if ((left == 0) && (right == 0))
+      return 0;
+
+   uint64_t h = left * 0x9E3779B97F4A7C15ULL + right;
+   h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+   h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+   return h ^ (h >> 31);
+}
+
+/*****************************************************************************************
+ * MerkleTree (constructor) - allocates a tree with 2^depth leaves
+ *
+ *    Params:  depth - number of levels below the root (max 20)
+ *             bucket_span - the span of sim time (nanoseconds) covered by each leaf
+ *****************************************************************************************/
+MerkleTree::MerkleTree(unsigned int depth, simtime_t bucket_span):
+                              _depth(depth),
+                              _bucket_span(bucket_span),
+                              _nodes((2U << depth) - 1, 0)
+{
+   if ((depth > 20) || (bucket_span <= 0))
+      throw std::runtime_error("MerkleTree created with invalid depth or bucket size.");
+}
+
+MerkleTree::~MerkleTree() {
+
+}
+
+/*****************************************************************************************
+ * getLeaf - returns the leaf index covering the given timestamp
+ *****************************************************************************************/
+unsigned int MerkleTree::getLeaf(simtime_t timestamp) {
+   uint64_t bucket = (uint64_t) (timestamp / _bucket_span);
+
+   return (unsigned int) (bucket & ((1U << _depth) - 1));
+}
+
+/*****************************************************************************************
+ * getHash - returns the hash of a node in the tree
+ *
+ *    Params:  level - 0 for the root up to depth for the leaves
+ *             index - position of the node within the level
+ *
+ *    Throws: runtime_error if the node does not exist
+ *****************************************************************************************/
+uint64_t MerkleTree::getHash(unsigned int level, unsigned int index) {
+   if ((level > _depth) || (index >= getNumNodes(level)))
+      throw std::runtime_error("MerkleTree getHash called on a node that does not exist.");
+
+   return _nodes[nodePos(level, index)];
+}
+
+/*****************************************************************************************
+ * insert - adds the plot's hash into its leaf and rehashes the path back up to the root
+ *
+ *    Returns: true if the plot was added, false if the tree already had it
+ *****************************************************************************************/
+bool MerkleTree::insert(DronePlot &plot) {
+   uint64_t hash = plot.getHash();
+
+   if (!_plots.insert(hash).second)
+      return false;
+
+   unsigned int leaf = getLeaf(plot);
+   _nodes[nodePos(_depth, leaf)] += hash;
+   updatePath(leaf);
+   return true;
+}
+
+bool MerkleTree::contains(DronePlot &plot) {
+   return (_plots.find(plot.getHash()) != _plots.end());
+}
+
+/*****************************************************************************************
+ * updatePath - recomputes the internal node hashes from a leaf up to the root, O(depth)
+ *****************************************************************************************/
+void MerkleTree::updatePath(unsigned int leaf) {
+   unsigned int pos = nodePos(_depth, leaf);
+
+   while (pos > 0) {
+      pos = (pos - 1) / 2;
+      _nodes[pos] = combine_hash(_nodes[2 * pos + 1], _nodes[2 * pos + 2]);
+   }
+}
+
+/*****************************************************************************************
+ * clear - empties the tree
+ *****************************************************************************************/
+void MerkleTree::clear() {
+   std::fill(_nodes.begin(), _nodes.end(), 0);
+   _plots.clear();
+}
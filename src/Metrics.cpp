@@ -0,0 +1,318 @@
+#include <fstream>
+#include <time.h>
+#include "Metrics.h"
+
+const unsigned int hist_exact = 32;        // Values below this get a bucket each
+const unsigned int hist_sub_bits = 4;      // 16 sub-buckets per power of two above that
+const unsigned int hist_first_mag = 5;     // log2(hist_exact)
+
+// Bucket bounds (seconds) for the Prometheus histograms
+const double prom_buckets[] = { 0.00001, 0.0001, 0.001, 0.005, 0.01, 0.05, 0.1, 0.25, 0.5,
+                                1.0, 2.5, 5.0, 10.0, 30.0, 60.0 };
+
+std::atomic<bool> Metrics::_dump_requested(false);
+
+/*****************************************************************************************
+ * Histogram (constructor) - starts empty
+ *****************************************************************************************/
+Histogram::Histogram():_count(0), _sum(0), _max(0) {
+   for (unsigned int i=0; i<num_buckets; i++)
+      _buckets[i].store(0, std::memory_order_relaxed);
+}
+
+/*****************************************************************************************
+ * bucketIndex - the bucket a value is counted in
+ *****************************************************************************************/
+unsigned int Histogram::bucketIndex(uint64_t value) {
+   if (value < hist_exact)
+      return (unsigned int) value;
+
+   unsigned int mag = 63 - __builtin_clzll(value);
+   unsigned int sub = (unsigned int) (value >> (mag - hist_sub_bits)) & ((1 << hist_sub_bits) - 1);
+   return hist_exact + ((mag - hist_first_mag) << hist_sub_bits) + sub;
+}
+
+/*****************************************************************************************
+ * bucketUpper - the largest value that lands in bucket i
+ *****************************************************************************************/
+uint64_t Histogram::bucketUpper(unsigned int i) {
+   if (i < hist_exact)
+      return i;
+
+   unsigned int mag = ((i - hist_exact) >> hist_sub_bits) + hist_first_mag;
+   uint64_t sub = (i - hist_exact) & ((1 << hist_sub_bits) - 1);
+   uint64_t width = 1ULL << (mag - hist_sub_bits);
+   return (((1ULL << hist_sub_bits) + sub) * width) + (width - 1);
+}
+
+/*****************************************************************************************
+ * record - counts one value
+ *****************************************************************************************/
+void Histogram::record(uint64_t value) {
+   _buckets[bucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+   _count.fetch_add(1, std::memory_order_relaxed);
+   _sum.fetch_add(value, std::memory_order_relaxed);
+
+   uint64_t cur = _max.load(std::memory_order_relaxed);
+   while ((value > cur) && !_max.compare_exchange_weak(cur, value, std::memory_order_relaxed));
+}
+
+/*****************************************************************************************
+ * getPercentile - walks the buckets until pct percent of the values are covered. Reads
+ *                 while other threads record, so the result is approximate under load
+ *****************************************************************************************/
+uint64_t Histogram::getPercentile(double pct) {
+   uint64_t total = getCount();
+   if (total == 0)
+      return 0;
+
+   uint64_t target = (uint64_t) ((pct / 100.0) * (double) total + 0.5);
+   if (target == 0)
+      target = 1;
+
+   uint64_t seen = 0;
+   for (unsigned int i=0; i<num_buckets; i++) {
+      seen += getBucketCount(i);
+      if (seen >= target) {
+         uint64_t upper = bucketUpper(i);
+         return (upper < getMax()) ? upper : getMax();
+      }
+   }
+   return getMax();
+}
+
+/*****************************************************************************************
+ * getCountUpTo - sums the buckets up to the one holding value
+ *****************************************************************************************/
+uint64_t Histogram::getCountUpTo(uint64_t value) {
+   uint64_t total = 0;
+   unsigned int last = bucketIndex(value);
+   for (unsigned int i=0; i<=last; i++)
+      total += getBucketCount(i);
+   return total;
+}
+
+/*****************************************************************************************
+ * merge - adds other's counts into ours
+ *****************************************************************************************/
+void Histogram::merge(Histogram &other) {
+   for (unsigned int i=0; i<num_buckets; i++) {
+      uint64_t count = other.getBucketCount(i);
+      if (count > 0)
+         _buckets[i].fetch_add(count, std::memory_order_relaxed);
+   }
+   _count.fetch_add(other.getCount(), std::memory_order_relaxed);
+   _sum.fetch_add(other.getSum(), std::memory_order_relaxed);
+
+   uint64_t value = other.getMax();
+   uint64_t cur = _max.load(std::memory_order_relaxed);
+   while ((value > cur) && !_max.compare_exchange_weak(cur, value, std::memory_order_relaxed));
+}
+
+/*****************************************************************************************
+ * Metrics (constructor) - all counters start at zero
+ *****************************************************************************************/
+Metrics::Metrics():
+                  plots_queued(0),
+                  plots_replicated(0),
+                  plots_duplicate(0),
+                  batches_sent(0),
+                  batches_received(0),
+                  connect_failures(0),
+                  reconnects(0),
+                  handshake_timeouts(0),
+                  ack_timeouts(0),
+                  shm_sends(0),
+                  shm_fallbacks(0),
+                  mcast_bytes_sent(0),
+                  nacks_sent(0),
+                  batches_resent(0),
+                  msgs_dropped(0),
+                  queue_depth(0),
+                  connections(0)
+{
+   pthread_mutex_init(&_peer_mutex, NULL);
+}
+
+Metrics::~Metrics() {
+   pthread_mutex_destroy(&_peer_mutex);
+}
+
+/*****************************************************************************************
+ * getPeer - finds or creates the stats for a peer. Only the lookup is locked; the counters
+ *           themselves are atomics
+ *****************************************************************************************/
+Metrics::peer_stats &Metrics::getPeer(const char *peer_id) {
+   pthread_mutex_lock(&_peer_mutex);
+
+   std::unique_ptr<peer_stats> &stats = _peers[peer_id];
+   if (!stats)
+      stats.reset(new peer_stats());
+   peer_stats &result = *stats;
+
+   pthread_mutex_unlock(&_peer_mutex);
+   return result;
+}
+
+uint64_t Metrics::getTotalBytesSent() {
+   uint64_t total = mcast_bytes_sent.load();
+
+   pthread_mutex_lock(&_peer_mutex);
+   for (auto pit = _peers.begin(); pit != _peers.end(); pit++)
+      total += pit->second->bytes_sent.load();
+   pthread_mutex_unlock(&_peer_mutex);
+   return total;
+}
+
+void Metrics::writeHistogram(std::ostream &out, const char *name, Histogram &hist) {
+   uint64_t count = hist.getCount();
+   out << name << "_count " << count << "\n";
+   out << name << "_mean " << ((count > 0) ? hist.getSum() / count : 0) << "\n";
+   out << name << "_p50 " << hist.getPercentile(50.0) << "\n";
+   out << name << "_p90 " << hist.getPercentile(90.0) << "\n";
+   out << name << "_p99 " << hist.getPercentile(99.0) << "\n";
+   out << name << "_max " << hist.getMax() << "\n";
+}
+
+/*****************************************************************************************
+ * writeReport - one "name value" line per metric, histograms as count/mean/percentiles/max
+ *****************************************************************************************/
+void Metrics::writeReport(std::ostream &out) {
+   out << "plots_queued " << plots_queued.load() << "\n";
+   out << "plots_replicated " << plots_replicated.load() << "\n";
+   out << "plots_duplicate " << plots_duplicate.load() << "\n";
+   out << "batches_sent " << batches_sent.load() << "\n";
+   out << "batches_received " << batches_received.load() << "\n";
+   out << "connect_failures " << connect_failures.load() << "\n";
+   out << "reconnects " << reconnects.load() << "\n";
+   out << "handshake_timeouts " << handshake_timeouts.load() << "\n";
+   out << "ack_timeouts " << ack_timeouts.load() << "\n";
+   out << "shm_sends " << shm_sends.load() << "\n";
+   out << "shm_fallbacks " << shm_fallbacks.load() << "\n";
+   out << "mcast_bytes_sent " << mcast_bytes_sent.load() << "\n";
+   out << "nacks_sent " << nacks_sent.load() << "\n";
+   out << "batches_resent " << batches_resent.load() << "\n";
+   out << "msgs_dropped " << msgs_dropped.load() << "\n";
+   out << "queue_depth " << queue_depth.load() << "\n";
+   out << "connections " << connections.load() << "\n";
+
+   writeHistogram(out, "ingest_latency_ns", ingest_latency);
+   writeHistogram(out, "repl_latency_ns", repl_latency);
+   writeHistogram(out, "handshake_time_ns", handshake_time);
+   writeHistogram(out, "encrypt_time_ns", encrypt_time);
+   writeHistogram(out, "decrypt_time_ns", decrypt_time);
+   writeHistogram(out, "encode_time_ns", encode_time);
+   writeHistogram(out, "decode_time_ns", decode_time);
+
+   pthread_mutex_lock(&_peer_mutex);
+   for (auto pit = _peers.begin(); pit != _peers.end(); pit++) {
+      peer_stats &stats = *pit->second;
+      out << "peer " << pit->first << " bytes_sent " << stats.bytes_sent.load() <<
+             " bytes_received " << stats.bytes_received.load() << " plots_received " <<
+             stats.plots_received.load() << " handshakes " << stats.handshakes.load() << "\n";
+   }
+   pthread_mutex_unlock(&_peer_mutex);
+}
+
+/*****************************************************************************************
+ * appendToFile - adds a report headed by the current date/time to the end of filename
+ *****************************************************************************************/
+bool Metrics::appendToFile(const char *filename) {
+   std::ofstream out(filename, std::ios::app);
+   if (!out.is_open())
+      return false;
+
+   char timestr[26];
+   time_t curtime = time(NULL);
+   if (ctime_r(&curtime, timestr) == NULL)
+      return false;
+
+   out << "# metrics " << timestr;
+   writeReport(out);
+   out << "\n";
+   return out.good();
+}
+
+void Metrics::writePromHistogram(std::ostream &out, const std::string &name, const char *help,
+                                 Histogram &hist) {
+   out << "# HELP " << name << " " << help << "\n";
+   out << "# TYPE " << name << " histogram\n";
+   for (unsigned int i=0; i<sizeof(prom_buckets) / sizeof(prom_buckets[0]); i++) {
+      out << name << "_bucket{le=\"" << prom_buckets[i] << "\"} " <<
+             hist.getCountUpTo((uint64_t) (prom_buckets[i] * 1e9)) << "\n";
+   }
+   out << name << "_bucket{le=\"+Inf\"} " << hist.getCount() << "\n";
+   out << name << "_sum " << (double) hist.getSum() / 1e9 << "\n";
+   out << name << "_count " << hist.getCount() << "\n";
+}
+
+/*****************************************************************************************
+ * writePrometheus - counters as _total, gauges as is, histograms in seconds and per-peer
+ *                   stats labeled with the peer ID
+ *****************************************************************************************/
+void Metrics::writePrometheus(std::ostream &out, const char *prefix) {
+   std::string p(prefix);
+
+   struct { const char *name; const char *help; std::atomic<uint64_t> &value; } counters[] = {
+      { "plots_queued_total", "Local plots queued for replication", plots_queued },
+      { "plots_replicated_total", "Plots received from peers and stored", plots_replicated },
+      { "plots_duplicate_total", "Plots received that we already held", plots_duplicate },
+      { "batches_sent_total", "Plot batches queued to peers", batches_sent },
+      { "batches_received_total", "Plot batches received from peers", batches_received },
+      { "connect_failures_total", "Failed outgoing connection attempts", connect_failures },
+      { "reconnects_total", "Outgoing connection retries", reconnects },
+      { "handshake_timeouts_total", "Connections dropped mid-handshake", handshake_timeouts },
+      { "ack_timeouts_total", "Sends that got no ACK in time", ack_timeouts },
+      { "shm_sends_total", "Payloads sent to co-located peers over shared memory", shm_sends },
+      { "shm_fallbacks_total", "Payloads for co-located peers sent over TCP instead", shm_fallbacks },
+      { "mcast_bytes_sent_total", "Datagram bytes sent to the multicast group", mcast_bytes_sent },
+      { "nacks_sent_total", "Requests to retransmit missed batches", nacks_sent },
+      { "batches_resent_total", "Batches retransmitted for a NACK", batches_resent },
+      { "msgs_dropped_total", "Replication messages dropped as malformed", msgs_dropped },
+   };
+   for (auto &c : counters) {
+      out << "# HELP " << p << "_" << c.name << " " << c.help << "\n";
+      out << "# TYPE " << p << "_" << c.name << " counter\n";
+      out << p << "_" << c.name << " " << c.value.load() << "\n";
+   }
+
+   out << "# HELP " << p << "_queue_depth Entries in the replication queue\n";
+   out << "# TYPE " << p << "_queue_depth gauge\n";
+   out << p << "_queue_depth " << queue_depth.load() << "\n";
+   out << "# HELP " << p << "_connections Open peer connections\n";
+   out << "# TYPE " << p << "_connections gauge\n";
+   out << p << "_connections " << connections.load() << "\n";
+
+   writePromHistogram(out, p + "_ingest_latency_seconds", "Antenna injection to queued for "
+                      "replication", ingest_latency);
+   writePromHistogram(out, p + "_repl_latency_seconds", "Injection on the origin to stored "
+                      "here", repl_latency);
+   writePromHistogram(out, p + "_handshake_seconds", "Connect or accept to authenticated",
+                      handshake_time);
+   writePromHistogram(out, p + "_encrypt_seconds", "Time to encrypt a message", encrypt_time);
+   writePromHistogram(out, p + "_decrypt_seconds", "Time to decrypt a message", decrypt_time);
+   writePromHistogram(out, p + "_encode_seconds", "Time to encode an outgoing payload",
+                      encode_time);
+   writePromHistogram(out, p + "_decode_seconds", "Time to decode an incoming payload",
+                      decode_time);
+
+   const char *peer_names[] = { "peer_bytes_sent_total", "peer_bytes_received_total",
+                                "peer_plots_received_total", "peer_handshakes_total" };
+   const char *peer_help[] = { "Payload bytes sent to the peer", "Payload bytes received "
+                               "from the peer", "Plots received from the peer",
+                               "Completed handshakes with the peer" };
+
+   pthread_mutex_lock(&_peer_mutex);
+   for (unsigned int i=0; i<4; i++) {
+      out << "# HELP " << p << "_" << peer_names[i] << " " << peer_help[i] << "\n";
+      out << "# TYPE " << p << "_" << peer_names[i] << " counter\n";
+      for (auto pit = _peers.begin(); pit != _peers.end(); pit++) {
+         peer_stats &stats = *pit->second;
+         std::atomic<uint64_t> *values[] = { &stats.bytes_sent, &stats.bytes_received,
+                                             &stats.plots_received, &stats.handshakes };
+         out << p << "_" << peer_names[i] << "{peer=\"" << pit->first << "\"} " <<
+                values[i]->load() << "\n";
+      }
+   }
+   pthread_mutex_unlock(&_peer_mutex);
+}
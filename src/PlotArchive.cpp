@@ -0,0 +1,655 @@
+#include <stdexcept>
+#include <cstring>
+#include <unordered_map>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "PlotArchive.h"
+#include "FileDesc.h"
+
+const char archive_magic[4] = { 'P', 'D', 'A', 'R' };
+const char index_magic[4] = { 'P', 'D', 'A', 'X' };
+const unsigned int archive_header_size = 16;
+const unsigned int block_header_size = 24;
+const unsigned int index_entry_size = 34;       // Not counting the node IDs
+const unsigned int index_trailer_size = 16;
+
+// Appends a little-endian integer to buf
+template <typename T>
+static void putLE(std::vector<uint8_t> &buf, T value) {
+   uint64_t v = (uint64_t) value;
+   for (unsigned int i=0; i<sizeof(T); i++)
+      buf.push_back((uint8_t) (v >> (8 * i)));
+}
+
+// Reads a little-endian integer from data
+template <typename T>
+static T getLE(const uint8_t *data) {
+   uint64_t v = 0;
+   for (unsigned int i=0; i<sizeof(T); i++)
+      v |= (uint64_t) data[i] << (8 * i);
+   return (T) v;
+}
+
+// Bits needed to index n dictionary entries (0 if there is only one)
+static unsigned int indexBits(size_t n) {
+   unsigned int bits = 0;
+   while ((((size_t) 1) << bits) < n)
+      bits++;
+   return bits;
+}
+
+/******************************************************************************************
+ * BitWriter / BitReader - pack values of any width up to 64 bits, most significant bit first
+ ******************************************************************************************/
+class BitWriter
+{
+public:
+   BitWriter(std::vector<uint8_t> &buf):_buf(buf), _acc(0), _nbits(0) {};
+
+   void write(uint64_t value, unsigned int bits) {
+      if (bits > 32) {
+         write(value >> 32, bits - 32);
+         bits = 32;
+      }
+      if (bits == 0)
+         return;
+
+      _acc = (_acc << bits) | (value & ((1ULL << bits) - 1));
+      _nbits += bits;
+      while (_nbits >= 8) {
+         _nbits -= 8;
+         _buf.push_back((uint8_t) (_acc >> _nbits));
+      }
+   }
+
+   // Pads out the last partial byte with zeros
+   void flush() {
+      if (_nbits > 0)
+         _buf.push_back((uint8_t) (_acc << (8 - _nbits)));
+      _nbits = 0;
+   }
+
+private:
+   std::vector<uint8_t> &_buf;
+   uint64_t _acc;
+   unsigned int _nbits;
+};
+
+class BitReader
+{
+public:
+   BitReader(const uint8_t *data, size_t size):_data(data), _size(size), _pos(0), _acc(0), _nbits(0) {};
+
+   uint64_t read(unsigned int bits) {
+      if (bits > 32) {
+         uint64_t high = read(bits - 32);
+         return (high << 32) | read(32);
+      }
+      if (bits == 0)
+         return 0;
+
+      while (_nbits < bits) {
+         if (_pos >= _size)
+            throw std::runtime_error("Archive block ran out of data prematurely");
+         _acc = (_acc << 8) | _data[_pos++];
+         _nbits += 8;
+      }
+      _nbits -= bits;
+      return (_acc >> _nbits) & ((1ULL << bits) - 1);
+   }
+
+private:
+   const uint8_t *_data;
+   size_t _size;
+   size_t _pos;
+   uint64_t _acc;
+   unsigned int _nbits;
+};
+
+/******************************************************************************************
+ * Timestamp column - each value is stored as the change in its delta from the previous one,
+ * zigzag encoded, with a prefix code picking the smallest width that holds it:
+ *    0 = same delta, 10 = 7 bits, 110 = 14 bits, 1110 = 24 bits, 11110 = 40 bits, 11111 = 64
+ ******************************************************************************************/
+const unsigned int dod_widths[] = { 7, 14, 24, 40 };
+const unsigned int num_dod_widths = 4;
+
+static void writeDoD(BitWriter &bits, int64_t dod) {
+   uint64_t zz = ((uint64_t) dod << 1) ^ (uint64_t) (dod >> 63);
+
+   if (zz == 0) {
+      bits.write(0, 1);
+      return;
+   }
+
+   for (unsigned int i=0; i<num_dod_widths; i++) {
+      if (zz < (1ULL << dod_widths[i])) {
+         bits.write((1ULL << (i + 2)) - 2, i + 2);    // i+1 ones then a zero
+         bits.write(zz, dod_widths[i]);
+         return;
+      }
+   }
+   bits.write((1ULL << (num_dod_widths + 1)) - 1, num_dod_widths + 1);
+   bits.write(zz, 64);
+}
+
+static int64_t readDoD(BitReader &bits) {
+   unsigned int ones = 0;
+   while ((ones <= num_dod_widths) && (bits.read(1) == 1))
+      ones++;
+
+   uint64_t zz = 0;
+   if (ones > num_dod_widths)
+      zz = bits.read(64);
+   else if (ones > 0)
+      zz = bits.read(dod_widths[ones - 1]);
+
+   return (int64_t) (zz >> 1) ^ -(int64_t) (zz & 1);
+}
+
+/******************************************************************************************
+ * Float columns (Gorilla XOR) - each value is XORed with the previous one:
+ *    0                    - same value
+ *    10 + bits            - changed bits fit in the previous leading/trailing zero window
+ *    11 + lead(5) + len-1(5) + bits - a new window
+ ******************************************************************************************/
+struct xor_state {
+   uint32_t prev = 0;
+   unsigned int lead = 33;    // no window yet
+   unsigned int trail = 0;
+};
+
+static void writeXOR(BitWriter &bits, xor_state &state, float value) {
+   uint32_t cur;
+   memcpy(&cur, &value, sizeof(cur));
+   uint32_t x = cur ^ state.prev;
+   state.prev = cur;
+
+   if (x == 0) {
+      bits.write(0, 1);
+      return;
+   }
+
+   unsigned int lead = __builtin_clz(x);
+   unsigned int trail = __builtin_ctz(x);
+
+   if ((state.lead <= 32) && (lead >= state.lead) && (trail >= state.trail)) {
+      bits.write(2, 2);
+      bits.write(x >> state.trail, 32 - state.lead - state.trail);
+      return;
+   }
+
+   unsigned int len = 32 - lead - trail;
+   bits.write(3, 2);
+   bits.write(lead, 5);
+   bits.write(len - 1, 5);
+   bits.write(x >> trail, len);
+   state.lead = lead;
+   state.trail = trail;
+}
+
+static float readXOR(BitReader &bits, xor_state &state) {
+   if (bits.read(1) == 1) {
+      uint32_t x;
+      if (bits.read(1) == 0) {
+         if (state.lead > 32)
+            throw std::runtime_error("Archive block reused a float window before setting one");
+         x = (uint32_t) bits.read(32 - state.lead - state.trail) << state.trail;
+      } else {
+         unsigned int lead = bits.read(5);
+         unsigned int len = bits.read(5) + 1;
+         if (lead + len > 32)
+            throw std::runtime_error("Archive block has an invalid float window");
+         state.lead = lead;
+         state.trail = 32 - lead - len;
+         x = (uint32_t) bits.read(len) << state.trail;
+      }
+      state.prev ^= x;
+   }
+
+   float value;
+   memcpy(&value, &state.prev, sizeof(value));
+   return value;
+}
+
+/*****************************************************************************************
+ * PlotArchive (constructor)
+ *
+ *    Params:  filename - the archive to read or write
+ *****************************************************************************************/
+PlotArchive::PlotArchive(const char *filename):
+                              _filename(filename),
+                              _blocks_read(0),
+                              _blocks_skipped(0)
+{
+
+}
+
+PlotArchive::~PlotArchive() {
+
+}
+
+/*****************************************************************************************
+ * encodeBlock - appends the compressed payload for a block of plots to buf and returns the
+ *               distinct node IDs in the block (for the footer index) in node_dict
+ *
+ *    Format: node dictionary (u16 count, u32 IDs), drone dictionary (u16 count, u32 IDs),
+ *            then a bitstream of the node index, drone index, timestamp, latitude and
+ *            longitude columns, padded to a whole byte
+ *****************************************************************************************/
+void PlotArchive::encodeBlock(std::vector<DronePlot *> &plots, std::vector<uint8_t> &buf,
+                              std::vector<unsigned int> &node_dict) {
+   std::vector<unsigned int> node_idx(plots.size()), drone_idx(plots.size());
+   std::vector<unsigned int> drone_dict;
+   node_dict.clear();
+   std::unordered_map<unsigned int, unsigned int> node_map, drone_map;
+
+   // Build the ID dictionaries in order of first appearance
+   for (unsigned int i=0; i<plots.size(); i++) {
+      auto nres = node_map.emplace(plots[i]->node_id, node_dict.size());
+      if (nres.second)
+         node_dict.push_back(plots[i]->node_id);
+      node_idx[i] = nres.first->second;
+
+      auto dres = drone_map.emplace(plots[i]->drone_id, drone_dict.size());
+      if (dres.second)
+         drone_dict.push_back(plots[i]->drone_id);
+      drone_idx[i] = dres.first->second;
+   }
+
+   putLE<uint16_t>(buf, node_dict.size());
+   for (unsigned int i=0; i<node_dict.size(); i++)
+      putLE<uint32_t>(buf, node_dict[i]);
+   putLE<uint16_t>(buf, drone_dict.size());
+   for (unsigned int i=0; i<drone_dict.size(); i++)
+      putLE<uint32_t>(buf, drone_dict[i]);
+
+   BitWriter bits(buf);
+
+   unsigned int width = indexBits(node_dict.size());
+   for (unsigned int i=0; i<plots.size(); i++)
+      bits.write(node_idx[i], width);
+
+   width = indexBits(drone_dict.size());
+   for (unsigned int i=0; i<plots.size(); i++)
+      bits.write(drone_idx[i], width);
+
+   simtime_t prev_time = 0, prev_delta = 0;
+   for (unsigned int i=0; i<plots.size(); i++) {
+      if (i == 0) {
+         bits.write((uint64_t) plots[i]->timestamp, 64);
+      } else {
+         // Unsigned math so wildly out-of-order timestamps wrap instead of overflowing
+         simtime_t delta = (simtime_t) ((uint64_t) plots[i]->timestamp - (uint64_t) prev_time);
+         writeDoD(bits, (int64_t) ((uint64_t) delta - (uint64_t) prev_delta));
+         prev_delta = delta;
+      }
+      prev_time = plots[i]->timestamp;
+   }
+
+   xor_state lat_state, lon_state;
+   for (unsigned int i=0; i<plots.size(); i++)
+      writeXOR(bits, lat_state, plots[i]->latitude);
+   for (unsigned int i=0; i<plots.size(); i++)
+      writeXOR(bits, lon_state, plots[i]->longitude);
+
+   bits.flush();
+}
+
+/*****************************************************************************************
+ * decodeBlock - rebuilds the plots of one block from its payload
+ *
+ *    Throws: runtime_error if the payload is corrupt
+ *****************************************************************************************/
+void PlotArchive::decodeBlock(const uint8_t *data, size_t size, unsigned int num_plots,
+                              std::vector<DronePlot> &plots) {
+   std::vector<unsigned int> node_dict, drone_dict;
+   size_t pos = 0;
+
+   for (std::vector<unsigned int> *dict : { &node_dict, &drone_dict }) {
+      if (pos + sizeof(uint16_t) > size)
+         throw std::runtime_error("Archive block ran out of data prematurely");
+      unsigned int count = getLE<uint16_t>(data + pos);
+      pos += sizeof(uint16_t);
+
+      if ((count == 0) || (pos + count * sizeof(uint32_t) > size))
+         throw std::runtime_error("Archive block has an invalid ID dictionary");
+      for (unsigned int i=0; i<count; i++, pos += sizeof(uint32_t))
+         dict->push_back(getLE<uint32_t>(data + pos));
+   }
+
+   // Each plot takes at least 3 bits (timestamp, latitude and longitude), so a count the
+   // payload cannot hold is corrupt
+   if (num_plots > (size - pos) * 8 / 3)
+      throw std::runtime_error("Archive block has more plots than its payload holds");
+
+   plots.resize(num_plots);
+   BitReader bits(data + pos, size - pos);
+
+   unsigned int width = indexBits(node_dict.size());
+   for (unsigned int i=0; i<num_plots; i++) {
+      unsigned int idx = bits.read(width);
+      if (idx >= node_dict.size())
+         throw std::runtime_error("Archive block has a node index out of range");
+      plots[i].node_id = node_dict[idx];
+   }
+
+   width = indexBits(drone_dict.size());
+   for (unsigned int i=0; i<num_plots; i++) {
+      unsigned int idx = bits.read(width);
+      if (idx >= drone_dict.size())
+         throw std::runtime_error("Archive block has a drone index out of range");
+      plots[i].drone_id = drone_dict[idx];
+   }
+
+   simtime_t prev_time = 0, prev_delta = 0;
+   for (unsigned int i=0; i<num_plots; i++) {
+      if (i == 0) {
+         plots[i].timestamp = (simtime_t) bits.read(64);
+      } else {
+         prev_delta = (simtime_t) ((uint64_t) prev_delta + (uint64_t) readDoD(bits));
+         plots[i].timestamp = (simtime_t) ((uint64_t) prev_time + (uint64_t) prev_delta);
+      }
+      prev_time = plots[i].timestamp;
+   }
+
+   xor_state lat_state, lon_state;
+   for (unsigned int i=0; i<num_plots; i++)
+      plots[i].latitude = readXOR(bits, lat_state);
+   for (unsigned int i=0; i<num_plots; i++)
+      plots[i].longitude = readXOR(bits, lon_state);
+}
+
+/*****************************************************************************************
+ * writeAll - writes all of buf to the file, retrying partial writes
+ *
+ *    Returns: false if a write failed
+ *****************************************************************************************/
+static bool writeAll(FileFD &outfile, std::vector<uint8_t> &buf) {
+   for (size_t wpos = 0; wpos < buf.size(); ) {
+      ssize_t results = outfile.writeFD((const char *) buf.data() + wpos, buf.size() - wpos);
+      if (results < 0)
+         return false;
+      wpos += results;
+   }
+   return true;
+}
+
+/*****************************************************************************************
+ * writePlots - writes plots to the archive in blocks, followed by the footer index, replacing
+ *              the file
+ *
+ *    Params:  start, end - the plots to write
+ *             block_plots - most plots per block (1-65535). Smaller blocks let time-range
+ *                           reads skip more precisely but compress a little worse
+ *
+ *    Returns: -1 if the file could not be written, otherwise num written
+ *****************************************************************************************/
+int PlotArchive::writePlots(std::list<DronePlot>::iterator start, std::list<DronePlot>::iterator end,
+                            unsigned int block_plots) {
+   if ((block_plots == 0) || (block_plots > UINT16_MAX))
+      throw std::runtime_error("Archive block size must be between 1 and 65535 plots.");
+
+   FileFD outfile(_filename.c_str());
+   if (!outfile.openFile(FileFD::writefd, true))
+      return -1;
+
+   std::vector<uint8_t> buf(archive_magic, archive_magic + sizeof(archive_magic));
+   putLE<uint16_t>(buf, archive_version);
+   putLE<uint16_t>(buf, 0);
+   putLE<uint32_t>(buf, block_plots);
+   putLE<uint32_t>(buf, 0);
+
+   int count = 0;
+   uint64_t file_pos = 0;     // File offset of the start of buf
+   std::vector<archive_block> index;
+   std::vector<DronePlot *> block;
+   block.reserve(block_plots);
+   std::list<DronePlot>::iterator dpit = start;
+
+   while ((dpit != end) || (block.size() > 0)) {
+      if (dpit != end) {
+         block.push_back(&(*dpit));
+         dpit++;
+      }
+
+      if ((block.size() == block_plots) || ((dpit == end) && (block.size() > 0))) {
+         archive_block entry;
+         entry.offset = file_pos + buf.size();
+         entry.num_plots = block.size();
+         entry.min_time = block[0]->timestamp;
+         entry.max_time = block[0]->timestamp;
+         for (unsigned int i=1; i<block.size(); i++) {
+            entry.min_time = std::min(entry.min_time, block[i]->timestamp);
+            entry.max_time = std::max(entry.max_time, block[i]->timestamp);
+         }
+
+         // Header goes in front of the payload once we know the payload size
+         size_t header_pos = buf.size();
+         buf.resize(header_pos + block_header_size);
+         encodeBlock(block, buf, entry.nodes);
+         entry.payload_size = buf.size() - header_pos - block_header_size;
+
+         std::vector<uint8_t> header;
+         putLE<uint32_t>(header, entry.num_plots);
+         putLE<uint32_t>(header, entry.payload_size);
+         putLE<int64_t>(header, entry.min_time);
+         putLE<int64_t>(header, entry.max_time);
+         memcpy(buf.data() + header_pos, header.data(), block_header_size);
+
+         index.push_back(entry);
+         count += block.size();
+         block.clear();
+      }
+
+      // Write in large chunks rather than per block
+      if (buf.size() >= 1024 * 1024) {
+         if (!writeAll(outfile, buf)) {
+            outfile.closeFD();
+            return -1;
+         }
+         file_pos += buf.size();
+         buf.clear();
+      }
+   }
+
+   // Footer index so readers can pick blocks without touching the rest of the file
+   uint64_t index_offset = file_pos + buf.size();
+   for (unsigned int i=0; i<index.size(); i++) {
+      putLE<uint64_t>(buf, index[i].offset);
+      putLE<uint32_t>(buf, index[i].num_plots);
+      putLE<uint32_t>(buf, index[i].payload_size);
+      putLE<int64_t>(buf, index[i].min_time);
+      putLE<int64_t>(buf, index[i].max_time);
+      putLE<uint16_t>(buf, index[i].nodes.size());
+      for (unsigned int j=0; j<index[i].nodes.size(); j++)
+         putLE<uint32_t>(buf, index[i].nodes[j]);
+   }
+   putLE<uint64_t>(buf, index_offset);
+   putLE<uint32_t>(buf, index.size());
+   buf.insert(buf.end(), index_magic, index_magic + sizeof(index_magic));
+
+   bool results = writeAll(outfile, buf);
+   outfile.closeFD();
+   return results ? count : -1;
+}
+
+/*****************************************************************************************
+ * readIndex - loads the block list from the footer index (version 2 and up)
+ *
+ *    Throws: runtime_error if the footer is missing or corrupt
+ *****************************************************************************************/
+void PlotArchive::readIndex(const uint8_t *data, size_t size, std::vector<archive_block> &blocks) {
+   if ((size < archive_header_size + index_trailer_size) ||
+            (memcmp(data + size - sizeof(index_magic), index_magic, sizeof(index_magic)) != 0))
+      throw std::runtime_error("Archive footer index missing (file truncated?)");
+
+   const uint8_t *trailer = data + size - index_trailer_size;
+   uint64_t pos = getLE<uint64_t>(trailer);
+   unsigned int num_blocks = getLE<uint32_t>(trailer + 8);
+   uint64_t index_end = size - index_trailer_size;
+
+   if ((pos < archive_header_size) || (pos > index_end))
+      throw std::runtime_error("Archive footer index offset out of range");
+
+   // Every entry takes at least index_entry_size bytes, so a larger count is corrupt
+   if (num_blocks > (index_end - pos) / index_entry_size)
+      throw std::runtime_error("Archive footer index truncated");
+
+   blocks.resize(num_blocks);
+   for (unsigned int i=0; i<num_blocks; i++) {
+      if (pos + index_entry_size > index_end)
+         throw std::runtime_error("Archive footer index truncated");
+
+      blocks[i].offset = getLE<uint64_t>(data + pos);
+      blocks[i].num_plots = getLE<uint32_t>(data + pos + 8);
+      blocks[i].payload_size = getLE<uint32_t>(data + pos + 12);
+      blocks[i].min_time = getLE<int64_t>(data + pos + 16);
+      blocks[i].max_time = getLE<int64_t>(data + pos + 24);
+      unsigned int num_nodes = getLE<uint16_t>(data + pos + 32);
+      pos += index_entry_size;
+
+      if (pos + num_nodes * sizeof(uint32_t) > index_end)
+         throw std::runtime_error("Archive footer index truncated");
+      for (unsigned int j=0; j<num_nodes; j++, pos += sizeof(uint32_t))
+         blocks[i].nodes.push_back(getLE<uint32_t>(data + pos));
+
+      if (blocks[i].offset + block_header_size + blocks[i].payload_size > index_end)
+         throw std::runtime_error("Archive footer index points past the blocks");
+   }
+}
+
+/*****************************************************************************************
+ * scanBlocks - builds the block list by hopping from block header to block header, for
+ *              version 1 archives that have no footer index
+ *
+ *    Throws: runtime_error if a block is truncated
+ *****************************************************************************************/
+void PlotArchive::scanBlocks(const uint8_t *data, size_t size, std::vector<archive_block> &blocks) {
+   size_t pos = archive_header_size;
+
+   while (pos < size) {
+      if (pos + block_header_size > size)
+         throw std::runtime_error("Archive block header truncated");
+
+      archive_block entry;
+      entry.offset = pos;
+      entry.num_plots = getLE<uint32_t>(data + pos);
+      entry.payload_size = getLE<uint32_t>(data + pos + 4);
+      entry.min_time = getLE<int64_t>(data + pos + 8);
+      entry.max_time = getLE<int64_t>(data + pos + 16);
+      pos += block_header_size + entry.payload_size;
+
+      if (pos > size)
+         throw std::runtime_error("Archive block payload truncated");
+      blocks.push_back(entry);
+   }
+}
+
+/*****************************************************************************************
+ * readPlots - maps the archive and decodes only the blocks that can hold wanted plots. The
+ *             footer index gives every block's time range and node IDs, so blocks outside
+ *             the time window or without any wanted node are never touched
+ *
+ *    Params:  plots - where to add the plots read
+ *             start_time, end_time - the time range to keep, [start_time, end_time)
+ *             nodes - the node IDs to keep, empty for all of them
+ *
+ *    Returns: -1 if the file could not be opened or is corrupt (nothing is added), otherwise
+ *             num read in
+ *****************************************************************************************/
+int PlotArchive::readPlots(std::list<DronePlot> &plots, simtime_t start_time, simtime_t end_time,
+                           const std::set<unsigned int> &nodes) {
+   _blocks_read = 0;
+   _blocks_skipped = 0;
+
+   FileFD infile(_filename.c_str());
+   if (!infile.openFile(FileFD::readfd))
+      return -1;
+
+   struct stat fileinfo;
+   if ((fstat(infile.getFD(), &fileinfo) == -1) || ((size_t) fileinfo.st_size < archive_header_size)) {
+      infile.closeFD();
+      return -1;
+   }
+
+   size_t size = fileinfo.st_size;
+   void *mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, infile.getFD(), 0);
+   infile.closeFD();
+   if (mapped == MAP_FAILED)
+      return -1;
+
+   const uint8_t *data = (const uint8_t *) mapped;
+   std::list<DronePlot> results;
+
+   try {
+      if (memcmp(data, archive_magic, sizeof(archive_magic)) != 0)
+         throw std::runtime_error("Not a plot archive");
+
+      std::vector<archive_block> blocks;
+      uint16_t version = getLE<uint16_t>(data + 4);
+      if (version == 1)
+         scanBlocks(data, size, blocks);
+      else if (version == archive_version)
+         readIndex(data, size, blocks);
+      else
+         throw std::runtime_error("Unsupported plot archive version");
+
+      unsigned int block_plots = getLE<uint32_t>(data + 8);
+
+      std::vector<DronePlot> block;
+      for (unsigned int i=0; i<blocks.size(); i++) {
+         bool wanted = (blocks[i].max_time >= start_time) && (blocks[i].min_time < end_time);
+
+         // Version 1 blocks have no node list in the index, so they always get decoded
+         if (wanted && !nodes.empty() && !blocks[i].nodes.empty()) {
+            wanted = false;
+            for (unsigned int j=0; j<blocks[i].nodes.size() && !wanted; j++)
+               wanted = (nodes.find(blocks[i].nodes[j]) != nodes.end());
+         }
+
+         if (!wanted) {
+            _blocks_skipped++;
+            continue;
+         }
+
+         if (blocks[i].num_plots > block_plots)
+            throw std::runtime_error("Archive block has more plots than the header allows");
+
+         decodeBlock(data + blocks[i].offset + block_header_size, blocks[i].payload_size,
+                     blocks[i].num_plots, block);
+         for (unsigned int j=0; j<block.size(); j++) {
+            if ((block[j].timestamp >= start_time) && (block[j].timestamp < end_time) &&
+                     (nodes.empty() || (nodes.find(block[j].node_id) != nodes.end())))
+               results.push_back(block[j]);
+         }
+         _blocks_read++;
+      }
+   } catch (std::runtime_error &e) {
+      munmap(mapped, size);
+      return -1;
+   }
+
+   munmap(mapped, size);
+
+   int count = results.size();
+   plots.splice(plots.end(), results);
+   return count;
+}
+
+/*****************************************************************************************
+ * isArchive - checks a file for the archive magic number
+ *****************************************************************************************/
+bool PlotArchive::isArchive(const char *filename) {
+   FileFD infile(filename);
+   if (!infile.openFile(FileFD::readfd))
+      return false;
+
+   char magic[sizeof(archive_magic)];
+   bool results = (read(infile.getFD(), magic, sizeof(magic)) == sizeof(magic)) &&
+                  (memcmp(magic, archive_magic, sizeof(magic)) == 0);
+   infile.closeFD();
+   return results;
+}
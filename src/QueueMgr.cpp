@@ -2,6 +2,7 @@
 #include <arpa/inet.h>
 #include <tuple>
 #include <sstream>
+#include <algorithm>
 #include <crypto++/osrng.h>
 #include <crypto++/filters.h>
 #include <crypto++/files.h>
@@ -15,8 +16,13 @@
  *
  ********************************************************************************************/
 
-QueueMgr::QueueMgr(unsigned int verbosity):TCPServer(verbosity)
-               
+QueueMgr::QueueMgr(unsigned int verbosity):TCPServer(verbosity),
+                                            _skew(NULL),
+                                            _codec(NULL),
+                                            _fast_handshake(false),
+                                            _use_shm(true),
+                                            _mcast_port(0),
+                                            _mcast_ready(false)
 {
    if (loadServerList("servers.txt") <= 0)
       throw std::runtime_error("Could not open server.txt file, or file was empty/corrupt.");
@@ -84,9 +90,31 @@ int QueueMgr::loadServerList(const char *filename) {
                                              unsigned long>(svrid, ipaddr.s_addr, port));
       count++;     
    }
+   indexServerList();
    return count;
 }
 
+/*********************************************************************************************
+ * indexServerList - maps each server ID and address to its position in the server list
+ *********************************************************************************************/
+void QueueMgr::indexServerList() {
+   _server_by_id.clear();
+   _server_by_addr.clear();
+
+   for (unsigned int i=0; i<_server_list.size(); i++) {
+      _server_by_id[std::get<0>(_server_list[i])] = i;
+      _server_by_addr[((uint64_t) std::get<1>(_server_list[i]) << 16) |
+                                                         std::get<2>(_server_list[i])] = i;
+   }
+}
+
+int QueueMgr::findServer(const char *sid) {
+   auto found = _server_by_id.find(sid);
+   if (found == _server_by_id.end())
+      return -1;
+   return found->second;
+}
+
 /**********************************************************************************************
  * getClientID - Gets the server ID based on the IP address and port in the lookup table
  *
@@ -97,13 +125,10 @@ int QueueMgr::loadServerList(const char *filename) {
  **********************************************************************************************/
 
 const char *QueueMgr::getClientID(unsigned long ip_addr, short unsigned int port) {
-   auto sl_iter = _server_list.begin();
-   for ( ; sl_iter != _server_list.end(); sl_iter++) {
-      if ((std::get<1>(*sl_iter) == ip_addr) && (std::get<2>(*sl_iter) == port)) {
-         return std::get<0>(*sl_iter).c_str();
-      }
-   }
-   return NULL;
+   auto found = _server_by_addr.find(((uint64_t) ip_addr << 16) | port);
+   if (found == _server_by_addr.end())
+      return NULL;
+   return std::get<0>(_server_list[found->second]).c_str();
 }
 
 
@@ -132,6 +157,7 @@ void QueueMgr::bindSvr(const char *ip_addr, short unsigned int port) {
       else
          sliter++;
    }
+   indexServerList();
 
    // If we never found our server, that's a problem--crash out
    if (!found) {
@@ -145,6 +171,62 @@ void QueueMgr::bindSvr(const char *ip_addr, short unsigned int port) {
    logname += "server.log";
    changeLogfile(logname.c_str()); 
    _server_log.writeLog("Server started.");
+
+   // Co-located servers find each other by our TCP address, so set up once that is known
+   if (_use_shm) {
+      try {
+         _shm.reset(new ShmTransport(_server_log, _verbosity));
+         _shm->listen(getServerID(), getIPAddr(), htons(getPort()));
+      } catch (std::runtime_error &e) {
+         std::string msg = "Shared memory links unavailable, using TCP only: ";
+         msg += e.what();
+         _server_log.writeLog(msg);
+         _shm.reset();
+      }
+   }
+
+   // Without a group everything goes by TCP, so failing to join is not fatal either
+   if (_mcast_group.size() > 0) {
+      try {
+         _mcast.reset(new McastChannel(_server_log, _aes_key, _verbosity));
+         _mcast->join(getServerID(), _mcast_group.c_str(), _mcast_port, getIPAddr());
+         _mcast_ready = true;
+      } catch (std::runtime_error &e) {
+         std::string msg = "Multicast unavailable, using TCP only: ";
+         msg += e.what();
+         _server_log.writeLog(msg);
+         _mcast.reset();
+      }
+   }
+}
+
+/**********************************************************************************************
+ * addPollFDs, handleEvents - add the shared memory links to the TCP sockets
+ *
+ **********************************************************************************************/
+
+simtime_t QueueMgr::addPollFDs(std::vector<struct pollfd> &fds, simtime_t max_wait) {
+   simtime_t wait = TCPServer::addPollFDs(fds, max_wait);
+   if (_shm)
+      _shm->addPollFDs(fds);
+   if (_mcast)
+      fds.push_back({_mcast->getFD(), POLLIN, 0});
+   return wait;
+}
+
+void QueueMgr::handleEvents(const std::vector<struct pollfd> &fds) {
+   TCPServer::handleEvents(fds);
+   if (_shm)
+      _shm->handleEvents(fds);
+
+   for (auto &pfd : fds) {
+      if (_mcast && (pfd.fd == _mcast->getFD()) && (pfd.revents != 0))
+         _mcast_ready = true;
+   }
+}
+
+bool QueueMgr::isLocalAddr(unsigned long ip_addr) {
+   return ((ntohl(ip_addr) >> 24) == 127) || (ip_addr == getIPAddr());
 }
 
 
@@ -157,7 +239,7 @@ void QueueMgr::bindSvr(const char *ip_addr, short unsigned int port) {
  *********************************************************************************************/
 void QueueMgr::handleQueue() {
 
-   // Accept new connections, if any
+   // Accept new connections, if any (initConn tells them who we are for the handshake)
    handleSocket();
 
    // Handle any open connections, reading from and writing to the socket
@@ -166,6 +248,22 @@ void QueueMgr::handleQueue() {
    // Get data from input buffers on connections and add to the queue
    populateQueue();
 
+   if (_metrics != NULL)
+      _metrics->queue_depth = _queue.size();
+
+}
+
+/**********************************************************************************************
+ * initConn - hands a new connection, ours or accepted, what it needs for the handshake
+ *
+ **********************************************************************************************/
+void QueueMgr::initConn(TCPConn *conn) {
+   conn->setSvrID(getServerID());
+   conn->setSkewEstimator(_skew);
+   conn->setPayloadCodec(_codec);
+   conn->setMetrics(_metrics);
+   conn->setHandshakeCache(&_handshakes);
+   conn->setFastHandshake(_fast_handshake);
 }
 
 /**********************************************************************************************
@@ -176,29 +274,80 @@ void QueueMgr::handleQueue() {
  **********************************************************************************************/
 void QueueMgr::populateQueue() {
 
-   // Loop through the connections, handling each one
-   auto conn_it = _connlist.begin();
-   for ( ; conn_it != _connlist.end(); conn_it++) {
+   // Loop through the active connections--one that just received data stays active until
+   // it is collected here
+   for (conn_handle handle : _conns.getActive()) {
+      TCPConn *conn = _conns.get(handle);
+      if (conn == NULL)
+         continue;
       
       // If the connection has data marked ready, get it and handle it based on the
       // command at the beginning
-      if (((*conn_it)->getStatus() == TCPConn::s_hasdata) && (*conn_it)->isInputDataReady()) {
+      if ((conn->getStatus() == TCPConn::s_hasdata) && conn->isInputDataReady()) {
          std::vector<uint8_t> buf;
 
-         (*conn_it)->getInputData(buf);
+         conn->getInputData(buf);
          if (buf.size() == 0) {
             // Handle this better later on
             throw std::runtime_error("TCPConn claimed replication data but none existed.");
          }
         
          // Add this data to the queue
-         _queue.emplace(recv, (*conn_it)->getNodeID(), buf);
+         _queue.emplace(recv, conn->getNodeID(), buf);
          if (_verbosity >= 3) {
             std::cout << "Replication info pulled off connection and placed into queue w/ " <<
-                              (buf.size()-4) / DronePlot::getDataSize() << " potential plots.\n";
+                              buf.size() << " bytes.\n";
          }   
       }      
    }
+
+   // And whatever co-located servers put in our shared memory rings
+   if (_shm) {
+      std::string sid;
+      std::vector<uint8_t> buf;
+      while (_shm->receive(sid, buf)) {
+         if (findServer(sid.c_str()) < 0) {
+            std::string msg = "Dropped shared memory data from unknown server ID " + sid;
+            _server_log.writeLog(msg);
+            continue;
+         }
+
+         if (_metrics != NULL)
+            _metrics->getPeer(sid.c_str()).bytes_received += buf.size();
+         _queue.emplace(recv, sid.c_str(), buf);
+      }
+   }
+
+   // And the datagrams sent to the multicast group
+   if (_mcast && _mcast_ready) {
+      std::string sid;
+      std::vector<uint8_t> buf;
+      while (_mcast->receive(sid, buf)) {
+         if (findServer(sid.c_str()) < 0) {
+            std::string msg = "Dropped multicast data from unknown server ID " + sid;
+            _server_log.writeLog(msg);
+            continue;
+         }
+
+         if (_metrics != NULL)
+            _metrics->getPeer(sid.c_str()).bytes_received += buf.size();
+
+         if (_codec != NULL) {
+            simtime_t start = SimClock::monoNow();
+            try {
+               _codec->decodePayload(buf);
+            } catch (std::runtime_error &e) {
+               std::string msg = "Dropped corrupt multicast data from " + sid + ": " + e.what();
+               _server_log.writeLog(msg);
+               continue;
+            }
+            if (_metrics != NULL)
+               _metrics->decode_time.record(SimClock::monoNow() - start);
+         }
+         _queue.emplace(recv, sid.c_str(), buf);
+      }
+      _mcast_ready = false;
+   }
 }
 
 /*********************************************************************************************
@@ -228,6 +377,69 @@ void QueueMgr::sendToAll(std::vector<uint8_t> &data) {
 void QueueMgr::sendToServer(const char *server_id, std::vector<uint8_t> &data) {
    _queue.emplace(send, server_id, data);
 
+   if (_metrics != NULL)
+      _metrics->queue_depth = _queue.size();
+
+}
+
+/*********************************************************************************************
+ * sendToGroup - sends data to the multicast group right away (it does not go through the
+ *               queue, as there is no connection to set up). Every server runs the same
+ *               codec, so the data is encoded with everything ours supports
+ *
+ *    Params:  data - the data in binary form to send
+ *
+ *    Returns: true if it went out, false if the caller needs to send it another way
+ *
+ *    Throws: runtime_error if the multicast socket fails
+ *********************************************************************************************/
+bool QueueMgr::sendToGroup(std::vector<uint8_t> &data) {
+   if (!_mcast)
+      return false;
+
+   std::vector<uint8_t> buf = data;
+   if (_codec != NULL) {
+      simtime_t start = SimClock::monoNow();
+      _codec->encodePayload(buf, _codec->getCaps());
+      if (_metrics != NULL)
+         _metrics->encode_time.record(SimClock::monoNow() - start);
+   }
+
+   if (!_mcast->send(buf))
+      return false;
+
+   if (_metrics != NULL)
+      _metrics->mcast_bytes_sent += buf.size();
+   return true;
+}
+
+/*********************************************************************************************
+ * sendToRandom - places data into the queue for up to fanout servers picked at random from the
+ *                server list. Used for gossip dissemination so the number of sends per batch
+ *                stays fixed no matter how many servers are in servers.txt
+ *
+ *    Params:  data - the data in binary form to send
+ *             fanout - the most servers to send to
+ *             exclude - server IDs not to pick (the sender, the origin, etc)
+ *
+ *    Returns: number of servers the data was queued for
+ *********************************************************************************************/
+unsigned int QueueMgr::sendToRandom(std::vector<uint8_t> &data, unsigned int fanout,
+                                                      std::vector<std::string> &exclude) {
+   std::vector<unsigned int> candidates;
+   for (unsigned int i=0; i<_server_list.size(); i++) {
+      if (std::find(exclude.begin(), exclude.end(), std::get<0>(_server_list[i])) == exclude.end())
+         candidates.push_back(i);
+   }
+
+   // Partial Fisher-Yates shuffle--only the first fanout picks are needed
+   unsigned int count = std::min<unsigned int>(fanout, candidates.size());
+   for (unsigned int i=0; i<count; i++) {
+      unsigned int pick = i + (rand() % (candidates.size() - i));
+      std::swap(candidates[i], candidates[pick]);
+      sendToServer(std::get<0>(_server_list[candidates[i]]).c_str(), data);
+   }
+   return count;
 }
 
 /*********************************************************************************************
@@ -260,8 +472,14 @@ bool QueueMgr::pop(std::string &sid, std::vector<uint8_t> &data) {
       sid = next_qe.server_id;
       data = std::move(next_qe.data);
       _queue.pop();
+
+      if (_metrics != NULL)
+         _metrics->queue_depth = _queue.size();
       return true;
    }
+
+   if (_metrics != NULL)
+      _metrics->queue_depth = 0;
    return false;
 }
 
@@ -275,41 +493,50 @@ bool QueueMgr::pop(std::string &sid, std::vector<uint8_t> &data) {
  *********************************************************************************************/
 void QueueMgr::launchDataConn(const char *sid, std::vector<uint8_t> &data) {
 
-   unsigned long ip_addr;
-   unsigned short port;
-
    // Find the IP address of the destination server
-   unsigned int i;
-   for (i=0; i<_server_list.size(); i++) {
-      if (!std::get<0>(_server_list[i]).compare(sid)) {
-         ip_addr = std::get<1>(_server_list[i]);
-         port = std::get<2>(_server_list[i]);
-         break;
-      }
+   int i = findServer(sid);
+   if (i < 0) {
+      throw std::runtime_error("Attempt to send data to server ID not in the server list.");
    }
 
-   if (i==_server_list.size()) {
-      throw std::runtime_error("Attempt to send data to server ID not in the server list.");
+   unsigned long ip_addr = std::get<1>(_server_list[i]);
+   unsigned short port = std::get<2>(_server_list[i]);
+
+   // A server on this host gets it through shared memory, once the TCP handshakes have
+   // measured its clock. If the ring cannot take it right now, it goes by TCP as usual
+   if (_shm && isLocalAddr(ip_addr) && ((_skew == NULL) || _skew->hasSample(sid))) {
+      if (_shm->send(sid, ip_addr, port, data)) {
+         if (_metrics != NULL) {
+            _metrics->shm_sends++;
+            _metrics->getPeer(sid).bytes_sent += data.size();
+         }
+         return;
+      }
+
+      if (_metrics != NULL)
+         _metrics->shm_fallbacks++;
    }
 
    // Try to connect to the server and if there's an issue, delete and re-throw socket_error
    TCPConn *new_conn = new TCPConn(_server_log, _aes_key, _verbosity);
    new_conn->setNodeID(sid);
-   new_conn->setSvrID(getServerID());
+   initConn(new_conn);
+   new_conn->setTimers(&_timers);
+   new_conn->setRing(_ring.get());
+   conn_handle handle = addConn(new_conn);
 
    try {
       new_conn->connect(ip_addr, port);
+      _conns.indexFD(handle);
    } catch (socket_error &e) {
       std::stringstream msg;
       msg << "Connect to SID " << sid << " failed when trying to send data. Retrying. Msg: " <<
                         e.what();
       _server_log.writeLog(msg.str().c_str());
-      new_conn->disconnect();
-      new_conn->reconnect = time(NULL) + reconnect_delay;  // Try again in 5 seconds, real-world
+      new_conn->retryLater();  // Try again in 5 seconds, real-world
    }
 
 
    new_conn->assignOutgoingData(data);
-   _connlist.push_back(std::unique_ptr<TCPConn>(new_conn));
 }
 
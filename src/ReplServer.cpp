@@ -1,95 +1,149 @@
 #include <iostream>
 #include <exception>
+#include <cstring>
+#include <algorithm>
+#include <cerrno>
+#include <poll.h>
 #include "ReplServer.h"
+#include "LZ4Block.h"
 
-const time_t secs_between_repl = 20;
+const simtime_t repl_interval = 20 * simtime_per_sec;
+const simtime_t repl_min_interval = 1 * simtime_per_sec;
+const simtime_t max_idle_wait = 100 * simtime_per_ms;     // Real time, bounds shutdown latency
+const simtime_t sync_interval = 30 * simtime_per_sec;
+const simtime_t max_skew_wait = 60 * simtime_per_sec;
+const simtime_t nack_interval = 500 * simtime_per_ms;
+const uint32_t mcast_history = 1024;          // Batches an origin keeps for retransmission
+const uint32_t seq_window = 1024;             // Batches past a gap before it is given up on
+const unsigned int max_nack_seqs = 64;         // Most sequence numbers in one NACK
 const unsigned int max_servers = 10;
+const unsigned int compress_min_size = 512;
+const uint64_t max_decompressed_size = 64 * 1024 * 1024;
+
+// Appends a value to a replication message in host byte order
+template <typename T>
+static void pushValue(std::vector<uint8_t> &buf, T value) {
+    uint8_t *vptr = (uint8_t *) &value;
+    buf.insert(buf.end(), vptr, vptr + sizeof(T));
+}
+
+// Reads a value out of a replication message at pos and advances pos
+template <typename T>
+static T pullValue(std::vector<uint8_t> &buf, unsigned int &pos) {
+    T value;
+    if (pos + sizeof(T) > buf.size())
+        throw std::runtime_error("Replication message ran out of data prematurely");
+    memcpy(&value, buf.data() + pos, sizeof(T));
+    pos += sizeof(T);
+    return value;
+}
+
+// Appends an unsigned LEB128 varint--7 bits per byte, high bit set on all but the last
+static void pushVarint(std::vector<uint8_t> &buf, uint64_t value) {
+    while (value >= 0x80) {
+        buf.push_back((uint8_t) (value | 0x80));
+        value >>= 7;
+    }
+    buf.push_back((uint8_t) value);
+}
+
+// Reads a varint at pos and advances pos
+static uint64_t pullVarint(std::vector<uint8_t> &buf, unsigned int &pos) {
+    uint64_t value = 0;
+    for (unsigned int shift = 0; shift < 64; shift += 7) {
+        if (pos >= buf.size())
+            throw std::runtime_error("Replication message ran out of data prematurely");
+        uint8_t byte = buf[pos++];
+        value |= (uint64_t) (byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0)
+            return value;
+    }
+    throw std::runtime_error("Replication message has an overlong varint");
+}
+
+// Zigzag maps signed deltas to unsigned so small negatives stay short as varints
+static uint64_t zigzag(int64_t value) {
+    return ((uint64_t) value << 1) ^ (uint64_t) (value >> 63);
+}
+
+static int64_t unzigzag(uint64_t value) {
+    return (int64_t) (value >> 1) ^ -(int64_t) (value & 1);
+}
+
+static uint32_t floatBits(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+static float bitsFloat(uint32_t bits) {
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
 
 /*********************************************************************************************
  * ReplServer (constructor) - creates our ReplServer. Initializes:
  *
  *    verbosity - passes this value into QueueMgr and local, plus each connection
- *    _time_mult - how fast to run the simulation - 2.0 = 2x faster
+ *    clock - the sim clock, which sets how fast to run the simulation
  *    ip_addr - which ip address to bind the server to
  *    port - bind the server here
  *
  *********************************************************************************************/
-ReplServer::ReplServer(DronePlotDB &plotdb, float time_mult)
+ReplServer::ReplServer(DronePlotDB &plotdb, SimClock &clock)
         :_queue(1),
          _plotdb(plotdb),
          _shutdown(false),
-         _time_mult(time_mult),
+         _clock(clock),
+         _skew(clock),
          _verbosity(1),
          _ip_addr("127.0.0.1"),
-         _port(9999)
+         _port(9999),
+         _gossip_fanout(0),
+         _epoch(SimClock::wallNow()),
+         _next_seq(1),
+         _seq_gaps(false),
+         _last_nack(0),
+         _compress_min(compress_min_size),
+         _metrics_interval(0),
+         _last_metrics(0),
+         _stats_port(0)
 {
-    _start_time = time(NULL);
+    _queue.setSkewEstimator(&_skew);
+    _queue.setPayloadCodec(this);
+    _queue.setMetrics(&_metrics);
 }
 
-ReplServer::ReplServer(DronePlotDB &plotdb, const char *ip_addr, unsigned short port, int offset,
-                       float time_mult, unsigned int verbosity)
+ReplServer::ReplServer(DronePlotDB &plotdb, const char *ip_addr, unsigned short port, SimClock &clock,
+                       unsigned int verbosity)
         :_queue(verbosity),
          _plotdb(plotdb),
          _shutdown(false),
-         _time_mult(time_mult),
+         _clock(clock),
+         _skew(clock),
          _verbosity(verbosity),
          _ip_addr(ip_addr),
-         _port(port)
-
+         _port(port),
+         _gossip_fanout(0),
+         _epoch(SimClock::wallNow()),
+         _next_seq(1),
+         _seq_gaps(false),
+         _last_nack(0),
+         _compress_min(compress_min_size),
+         _metrics_interval(0),
+         _last_metrics(0),
+         _stats_port(0)
 {
-    _start_time = time(NULL) + offset;
+    _queue.setSkewEstimator(&_skew);
+    _queue.setPayloadCodec(this);
+    _queue.setMetrics(&_metrics);
 }
 
 ReplServer::~ReplServer() {
 
 }
 
-
-/**********************************************************************************************
- * getAdjustedTime - gets the time since the replication server started up in seconds, modified
- *                   by _time_mult to speed up or slow down
- **********************************************************************************************/
-
-time_t ReplServer::getAdjustedTime() {
-    return static_cast<time_t>((time(NULL) - _start_time) * _time_mult);
-}
-
-/**********************************************************************************************
- * adjustSkew() - Adjusts the skew for all dronplot objects based on which node has priority
- *                  all plots should be within 5 seconds of each other
- *
- **********************************************************************************************/
-void ReplServer::adjustSkew(){
-    _plotdb.sortByTime();
-    //set up the priorityNode or the "coordinator"
-    priorityNode = _plotdb.begin()->node_id;
-    std::map<int, double> skewMap;
-    double lastSeenTime = _plotdb.begin()->timestamp;
-    int lastDroneID = priorityNode;
-    int currentSkew = 0;
-
-    std::list<DronePlot>::iterator dpit = _plotdb.begin();
-    for ( ; dpit != _plotdb.end(); dpit++) {
-        if (dpit->node_id != priorityNode){{
-            skewMap.emplace(std::pair(dpit->node_id, (dpit->timestamp - lastSeenTime)));
-            currentSkew = dpit->timestamp - lastSeenTime;
-        }
-
-        }
-        if (lastDroneID != dpit->node_id)
-            lastSeenTime = dpit->timestamp; //captures latest time from the priority node
-
-        lastDroneID = dpit->node_id;
-    }
-
-
-    std::list<DronePlot>::iterator adjust = _plotdb.begin();
-    for ( ; adjust != _plotdb.end(); adjust++) {
-        dpit->timestamp -= skewMap[dpit->node_id];
-    }
-
-}
-
 /**********************************************************************************************
  * replicate - the main function managing replication activities. Manages the QueueMgr and reads
  *             from the queue, deconflicting entries and populating the DronePlotDB object with
@@ -111,6 +165,8 @@ void ReplServer::replicate() {
 
     // Track when we started the server
     _last_repl = 0;
+    _last_sync = 0;
+    _new_plots = false;
 
     // Set up our queue's listening socket
     _queue.bindSvr(_ip_addr.c_str(), _port);
@@ -119,9 +175,15 @@ void ReplServer::replicate() {
     if (_verbosity >= 2)
         std::cout << "Server bound to " << _ip_addr << ", port: " << _port << " and listening\n";
 
+    // Stats are only served to local scrapers
+    if (_stats_port != 0) {
+        _stats.reset(new StatsServer(*this, "127.0.0.1", _stats_port));
+        if (_verbosity >= 2)
+            std::cout << "Serving stats on 127.0.0.1, port: " << _stats_port << "\n";
+    }
 
-    //go through all of the _plotdb object and adjust the skew
-   // adjustSkew();
+    // Measure the other servers' clocks before our first replication
+    probeClocks();
 
     // Replicate until we get the shutdown signal
     while (!_shutdown) {
@@ -130,12 +192,33 @@ void ReplServer::replicate() {
         _queue.handleQueue();
 
         // See if it's time to replicate and, if so, go through the database, identifying new plots
-        // that have not been replicated yet and adding them to the queue for replication
-        if (getAdjustedTime() - _last_repl > secs_between_repl) {
+        // that have not been replicated yet and adding them to the queue for replication. New
+        // plots go out as soon as repl_min_interval allows, the full interval is a fallback
+        if (replDue()) {
 
-            queueNewPlots();
+            // Hold our plots until every peer's clock is measured so all servers correct against
+            // the same set of clocks--but don't wait forever on a server that is down
+            if (replReady()) {
+                _new_plots = false;
+                queueNewPlots();
+            } else {
+                probeClocks();
+            }
             _last_repl = getAdjustedTime();
         }
+
+        // Ask origins for multicast batches that never made it here
+        if (_seq_gaps && (getAdjustedTime() - _last_nack > nack_interval)) {
+            sendNacks();
+            _last_nack = getAdjustedTime();
+        }
+
+        // Periodically compare Merkle trees with a random peer to repair any missed replication
+        if (getAdjustedTime() - _last_sync > sync_interval) {
+
+            startAntiEntropy();
+            _last_sync = getAdjustedTime();
+        }
         // Check the queue for updates and pop them until the queue is empty. The pop command only returns
         // incoming replication information--outgoing replication in the queue gets turned into a TCPConn
         // object and automatically removed from the queue by pop
@@ -143,12 +226,181 @@ void ReplServer::replicate() {
         std::vector<uint8_t> data;
         while (_queue.pop(sid, data)) {
 
-            // Incoming replication--add it to this server's local database
-            addReplDronePlots(data);
+            // Incoming replication or anti-entropy traffic from another server. One that is
+            // malformed is dropped on its own, rather than taking the server down
+            try {
+                handleReplMsg(sid, data);
+            } catch (std::runtime_error &e) {
+                std::string msg = "Dropped malformed replication message from " + sid + ": " +
+                                  e.what();
+                _queue.writeLog(msg.c_str());
+                if (_verbosity >= 2)
+                    std::cout << msg << "\n";
+                _metrics.msgs_dropped++;
+            }
         }
 
-        usleep(1000);
+        // Answer any stats scrapes--reads counters only, no replication state changes
+        if (_stats)
+            _stats->handleRequests();
+
+        // Write out our stats when asked to or when the interval is up
+        if (Metrics::takeDumpRequest() || ((_metrics_interval > 0) &&
+                                 (SimClock::monoNow() - _last_metrics >= _metrics_interval)))
+            dumpMetrics();
+
+        // Sleep until a socket, the database or a timer needs us
+        waitForEvents();
+    }
+
+    // Final numbers for the run
+    if (_metrics_file.size() > 0)
+        dumpMetrics();
+}
+
+/**********************************************************************************************
+ * replReady - true once our plots can go out (clocks measured, or we gave up waiting)
+ *
+ **********************************************************************************************/
+
+bool ReplServer::replReady() {
+    return skewReady() || (getAdjustedTime() > max_skew_wait);
+}
+
+/**********************************************************************************************
+ * replDue - true if the replication timer is up: repl_min_interval after the last batch if
+ *           the database has signaled new plots, otherwise the full repl_interval. The early
+ *           send waits for our previous batches to finish sending, so under load batches grow
+ *           rather than connections piling up
+ *
+ **********************************************************************************************/
+
+bool ReplServer::replDue() {
+    simtime_t since = getAdjustedTime() - _last_repl;
+    if (since > repl_interval)
+        return true;
+    return _new_plots && replReady() && (since >= repl_min_interval) &&
+           (_queue.getNumSending() == 0);
+}
+
+/**********************************************************************************************
+ * waitForEvents - Blocks until there is something to do: input on our listening socket, a
+ *                 connection or the stats listener, new plots signaled by the database, or the
+ *                 next timer. Returns at once if a connection has work that needs no input,
+ *                 and never waits past max_idle_wait so shutdown is noticed
+ *
+ **********************************************************************************************/
+
+void ReplServer::waitForEvents() {
+    std::vector<struct pollfd> fds;
+    fds.push_back({_plotdb.getNotifyFD(), POLLIN, 0});
+    if (_stats)
+        _stats->addPollFDs(fds);
+
+    simtime_t wait = _queue.addPollFDs(fds, max_idle_wait);
+
+    // Timers run on the sim clock, so convert what is left of each to real time
+    simtime_t now = getAdjustedTime();
+    simtime_t repl_wait = (_new_plots && replReady() && (_queue.getNumSending() == 0)) ?
+                                                           repl_min_interval : repl_interval;
+    wait = std::min(wait, _clock.toRealTime(std::max<simtime_t>(_last_repl + repl_wait - now, 0)));
+    wait = std::min(wait, _clock.toRealTime(std::max<simtime_t>(_last_sync + sync_interval - now, 0)));
+    if (_seq_gaps)
+        wait = std::min(wait, _clock.toRealTime(std::max<simtime_t>(_last_nack + nack_interval - now, 0)));
+    if (_metrics_interval > 0)
+        wait = std::min(wait, std::max<simtime_t>(_last_metrics + _metrics_interval -
+                                                                   SimClock::monoNow(), 0));
+
+    struct timespec timeout;
+    timeout.tv_sec = wait / simtime_per_sec;
+    timeout.tv_nsec = wait % simtime_per_sec;
+    if (ppoll(fds.data(), fds.size(), &timeout, NULL) < 0) {
+        if (errno != EINTR)
+            throw std::runtime_error("Replication event loop poll failed");
+        return;
+    }
+
+    // Connections with socket events get handled on the next pass of the queue
+    _queue.handleEvents(fds);
+
+    // The new plots are picked up by the next scan, so clear before that scan happens
+    if (fds[0].revents & POLLIN) {
+        _plotdb.clearNotify();
+        _new_plots = true;
+    }
+}
+
+/**********************************************************************************************
+ * setMetricsFile - Sets the file metrics reports are appended to and how often (real nanoseconds,
+ *                  0 for only on request and at shutdown)
+ *
+ **********************************************************************************************/
+
+void ReplServer::setMetricsFile(const char *filename, simtime_t interval) {
+    _metrics_file = filename;
+    _metrics_interval = interval;
+    _last_metrics = SimClock::monoNow();
+}
+
+/**********************************************************************************************
+ * writeStats - Fills in the stats page: our metrics, the state of each peer connection, the
+ *              queue size and how many plots the database holds
+ *
+ **********************************************************************************************/
+
+void ReplServer::writeStats(std::ostream &out) {
+    _metrics.writePrometheus(out, "repsvr");
+
+    out << "# HELP repsvr_db_plots Plots in the database\n";
+    out << "# TYPE repsvr_db_plots gauge\n";
+    out << "repsvr_db_plots " << _plotdb.size() << "\n";
+
+    out << "# HELP repsvr_queue_size Entries waiting in the replication queue\n";
+    out << "# TYPE repsvr_queue_size gauge\n";
+    out << "repsvr_queue_size " << _queue.getQueueSize() << "\n";
+
+    // Count connections by peer and status (unidentified peers are reported as "unknown")
+    std::vector<std::pair<std::string, TCPConn::statustype>> states;
+    _queue.getConnStates(states);
+
+    std::map<std::pair<std::string, std::string>, unsigned int> conn_counts;
+    for (unsigned int i=0; i<states.size(); i++) {
+        std::string peer = (states[i].first.size() > 0) ? states[i].first : "unknown";
+        conn_counts[std::make_pair(peer, TCPConn::getStatusName(states[i].second))]++;
+    }
+
+    out << "# HELP repsvr_peer_connections Open connections by peer and state\n";
+    out << "# TYPE repsvr_peer_connections gauge\n";
+    for (auto cit = conn_counts.begin(); cit != conn_counts.end(); cit++) {
+        out << "repsvr_peer_connections{peer=\"" << cit->first.first << "\",state=\"" <<
+               cit->first.second << "\"} " << cit->second << "\n";
+    }
+
+    out << "# HELP repsvr_peer_clock_offset_seconds Estimated peer clock minus ours\n";
+    out << "# TYPE repsvr_peer_clock_offset_seconds gauge\n";
+    for (unsigned int i=0; i<_queue.getNumServers(); i++) {
+        simtime_t offset;
+        if (_skew.getOffset(_queue.getPeerID(i), offset))
+            out << "repsvr_peer_clock_offset_seconds{peer=\"" << _queue.getPeerID(i) << "\"} " <<
+                   simTimeToSecs(offset) << "\n";
+    }
+}
+
+/**********************************************************************************************
+ * dumpMetrics - Appends a metrics report to the metrics file, or prints it if there is none
+ *
+ **********************************************************************************************/
+
+void ReplServer::dumpMetrics() {
+    _last_metrics = SimClock::monoNow();
+
+    if (_metrics_file.size() == 0) {
+        _metrics.writeReport(std::cout);
+        return;
     }
+
+    if (!_metrics.appendToFile(_metrics_file.c_str()))
+        std::cerr << "Unable to write metrics to " << _metrics_file << "\n";
 }
 
 /**********************************************************************************************
@@ -162,39 +414,32 @@ void ReplServer::replicate() {
 
 unsigned int ReplServer::queueNewPlots() {
     std::vector<uint8_t> marshall_data;
-    std::list<DronePlot> current_plots_seen;
     unsigned int count = 0;
 
+    // Our plots go out on the cluster-average clock, so replicas never need to adjust them
+    simtime_t correction = _skew.getCorrection();
+
     if (_verbosity >= 3)
-        std::cout << "Replicating plots.\n";
+        std::cout << "Replicating plots, clock correction " << simTimeToSecs(correction) << " secs.\n";
 
     // Loop through the drone plots, looking for new ones
+    simtime_t now = getAdjustedTime();
     std::list<DronePlot>::iterator dpit = _plotdb.begin();
     for ( ; dpit != _plotdb.end(); dpit++) {
 
-        //make sure each new plot's time is aligned with the priority node's time
-        bool duplicate = false;
-        std::list<DronePlot>::iterator duplicate_check = _plotdb.begin();
-
-        //go through to make sure there are no duplicates
-        for ( ; duplicate_check != current_plots_seen.end(); duplicate_check++) {
-            if (duplicate_check->drone_id == dpit->drone_id){ //check if the drone IDs are the same
-                if ((duplicate_check->latitude - dpit->latitude) < 5 && (duplicate_check->longitude - dpit->longitude) < 5 ) //check and make sure duplicates are within certain lat/long
-                    duplicate = true;
-            }
-        }
-
-        current_plots_seen.emplace_back(*dpit);
+        // If this is a new one, correct its skew, add it to our tree, marshall it and clear the flag
+        if (dpit->isFlagSet(DBFLAG_NEW)) {
 
-        if (!duplicate) {
-            // If this is a new one, marshall it and clear the flag
-            if (dpit->isFlagSet(DBFLAG_NEW)) {
+            // How long it waited here since the antenna injected it (timestamps are sim time)
+            if (now > dpit->timestamp)
+                _metrics.ingest_latency.record(_clock.toRealTime(now - dpit->timestamp));
 
-                dpit->serialize(marshall_data);
-                dpit->clrFlags(DBFLAG_NEW);
+            dpit->timestamp += correction;
+            _tree.insert(*dpit);
+            dpit->serialize(marshall_data);
+            dpit->clrFlags(DBFLAG_NEW);
 
-                count++;
-            }
+            count++;
         }
         if (marshall_data.size() % DronePlot::getDataSize() != 0)
             throw std::runtime_error("Issue with marshalling!");
@@ -204,20 +449,34 @@ unsigned int ReplServer::queueNewPlots() {
         if (_verbosity >= 3)
             std::cout << "No new plots found to replicate.\n";
 
+        // Let the group know where our sequence is, so a lost last batch still gets noticed
+        if (_queue.hasMulticast() && (_next_seq > 1))
+            sendSeqMark();
         return 0;
     }
 
 
-    // Add the count onto the front
-    std::cout << "Adding in count: " << count << "\n";
-    uint8_t *ctptr_begin = (uint8_t *) &count;
-    marshall_data.insert(marshall_data.begin(), ctptr_begin, ctptr_begin+sizeof(unsigned int));
+    // Add the message header onto the front, tagged with our next batch sequence number
+    std::vector<uint8_t> header;
+    uint32_t seq = _next_seq++;
+    unsigned int count_pos = beginPlotMsg(header, seq);
+    memcpy(header.data() + count_pos, &count, sizeof(count));
+    marshall_data.insert(marshall_data.begin(), header.begin(), header.end());
 
-    // Send to the queue manager
-    if (marshall_data.size() > 0) {
+    // Send to the queue manager--once to the multicast group, every server, or a few random
+    // ones in gossip mode
+    if (_queue.hasMulticast()) {
+        multicastBatch(seq, marshall_data);
+    } else if (_gossip_fanout == 0) {
         _queue.sendToAll(marshall_data);
+    } else {
+        std::vector<std::string> exclude;
+        _queue.sendToRandom(marshall_data, _gossip_fanout, exclude);
     }
 
+    _metrics.plots_queued += count;
+    _metrics.batches_sent++;
+
     if (_verbosity >= 2)
         std::cout << "Queued up " << count << " plots to be replicated.\n";
 
@@ -225,56 +484,791 @@ unsigned int ReplServer::queueNewPlots() {
 }
 
 /**********************************************************************************************
- * addReplDronePlots - Adds drone plots to the database from data that was replicated in.
- *                     Deconflicts issues between plot points.
+ * handleReplMsg - Looks at the message type at the front of a payload pulled off the queue and
+ *                 passes it to the right handler
+ *
+ *    Params:  sid - the server ID that sent the message
+ *             data - the full payload, starting with the message type byte
+ *
+ *    Throws: runtime_error if the message is malformed
+ **********************************************************************************************/
+
+void ReplServer::handleReplMsg(std::string &sid, std::vector<uint8_t> &data) {
+    if (data.size() < 1)
+        throw std::runtime_error("Empty replication message received");
+
+    switch (data[0]) {
+        case rm_plots:
+            handlePlotMsg(sid.c_str(), data);
+            break;
+
+        case rm_treesum:
+            handleTreeSummary(sid.c_str(), data);
+            break;
+
+        case rm_pullreq:
+            handlePullReq(sid.c_str(), data);
+            break;
+
+        // Only sent to get a handshake going, the connection already measured the clock
+        case rm_clockprobe:
+            break;
+
+        case rm_nack:
+            handleNack(sid.c_str(), data);
+            break;
+
+        case rm_seqmark:
+            handleSeqMark(sid.c_str(), data);
+            break;
+
+        default:
+            throw std::runtime_error("Unknown replication message type received");
+    }
+}
+
+/**********************************************************************************************
+ * beginPlotMsg - Starts an rm_plots message with our server ID as the origin and a placeholder
+ *                count that the caller fills in once the plots are appended
+ *
+ *    Params:  msg - the vector to add the header to
+ *             seq - the origin's batch sequence number, or 0 for plots that should not be
+ *                   forwarded (anti-entropy)
+ *
+ *    Format: rm_plots, origin ID length (uint8), origin ID, epoch (uint64), seq (uint32),
+ *            count (uint32), plots
+ *
+ *    Returns: the position of the count in msg
+ **********************************************************************************************/
+
+unsigned int ReplServer::beginPlotMsg(std::vector<uint8_t> &msg, uint32_t seq) {
+    std::string origin = _queue.getServerID();
+
+    pushValue<uint8_t>(msg, rm_plots);
+    pushValue<uint8_t>(msg, (uint8_t) origin.size());
+    msg.insert(msg.end(), origin.begin(), origin.end());
+    pushValue<uint64_t>(msg, _epoch);
+    pushValue<uint32_t>(msg, seq);
+
+    unsigned int count_pos = msg.size();
+    pushValue<unsigned int>(msg, 0);
+    return count_pos;
+}
+
+/**********************************************************************************************
+ * handlePlotMsg - Reads the origin and sequence number of a plot batch. Batches we have already
+ *                 seen from that origin (in its current run) are dropped. New ones are merged
+ *                 and, in gossip mode, forwarded unchanged to a few random peers other than the
+ *                 sender and origin.
+ *
+ *    Params:  sid - the server that sent us this batch (not necessarily its origin)
+ *             data - the rm_plots message
+ *
+ *    Throws: runtime_error if the message is malformed
+ **********************************************************************************************/
+
+void ReplServer::handlePlotMsg(const char *sid, std::vector<uint8_t> &data) {
+    unsigned int pos = sizeof(uint8_t);
+    unsigned int idlen = pullValue<uint8_t>(data, pos);
+    if (pos + idlen > data.size())
+        throw std::runtime_error("Replication message ran out of data prematurely");
+
+    std::string origin(data.begin() + pos, data.begin() + pos + idlen);
+    pos += idlen;
+    uint64_t epoch = pullValue<uint64_t>(data, pos);
+    uint32_t seq = pullValue<uint32_t>(data, pos);
+
+    // A damaged batch is thrown out before it is marked seen (or forwarded), so the intact
+    // copy can still be NACKed for
+    checkPlotCount(data, pos);
+
+    if (seq != 0) {
+        // Our own batch coming back around, one that reached us by another path, or one left
+        // over from before the origin restarted
+        SeqTracker *seen = NULL;
+        if (origin.compare(_queue.getServerID()) != 0)
+            seen = getSeenBatches(origin, epoch);
+        if ((seen == NULL) || !seen->markSeen(seq)) {
+            if (_verbosity >= 3)
+                std::cout << "Dropping batch " << seq << " from " << origin << " (already seen)\n";
+            return;
+        }
+
+        // A batch gossip never delivers would hold everything after it, so give up on gaps
+        // that far behind
+        if (seen->getHighest() > seq_window)
+            seen->skipTo(seen->getHighest() - seq_window);
+
+        if (_queue.hasMulticast())
+            noteOriginSeq(origin, seq);
+
+        if ((_gossip_fanout > 0) && !_queue.hasMulticast()) {
+            std::vector<std::string> exclude;
+            exclude.push_back(sid);
+            exclude.push_back(origin);
+            _queue.sendToRandom(data, _gossip_fanout, exclude);
+        }
+    }
+
+    unsigned int count = addReplDronePlots(data, pos);
+
+    _metrics.batches_received++;
+    _metrics.getPeer(sid).plots_received += count;
+}
+
+/**********************************************************************************************
+ * checkPlotCount - Checks the plot count and the plots that follow it fill the rest of the
+ *                  message exactly
+ *
+ * Params:  data - an rm_plots message
+ *          pos - where the number of data points (32 bit unsigned integer) starts
  *
- * Params:  data - should start with the number of data points in a 32 bit unsigned integer,
- *                 then a series of drone plot points
+ * Returns: the number of plots in the batch
  *
+ * Throws:  runtime_error if they do not
  **********************************************************************************************/
 
-void ReplServer::addReplDronePlots(std::vector<uint8_t> &data) {
-    if (data.size() < 4) {
-        throw std::runtime_error("Not enough data passed into addReplDronePlots");
+unsigned int ReplServer::checkPlotCount(std::vector<uint8_t> &data, unsigned int pos) {
+    unsigned int header_size = pos + sizeof(unsigned int);
+    if (data.size() < header_size) {
+        throw std::runtime_error("Not enough data passed into checkPlotCount");
     }
 
-    if ((data.size() - 4) % DronePlot::getDataSize() != 0) {
-        throw std::runtime_error("Data passed into addReplDronePlots was not the right multiple of DronePlot size");
+    if ((data.size() - header_size) % DronePlot::getDataSize() != 0) {
+        throw std::runtime_error("Data passed into checkPlotCount was not the right multiple of DronePlot size");
     }
 
+    unsigned int count = pullValue<unsigned int>(data, pos);
+    if (count * DronePlot::getDataSize() != data.size() - header_size)
+        throw std::runtime_error("Plot count in replication data does not match its size");
+    return count;
+}
+
+/**********************************************************************************************
+ * addReplDronePlots - Adds drone plots to the database from data that was replicated in.
+ *                     Plots we already hold are skipped, so the same plots can safely arrive
+ *                     from both replication and anti-entropy.
+ *
+ * Params:  data - an rm_plots message
+ *          pos - where the number of data points (32 bit unsigned integer) starts, followed by
+ *                a series of drone plot points
+ *
+ * Returns: the number of plots in the batch
+ **********************************************************************************************/
+
+unsigned int ReplServer::addReplDronePlots(std::vector<uint8_t> &data, unsigned int pos) {
+    unsigned int header_size = pos + sizeof(unsigned int);
+
     // Get the number of plot points
-    unsigned int *numptr = (unsigned int *) data.data();
-    unsigned int count = *numptr;
+    unsigned int count = checkPlotCount(data, pos);
+
+    // Plots carry cluster-average time, so compare them against our clock on the same basis
+    simtime_t arrival = getAdjustedTime() + _skew.getCorrection();
 
-    // Store sub-vectors for efficiency
-    std::vector<uint8_t> plot;
-    auto dptr = data.begin() + sizeof(unsigned int);
+    // Deserialize straight out of the message and add everything new in one locked insert
+    std::vector<DronePlot> plots;
+    plots.reserve(count);
 
+    DronePlot tmp_plot;
     for (unsigned int i=0; i<count; i++) {
-        plot.clear();
-        plot.assign(dptr, dptr + DronePlot::getDataSize());
-        addSingleDronePlot(plot);
-        dptr += DronePlot::getDataSize();
+        tmp_plot.deserialize(data, header_size + i * DronePlot::getDataSize());
+        if (acceptReplPlot(tmp_plot, arrival))
+            plots.push_back(tmp_plot);
     }
+    _plotdb.addPlots(plots);
+
     if (_verbosity >= 2)
         std::cout << "Replicated in " << count << " plots\n";
+
+    return count;
 }
 
 
 /**********************************************************************************************
- * addSingleDronePlot - Takes in binary serialized drone data and adds it to the database.
+ * acceptReplPlot - Checks whether a replicated plot is new to us. New plots are added to our
+ *                  tree and counted, the caller then adds them to the database
  *
+ *    Params:  plot - the replicated plot
+ *             arrival - when the batch arrived, on the cluster-average clock
+ *
+ *    Returns: true if the plot is new, false if we already have it
  **********************************************************************************************/
 
-void ReplServer::addSingleDronePlot(std::vector<uint8_t> &data) {
-    DronePlot tmp_plot;
+bool ReplServer::acceptReplPlot(DronePlot &plot, simtime_t arrival) {
+
+    // Already have it (seen through another path)
+    if (!_tree.insert(plot)) {
+        _metrics.plots_duplicate++;
+        return false;
+    }
 
-    tmp_plot.deserialize(data);
+    _metrics.plots_replicated++;
+    if (arrival > plot.timestamp)
+        _metrics.repl_latency.record(_clock.toRealTime(arrival - plot.timestamp));
 
-    _plotdb.addPlot(tmp_plot.drone_id, tmp_plot.node_id, tmp_plot.timestamp, tmp_plot.latitude,
-                    tmp_plot.longitude);
+    return true;
 }
 
+/**********************************************************************************************
+ * getCaps - The payload features we offer peers in the handshake
+ *
+ **********************************************************************************************/
+
+uint32_t ReplServer::getCaps() {
+    uint32_t caps = cap_compact_plots;
+    if (_compress_min > 0)
+        caps |= cap_lz4;
+    return caps;
+}
+
+/**********************************************************************************************
+ * encodePayload - Called by a connection just before it sends a payload. Plot batches are
+ *                 rewritten as rm_plots_compact if the peer agreed to cap_compact_plots. Then
+ *                 if the peer agreed to cap_lz4, payloads of at least _compress_min bytes are
+ *                 compressed
+ *
+ **********************************************************************************************/
+
+void ReplServer::encodePayload(std::vector<uint8_t> &buf, uint32_t caps) {
+    if ((caps & cap_compact_plots) && (buf.size() > 0) && (buf[0] == rm_plots))
+        compactPlotMsg(buf);
+
+    if ((caps & cap_lz4) && (_compress_min > 0) && (buf.size() >= _compress_min))
+        compressMsg(buf);
+}
+
+/**********************************************************************************************
+ * decodePayload - Called by a connection on each payload it receives. Compact plot batches are
+ *                 turned back into rm_plots so the handlers (and gossip forwarding) only ever
+ *                 see the plain format
+ *
+ *    Throws: runtime_error if the compact batch is malformed
+ **********************************************************************************************/
+
+void ReplServer::decodePayload(std::vector<uint8_t> &buf) {
+    if ((buf.size() > 0) && (buf[0] == rm_lz4))
+        decompressMsg(buf);
+
+    if ((buf.size() > 0) && (buf[0] == rm_plots_compact))
+        expandPlotMsg(buf);
+}
+
+/**********************************************************************************************
+ * plotHeaderSize - Returns the size of the type, origin, epoch and seq fields at the front of a
+ *                  plot batch, which are the same in both encodings
+ *
+ **********************************************************************************************/
+
+unsigned int ReplServer::plotHeaderSize(std::vector<uint8_t> &data) {
+    unsigned int pos = sizeof(uint8_t);
+    unsigned int idlen = pullValue<uint8_t>(data, pos);
+    pos += idlen + sizeof(uint64_t) + sizeof(uint32_t);
+    if (pos > data.size())
+        throw std::runtime_error("Replication message ran out of data prematurely");
+    return pos;
+}
+
+/**********************************************************************************************
+ * compactPlotMsg - Rewrites an rm_plots batch in place as rm_plots_compact. The plots are
+ *                  sorted by drone and time so consecutive plots are close together, then each
+ *                  field is stored as a varint of its difference from the previous plot:
+ *
+ *                     drone_id  - delta (never negative once sorted)
+ *                     node_id   - zigzag delta
+ *                     timestamp - zigzag delta-of-delta within a drone's track, or a zigzag
+ *                                 delta on the first plot of a new drone
+ *                     lat, lon  - XOR of the float bits with the previous value, so nearby
+ *                                 positions leave only the low mantissa bits set
+ *
+ *                  Every value is kept bit for bit, so plots hash the same after the trip.
+ *
+ *    Format: rm_plots_compact, origin ID length (uint8), origin ID, epoch (uint64), seq (uint32),
+ *            count (varint), plots
+ **********************************************************************************************/
+
+void ReplServer::compactPlotMsg(std::vector<uint8_t> &data) {
+    unsigned int header_size = plotHeaderSize(data);
+    unsigned int pos = header_size;
+    unsigned int count = pullValue<unsigned int>(data, pos);
+    if (count * DronePlot::getDataSize() != data.size() - pos)
+        throw std::runtime_error("Plot count in replication data does not match its size");
+
+    std::vector<DronePlot> plots(count);
+    for (unsigned int i=0; i<count; i++)
+        plots[i].deserialize(data, pos + i * DronePlot::getDataSize());
+
+    std::sort(plots.begin(), plots.end(), [](const DronePlot &a, const DronePlot &b) {
+        if (a.drone_id != b.drone_id)
+            return a.drone_id < b.drone_id;
+        return a.timestamp < b.timestamp;
+    });
+
+    std::vector<uint8_t> msg(data.begin(), data.begin() + header_size);
+    msg[0] = rm_plots_compact;
+    pushVarint(msg, count);
+
+    unsigned int prev_drone = 0, prev_node = 0;
+    uint64_t prev_time = 0, prev_delta = 0;
+    uint32_t prev_lat = 0, prev_lon = 0;
+
+    for (unsigned int i=0; i<count; i++) {
+        DronePlot &plot = plots[i];
+
+        // Unsigned wrap-around arithmetic so extreme values cannot overflow
+        uint64_t delta = (uint64_t) plot.timestamp - prev_time;
+        if ((i == 0) || (plot.drone_id != prev_drone)) {
+            pushVarint(msg, plot.drone_id - prev_drone);
+            pushVarint(msg, zigzag((int32_t) (plot.node_id - prev_node)));
+            pushVarint(msg, zigzag((int64_t) delta));
+        } else {
+            pushVarint(msg, 0);
+            pushVarint(msg, zigzag((int32_t) (plot.node_id - prev_node)));
+            pushVarint(msg, zigzag((int64_t) (delta - prev_delta)));
+        }
+
+        uint32_t lat = floatBits(plot.latitude), lon = floatBits(plot.longitude);
+        pushVarint(msg, lat ^ prev_lat);
+        pushVarint(msg, lon ^ prev_lon);
+
+        prev_delta = ((i == 0) || (plot.drone_id != prev_drone)) ? 0 : delta;
+        prev_drone = plot.drone_id;
+        prev_node = plot.node_id;
+        prev_time = (uint64_t) plot.timestamp;
+        prev_lat = lat;
+        prev_lon = lon;
+    }
+
+    if (_verbosity >= 3)
+        std::cout << "Compacted " << count << " plots from " << data.size() << " to " <<
+                     msg.size() << " bytes.\n";
+
+    data.swap(msg);
+}
+
+/**********************************************************************************************
+ * expandPlotMsg - Rewrites an rm_plots_compact batch in place as the rm_plots batch it came
+ *                 from (plots in drone/time order)
+ *
+ *    Throws: runtime_error if the batch is malformed
+ **********************************************************************************************/
+
+void ReplServer::expandPlotMsg(std::vector<uint8_t> &data) {
+    unsigned int header_size = plotHeaderSize(data);
+    unsigned int pos = header_size;
+    uint64_t count = pullVarint(data, pos);
+
+    // Each plot takes at least one byte per field, so a larger count is corrupt
+    if (count > (data.size() - pos) / 5)
+        throw std::runtime_error("Plot count in compact replication data does not match its size");
+
+    std::vector<uint8_t> msg(data.begin(), data.begin() + header_size);
+    msg[0] = rm_plots;
+    pushValue<unsigned int>(msg, (unsigned int) count);
+    msg.reserve(msg.size() + count * DronePlot::getDataSize());
+
+    unsigned int prev_drone = 0, prev_node = 0;
+    uint64_t prev_time = 0, prev_delta = 0;
+    uint32_t prev_lat = 0, prev_lon = 0;
+    DronePlot plot;
+
+    for (uint64_t i=0; i<count; i++) {
+        uint64_t drone_delta = pullVarint(data, pos);
+        bool new_track = (i == 0) || (drone_delta != 0);
+
+        plot.drone_id = prev_drone + (unsigned int) drone_delta;
+        plot.node_id = prev_node + (unsigned int) unzigzag(pullVarint(data, pos));
+
+        uint64_t delta = (uint64_t) unzigzag(pullVarint(data, pos));
+        if (!new_track)
+            delta += prev_delta;
+        plot.timestamp = (simtime_t) (prev_time + delta);
+
+        prev_lat ^= (uint32_t) pullVarint(data, pos);
+        prev_lon ^= (uint32_t) pullVarint(data, pos);
+        plot.latitude = bitsFloat(prev_lat);
+        plot.longitude = bitsFloat(prev_lon);
+
+        plot.serialize(msg);
+
+        prev_delta = new_track ? 0 : delta;
+        prev_drone = plot.drone_id;
+        prev_node = plot.node_id;
+        prev_time = (uint64_t) plot.timestamp;
+    }
+
+    if (pos != data.size())
+        throw std::runtime_error("Compact replication data has trailing bytes");
+
+    data.swap(msg);
+}
+
+/**********************************************************************************************
+ * compressMsg - Replaces a payload with an rm_lz4 message holding it compressed. Left alone if
+ *               compressing does not make it smaller
+ *
+ *    Format: rm_lz4, uncompressed size (varint), LZ4 block
+ **********************************************************************************************/
+
+void ReplServer::compressMsg(std::vector<uint8_t> &data) {
+    std::vector<uint8_t> msg;
+    pushValue<uint8_t>(msg, rm_lz4);
+    pushVarint(msg, data.size());
+    LZ4Block::compress(data.data(), data.size(), msg);
+
+    if (msg.size() >= data.size())
+        return;
+
+    if (_verbosity >= 3)
+        std::cout << "Compressed payload from " << data.size() << " to " << msg.size() << " bytes.\n";
+
+    data.swap(msg);
+}
+
+/**********************************************************************************************
+ * decompressMsg - Replaces an rm_lz4 message with the payload it holds
+ *
+ *    Throws: runtime_error if the message is malformed
+ **********************************************************************************************/
+
+void ReplServer::decompressMsg(std::vector<uint8_t> &data) {
+    unsigned int pos = sizeof(uint8_t);
+    uint64_t raw_size = pullVarint(data, pos);
+    if (raw_size > max_decompressed_size)
+        throw std::runtime_error("Compressed replication message is too large");
+
+    std::vector<uint8_t> msg;
+    LZ4Block::decompress(data.data() + pos, data.size() - pos, raw_size, msg);
+    data.swap(msg);
+}
+
+/**********************************************************************************************
+ * startAntiEntropy - Picks a random peer and sends it our Merkle root. The peer compares it to
+ *                    its own tree and the exchange walks down only the subtrees that differ,
+ *                    ending with both sides trading the plots in the mismatched time buckets.
+ *                    Repairs plots lost to a failed <REP> without resending the whole database.
+ *
+ **********************************************************************************************/
+
+void ReplServer::startAntiEntropy() {
+    if (_queue.getNumServers() == 0)
+        return;
+
+    const char *peer = _queue.getPeerID(rand() % _queue.getNumServers());
+    std::vector<unsigned int> root(1, 0);
+
+    if (_verbosity >= 3)
+        std::cout << "Starting anti-entropy exchange with " << peer << "\n";
+
+    sendTreeSummary(peer, 0, root);
+}
+
+/**********************************************************************************************
+ * sendTreeSummary - Sends our hashes for a set of nodes at one level of the Merkle tree
+ *
+ *    Params:  sid - the server to send to
+ *             level - tree level of the nodes (0 = root)
+ *             indices - which nodes at that level to send
+ *
+ *    Format: rm_treesum, level (uint8), count (uint32), then count x [index (uint32), hash (uint64)]
+ **********************************************************************************************/
+
+void ReplServer::sendTreeSummary(const char *sid, unsigned int level, std::vector<unsigned int> &indices) {
+    std::vector<uint8_t> msg;
+    msg.reserve(sizeof(uint8_t) * 2 + sizeof(uint32_t) +
+                        indices.size() * (sizeof(uint32_t) + sizeof(uint64_t)));
+
+    pushValue<uint8_t>(msg, rm_treesum);
+    pushValue<uint8_t>(msg, (uint8_t) level);
+    pushValue<uint32_t>(msg, (uint32_t) indices.size());
+
+    for (unsigned int i=0; i<indices.size(); i++) {
+        pushValue<uint32_t>(msg, indices[i]);
+        pushValue<uint64_t>(msg, _tree.getHash(level, indices[i]));
+    }
+
+    _queue.sendToServer(sid, msg);
+}
+
+/**********************************************************************************************
+ * handleTreeSummary - Compares a peer's node hashes against ours. For mismatched internal nodes
+ *                     we reply with our hashes for their children. For mismatched leaves we send
+ *                     our plots in those buckets and ask the peer for theirs.
+ *
+ *    Params:  sid - the server that sent the summary
+ *             data - the rm_treesum message
+ *
+ *    Throws: runtime_error if the message is malformed
+ **********************************************************************************************/
+
+void ReplServer::handleTreeSummary(const char *sid, std::vector<uint8_t> &data) {
+    unsigned int pos = sizeof(uint8_t);
+    unsigned int level = pullValue<uint8_t>(data, pos);
+    uint32_t count = pullValue<uint32_t>(data, pos);
+
+    if (level > _tree.getDepth())
+        throw std::runtime_error("Tree summary received for a level deeper than our tree");
+
+    std::vector<unsigned int> diffs;
+    for (unsigned int i=0; i<count; i++) {
+        uint32_t index = pullValue<uint32_t>(data, pos);
+        uint64_t hash = pullValue<uint64_t>(data, pos);
+
+        if (index >= _tree.getNumNodes(level))
+            throw std::runtime_error("Tree summary received with a node index out of range");
+
+        if (_tree.getHash(level, index) != hash)
+            diffs.push_back(index);
+    }
+
+    if (diffs.size() == 0) {
+        if (_verbosity >= 3)
+            std::cout << "Anti-entropy with " << sid << ": trees match at level " << level << "\n";
+        return;
+    }
+
+    // Not down to the leaves yet, so send back our hashes of the children that may differ
+    if (level < _tree.getDepth()) {
+        std::vector<unsigned int> children;
+        children.reserve(diffs.size() * 2);
+        for (unsigned int i=0; i<diffs.size(); i++) {
+            children.push_back(diffs[i] * 2);
+            children.push_back(diffs[i] * 2 + 1);
+        }
+        sendTreeSummary(sid, level + 1, children);
+        return;
+    }
+
+    if (_verbosity >= 2)
+        std::cout << "Anti-entropy with " << sid << ": " << diffs.size() << " time buckets differ\n";
+
+    // At the leaves, push what we have in those buckets and pull what they have
+    sendLeafPlots(sid, diffs);
+
+    std::vector<uint8_t> msg;
+    pushValue<uint8_t>(msg, rm_pullreq);
+    pushValue<uint32_t>(msg, (uint32_t) diffs.size());
+    for (unsigned int i=0; i<diffs.size(); i++)
+        pushValue<uint32_t>(msg, diffs[i]);
+
+    _queue.sendToServer(sid, msg);
+}
+
+/**********************************************************************************************
+ * handlePullReq - A peer found that some of our leaves differ from theirs and wants our plots
+ *                 in those buckets
+ *
+ *    Format: rm_pullreq, count (uint32), then count x leaf index (uint32)
+ *
+ *    Throws: runtime_error if the message is malformed
+ **********************************************************************************************/
+
+void ReplServer::handlePullReq(const char *sid, std::vector<uint8_t> &data) {
+    unsigned int pos = sizeof(uint8_t);
+    uint32_t count = pullValue<uint32_t>(data, pos);
+
+    std::vector<unsigned int> leaves;
+    for (unsigned int i=0; i<count; i++) {
+        uint32_t leaf = pullValue<uint32_t>(data, pos);
+        if (leaf >= _tree.getNumNodes(_tree.getDepth()))
+            throw std::runtime_error("Pull request received with a leaf index out of range");
+        leaves.push_back(leaf);
+    }
+
+    sendLeafPlots(sid, leaves);
+}
+
+/**********************************************************************************************
+ * sendLeafPlots - Sends every plot we hold that falls in the given leaves as an rm_plots message
+ *
+ **********************************************************************************************/
+
+void ReplServer::sendLeafPlots(const char *sid, std::vector<unsigned int> &leaves) {
+    std::vector<bool> wanted(_tree.getNumNodes(_tree.getDepth()), false);
+    for (unsigned int i=0; i<leaves.size(); i++)
+        wanted[leaves[i]] = true;
+
+    std::vector<uint8_t> msg;
+    unsigned int count_pos = beginPlotMsg(msg, 0);
+
+    // Only send plots already in our tree--new local ones go out with the next replication
+    unsigned int count = 0;
+    std::list<DronePlot>::iterator dpit = _plotdb.begin();
+    for ( ; dpit != _plotdb.end(); dpit++) {
+        if (wanted[_tree.getLeaf(*dpit)] && !dpit->isFlagSet(DBFLAG_NEW)) {
+            dpit->serialize(msg);
+            count++;
+        }
+    }
+
+    if (count == 0)
+        return;
+
+    memcpy(msg.data() + count_pos, &count, sizeof(count));
+    _queue.sendToServer(sid, msg);
+}
+
+/**********************************************************************************************
+ * multicastBatch - Keeps a batch for retransmission and sends it to the multicast group.
+ *                  One too big for a datagram goes to every server over TCP instead--it
+ *                  carries its sequence number either way
+ *
+ **********************************************************************************************/
+
+void ReplServer::multicastBatch(uint32_t seq, std::vector<uint8_t> &batch) {
+    _sent_batches[seq] = batch;
+    while (_sent_batches.size() > mcast_history)
+        _sent_batches.erase(_sent_batches.begin());
+
+    if (!_queue.sendToGroup(batch))
+        _queue.sendToAll(batch);
+}
+
+/**********************************************************************************************
+ * sendSeqMark - Multicasts the sequence number of our last batch
+ *
+ *    Format: rm_seqmark, epoch (uint64), seq (uint32)
+ **********************************************************************************************/
+
+void ReplServer::sendSeqMark() {
+    std::vector<uint8_t> msg;
+    pushValue<uint8_t>(msg, rm_seqmark);
+    pushValue<uint64_t>(msg, _epoch);
+    pushValue<uint32_t>(msg, _next_seq - 1);
+    _queue.sendToGroup(msg);
+}
+
+void ReplServer::handleSeqMark(const char *sid, std::vector<uint8_t> &data) {
+    unsigned int pos = sizeof(uint8_t);
+    uint64_t epoch = pullValue<uint64_t>(data, pos);
+    uint32_t seq = pullValue<uint32_t>(data, pos);
+    if (_queue.hasMulticast() && (getSeenBatches(sid, epoch) != NULL))
+        noteOriginSeq(sid, seq);
+}
+
+/**********************************************************************************************
+ * getSeenBatches - Returns the batches seen from an origin in the run epoch started. A later
+ *                  epoch means the origin restarted and numbers its batches from 1 again, so
+ *                  what we tracked for it is dropped
+ *
+ *    Returns: NULL if epoch is from an earlier run than one we have already heard from
+ **********************************************************************************************/
+
+SeqTracker *ReplServer::getSeenBatches(const std::string &origin, uint64_t epoch) {
+    uint64_t &current = _origin_epoch[origin];
+    if (epoch < current)
+        return NULL;
+
+    if (epoch > current) {
+        if ((current != 0) && (_verbosity >= 2))
+            std::cout << "Server " << origin << " restarted, tracking its batches afresh\n";
+        current = epoch;
+        _seen_batches.erase(origin);
+        _origin_highest.erase(origin);
+    }
+    return &_seen_batches[origin];
+}
+
+/**********************************************************************************************
+ * noteOriginSeq - Records that an origin has sent batches up to seq. The origin only keeps its
+ *                 last mcast_history batches, so anything older is given up on (anti-entropy
+ *                 still repairs the plots in them)
+ *
+ **********************************************************************************************/
+
+void ReplServer::noteOriginSeq(const std::string &origin, uint32_t seq) {
+    uint32_t &highest = _origin_highest[origin];
+    highest = std::max(highest, seq);
+
+    SeqTracker &seen = _seen_batches[origin];
+    if (highest > mcast_history)
+        seen.skipTo(highest - mcast_history);
+
+    if (seen.getBase() < highest)
+        _seq_gaps = true;
+}
+
+/**********************************************************************************************
+ * sendNacks - Asks each origin with gaps for the batches we are missing. Runs every
+ *             nack_interval while gaps remain, so a lost NACK or retransmission is asked for
+ *             again
+ *
+ *    Format: rm_nack, count (uint32), then count x seq (uint32)
+ **********************************************************************************************/
+
+void ReplServer::sendNacks() {
+    _seq_gaps = false;
+
+    std::vector<uint32_t> missing;
+    for (auto oit = _origin_highest.begin(); oit != _origin_highest.end(); oit++) {
+        _seen_batches[oit->first].getMissing(oit->second, missing, max_nack_seqs);
+        if (missing.size() == 0)
+            continue;
+
+        std::vector<uint8_t> msg;
+        pushValue<uint8_t>(msg, rm_nack);
+        pushValue<uint32_t>(msg, (uint32_t) missing.size());
+        for (unsigned int i=0; i<missing.size(); i++)
+            pushValue<uint32_t>(msg, missing[i]);
+
+        if (_verbosity >= 3)
+            std::cout << "Asking " << oit->first << " to resend " << missing.size() << " batches\n";
+
+        _queue.sendToServer(oit->first.c_str(), msg);
+        _metrics.nacks_sent++;
+        _seq_gaps = true;
+    }
+}
+
+/**********************************************************************************************
+ * handleNack - Resends the requested batches we still have to the server that asked, over TCP
+ *
+ *    Throws: runtime_error if the message is malformed
+ **********************************************************************************************/
+
+void ReplServer::handleNack(const char *sid, std::vector<uint8_t> &data) {
+    unsigned int pos = sizeof(uint8_t);
+    uint32_t count = pullValue<uint32_t>(data, pos);
+    if (count > (data.size() - pos) / sizeof(uint32_t))
+        throw std::runtime_error("NACK lists more batches than it holds");
+
+    for (uint32_t i=0; i<count; i++) {
+        auto found = _sent_batches.find(pullValue<uint32_t>(data, pos));
+        if (found == _sent_batches.end())
+            continue;
+
+        _queue.sendToServer(sid, found->second);
+        _metrics.batches_resent++;
+    }
+}
+
+/**********************************************************************************************
+ * probeClocks - Sends an empty rm_clockprobe to each peer whose clock we have not measured yet.
+ *               The TCPConn handshake that delivers it takes the skew sample
+ *
+ **********************************************************************************************/
+
+void ReplServer::probeClocks() {
+    std::vector<uint8_t> msg;
+    pushValue<uint8_t>(msg, rm_clockprobe);
+
+    for (unsigned int i=0; i<_queue.getNumServers(); i++) {
+        if (!_skew.hasSample(_queue.getPeerID(i)))
+            _queue.sendToServer(_queue.getPeerID(i), msg);
+    }
+}
+
+/**********************************************************************************************
+ * skewReady - Returns true once we have a clock offset for every server in the list
+ *
+ **********************************************************************************************/
+
+bool ReplServer::skewReady() {
+    for (unsigned int i=0; i<_queue.getNumServers(); i++) {
+        if (!_skew.hasSample(_queue.getPeerID(i)))
+            return false;
+    }
+    return true;
+}
 
 void ReplServer::shutdown() {
     _shutdown = true;
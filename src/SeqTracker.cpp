@@ -0,0 +1,67 @@
+#include "SeqTracker.h"
+
+SeqTracker::SeqTracker():_base(0) {
+
+}
+
+SeqTracker::~SeqTracker() {
+
+}
+
+/*****************************************************************************************
+ * markSeen - records a sequence number and advances the base over any gap it filled
+ *
+ *    Returns: true if this sequence number had not been seen before, false otherwise
+ *****************************************************************************************/
+bool SeqTracker::markSeen(uint32_t seq) {
+   if (seq <= _base)
+      return false;
+
+   if (!_above.insert(seq).second)
+      return false;
+
+   // Slide the base forward while the next sequence number is in hand
+   auto next = _above.begin();
+   while ((next != _above.end()) && (*next == _base + 1)) {
+      _base++;
+      next = _above.erase(next);
+   }
+   return true;
+}
+
+bool SeqTracker::isSeen(uint32_t seq) {
+   return (seq <= _base) || (_above.find(seq) != _above.end());
+}
+
+/*****************************************************************************************
+ * skipTo - moves the base up to seq (if it is below), then on over anything held above
+ *****************************************************************************************/
+void SeqTracker::skipTo(uint32_t seq) {
+   if (seq <= _base)
+      return;
+
+   _base = seq;
+   auto next = _above.begin();
+   while ((next != _above.end()) && (*next <= _base + 1)) {
+      if (*next == _base + 1)
+         _base++;
+      next = _above.erase(next);
+   }
+}
+
+/*****************************************************************************************
+ * getMissing - walks the gaps between the base and the numbers held above it
+ *****************************************************************************************/
+void SeqTracker::getMissing(uint32_t upto, std::vector<uint32_t> &missing, unsigned int max) {
+   missing.clear();
+
+   uint32_t seq = _base + 1;
+   auto next = _above.begin();
+   while ((seq <= upto) && (missing.size() < max)) {
+      if ((next != _above.end()) && (*next == seq))
+         next++;
+      else
+         missing.push_back(seq);
+      seq++;
+   }
+}
@@ -0,0 +1,157 @@
+#include <stdexcept>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "ShmRing.h"
+
+// Length word that tells the reader to skip to the front of the data area
+const uint32_t wrap_marker = 0xffffffff;
+const uint32_t record_hdr = 8;
+
+static uint64_t padRecord(size_t len) {
+   return record_hdr + ((len + 7) & ~(uint64_t) 7);
+}
+
+/*****************************************************************************************
+ * ShmRing (constructor) - creates an anonymous memfd segment and sets up an empty ring
+ *****************************************************************************************/
+ShmRing::ShmRing(uint32_t capacity):_hdr(NULL), _data(NULL), _map_size(0) {
+   _capacity = 64;
+   while (_capacity < capacity)
+      _capacity <<= 1;
+
+   _fd = memfd_create("repsvr-ring", MFD_CLOEXEC);
+   if (_fd < 0)
+      throw std::runtime_error("Could not create shared memory for a ring");
+
+   if (ftruncate(_fd, sizeof(header) + _capacity) != 0) {
+      close(_fd);
+      throw std::runtime_error("Could not size shared memory for a ring");
+   }
+
+   mapSegment(sizeof(header) + _capacity);
+
+   _hdr->magic = shm_ring_magic;
+   _hdr->capacity = _capacity;
+   _hdr->head.store(0);
+   _hdr->tail.store(0);
+}
+
+/*****************************************************************************************
+ * ShmRing (constructor) - maps a segment made by another ShmRing, checking it is one
+ *
+ *    Params: memfd - the segment
+ *            take_fd - if true the ring closes memfd when done, otherwise it keeps a dup
+ *****************************************************************************************/
+ShmRing::ShmRing(int memfd, bool take_fd):_hdr(NULL), _data(NULL), _map_size(0) {
+   _fd = take_fd ? memfd : dup(memfd);
+   if (_fd < 0)
+      throw std::runtime_error("Could not duplicate a shared memory ring descriptor");
+
+   struct stat st;
+   if ((fstat(_fd, &st) != 0) || ((size_t) st.st_size <= sizeof(header))) {
+      close(_fd);
+      throw std::runtime_error("Shared memory ring segment is missing or too small");
+   }
+   mapSegment(st.st_size);
+
+   _capacity = _hdr->capacity;
+   if ((_hdr->magic != shm_ring_magic) || (_capacity & (_capacity - 1)) ||
+                                    (sizeof(header) + _capacity > (size_t) st.st_size)) {
+      munmap(_hdr, _map_size);
+      close(_fd);
+      throw std::runtime_error("Shared memory segment is not a replication ring");
+   }
+}
+
+ShmRing::~ShmRing() {
+   if (_hdr != NULL)
+      munmap(_hdr, _map_size);
+   if (_fd >= 0)
+      close(_fd);
+}
+
+void ShmRing::mapSegment(size_t size) {
+   void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+   if (mem == MAP_FAILED) {
+      close(_fd);
+      throw std::runtime_error("Could not map shared memory for a ring");
+   }
+
+   _map_size = size;
+   _hdr = (header *) mem;
+   _data = (uint8_t *) mem + sizeof(header);
+}
+
+/*****************************************************************************************
+ * push - writes the message, then publishes it by moving head (release), so the reader
+ *        never sees a length before the bytes behind it
+ *
+ *    Returns: false if the ring is too full for it, or it is bigger than the ring could hold
+ *****************************************************************************************/
+bool ShmRing::push(const uint8_t *data, size_t len) {
+   uint64_t rec = padRecord(len);
+   if ((len >= wrap_marker) || (rec > _capacity / 2))
+      return false;
+
+   uint64_t head = _hdr->head.load(std::memory_order_relaxed);
+   uint64_t tail = _hdr->tail.load(std::memory_order_acquire);
+
+   uint64_t offset = head & (_capacity - 1);
+   uint64_t to_end = _capacity - offset;
+   uint64_t need = (to_end < rec) ? to_end + rec : rec;
+   if (head - tail + need > _capacity)
+      return false;
+
+   // Records are 8-byte aligned, so there is always room for the marker
+   if (to_end < rec) {
+      uint32_t marker = wrap_marker;
+      memcpy(_data + offset, &marker, sizeof(marker));
+      head += to_end;
+      offset = 0;
+   }
+
+   uint32_t len32 = (uint32_t) len;
+   memcpy(_data + offset, &len32, sizeof(len32));
+   memcpy(_data + offset + record_hdr, data, len);
+   _hdr->head.store(head + rec, std::memory_order_release);
+   return true;
+}
+
+/*****************************************************************************************
+ * pop - reads the oldest message, then frees its space by moving tail (release)
+ *
+ *    Throws: runtime_error if the ring holds something that is not a valid message
+ *****************************************************************************************/
+bool ShmRing::pop(std::vector<uint8_t> &buf) {
+   uint64_t tail = _hdr->tail.load(std::memory_order_relaxed);
+   uint64_t head = _hdr->head.load(std::memory_order_acquire);
+
+   while (tail != head) {
+      uint64_t offset = tail & (_capacity - 1);
+      uint32_t len;
+      memcpy(&len, _data + offset, sizeof(len));
+
+      if (len == wrap_marker) {
+         tail += _capacity - offset;
+         continue;
+      }
+
+      uint64_t rec = padRecord(len);
+      if ((offset + rec > _capacity) || (tail + rec > head))
+         throw std::runtime_error("Shared memory ring is corrupt");
+
+      buf.assign(_data + offset + record_hdr, _data + offset + record_hdr + len);
+      _hdr->tail.store(tail + rec, std::memory_order_release);
+      return true;
+   }
+
+   // Only wrap markers were left--give the space back
+   _hdr->tail.store(tail, std::memory_order_release);
+   return false;
+}
+
+bool ShmRing::isEmpty() {
+   return _hdr->tail.load(std::memory_order_acquire) == _hdr->head.load(std::memory_order_acquire);
+}
@@ -0,0 +1,346 @@
+#include <stdexcept>
+#include <sstream>
+#include <cstring>
+#include <cstddef>
+#include <cerrno>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include "ShmTransport.h"
+
+// How long (real time) before we try again to link to a peer that was not listening
+const simtime_t shm_retry_delay = 5 * simtime_per_sec;
+
+// Longest server ID a hello carries
+const size_t max_hello = 256;
+
+ShmTransport::link::~link() {
+   if (sock >= 0)
+      close(sock);
+   if (doorbell >= 0)
+      close(doorbell);
+}
+
+ShmTransport::ShmTransport(LogMgr &log, unsigned int verbosity):
+                                    _log(log),
+                                    _verbosity(verbosity),
+                                    _listen_fd(-1),
+                                    _next_in(0)
+{
+}
+
+ShmTransport::~ShmTransport() {
+   if (_listen_fd >= 0)
+      close(_listen_fd);
+}
+
+/*****************************************************************************************
+ * makeAddr - abstract socket names live in the network namespace rather than the
+ *            filesystem, so there is nothing to clean up if a server dies
+ *
+ *    Returns: the length of the address to pass to bind/connect
+ *****************************************************************************************/
+socklen_t ShmTransport::makeAddr(struct sockaddr_un &addr, unsigned long ip_addr,
+                                                                  unsigned short port) {
+   char ipstr[INET_ADDRSTRLEN];
+   in_addr in;
+   in.s_addr = ip_addr;
+   inet_ntop(AF_INET, &in, ipstr, sizeof(ipstr));
+
+   memset(&addr, 0, sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   int len = snprintf(addr.sun_path + 1, sizeof(addr.sun_path) - 1, "repsvr-shm-%s:%u",
+                                                                     ipstr, ntohs(port));
+   return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+}
+
+/*****************************************************************************************
+ * listen - binds our unix socket
+ *
+ *    Throws: runtime_error if the socket cannot be created, bound or listened on
+ *****************************************************************************************/
+void ShmTransport::listen(const char *svr_id, unsigned long ip_addr, unsigned short port) {
+   _svr_id = svr_id;
+
+   _listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+   if (_listen_fd < 0)
+      throw std::runtime_error("Unable to create the shared memory link socket");
+
+   struct sockaddr_un addr;
+   socklen_t len = makeAddr(addr, ip_addr, port);
+   if ((bind(_listen_fd, (struct sockaddr *) &addr, len) != 0) ||
+                                                   (::listen(_listen_fd, 16) != 0)) {
+      close(_listen_fd);
+      _listen_fd = -1;
+      throw std::runtime_error("Unable to bind the shared memory link socket");
+   }
+}
+
+/*****************************************************************************************
+ * openLink - creates a ring and doorbell for the peer and hands them over with our ID
+ *
+ *    Returns: the new link, or NULL if the peer is not listening (or anything else failed)
+ *****************************************************************************************/
+ShmTransport::link *ShmTransport::openLink(const char *sid, unsigned long ip_addr,
+                                                                  unsigned short port) {
+   auto retry = _retry_at.find(sid);
+   if ((retry != _retry_at.end()) && (SimClock::monoNow() < retry->second))
+      return NULL;
+
+   std::unique_ptr<link> out(new link(socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK |
+                                                                     SOCK_CLOEXEC, 0)));
+   struct sockaddr_un addr;
+   socklen_t len = makeAddr(addr, ip_addr, port);
+   if ((out->sock < 0) || (connect(out->sock, (struct sockaddr *) &addr, len) != 0)) {
+      _retry_at[sid] = SimClock::monoNow() + shm_retry_delay;
+      return NULL;
+   }
+
+   try {
+      out->ring.reset(new ShmRing(shm_ring_size));
+   } catch (std::runtime_error &e) {
+      _log.writeLog(e.what());
+      _retry_at[sid] = SimClock::monoNow() + shm_retry_delay;
+      return NULL;
+   }
+
+   out->doorbell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+   if (out->doorbell < 0)
+      return NULL;
+
+   // The hello: our ID, with the ring and doorbell riding along
+   int fds[2] = { out->ring->getFD(), out->doorbell };
+   char cbuf[CMSG_SPACE(sizeof(fds))];
+   memset(cbuf, 0, sizeof(cbuf));
+
+   struct iovec iov = { (void *) _svr_id.data(), _svr_id.size() };
+   struct msghdr msg;
+   memset(&msg, 0, sizeof(msg));
+   msg.msg_iov = &iov;
+   msg.msg_iovlen = 1;
+   msg.msg_control = cbuf;
+   msg.msg_controllen = sizeof(cbuf);
+
+   struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+   cmsg->cmsg_level = SOL_SOCKET;
+   cmsg->cmsg_type = SCM_RIGHTS;
+   cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+   memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+   if (sendmsg(out->sock, &msg, MSG_NOSIGNAL) != (ssize_t) _svr_id.size()) {
+      _retry_at[sid] = SimClock::monoNow() + shm_retry_delay;
+      return NULL;
+   }
+
+   if (_verbosity >= 2) {
+      std::stringstream logmsg;
+      logmsg << "Shared memory link to co-located server " << sid << " opened.";
+      _log.writeLog(logmsg.str().c_str());
+   }
+
+   out->sid = sid;
+   _retry_at.erase(sid);
+   return (_out[sid] = std::move(out)).get();
+}
+
+/*****************************************************************************************
+ * send - pushes data into the peer's ring and rings its doorbell
+ *
+ *    Params:  sid - the peer's server ID
+ *             ip_addr, port - the peer's TCP address (network format), which names its socket
+ *             data - the payload
+ *
+ *    Returns: true if the peer will get the payload, false if it has to go another way
+ *****************************************************************************************/
+bool ShmTransport::send(const char *sid, unsigned long ip_addr, unsigned short port,
+                                                         const std::vector<uint8_t> &data) {
+   if (_listen_fd < 0)
+      return false;
+
+   auto found = _out.find(sid);
+   link *out = (found != _out.end()) ? found->second.get() : openLink(sid, ip_addr, port);
+   if ((out == NULL) || !out->ring->push(data.data(), data.size()))
+      return false;
+
+   uint64_t one = 1;
+   if ((write(out->doorbell, &one, sizeof(one)) < 0) && (errno != EAGAIN))
+      throw std::runtime_error("Unable to ring a shared memory link doorbell");
+   return true;
+}
+
+/*****************************************************************************************
+ * acceptLinks - takes every connection waiting on the listening socket from a process
+ *               of our own user. The hello is read once it arrives (readHello)
+ *****************************************************************************************/
+void ShmTransport::acceptLinks() {
+   int sock;
+   while ((sock = accept4(_listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+      struct ucred cred;
+      socklen_t len = sizeof(cred);
+      if ((getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0) ||
+                                                               (cred.uid != getuid())) {
+         _log.writeLog("Refused a shared memory link from a process of another user.");
+         close(sock);
+         continue;
+      }
+      _in.emplace_back(new link(sock));
+   }
+}
+
+/*****************************************************************************************
+ * readHello - reads the peer's ID and maps the ring it passed us
+ *
+ *    Returns: false if the link should be dropped
+ *****************************************************************************************/
+bool ShmTransport::readHello(link &in) {
+   char idbuf[max_hello];
+   int fds[2];
+   char cbuf[CMSG_SPACE(sizeof(fds))];
+
+   struct iovec iov = { idbuf, sizeof(idbuf) };
+   struct msghdr msg;
+   memset(&msg, 0, sizeof(msg));
+   msg.msg_iov = &iov;
+   msg.msg_iovlen = 1;
+   msg.msg_control = cbuf;
+   msg.msg_controllen = sizeof(cbuf);
+
+   ssize_t got = recvmsg(in.sock, &msg, MSG_CMSG_CLOEXEC);
+   if ((got < 0) && (errno == EAGAIN))
+      return true;
+
+   struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+   if ((got <= 0) || (cmsg == NULL) || (cmsg->cmsg_level != SOL_SOCKET) ||
+            (cmsg->cmsg_type != SCM_RIGHTS) || (cmsg->cmsg_len != CMSG_LEN(sizeof(fds)))) {
+      if (got >= 0)
+         closeRights(msg);
+      return false;
+   }
+   memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+   in.doorbell = fds[1];
+
+   try {
+      in.ring.reset(new ShmRing(fds[0], true));
+   } catch (std::runtime_error &e) {
+      _log.writeLog(e.what());
+      return false;
+   }
+   in.sid.assign(idbuf, got);
+
+   if (_verbosity >= 2) {
+      std::stringstream logmsg;
+      logmsg << "Shared memory link from co-located server " << in.sid << " opened.";
+      _log.writeLog(logmsg.str().c_str());
+   }
+   return true;
+}
+
+/*****************************************************************************************
+ * closeRights - closes every descriptor a rejected hello carried, so a malformed one does
+ *               not leak them
+ *****************************************************************************************/
+void ShmTransport::closeRights(struct msghdr &msg) {
+   if (msg.msg_controllen == 0)
+      return;
+
+   for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+                                                    cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if ((cmsg->cmsg_level != SOL_SOCKET) || (cmsg->cmsg_type != SCM_RIGHTS) ||
+                                              (cmsg->cmsg_len < CMSG_LEN(0)))
+         continue;
+
+      size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      for (size_t i=0; i<count; i++) {
+         int fd;
+         memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(fd));
+         close(fd);
+      }
+   }
+}
+
+/*****************************************************************************************
+ * receive - pops the next payload, taking the rings in turn
+ *
+ *    Throws: runtime_error if a peer's ring is corrupt
+ *****************************************************************************************/
+bool ShmTransport::receive(std::string &sid, std::vector<uint8_t> &data) {
+   if (!_leftover.empty()) {
+      sid = std::move(_leftover.front().first);
+      data = std::move(_leftover.front().second);
+      _leftover.pop_front();
+      return true;
+   }
+
+   for (size_t n=0; n<_in.size(); n++) {
+      link &in = *_in[(_next_in + n) % _in.size()];
+      if (in.ring && in.ring->pop(data)) {
+         sid = in.sid;
+         _next_in = (_next_in + n + 1) % _in.size();
+         return true;
+      }
+   }
+   return false;
+}
+
+void ShmTransport::addPollFDs(std::vector<struct pollfd> &fds) {
+   if (_listen_fd < 0)
+      return;
+
+   fds.push_back({_listen_fd, POLLIN, 0});
+   for (auto &out : _out)
+      fds.push_back({out.second->sock, POLLIN, 0});
+   for (auto &in : _in) {
+      fds.push_back({in->sock, POLLIN, 0});
+      if (in->doorbell >= 0)
+         fds.push_back({in->doorbell, POLLIN, 0});
+   }
+}
+
+/*****************************************************************************************
+ * handleEvents - the peers never write to a link socket after the hello, so any other
+ *                event on one means the other end closed it. What is still in the ring of
+ *                a closed incoming link was sent, so it is kept for receive
+ *****************************************************************************************/
+void ShmTransport::handleEvents(const std::vector<struct pollfd> &fds) {
+   for (auto &pfd : fds) {
+      if ((pfd.revents == 0) || (_listen_fd < 0))
+         continue;
+
+      if (pfd.fd == _listen_fd) {
+         acceptLinks();
+         continue;
+      }
+
+      for (auto out = _out.begin(); out != _out.end(); out++) {
+         if (out->second->sock == pfd.fd) {
+            std::string logmsg = "Shared memory link to " + out->first + " closed by the peer.";
+            _log.writeLog(logmsg);
+            _out.erase(out);
+            break;
+         }
+      }
+
+      for (auto in = _in.begin(); in != _in.end(); in++) {
+         link &l = **in;
+         if (l.doorbell == pfd.fd) {
+            uint64_t count;
+            while (read(l.doorbell, &count, sizeof(count)) > 0)
+               ;
+            break;
+         }
+
+         if (l.sock != pfd.fd)
+            continue;
+
+         if (!l.ring && readHello(l))
+            break;
+
+         std::vector<uint8_t> data;
+         while (l.ring && l.ring->pop(data))
+            _leftover.emplace_back(l.sid, std::move(data));
+         _in.erase(in);
+         break;
+      }
+   }
+}
@@ -0,0 +1,148 @@
+#include <stdexcept>
+#include <charconv>
+#include <cerrno>
+#include "SimClock.h"
+
+/*****************************************************************************************
+ * SimClock (constructor) - creates the clock and starts it
+ *
+ *    Params:  time_mult - how fast to run the clock - 2.0 = 2x faster, must be > 0
+ *             offset - sim time the clock reads when started (models a skewed clock)
+ *****************************************************************************************/
+SimClock::SimClock(double time_mult, simtime_t offset):
+                              _time_mult(time_mult),
+                              _offset(offset)
+{
+   if (time_mult <= 0.0)
+      throw std::runtime_error("SimClock time multiplier must be greater than 0.");
+
+   start();
+}
+
+SimClock::~SimClock() {
+
+}
+
+/*****************************************************************************************
+ * monoNow - reads CLOCK_MONOTONIC in nanoseconds
+ *****************************************************************************************/
+simtime_t SimClock::monoNow() {
+   timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (simtime_t) ts.tv_sec * simtime_per_sec + ts.tv_nsec;
+}
+
+/*****************************************************************************************
+ * wallNow - reads CLOCK_REALTIME in nanoseconds
+ *****************************************************************************************/
+simtime_t SimClock::wallNow() {
+   timespec ts;
+   clock_gettime(CLOCK_REALTIME, &ts);
+   return (simtime_t) ts.tv_sec * simtime_per_sec + ts.tv_nsec;
+}
+
+void SimClock::start() {
+   _mono_start = monoNow();
+}
+
+/*****************************************************************************************
+ * now - returns the current sim time in nanoseconds
+ *****************************************************************************************/
+simtime_t SimClock::now() {
+   return (simtime_t) ((double) (monoNow() - _mono_start) * _time_mult) + _offset;
+}
+
+/*****************************************************************************************
+ * sleepUntil - sleeps on the monotonic clock until the sim time reaches target. Uses an
+ *              absolute deadline so repeated sleeps do not drift
+ *
+ *    Params:  target - the sim time to wake up at
+ *             max_wait - the most real nanoseconds to sleep, 0 for no limit. Lets callers
+ *                        wake up periodically to check for shutdown
+ *
+ *    Returns: true if the sim clock has reached target, false if max_wait cut it short
+ *****************************************************************************************/
+bool SimClock::sleepUntil(simtime_t target, simtime_t max_wait) {
+   simtime_t deadline = _mono_start + toRealTime(target - _offset);
+
+   if (max_wait > 0) {
+      simtime_t limit = monoNow() + max_wait;
+      if (limit < deadline)
+         deadline = limit;
+   }
+
+   timespec ts;
+   ts.tv_sec = deadline / simtime_per_sec;
+   ts.tv_nsec = deadline % simtime_per_sec;
+   while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+
+   return (now() >= target);
+}
+
+/*****************************************************************************************
+ * formatSimTime - writes t as decimal seconds, with only as many fractional digits as needed
+ *
+ *    Params:  buf - where to write, must have room for 21 chars
+ *             t - the time to write
+ *
+ *    Returns: pointer just past the last char written (no null terminator is added)
+ *****************************************************************************************/
+char *formatSimTime(char *buf, simtime_t t) {
+   uint64_t mag = (t < 0) ? (uint64_t) 0 - (uint64_t) t : (uint64_t) t;
+   if (t < 0)
+      *buf++ = '-';
+
+   buf = std::to_chars(buf, buf + 20, mag / simtime_per_sec).ptr;
+
+   uint64_t frac = mag % simtime_per_sec;
+   if (frac != 0) {
+      *buf++ = '.';
+      for (uint64_t div = simtime_per_sec / 10; frac != 0; div /= 10) {
+         *buf++ = (char) ('0' + frac / div);
+         frac %= div;
+      }
+   }
+   return buf;
+}
+
+/*****************************************************************************************
+ * parseSimTime - reads decimal seconds ("5", "5.25", "-3.001") into nanoseconds. Digits past
+ *                nanosecond precision are ignored. Trailing spaces and \r are allowed
+ *
+ *    Params:  str/end - the text to parse
+ *             t - receives the time
+ *
+ *    Returns: true if the text was a valid number, false otherwise
+ *****************************************************************************************/
+bool parseSimTime(const char *str, const char *end, simtime_t &t) {
+   bool negative = false;
+   if ((str < end) && ((*str == '-') || (*str == '+')))
+      negative = (*str++ == '-');
+
+   int64_t secs = 0;
+   if ((str == end) || (*str != '.')) {
+      auto results = std::from_chars(str, end, secs);
+      if (results.ec != std::errc())
+         return false;
+      str = results.ptr;
+   }
+
+   int64_t frac = 0;
+   if ((str < end) && (*str == '.')) {
+      str++;
+      for (simtime_t div = simtime_per_sec / 10; (str < end) && (*str >= '0') && (*str <= '9'); str++) {
+         frac += (*str - '0') * div;
+         div /= 10;
+      }
+   }
+
+   while ((str < end) && ((*str == ' ') || (*str == '\r')))
+      str++;
+   if (str != end)
+      return false;
+
+   t = secs * simtime_per_sec + frac;
+   if (negative)
+      t = -t;
+   return true;
+}
@@ -0,0 +1,68 @@
+#include <stdexcept>
+#include "SkewEstimator.h"
+
+/*****************************************************************************************
+ * SkewEstimator (constructor)
+ *
+ *    Params:  clock - our sim clock, read when stamping handshakes
+ *             filter_size - how many recent samples to keep per peer
+ *****************************************************************************************/
+SkewEstimator::SkewEstimator(SimClock &clock, unsigned int filter_size):
+                              _clock(clock),
+                              _filter_size(filter_size)
+{
+   if (filter_size == 0)
+      throw std::runtime_error("SkewEstimator needs a filter size of at least 1.");
+}
+
+SkewEstimator::~SkewEstimator() {
+
+}
+
+/*****************************************************************************************
+ * addSample - adds a handshake measurement for a peer, dropping its oldest if the filter is
+ *             full. Samples with a negative delay mean a timestamp was bad and are ignored
+ *****************************************************************************************/
+void SkewEstimator::addSample(const char *peer, simtime_t offset, simtime_t delay) {
+   if (delay < 0)
+      return;
+
+   std::deque<skew_sample> &samples = _peers[peer];
+   samples.emplace_back(offset, delay);
+   if (samples.size() > _filter_size)
+      samples.pop_front();
+}
+
+/*****************************************************************************************
+ * getOffset - returns the offset from the lowest-delay sample we hold for the peer
+ *
+ *    Returns: true if there was a sample, false if we have never measured the peer
+ *****************************************************************************************/
+bool SkewEstimator::getOffset(const char *peer, simtime_t &offset) {
+   auto pit = _peers.find(peer);
+   if (pit == _peers.end())
+      return false;
+
+   auto best = pit->second.begin();
+   for (auto sit = pit->second.begin(); sit != pit->second.end(); sit++) {
+      if (sit->delay < best->delay)
+         best = sit;
+   }
+   offset = best->offset;
+   return true;
+}
+
+/*****************************************************************************************
+ * getCorrection - averages the offsets of all measured peers plus our own (0). Adding the
+ *                 result to a local timestamp gives the cluster-average time
+ *****************************************************************************************/
+simtime_t SkewEstimator::getCorrection() {
+   simtime_t sum = 0;
+
+   for (auto pit = _peers.begin(); pit != _peers.end(); pit++) {
+      simtime_t offset;
+      getOffset(pit->first.c_str(), offset);
+      sum += offset;
+   }
+   return sum / (simtime_t) (_peers.size() + 1);
+}
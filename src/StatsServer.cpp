@@ -0,0 +1,130 @@
+#include <cerrno>
+#include <sstream>
+#include <unistd.h>
+#include "StatsServer.h"
+
+const simtime_t stats_client_timeout = 2 * simtime_per_sec;
+const unsigned int stats_max_request = 8192;
+
+/*****************************************************************************************
+ * StatsServer (constructor) - binds and listens on ip_addr:port
+ *
+ *    Throws: socket_error if the port cannot be bound
+ *****************************************************************************************/
+StatsServer::StatsServer(StatsProvider &provider, const char *ip_addr, unsigned short port):
+                              _provider(provider),
+                              _served(0)
+{
+   _sockfd.setReusable();
+   _sockfd.bindFD(ip_addr, port);
+   _sockfd.listenFD();
+}
+
+StatsServer::~StatsServer() {
+   for (auto cit = _clients.begin(); cit != _clients.end(); cit++)
+      (*cit)->sock.closeFD();
+   _sockfd.closeFD();
+}
+
+/*****************************************************************************************
+ * handleRequests - accepts any waiting clients and services the ones already connected.
+ *                  Only polls (zero timeout), so it costs one select per call when idle
+ *****************************************************************************************/
+void StatsServer::handleRequests() {
+   while (_sockfd.hasData(0)) {
+      std::unique_ptr<stats_client> client(new stats_client());
+      if (!client->sock.acceptFD(_sockfd))
+         break;
+      client->deadline = SimClock::monoNow() + stats_client_timeout;
+      _clients.push_back(std::move(client));
+   }
+
+   auto cit = _clients.begin();
+   while (cit != _clients.end()) {
+      if (handleClient(**cit)) {
+         (*cit)->sock.closeFD();
+         cit = _clients.erase(cit);
+      } else {
+         cit++;
+      }
+   }
+}
+
+void StatsServer::addPollFDs(std::vector<struct pollfd> &fds) {
+   fds.push_back({_sockfd.getFD(), POLLIN, 0});
+   for (auto &client : _clients) {
+      short events = client->response.empty() ? POLLIN : POLLOUT;
+      fds.push_back({client->sock.getFD(), events, 0});
+   }
+}
+
+/*****************************************************************************************
+ * handleClient - reads what the client has sent and, once the request headers are complete,
+ *                writes the stats page
+ *
+ *    Returns: true if the client can be closed
+ *****************************************************************************************/
+bool StatsServer::handleClient(stats_client &client) {
+   if (SimClock::monoNow() > client.deadline)
+      return true;
+
+   if (!client.response.empty())
+      return writeResponse(client);
+
+   if (!client.sock.hasData(0))
+      return false;
+
+   char buf[1024];
+   ssize_t amt = read(client.sock.getFD(), buf, sizeof(buf));
+   if (amt <= 0)
+      return true;
+   client.request.append(buf, amt);
+
+   if (client.request.size() > stats_max_request)
+      return true;
+
+   // Wait for the blank line that ends the headers
+   if ((client.request.find("\r\n\r\n") == std::string::npos) &&
+       (client.request.find("\n\n") == std::string::npos))
+      return false;
+
+   std::stringstream body;
+   _provider.writeStats(body);
+   std::string content = body.str();
+
+   std::stringstream response;
+   response << "HTTP/1.0 200 OK\r\n";
+   response << "Content-Type: text/plain; version=0.0.4\r\n";
+   response << "Content-Length: " << content.size() << "\r\n";
+   response << "Connection: close\r\n\r\n";
+   response << content;
+
+   client.response = response.str();
+   client.sent = 0;
+   _served++;
+   return writeResponse(client);
+}
+
+/*****************************************************************************************
+ * writeResponse - writes as much of the response as the socket will take. Each write that
+ *                 gets somewhere pushes the deadline back, so only a stalled client is cut off
+ *
+ *    Returns: true once all of it is out (or the client is gone), false to wait for POLLOUT
+ *****************************************************************************************/
+bool StatsServer::writeResponse(stats_client &client) {
+   while (client.sent < client.response.size()) {
+      ssize_t n = client.sock.writeFD(client.response.data() + client.sent,
+                                      client.response.size() - client.sent);
+      if (n < 0) {
+         if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+            return false;
+         return true;
+      }
+      if (n == 0)
+         return false;
+
+      client.sent += n;
+      client.deadline = SimClock::monoNow() + stats_client_timeout;
+   }
+   return true;
+}
@@ -1,7 +1,10 @@
 #include <stdexcept>
 #include <strings.h>
 #include <unistd.h>
+#include <poll.h>
 #include <cstring>
+#include <cstdlib>
+#include <cerrno>
 #include <algorithm>
 #include <iostream>
 #include <sstream>
@@ -13,6 +16,9 @@
 #include <crypto++/rijndael.h>
 #include <crypto++/gcm.h>
 #include <crypto++/aes.h>
+#include <crypto++/sha.h>
+#include <crypto++/hmac.h>
+#include <crypto++/hkdf.h>
 #include <random>
 
 using namespace CryptoPP;
@@ -22,6 +28,21 @@ const unsigned int iv_size = AES::BLOCKSIZE;
 const unsigned int key_size = AES::DEFAULT_KEYLENGTH;
 const unsigned int auth_size = 16;
 
+// Most getData asks the socket for at once
+const unsigned int read_chunk = 16384;
+
+// One round-trip handshake - the client's nonce, the tags on each flight, and the most sealed
+// data a hello may announce (it is buffered before it can be authenticated)
+const unsigned int nonce_size = 16;
+const unsigned int mac_size = HMAC<SHA256>::DIGESTSIZE;
+const size_t max_hello_data = 64 * 1024 * 1024;
+
+// Labels that keep the session keys apart from each other and from the other uses of the
+// shared key
+static const char client_enc_label[] = "repsvr handshake client encryption";
+static const char client_mac_label[] = "repsvr handshake client authentication";
+static const char server_mac_label[] = "repsvr handshake server authentication";
+
 /**********************************************************************************************
  * TCPConn (constructor) - creates the connector and initializes - creates the command strings
  *                         to wrap around network commands
@@ -80,6 +101,48 @@ TCPConn::TCPConn(LogMgr &server_log, CryptoPP::SecByteBlock &key, unsigned int v
 
    c_endsid = c_sid;
    c_endsid.insert(c_endsid.begin()+1, 1, slash);
+
+   c_tim.push_back((uint8_t) '<');
+   c_tim.push_back((uint8_t) 'T');
+   c_tim.push_back((uint8_t) 'I');
+   c_tim.push_back((uint8_t) 'M');
+   c_tim.push_back((uint8_t) '>');
+
+   c_endtim = c_tim;
+   c_endtim.insert(c_endtim.begin()+1, 1, slash);
+
+   c_cap.push_back((uint8_t) '<');
+   c_cap.push_back((uint8_t) 'C');
+   c_cap.push_back((uint8_t) 'A');
+   c_cap.push_back((uint8_t) 'P');
+   c_cap.push_back((uint8_t) '>');
+
+   c_endcap = c_cap;
+   c_endcap.insert(c_endcap.begin()+1, 1, slash);
+
+   c_hel.push_back((uint8_t) '<');
+   c_hel.push_back((uint8_t) 'H');
+   c_hel.push_back((uint8_t) 'E');
+   c_hel.push_back((uint8_t) 'L');
+   c_hel.push_back((uint8_t) '>');
+
+   c_endhel = c_hel;
+   c_endhel.insert(c_endhel.begin()+1, 1, slash);
+
+   c_mac.push_back((uint8_t) '<');
+   c_mac.push_back((uint8_t) 'M');
+   c_mac.push_back((uint8_t) 'A');
+   c_mac.push_back((uint8_t) 'C');
+   c_mac.push_back((uint8_t) '>');
+
+   c_endmac = c_mac;
+   c_endmac.insert(c_endmac.begin()+1, 1, slash);
+
+   _timer.setCallback([this]() {
+      handleTimeout();
+      if (_wakeup)
+         _wakeup();
+   });
 }
 
 
@@ -87,6 +150,19 @@ TCPConn::~TCPConn() {
 
 }
 
+/**********************************************************************************************
+ * getStatusName - the status without its s_ prefix
+ **********************************************************************************************/
+
+const char *TCPConn::getStatusName(statustype status) {
+   static const char *names[] = { "none", "connecting", "connected", "datatx", "datarx",
+                                  "waitack", "hasdata", "clientauth1", "clientauth2",
+                                  "serverauth1", "serverauth2" };
+   if ((unsigned int) status >= sizeof(names) / sizeof(names[0]))
+      return "unknown";
+   return names[status];
+}
+
 /**********************************************************************************************
  * accept - simply calls the acceptFD FileDesc method to accept a connection on a server socket.
  *
@@ -97,31 +173,97 @@ TCPConn::~TCPConn() {
 
 bool TCPConn::accept(SocketFD &server) {
    // Accept the connection
-   bool results = _connfd.acceptFD(server);
+   if (!_connfd.acceptFD(server))
+      return false;
+   _handshake_start = SimClock::monoNow();
 
 
    // Set the state as waiting for the authorization packet
    _status = s_connected;
    _connected = true;
-   return results;
+   _recvbuf.clear();
+   startProto(runServer());
+   armTimer(handshake_timeout);
+   return true;
 }
 
 /**********************************************************************************************
- * sendData - sends the data in the parameter to the socket
+ * sendData - sends the data in the parameter to the socket. Sockets are nonblocking, so
+ *            whatever does not fit in the socket's buffer is queued, and goes out from
+ *            handleConnection as the socket drains (see sendFlushed)
  *
- *    Params:  msg - the string to be sent
- *             size - if we know how much data we should expect to send, this should be populated
+ *    Params:  buf - the data to be sent
  *
- *    Throws: runtime_error for unrecoverable errors
+ *    Returns: true if it all went out now, false if some is queued
+ *
+ *    Throws: socket_error if the write failed
  **********************************************************************************************/
 
 bool TCPConn::sendData(std::vector<uint8_t> &buf) {
-   
-   _connfd.writeBytes<uint8_t>(buf);
-   
+   if (!_connected)
+      return false;
+
+   // Behind data already queued, so it all has to wait its turn
+   if (isSendQueued()) {
+      _sendbuf.insert(_sendbuf.end(), buf.begin(), buf.end());
+      return flushSend();
+   }
+
+   size_t sent = 0;
+   if (!writeSome(buf.data(), buf.size(), sent)) {
+      _sendbuf.assign(buf.begin() + sent, buf.end());
+      _send_pos = 0;
+      return false;
+   }
+   return true;
+}
+
+/**********************************************************************************************
+ * flushSend - writes as much of the queued data as the socket takes
+ *
+ *    Returns: true once nothing is left queued
+ *
+ *    Throws: socket_error if the write failed
+ **********************************************************************************************/
+
+bool TCPConn::flushSend() {
+   if (!isSendQueued())
+      return true;
+
+   if (!writeSome(_sendbuf.data() + _send_pos, _sendbuf.size() - _send_pos, _send_pos))
+      return false;
+
+   _sendbuf.clear();
+   _send_pos = 0;
    return true;
 }
 
+/**********************************************************************************************
+ * writeSome - writes len bytes of data until they are all out or the socket is full, adding
+ *             what went out to sent
+ *
+ *    Returns: true if all of it went out
+ *
+ *    Throws: socket_error if the write failed
+ **********************************************************************************************/
+
+bool TCPConn::writeSome(const uint8_t *data, size_t len, size_t &sent) {
+   size_t done = 0;
+   while (done < len) {
+      ssize_t results = _connfd.writeFD((const char *) data + done, len - done);
+      if (results < 0) {
+         if (errno == EINTR)
+            continue;
+         if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+            throw socket_error("Write to socket failed.");
+         break;
+      }
+      done += results;
+   }
+   sent += done;
+   return done == len;
+}
+
 /**********************************************************************************************
  * sendEncryptedData - sends the data in the parameter to the socket after block encrypting it
  *
@@ -149,6 +291,12 @@ bool TCPConn::sendEncryptedData(std::vector<uint8_t> &buf) {
  **********************************************************************************************/
 
 void TCPConn::encryptData(std::vector<uint8_t> &buf) {
+   encryptData(buf, _aes_key);
+}
+
+void TCPConn::encryptData(std::vector<uint8_t> &buf, const SecByteBlock &key) {
+   simtime_t start = SimClock::monoNow();
+
    // For the initialization vector
    SecByteBlock init_vector(iv_size);
    AutoSeededRandomPool rnd;
@@ -158,7 +306,7 @@ void TCPConn::encryptData(std::vector<uint8_t> &buf) {
 
    // Encrypt the data
    CFB_Mode<AES>::Encryption encryptor;
-   encryptor.SetKeyWithIV(_aes_key, _aes_key.size(), init_vector);
+   encryptor.SetKeyWithIV(key, key.size(), init_vector);
 
    std::string cipher;
    ArraySource as(buf.data(), buf.size(), true,
@@ -168,68 +316,41 @@ void TCPConn::encryptData(std::vector<uint8_t> &buf) {
    std::vector<uint8_t> enc_data(init_vector.begin(), init_vector.end());
    enc_data.insert(enc_data.end(), cipher.begin(), cipher.end());
    buf = enc_data;
+
+   if (_metrics != NULL)
+      _metrics->encrypt_time.record(SimClock::monoNow() - start);
 }
 
 /**********************************************************************************************
- * handleConnection - performs a check of the connection, looking for data on the socket and
- *                    handling it based on the _status, or stage, of the connection
+ * handleConnection - reads whatever has arrived on the socket and, once the message the protocol
+ *                    is suspended on is complete (or the connection was lost), resumes it. It
+ *                    runs until it needs a message that is not fully here yet, or finishes
  *
  *    Throws: runtime_error for unrecoverable issues
  **********************************************************************************************/
 
 void TCPConn::handleConnection() {
+   if (!_proto.isRunning())
+      return;
 
    try {
-      switch (_status) {
-
-         // Client: Just connected, send our SID
-         case s_connecting:
-            sendSID();
-            break;
-
-         // Server: Wait for the SID from a newly-connected client
-         case s_connected:
-            waitForSID();
-            break;
-
-            //client authentication part 1
-          case s_clientauth1:
-              authClient1();
-              break;
-
-              //server authentication part1
-          case s_serverauth1:
-              authServer1();
-              break;
-
-              //client authenication part 2
-          case s_clientauth2:
-              authClient2();
-              break;
-
-              // Client: connecting user - replicate data
-         case s_datatx:
-            transmitData();
-            break;
-
-         // Server: Receive data from the client
-         case s_datarx:
-            waitForData();
-            break;
-   
-         // Client: Wait for acknowledgement that data sent was received before disconnecting
-         case s_waitack:
-            awaitAck();
-            break;
-         
-         // Server: Data received and conn disconnected, but waiting for the data to be retrieved
-         case s_hasdata:
-            break;
-
-         default:
-            throw std::runtime_error("Invalid connection status!");
-            break;
+      // Data queued by an earlier step goes out first, whatever the protocol waits on
+      bool flushed = flushSend();
+
+      if (_await_send) {
+         if (!flushed && _connected)
+            return;
+
+         _await_send = false;
+      } else if (_await_buf != NULL) {
+         if (!getMsg(*_await_buf, _await_cmd, _await_len) && _connected)
+            return;
+
+         _await_buf = NULL;
+         _await_cmd = NULL;
       }
+
+      _proto.resume();
    } catch (socket_error &e) {
       std::cout << "Socket error, disconnecting.\n";
       disconnect();
@@ -238,6 +359,142 @@ void TCPConn::handleConnection() {
 
 }
 
+/**********************************************************************************************
+ * isWaitingForInput - true while the protocol is suspended on a message or on its queued data
+ *                     going out. Otherwise (connecting, or done and waiting to be collected)
+ *                     the connection needs handling whether or not its socket is ready
+ *
+ **********************************************************************************************/
+
+bool TCPConn::isWaitingForInput() {
+   return _connected && (_await_send || (_await_buf != NULL) || !_proto.isRunning());
+}
+
+/**********************************************************************************************
+ * getPollEvents - POLLIN, plus POLLOUT while data is queued to send. Only POLLOUT if the
+ *                 protocol waits on nothing but that data, so input it is not reading yet
+ *                 does not keep waking us
+ *
+ **********************************************************************************************/
+
+short TCPConn::getPollEvents() {
+   if (!isSendQueued())
+      return POLLIN;
+   return _await_send ? POLLOUT : (POLLIN | POLLOUT);
+}
+
+/**********************************************************************************************
+ * startProto - replaces any protocol still suspended from an earlier connection with proto,
+ *              which first runs at the next handleConnection
+ *
+ **********************************************************************************************/
+
+void TCPConn::startProto(ConnTask proto) {
+   _proto = std::move(proto);
+   _await_buf = NULL;
+   _await_cmd = NULL;
+   _await_send = false;
+}
+
+/**********************************************************************************************
+ * runClient - Client: sends our SID, answers the server's challenge with our own, checks the
+ *             server's answer, then sends the replication data and waits for the ACK. That
+ *             is three round trips before the data moves, so with setFastHandshake it is
+ *             one instead:
+ *
+ *                client: <HEL>nonce,sent,caps,len</HEL><SID>id</SID> + len bytes of sealed
+ *                        data (IV, ciphertext, then a tag over everything before it)
+ *                server: <ACK><SID>id</SID><CAP>caps</CAP>[<TIM>t2,t3</TIM>]<MAC>tag</MAC>
+ *
+ *             Session keys come from the shared key by HKDF, salted with the client's random
+ *             nonce. The client's tag proves it holds the key, and the server only takes a
+ *             nonce once and a hello stamped within replay_window of its clock, so a
+ *             recorded flight cannot be replayed. The server's tag covers the client's, so
+ *             it proves the server holds the key and answered this flight. The data is
+ *             encoded with the caps the peer agreed to last time (plain the first time)
+ *
+ *    Throws: socket_error for network issues, runtime_error for unrecoverable issues
+ **********************************************************************************************/
+
+ConnTask TCPConn::runClient() {
+   std::vector<uint8_t> buf;
+
+   // One round trip - the data goes out with our hello, and the reply both ACKs it and
+   // authenticates the server
+   if (_fast) {
+      sendHello();
+
+      if (!co_await recvMsg(buf, c_endmac))
+         co_return;
+      recvHelloReply(buf);
+      co_return;
+   }
+
+   sendSID();
+
+   if (!co_await recvMsg(buf, c_endrand))
+      co_return;
+   authClient1(buf);
+
+   if (!co_await recvMsg(buf, c_endsid))
+      co_return;
+   authClient2(buf);
+   if (!_connected)
+      co_return;
+
+   transmitData();
+
+   if (!co_await recvMsg(buf, c_ack))
+      co_return;
+   recvAck(buf);
+}
+
+/**********************************************************************************************
+ * runServer - Server: challenges the client once it sends its SID, checks its answer and
+ *             answers its challenge, then takes the replication data and ACKs it. Or, if a
+ *             hello comes with the SID, takes the sealed data that follows and answers in one
+ *             (see runClient)
+ *
+ *    Throws: socket_error for network issues, runtime_error for unrecoverable issues
+ **********************************************************************************************/
+
+ConnTask TCPConn::runServer() {
+   std::vector<uint8_t> buf;
+
+   if (!co_await recvMsg(buf, c_endsid))
+      co_return;
+
+   // A hello ahead of the SID means the client's data follows in the same flight
+   if (hasCmd(buf, c_hel)) {
+      std::vector<uint8_t> hello = buf;
+      size_t len = readHello(hello);
+      if (len == 0)
+         co_return;
+
+      if (!co_await recvBytes(buf, len))
+         co_return;
+      recvSealedData(hello, buf);
+
+      // The reply may not all have fit in the socket, so it has to go out before we close
+      if (co_await sendFlushed())
+         disconnect();
+      co_return;
+   }
+
+   recvSID(buf);
+
+   if (!co_await recvMsg(buf, c_endrand))
+      co_return;
+   authServer1(buf);
+
+   if (!co_await recvMsg(buf, c_endrep))
+      co_return;
+   recvData(buf);
+
+   if (co_await sendFlushed())
+      disconnect();
+}
+
 /**********************************************************************************************
  * sendSID()  - Client: after a connection, client sends its Server ID to the server
  *
@@ -253,171 +510,263 @@ void TCPConn::sendSID() {
 }
 
 /**********************************************************************************************
- * waitForSID()  - receives the SID and sends our SID
+ * recvSID()  - receives the SID and sends our challenge
+ *
+ *    Params:  buf - the client's <SID> message
  *
  *    Throws: socket_error for network issues, runtime_error for unrecoverable issues
  **********************************************************************************************/
 
-void TCPConn::waitForSID() {
-
-   // If data on the socket, should be our Auth string from our host server
-   if (_connfd.hasData()) {
-      std::vector<uint8_t> buf;
-      getData(buf);
-      if (buf.size() <= 0)
-         return;
+void TCPConn::recvSID(std::vector<uint8_t> &buf) {
 
-      if (!getCmdData(buf, c_sid, c_endsid)) {
-         std::stringstream msg;
-         msg << "SID string from connecting client invalid format. Cannot authenticate.";
-         _server_log.writeLog(msg.str().c_str());
-         disconnect();
-         return;
-      }
+   if (!getCmdData(buf, c_sid, c_endsid)) {
+      std::stringstream msg;
+      msg << "SID string from connecting client invalid format. Cannot authenticate.";
+      _server_log.writeLog(msg.str().c_str());
+      disconnect();
+      return;
+   }
 
-      std::string node(buf.begin(), buf.end());
-      setNodeID(node.c_str());
-      sendRandomAuth();
-      /*
-      // Send our Node ID
-      buf.assign(_svr_id.begin(), _svr_id.end());
-      wrapCmd(buf, c_sid, c_endsid);
-      sendData(buf);
+   std::string node(buf.begin(), buf.end());
+   setNodeID(node.c_str());
+   sendRandomAuth();
+   /*
+   // Send our Node ID
+   buf.assign(_svr_id.begin(), _svr_id.end());
+   wrapCmd(buf, c_sid, c_endsid);
+   sendData(buf);
 */
-      _status = s_serverauth1;
-   }
+   _status = s_serverauth1;
 }
 
 /**********************************************************************************************
  * authClient1()  - receives the random string from server and sends it back encrypted
  *
+ *    Params:  buf - the server's <RAN> message
+ *
  *    Throws: socket_error for network issues, runtime_error for unrecoverable issues
  **********************************************************************************************/
 
-void TCPConn::authClient1(){
-    if (_connfd.hasData()) {
-        std::vector<uint8_t> buf;
-
-        if (!getData(buf))
-            return;
+void TCPConn::authClient1(std::vector<uint8_t> &buf) {
+    if (!getCmdData(buf, c_rand, c_endrand)) {
+        std::stringstream msg;
+        msg << "Tried to receive random bytes. Failed. Node:" << getNodeID() << "\n";
+        _server_log.writeLog(msg.str().c_str());
+    }
 
-        if (!getCmdData(buf, c_rand, c_endrand)) {
-            std::stringstream msg;
-            msg << "Tried to receive random bytes. Failed. Node:" << getNodeID() << "\n";
-            _server_log.writeLog(msg.str().c_str());
-        }
+    encryptData(buf);
+    wrapCmd(buf, c_auth, c_endauth);
+    sendData(buf);
+    sendCaps(getLocalCaps());
+    sendRandomAuth();
 
-        encryptData(buf);
-        wrapCmd(buf, c_auth, c_endauth);
-        sendData(buf);
-        sendRandomAuth();
+    // t1 for the clock skew exchange
+    if (_skew != NULL)
+        _skew_t1 = _skew->now();
 
-        _status = s_clientauth2;
-    }
+    _status = s_clientauth2;
 }
 
 /**********************************************************************************************
  * authClient2()  - receives the encrypted string from the server checks if it is the string saved in
  * TCP conn in _authstr, and receives the SID from the server
  *
+ *    Params:  buf - the server's reply, ending with its <SID>
+ *
  *    Throws: socket_error for network issues, runtime_error for unrecoverable issues
  **********************************************************************************************/
-void TCPConn::authClient2(){
-    if (_connfd.hasData()) {
-        std::vector<uint8_t> buf;
+void TCPConn::authClient2(std::vector<uint8_t> &buf) {
+    // t4 for the clock skew exchange
+    simtime_t t4 = (_skew != NULL) ? _skew->now() : 0;
+
+    std::vector<uint8_t> newcmd = getMultipleCmdData(buf, c_auth, c_endauth);
+    if (newcmd.size() == 0) {
+        std::stringstream msg;
+        msg << "Tried to receive encrypted bytes. Failed. Node:" << getNodeID() << "\n";
+        _server_log.writeLog(msg.str().c_str());
+    }
 
-        if (!getData(buf))
-            return;
+    //parse the data inbetween the tags perhaps.. have to do so encrypted and random numbers
+    decryptData(newcmd); //make sure if the tags were still on
+    std::string translatedData (newcmd.begin(), newcmd.end()); //not sure if i'm doing this right
+    std::string str(_authstr.begin(), _authstr.end());
+
+    if (translatedData.compare(str) != 0){ //check to make sure that the encrypted is the same as athe stored string
+        std::stringstream msg;
+        msg << "Bad encyrption from the server. Node:" << getNodeID() << "\n";
+        _server_log.writeLog(msg.str().c_str());
+        disconnect();
+        return;
+    }
 
-        std::vector<uint8_t> newcmd = getMultipleCmdData(buf, c_auth, c_endauth);
-        if (newcmd.size() == 0) {
-            std::stringstream msg;
-            msg << "Tried to receive encrypted bytes. Failed. Node:" << getNodeID() << "\n";
-            _server_log.writeLog(msg.str().c_str());
-        }
+    std::vector<uint8_t> newcmd2 = getMultipleCmdData(buf, c_sid, c_endsid);
+    if (newcmd2.size() == 0) {
+        std::stringstream msg;
+        msg << "SID string from connected server invalid format. Cannot authenticate.";
+        _server_log.writeLog(msg.str().c_str());
+        disconnect();
+        return;
+    }
 
-        //parse the data inbetween the tags perhaps.. have to do so encrypted and random numbers
-        decryptData(newcmd); //make sure if the tags were still on
-        std::string translatedData (newcmd.begin(), newcmd.end()); //not sure if i'm doing this right
-        std::string str(_authstr.begin(), _authstr.end());
+    std::string node(newcmd2.begin(), newcmd2.end());
+    setNodeID(node.c_str());
 
-        if (translatedData.compare(str) != 0){ //check to make sure that the encrypted is the same as athe stored string
-            std::stringstream msg;
-            msg << "Bad encyrption from the server. Node:" << getNodeID() << "\n";
-            _server_log.writeLog(msg.str().c_str());
-            disconnect();
-            return;
-        }
+    // The features the server agreed to (none if it sent no <CAP>)
+    _peer_caps = readCaps(buf) & getLocalCaps();
+
+    // Servers that stamped the exchange send back when they received and replied
+    std::vector<uint8_t> timcmd = getMultipleCmdData(buf, c_tim, c_endtim);
+    if ((_skew != NULL) && (timcmd.size() > 0))
+        addSkewSample(timcmd, t4);
+
+    recordHandshake();
+    _status = s_datatx;
+}
 
-        std::vector<uint8_t> newcmd2 = getMultipleCmdData(buf, c_sid, c_endsid);
+/**********************************************************************************************
+ * authServer1()  - receives  the encrypted string from teh client, checks it against _authstr
+ * gets the random string from the client, encrypts it, and then sends it back. also sends its SID.
+ * A client that fails the challenge is disconnected
+ *
+ *    Params:  buf - the client's reply, ending with its <RAN>
+ *
+ *    Throws: socket_error for network issues, runtime_error for unrecoverable issues
+ **********************************************************************************************/
+void TCPConn::authServer1(std::vector<uint8_t> &buf) {
+    // t2 for the clock skew exchange
+    simtime_t t2 = (_skew != NULL) ? _skew->now() : 0;
+
+    std::vector<uint8_t> newcmd = getMultipleCmdData(buf, c_auth, c_endauth);
+    if (newcmd.size() == 0) {
+        std::stringstream msg;
+        msg << "Tried to receive encrypted bytes. Failed. Node:" << getNodeID() << "\n";
+        _server_log.writeLog(msg.str().c_str());
+    }
+
+    decryptData(newcmd); //find out if the tags are still on
+    std::string translatedData (newcmd.begin(), newcmd.end());
+    std::string str(_authstr.begin(), _authstr.end());
+
+    if (translatedData == str) {
+
+        std::vector<uint8_t> newcmd2 = getMultipleCmdData(buf, c_rand, c_endrand);
         if (newcmd2.size() == 0) {
             std::stringstream msg;
-            msg << "SID string from connected server invalid format. Cannot authenticate.";
+            msg << "Tried to receive random bytes. Failed. Node:" << getNodeID() << "\n";
             _server_log.writeLog(msg.str().c_str());
-            disconnect();
-            return;
         }
 
-        std::string node(newcmd2.begin(), newcmd2.end());
-        setNodeID(node.c_str());
+        encryptData(newcmd2);
+        wrapCmd(newcmd2, c_auth, c_endauth);
+        sendData(newcmd2);
 
-        _status = s_datatx;
+        // Agree on the payload features we both support
+        _peer_caps = readCaps(buf) & getLocalCaps();
+        sendCaps(_peer_caps);
+
+        // Tell the client when we received its reply (t2) and sent ours (t3)
+        if (_skew != NULL) {
+            std::string times = std::to_string(t2) + "," + std::to_string(_skew->now());
+            std::vector<uint8_t> timbuf(times.begin(), times.end());
+            wrapCmd(timbuf, c_tim, c_endtim);
+            sendData(timbuf);
+        }
+
+        std::vector<uint8_t> svrid;
+        //send SID of server
+        svrid.assign(_svr_id.begin(), _svr_id.end());
+        wrapCmd(svrid, c_sid, c_endsid);
+        sendData(svrid);
+
+        recordHandshake();
+        _status = s_datarx;
+    } else {
+        std::stringstream msg;
+        msg << "Bad encryption from the client. Node:" << getNodeID() << "\n";
+        _server_log.writeLog(msg.str().c_str());
+        disconnect();
     }
 }
 
 /**********************************************************************************************
- * authServer1()  - receives  the encrypted string from teh client, checks it against _authstr
- * gets the random string from the client, encrypts it, and then sends it back. also sends its SID
+ * addSkewSample()  - Client: parses the server's "t2,t3" timestamps and gives the estimator one
+ *                    NTP-style offset/delay sample for this server
  *
- *    Throws: socket_error for network issues, runtime_error for unrecoverable issues
+ *    Params:  timcmd - the contents of the <TIM> command
+ *             t4 - when we received the server's reply
  **********************************************************************************************/
-void TCPConn::authServer1(){
-    if (_connfd.hasData()) {
-        std::vector<uint8_t> buf;
+void TCPConn::addSkewSample(std::vector<uint8_t> &timcmd, simtime_t t4) {
+    std::string times(timcmd.begin(), timcmd.end());
+    std::string left, right;
+
+    if (!split(times, left, right, ',')) {
+        std::stringstream msg;
+        msg << "Clock timestamps from server invalid format. Node:" << getNodeID() << "\n";
+        _server_log.writeLog(msg.str().c_str());
+        return;
+    }
 
-        if (!getData(buf))
-            return;
+    simtime_t t2 = strtoll(left.c_str(), NULL, 10);
+    simtime_t t3 = strtoll(right.c_str(), NULL, 10);
 
-        std::vector<uint8_t> newcmd = getMultipleCmdData(buf, c_auth, c_endauth);
-        if (newcmd.size() == 0) {
-            std::stringstream msg;
-            msg << "Tried to receive encrypted bytes. Failed. Node:" << getNodeID() << "\n";
-            _server_log.writeLog(msg.str().c_str());
-        }
+    simtime_t offset = ((t2 - _skew_t1) + (t3 - t4)) / 2;
+    simtime_t delay = (t4 - _skew_t1) - (t3 - t2);
+    _skew->addSample(getNodeID(), offset, delay);
 
-        decryptData(newcmd); //find out if the tags are still on
-        std::string translatedData (newcmd.begin(), newcmd.end());
-        std::string str(_authstr.begin(), _authstr.end());
+    if (_verbosity >= 3)
+        std::cout << "Clock offset to " << getNodeID() << ": " << simTimeToSecs(offset) <<
+                     " secs (round trip " << simTimeToSecs(delay) << " secs)\n";
+}
+
+/**********************************************************************************************
+ * recordHandshake() - notes how long authentication took once it completes
+ **********************************************************************************************/
+void TCPConn::recordHandshake() {
+    if (_metrics == NULL)
+        return;
+
+    _metrics->handshake_time.record(SimClock::monoNow() - _handshake_start);
+    _metrics->getPeer(getNodeID()).handshakes++;
+}
 
-        if (translatedData == str) {
+/**********************************************************************************************
+ * getLocalCaps() - the payload features this connection can handle
+ **********************************************************************************************/
+uint32_t TCPConn::getLocalCaps() {
+    return (_codec != NULL) ? _codec->getCaps() : 0;
+}
 
-            std::vector<uint8_t> newcmd2 = getMultipleCmdData(buf, c_rand, c_endrand);
-            if (newcmd2.size() == 0) {
-                std::stringstream msg;
-                msg << "Tried to receive random bytes. Failed. Node:" << getNodeID() << "\n";
-                _server_log.writeLog(msg.str().c_str());
-            }
+/**********************************************************************************************
+ * readCaps() - pulls the cap_ bits out of a <CAP> command in buf
+ *
+ *    Returns: the bits, or 0 if the other end sent no <CAP> (an older server)
+ **********************************************************************************************/
+uint32_t TCPConn::readCaps(std::vector<uint8_t> &buf) {
+    std::vector<uint8_t> capcmd = getMultipleCmdData(buf, c_cap, c_endcap);
+    if (capcmd.size() == 0)
+        return 0;
 
-            encryptData(newcmd2);
-            wrapCmd(newcmd2, c_auth, c_endauth);
-            sendData(newcmd2);
+    std::string caps(capcmd.begin(), capcmd.end());
+    return (uint32_t) strtoul(caps.c_str(), NULL, 16);
+}
 
-            std::vector<uint8_t> svrid;
-            //send SID of server
-            svrid.assign(_svr_id.begin(), _svr_id.end());
-            wrapCmd(svrid, c_sid, c_endsid);
-            sendData(svrid);
+/**********************************************************************************************
+ * sendCaps() - sends cap_ bits as hex text in a <CAP> command
+ **********************************************************************************************/
+void TCPConn::sendCaps(uint32_t caps) {
+    std::stringstream capstr;
+    capstr << std::hex << caps;
 
-            _status = s_datarx;
-        }
-    }
+    std::string str = capstr.str();
+    std::vector<uint8_t> buf(str.begin(), str.end());
+    wrapCmd(buf, c_cap, c_endcap);
+    sendData(buf);
 }
 
 //sendRandomAuth(): sends random vector<uint_8> to client/server and stores it in _authstr
 void TCPConn::sendRandomAuth(){
     createRandAuthStr();
-    auto buf = std::vector<uint8_t>(auth_size);
-    std::copy(_authstr.begin(), _authstr.end(), buf.begin());
+    auto buf = _authstr;
     wrapCmd(buf, c_rand, c_endrand);
     sendData(buf);
 }
@@ -426,6 +775,7 @@ void TCPConn::sendRandomAuth(){
 void TCPConn::createRandAuthStr(){
     std::default_random_engine generator{std::random_device{}()};
     std::uniform_int_distribution<uint8_t > distribution(0, 225);
+    _authstr.clear();
     for (int i = 0; i < auth_size; i++)
         _authstr.emplace_back(distribution(generator));
 }
@@ -439,8 +789,19 @@ void TCPConn::createRandAuthStr(){
 
 void TCPConn::transmitData() {
 
-      // Send the replication data
-      sendData(_outputbuf);
+      // Encode for this peer, wrap and send the replication data
+      std::vector<uint8_t> buf = _outputbuf;
+      if (_codec != NULL) {
+         simtime_t start = SimClock::monoNow();
+         _codec->encodePayload(buf, _peer_caps);
+         if (_metrics != NULL)
+            _metrics->encode_time.record(SimClock::monoNow() - start);
+      }
+      wrapCmd(buf, c_rep, c_endrep);
+      sendData(buf);
+
+      if (_metrics != NULL)
+         _metrics->getPeer(getNodeID()).bytes_sent += buf.size();
 
       if (_verbosity >= 3)
          std::cout << "Successfully authenticated connection with " << getNodeID() <<
@@ -448,88 +809,383 @@ void TCPConn::transmitData() {
 
       // Wait for their response
       _status = s_waitack;
+      armTimer(ack_timeout);
 
 }
 
 
 /**********************************************************************************************
- * waitForData - receiving server, authentication complete, wait for replication datai
-               Also sends a plaintext random auth string of our own
+ * recvData - receiving server, authentication complete, takes the replication data and ACKs it
+ *            (runServer disconnects once the ACK is out)
+ *
+ *    Params:  buf - the client's <REP> message
  *
  *    Throws: socket_error for network issues, runtime_error for unrecoverable issues
  **********************************************************************************************/
 
-void TCPConn::waitForData() {
+void TCPConn::recvData(std::vector<uint8_t> &buf) {
+
+   if (_metrics != NULL)
+      _metrics->getPeer(getNodeID()).bytes_received += buf.size();
+
+   if (!getCmdData(buf, c_rep, c_endrep)) {
+      std::stringstream msg;
+      msg << "Replication data possibly corrupted from" << getNodeID() << "\n";
+      _server_log.writeLog(msg.str().c_str());
+      disconnect();
+      return;
+   }
+
+   if (!storeInput(buf))
+      return;
 
-   // If data on the socket, should be replication data
-   if (_connfd.hasData()) {
-      std::vector<uint8_t> buf;
+   // Send the acknowledgement
+   sendData(c_ack);
 
-      if (!getData(buf))
-         return;
+   if (_verbosity >= 2)
+      std::cout << "Successfully received replication data from " << getNodeID() << "\n";
 
-      if (!getCmdData(buf, c_rep, c_endrep)) {
+   _status = s_hasdata;
+}
+
+
+/**********************************************************************************************
+ * storeInput - puts received replication data back in plain form and saves it
+ *
+ *    Params:  buf - the data, as it came off the wire
+ *
+ *    Returns: true if saved, false if it could not be decoded (and we disconnected)
+ **********************************************************************************************/
+
+bool TCPConn::storeInput(std::vector<uint8_t> &buf) {
+
+   // Put it back in plain form
+   if (_codec != NULL) {
+      try {
+         simtime_t start = SimClock::monoNow();
+         _codec->decodePayload(buf);
+         if (_metrics != NULL)
+            _metrics->decode_time.record(SimClock::monoNow() - start);
+      } catch (std::runtime_error &e) {
          std::stringstream msg;
-         msg << "Replication data possibly corrupted from" << getNodeID() << "\n";
+         msg << "Replication data from " << getNodeID() << " could not be decoded: " << e.what();
          _server_log.writeLog(msg.str().c_str());
          disconnect();
-         return;
+         return false;
       }
+   }
+
+   // Got the data, save it
+   _inputbuf = buf;
+   _data_ready = true;
+   return true;
+}
+
+
+/**********************************************************************************************
+ * sendHello - Client: sends our hello, SID and the replication data, sealed with this
+ *             session's keys, as one flight (see runClient)
+ *
+ *    Throws: socket_error for network issues, runtime_error for unrecoverable issues
+ **********************************************************************************************/
+
+void TCPConn::sendHello() {
+   AutoSeededRandomPool rnd;
+   _nonce.resize(nonce_size);
+   rnd.GenerateBlock(_nonce.data(), _nonce.size());
+
+   SecByteBlock enc_key(key_size), mac_key(mac_size);
+   deriveKey(enc_key, client_enc_label);
+   deriveKey(mac_key, client_mac_label);
+
+   // Nothing has been negotiated yet, so encode with what this peer agreed to last time
+   std::vector<uint8_t> sealed = _outputbuf;
+   if (_codec != NULL) {
+      uint32_t caps = (_hs_cache != NULL) ? _hs_cache->getPeerCaps(getNodeID()) : 0;
+      simtime_t start = SimClock::monoNow();
+      _codec->encodePayload(sealed, caps & getLocalCaps());
+      if (_metrics != NULL)
+         _metrics->encode_time.record(SimClock::monoNow() - start);
+   }
+   encryptData(sealed, enc_key);
+
+   std::string nonce_hex;
+   toHex(_nonce.data(), _nonce.size(), nonce_hex);
+
+   std::stringstream hello;
+   hello << nonce_hex << "," << SimClock::wallNow() << "," << std::hex << getLocalCaps() <<
+                                                std::dec << "," << sealed.size() + mac_size;
+   std::string str = hello.str();
+   std::vector<uint8_t> buf(str.begin(), str.end());
+   wrapCmd(buf, c_hel, c_endhel);
+
+   std::vector<uint8_t> sid(_svr_id.begin(), _svr_id.end());
+   wrapCmd(sid, c_sid, c_endsid);
+   buf.insert(buf.end(), sid.begin(), sid.end());
+   buf.insert(buf.end(), sealed.begin(), sealed.end());
+
+   // Tag the hello, SID, IV and ciphertext together (encrypt-then-MAC)
+   _hello_tag.resize(mac_size);
+   HMAC<SHA256> hmac(mac_key, mac_key.size());
+   hmac.CalculateDigest(_hello_tag.data(), buf.data(), buf.size());
+   buf.insert(buf.end(), _hello_tag.begin(), _hello_tag.end());
+
+   // t1 for the clock skew exchange
+   if (_skew != NULL)
+      _skew_t1 = _skew->now();
+
+   sendData(buf);
+
+   // The data, as <REP> is counted in the other handshake (not the hello)
+   if (_metrics != NULL)
+      _metrics->getPeer(getNodeID()).bytes_sent += sealed.size() + mac_size;
+
+   if (_verbosity >= 3)
+      std::cout << "Sent hello and replication data to " << getNodeID() << ".\n";
+
+   _status = s_waitack;
+   armTimer(ack_timeout);
+}
 
-      // Got the data, save it
-      _inputbuf = buf;
-      _data_ready = true;
+/**********************************************************************************************
+ * readHello - Server: checks the client's hello and SID and notes its nonce, stamp and caps
+ *
+ *    Params:  buf - the <HEL> and <SID> messages
+ *
+ *    Returns: the length of the sealed data that follows, or 0 if the hello was bad (and we
+ *             disconnected)
+ **********************************************************************************************/
+
+size_t TCPConn::readHello(std::vector<uint8_t> &buf) {
+   std::vector<uint8_t> fields = getMultipleCmdData(buf, c_hel, c_endhel);
+   std::vector<uint8_t> sid = getMultipleCmdData(buf, c_sid, c_endsid);
 
-      // Send the acknowledgement and disconnect
-      sendData(c_ack);
+   std::string rest(fields.begin(), fields.end()), nonce_hex, sent, caps, len;
+   bool parsed = split(rest, nonce_hex, rest, ',') && split(rest, sent, rest, ',') &&
+                 split(rest, caps, len, ',') && fromHex(nonce_hex, _nonce) &&
+                 (_nonce.size() == nonce_size) && (sid.size() > 0);
 
-      if (_verbosity >= 2)
-         std::cout << "Successfully received replication data from " << getNodeID() << "\n";
+   size_t sealed_len = parsed ? strtoull(len.c_str(), NULL, 10) : 0;
+   _hello_sent = parsed ? strtoll(sent.c_str(), NULL, 10) : 0;
 
+   const char *problem = NULL;
+   if (!parsed || (sealed_len < iv_size + mac_size) || (sealed_len > max_hello_data))
+      problem = "Hello from connecting client invalid format. Cannot authenticate.";
+   else if (_hs_cache == NULL)
+      problem = "Hello from connecting client, but we cannot check it for replays. Refusing.";
+   else if (!_hs_cache->isTimely(_hello_sent))
+      problem = "Hello from connecting client is stale or its clock is off. Refusing.";
 
+   if (problem != NULL) {
+      _server_log.writeLog(problem);
       disconnect();
-      _status = s_hasdata;
+      return 0;
    }
-}
 
+   std::string node(sid.begin(), sid.end());
+   setNodeID(node.c_str());
+   _peer_caps = (uint32_t) strtoul(caps.c_str(), NULL, 16) & getLocalCaps();
+
+   _status = s_datarx;
+   return sealed_len;
+}
 
 /**********************************************************************************************
- * awaitAwk - waits for the awk that data was received and disconnects
+ * recvSealedData - Server: authenticates the client's flight, saves its data, and replies with
+ *                  the ACK and our own authentication (runServer disconnects once it is out)
+ *
+ *    Params:  hello - the <HEL> and <SID> messages
+ *             sealed - the sealed data that followed them
  *
  *    Throws: socket_error for network issues, runtime_error for unrecoverable issues
  **********************************************************************************************/
 
-void TCPConn::awaitAck() {
+void TCPConn::recvSealedData(std::vector<uint8_t> &hello, std::vector<uint8_t> &sealed) {
+   // t2 for the clock skew exchange
+   simtime_t t2 = (_skew != NULL) ? _skew->now() : 0;
 
-   // Should have the awk message
-   if (_connfd.hasData()) {
-      std::vector<uint8_t> buf;
+   if (_metrics != NULL)
+      _metrics->getPeer(getNodeID()).bytes_received += sealed.size();
 
-      if (!getData(buf))
-         return;
+   SecByteBlock enc_key(key_size), mac_key(mac_size);
+   deriveKey(enc_key, client_enc_label);
+   deriveKey(mac_key, client_mac_label);
 
-      if (findCmd(buf, c_ack) == buf.end())
-      {
-         std::stringstream msg;
-         msg << "Awk expected from data send, received something else. Node:" << getNodeID() << "\n";
-         _server_log.writeLog(msg.str().c_str());
-      }
-  
-      if (_verbosity >= 3)
-         std::cout << "Data ack received from " << getNodeID() << ". Disconnecting.\n";
+   _hello_tag.assign(sealed.end() - mac_size, sealed.end());
+   sealed.resize(sealed.size() - mac_size);
 
- 
+   std::vector<uint8_t> tag(mac_size);
+   HMAC<SHA256> hmac(mac_key, mac_key.size());
+   hmac.Update(hello.data(), hello.size());
+   hmac.Update(sealed.data(), sealed.size());
+   hmac.Final(tag.data());
+
+   if (!VerifyBufsEqual(tag.data(), _hello_tag.data(), mac_size)) {
+      std::stringstream msg;
+      msg << "Bad authentication from the client. Node:" << getNodeID() << "\n";
+      _server_log.writeLog(msg.str().c_str());
       disconnect();
+      return;
+   }
+
+   // Only authentic hellos are remembered, so nobody else can fill the cache
+   if (!_hs_cache->admitNonce(_nonce, _hello_sent)) {
+      std::stringstream msg;
+      msg << "Replayed hello from the client. Node:" << getNodeID() << "\n";
+      _server_log.writeLog(msg.str().c_str());
+      disconnect();
+      return;
+   }
+   recordHandshake();
+
+   decryptData(sealed, enc_key);
+   if (!storeInput(sealed))
+      return;
+
+   // ACK, with what the ACK in the old handshake's place would have told the client
+   std::vector<uint8_t> reply = c_ack;
+   std::vector<uint8_t> part(_svr_id.begin(), _svr_id.end());
+   wrapCmd(part, c_sid, c_endsid);
+   reply.insert(reply.end(), part.begin(), part.end());
+
+   std::stringstream capstr;
+   capstr << std::hex << _peer_caps;
+   std::string str = capstr.str();
+   part.assign(str.begin(), str.end());
+   wrapCmd(part, c_cap, c_endcap);
+   reply.insert(reply.end(), part.begin(), part.end());
+
+   if (_skew != NULL) {
+      str = std::to_string(t2) + "," + std::to_string(_skew->now());
+      part.assign(str.begin(), str.end());
+      wrapCmd(part, c_tim, c_endtim);
+      reply.insert(reply.end(), part.begin(), part.end());
    }
+
+   // Tag it along with the client's tag, so it answers this flight and no other
+   SecByteBlock svr_key(mac_size);
+   deriveKey(svr_key, server_mac_label);
+   HMAC<SHA256> svr_hmac(svr_key, svr_key.size());
+   svr_hmac.Update(_hello_tag.data(), _hello_tag.size());
+   svr_hmac.Update(reply.data(), reply.size());
+   svr_hmac.Final(tag.data());
+
+   toHex(tag.data(), tag.size(), str);
+   part.assign(str.begin(), str.end());
+   wrapCmd(part, c_mac, c_endmac);
+   reply.insert(reply.end(), part.begin(), part.end());
+   sendData(reply);
+
+   if (_verbosity >= 2)
+      std::cout << "Successfully received replication data from " << getNodeID() << "\n";
+
+   _status = s_hasdata;
 }
 
 /**********************************************************************************************
- * getData - Reads in data from the socket and checks to see if there's an end command to the
- *           message to confirm we got it all
+ * recvHelloReply - Client: checks the server's reply to our hello, which ACKs our data, then
+ *                  disconnects
  *
- *    Params: None - data is stored in _inputbuf for retrieval with GetInputData
+ *    Params:  buf - the reply, ending with its <MAC>
+ **********************************************************************************************/
+
+void TCPConn::recvHelloReply(std::vector<uint8_t> &buf) {
+   // t4 for the clock skew exchange
+   simtime_t t4 = (_skew != NULL) ? _skew->now() : 0;
+
+   std::vector<uint8_t> reply(buf.begin(), findCmd(buf, c_mac));
+   std::vector<uint8_t> machex = getMultipleCmdData(buf, c_mac, c_endmac);
+   std::vector<uint8_t> svr_tag;
+
+   SecByteBlock svr_key(mac_size);
+   deriveKey(svr_key, server_mac_label);
+
+   std::vector<uint8_t> tag(mac_size);
+   HMAC<SHA256> hmac(svr_key, svr_key.size());
+   hmac.Update(_hello_tag.data(), _hello_tag.size());
+   hmac.Update(reply.data(), reply.size());
+   hmac.Final(tag.data());
+
+   if (!fromHex(std::string(machex.begin(), machex.end()), svr_tag) ||
+                  (svr_tag.size() != mac_size) || !VerifyBufsEqual(tag.data(), svr_tag.data(), mac_size)) {
+      std::stringstream msg;
+      msg << "Bad authentication from the server. Node:" << getNodeID() << "\n";
+      _server_log.writeLog(msg.str().c_str());
+      disconnect();
+      return;
+   }
+
+   if (!hasCmd(reply, c_ack)) {
+      std::stringstream msg;
+      msg << "Awk expected from data send, received something else. Node:" << getNodeID() << "\n";
+      _server_log.writeLog(msg.str().c_str());
+   }
+
+   std::vector<uint8_t> sid = getMultipleCmdData(reply, c_sid, c_endsid);
+   if (sid.size() > 0) {
+      std::string node(sid.begin(), sid.end());
+      setNodeID(node.c_str());
+   }
+
+   // What the server agreed to, for our next connection to it
+   _peer_caps = readCaps(reply) & getLocalCaps();
+   if (_hs_cache != NULL)
+      _hs_cache->setPeerCaps(getNodeID(), _peer_caps);
+
+   std::vector<uint8_t> timcmd = getMultipleCmdData(reply, c_tim, c_endtim);
+   if ((_skew != NULL) && (timcmd.size() > 0))
+      addSkewSample(timcmd, t4);
+
+   recordHandshake();
+
+   if (_verbosity >= 3)
+      std::cout << "Data ack received from " << getNodeID() << ". Disconnecting.\n";
+
+   disconnect();
+}
+
+/**********************************************************************************************
+ * deriveKey - fills key (sized for its use) from the shared key by HKDF, with the client's
+ *             nonce as salt and the label as context
+ **********************************************************************************************/
+
+void TCPConn::deriveKey(SecByteBlock &key, const char *label) {
+   HKDF<SHA256> hkdf;
+   hkdf.DeriveKey(key, key.size(), _aes_key, _aes_key.size(), _nonce.data(), _nonce.size(),
+                                                   (const byte *) label, strlen(label));
+}
+
+/**********************************************************************************************
+ * recvAck - got the ACK that data was received, so disconnects
+ *
+ *    Params:  buf - the server's <ACK>
+ *
+ *    Throws: socket_error for network issues, runtime_error for unrecoverable issues
+ **********************************************************************************************/
+
+void TCPConn::recvAck(std::vector<uint8_t> &buf) {
+
+   if (findCmd(buf, c_ack) == buf.end())
+   {
+      std::stringstream msg;
+      msg << "Awk expected from data send, received something else. Node:" << getNodeID() << "\n";
+      _server_log.writeLog(msg.str().c_str());
+   }
+
+   if (_verbosity >= 3)
+      std::cout << "Data ack received from " << getNodeID() << ". Disconnecting.\n";
+
+
+   disconnect();
+}
+
+/**********************************************************************************************
+ * getData - Reads everything that has arrived on the socket, stopping at a short read or once
+ *           the (nonblocking) socket has no more. Never waits
  *
- *    Returns: true if the data is ready to be read, false if they lost connection
+ *    Params: buf - receives the data, empty if there was none
+ *
+ *    Returns: true if the connection is still up, false if they lost connection
  *
  *    Throws: runtime_error for unrecoverable issues
  **********************************************************************************************/
@@ -537,16 +1193,18 @@ void TCPConn::awaitAck() {
 bool TCPConn::getData(std::vector<uint8_t> &buf) {
 
    std::vector<uint8_t> readbuf;
-   size_t count = 0;
 
    buf.clear();
 
-   while (_connfd.hasData()) {
-      // read the data on the socket up to 1024
-      count += _connfd.readBytes<uint8_t>(readbuf, 1024);
+   while (true) {
+      int count = _connfd.readBytes<uint8_t>(readbuf, read_chunk);
+      if ((count < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+         return true;
+      if ((count < 0) && (errno == EINTR))
+         continue;
 
       // check if we lost connection
-      if (readbuf.size() == 0) {
+      if (count <= 0) {
          std::stringstream msg;
          std::string ip_addr;
          msg << "Connection from server " << _node_id << " lost (IP: " << 
@@ -557,13 +1215,70 @@ bool TCPConn::getData(std::vector<uint8_t> &buf) {
       }
 
       buf.insert(buf.end(), readbuf.begin(), readbuf.end());
-
-      // concat the data onto anything we've read before
-//      _inputbuf.insert(_inputbuf.end(), readbuf.begin(), readbuf.end());
+      if (count < (int) read_chunk)
+         return true;
    }
+}
+
+/**********************************************************************************************
+ * getTaggedData - Reads whatever is on the socket into the connection's receive buffer and, once
+ *                 the given end command has arrived, returns everything up to and including it.
+ *                 Messages split across several reads are held until they are complete, and
+ *                 anything after the end command is kept for the next call.
+ *
+ *    Params: buf - receives the complete message
+ *            endcmd - the command that ends the message we are waiting for
+ *
+ *    Returns: true if a complete message was placed in buf, false otherwise
+ *
+ *    Throws: runtime_error for unrecoverable issues
+ **********************************************************************************************/
+
+bool TCPConn::getTaggedData(std::vector<uint8_t> &buf, std::vector<uint8_t> &endcmd) {
+   std::vector<uint8_t> readbuf;
+
+   if (!getData(readbuf))
+      return false;
+   _recvbuf.insert(_recvbuf.end(), readbuf.begin(), readbuf.end());
+
+   auto end = findCmd(_recvbuf, endcmd);
+   if (end == _recvbuf.end())
+      return false;
+
+   end += endcmd.size();
+   buf.assign(_recvbuf.begin(), end);
+   _recvbuf.erase(_recvbuf.begin(), end);
    return true;
 }
 
+/**********************************************************************************************
+ * getSizedData - like getTaggedData, but for a message that is simply the next len bytes
+ *
+ *    Returns: true if len bytes were placed in buf, false otherwise
+ **********************************************************************************************/
+
+bool TCPConn::getSizedData(std::vector<uint8_t> &buf, size_t len) {
+   std::vector<uint8_t> readbuf;
+
+   if (!getData(readbuf))
+      return false;
+   _recvbuf.insert(_recvbuf.end(), readbuf.begin(), readbuf.end());
+
+   if (_recvbuf.size() < len)
+      return false;
+
+   buf.assign(_recvbuf.begin(), _recvbuf.begin() + len);
+   _recvbuf.erase(_recvbuf.begin(), _recvbuf.begin() + len);
+   return true;
+}
+
+// The message a protocol step awaits - ending with endcmd, or len bytes if there is none
+bool TCPConn::getMsg(std::vector<uint8_t> &buf, std::vector<uint8_t> *endcmd, size_t len) {
+   if (endcmd != NULL)
+      return getTaggedData(buf, *endcmd);
+   return getSizedData(buf, len);
+}
+
 /**********************************************************************************************
  * decryptData - Takes in an encrypted buffer in the form IV/Data and decrypts it, replacing
  *               buf with the decrypted info (destroys IV string>
@@ -572,6 +1287,12 @@ bool TCPConn::getData(std::vector<uint8_t> &buf) {
  *
  **********************************************************************************************/
 void TCPConn::decryptData(std::vector<uint8_t> &buf) {
+   decryptData(buf, _aes_key);
+}
+
+void TCPConn::decryptData(std::vector<uint8_t> &buf, const SecByteBlock &key) {
+   simtime_t start = SimClock::monoNow();
+
    // For the initialization vector
    SecByteBlock init_vector(iv_size);
 
@@ -581,7 +1302,7 @@ void TCPConn::decryptData(std::vector<uint8_t> &buf) {
 
    // Decrypt the data
    CFB_Mode<AES>::Decryption decryptor;
-   decryptor.SetKeyWithIV(_aes_key, _aes_key.size(), init_vector);
+   decryptor.SetKeyWithIV(key, key.size(), init_vector);
 
    std::string recovered;
    ArraySource as(buf.data(), buf.size(), true,
@@ -589,6 +1310,8 @@ void TCPConn::decryptData(std::vector<uint8_t> &buf) {
 
    buf.assign(recovered.begin(), recovered.end());
 
+   if (_metrics != NULL)
+      _metrics->decrypt_time.record(SimClock::monoNow() - start);
 }
 
 
@@ -721,23 +1444,51 @@ void TCPConn::connect(const char *ip_addr, unsigned short port) {
 
    // Set the status to connecting
    _status = s_connecting;
+   _retry_due = false;
+   resetHandshake();
 
    // Try to connect
    if (!_connfd.connectTo(ip_addr, port))
       throw socket_error("TCP Connection failed!");
 
+   _connfd.setNonBlocking();
    _connected = true;
+   startProto(runClient());
+   armTimer(handshake_timeout);
 }
 
 // Same as above, but ip_addr and port are in network (big endian) format
 void TCPConn::connect(unsigned long ip_addr, unsigned short port) {
    // Set the status to connecting
    _status = s_connecting;
+   _retry_due = false;
+   resetHandshake();
 
    if (!_connfd.connectTo(ip_addr, port))
       throw socket_error("TCP Connection failed!");
 
+   _connfd.setNonBlocking();
    _connected = true;
+   startProto(runClient());
+   armTimer(handshake_timeout);
+}
+
+/**********************************************************************************************
+ * resetHandshake - forgets what an earlier attempt on this connection left behind (partial
+ *                  input, our challenge, nonce, tags and negotiated caps), so a retry starts
+ *                  clean
+ *
+ **********************************************************************************************/
+
+void TCPConn::resetHandshake() {
+   _handshake_start = SimClock::monoNow();
+   _recvbuf.clear();
+   _authstr.clear();
+   _nonce.clear();
+   _hello_tag.clear();
+   _hello_sent = 0;
+   _skew_t1 = 0;
+   _peer_caps = 0;
 }
 
 /**********************************************************************************************
@@ -750,10 +1501,8 @@ void TCPConn::connect(unsigned long ip_addr, unsigned short port) {
 
 void TCPConn::assignOutgoingData(std::vector<uint8_t> &data) {
 
-   _outputbuf.clear();
-   _outputbuf = c_rep;
-   _outputbuf.insert(_outputbuf.end(), data.begin(), data.end());
-   _outputbuf.insert(_outputbuf.end(), c_endrep.begin(), c_endrep.end());
+   // Kept unwrapped--it is encoded for the peer once the handshake has negotiated caps
+   _outputbuf = data;
 }
  
 
@@ -765,6 +1514,75 @@ void TCPConn::assignOutgoingData(std::vector<uint8_t> &data) {
 void TCPConn::disconnect() {
    _connfd.closeFD();
    _connected = false;
+   _sendbuf.clear();
+   _send_pos = 0;
+
+   if (_timers != NULL)
+      _timers->cancel(_timer);
+}
+
+/**********************************************************************************************
+ * retryLater - drops the socket and goes back to connecting, with the retry held off for
+ *              reconnect_delay so a down peer is not hammered
+ *
+ **********************************************************************************************/
+void TCPConn::retryLater() {
+   disconnect();
+   _status = s_connecting;
+
+   _retry_due = (_timers == NULL);
+   armTimer(reconnect_delay);
+}
+
+void TCPConn::armTimer(simtime_t delay) {
+   if (_timers != NULL)
+      _timers->arm(_timer, SimClock::monoNow() + delay);
+}
+
+/**********************************************************************************************
+ * handleTimeout - the connection's timer fired. Depending on the state that means a retry is
+ *                 due, or the other end went quiet mid-handshake or before ACKing our data.
+ *                 A send that timed out is tried again up to max_attempts before the data is
+ *                 dropped (the next sync will offer it again); an incoming connection that
+ *                 stalls is simply closed. Either way handleConnections tidies up
+ *
+ **********************************************************************************************/
+void TCPConn::handleTimeout() {
+   if ((_status == s_connecting) && !_connected) {
+      _retry_due = true;
+      return;
+   }
+
+   // Past s_hasdata only the ACK can still be going out, which the timer bounds too
+   if ((_status == s_none) || ((_status == s_hasdata) && !_connected))
+      return;
+
+   bool sending = (_status == s_connecting) || (_status == s_clientauth1) ||
+                  (_status == s_clientauth2) || (_status == s_datatx) || (_status == s_waitack);
+
+   if (_metrics != NULL) {
+      if (_status == s_waitack)
+         _metrics->ack_timeouts++;
+      else
+         _metrics->handshake_timeouts++;
+   }
+
+   std::stringstream msg;
+   msg << "Connection with node '" << getNodeID() << "' timed out in state " <<
+                                                      getStatusName(_status) << ".";
+
+   if (sending && (++_attempts < max_attempts)) {
+      msg << " Retrying.";
+      retryLater();
+   } else {
+      disconnect();
+      if (sending)
+         _status = s_none;
+   }
+
+   if (_verbosity >= 2)
+      std::cout << msg.str() << "\n";
+   _server_log.writeLog(msg.str().c_str());
 }
 
 
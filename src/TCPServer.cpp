@@ -4,12 +4,14 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <cerrno>
 #include <stdexcept>
 #include <strings.h>
 #include <vector>
 #include <iostream>
 #include <memory>
 #include <sstream>
+#include <algorithm>
 #include <crypto++/secblock.h>
 #include <crypto++/osrng.h>
 #include <crypto++/files.h>
@@ -17,7 +19,8 @@
 #include "ALMgr.h"
 
 TCPServer::TCPServer(unsigned int verbosity)
-                        :_aes_key(CryptoPP::AES::DEFAULT_KEYLENGTH), 
+                        :_timers(SimClock::monoNow()),
+                         _aes_key(CryptoPP::AES::DEFAULT_KEYLENGTH), 
                          _server_log("server.log", 0),
                          _verbosity(verbosity)
 {
@@ -55,7 +58,17 @@ void TCPServer::bindSvr(const char *ip_addr, short unsigned int port) {
 
 // Simple function that simply starts the server listening
 void TCPServer::listenSvr() {
-   _sockfd.listenFD(5);
+   if (_use_ring) {
+      try {
+         _ring.reset(new IOUring());
+         _sockfd.setRing(_ring.get());
+      } catch (std::runtime_error &e) {
+         std::string msg = std::string(e.what()) + ". Using poll instead.";
+         _server_log.writeLog(msg);
+      }
+   }
+
+   _sockfd.listenFD(_backlog);
 
    std::string ipaddr_str;
    std::stringstream msg;
@@ -82,8 +95,11 @@ void TCPServer::runServer() {
    listenSvr();
 
    while (online) {
+      // No poll here, so look at the socket and every connection each time around
+      _accept_ready = true;
       handleSocket();
 
+      _conns.markAllActive();
       handleConnections();
 
       // So we're not chewing up CPU cycles unnecessarily
@@ -95,28 +111,50 @@ void TCPServer::runServer() {
 }
 
 /**********************************************************************************************
- * handleSocket - Checks the socket for incoming connections and validates against the whitelist.
- *                Accepts valid connections and adds them to the connection list.
+ * handleSocket - Accepts the connections waiting on the socket until it runs dry (or hits
+ *                max_accepts_per_pass), so a burst of peers reconnecting at once is taken in
+ *                one pass rather than one per loop. Validates each against the whitelist and
+ *                adds it to the connection list.
  *
- *    Returns: pointer to a new connection if one was found, otherwise NULL
+ *    Returns: number of connections accepted (including any then dropped by the whitelist)
  *
  *    Throws: socket_error for recoverable errors, runtime_error for unrecoverable types
  **********************************************************************************************/
 
-TCPConn *TCPServer::handleSocket() {
-  
-   // The socket has data, means a new connection 
-   if (_sockfd.hasData()) {
+unsigned int TCPServer::handleSocket() {
+   if (!_accept_ready)
+      return 0;
+
+   unsigned int count = 0;
+   while (count < max_accepts_per_pass) {
 
       // Try to accept the connection
       TCPConn *new_conn = new TCPConn(_server_log, _aes_key, _verbosity);
+      new_conn->setTimers(&_timers);
+      new_conn->setRing(_ring.get());
       if (!new_conn->accept(_sockfd)) {
+         int err = errno;
+         delete new_conn;
+
+         // Nothing more waiting--poll will tell us when there is
+         if ((err == EAGAIN) || (err == EWOULDBLOCK)) {
+            _accept_ready = false;
+            break;
+         }
+
+         // The peer gave up before we got to it
+         if ((err == ECONNABORTED) || (err == EINTR))
+            continue;
+
+         errno = err;
          _server_log.strerrLog("Data received on socket but failed to accept.");
-         return NULL;
+         break;
       }
+      count++;
       std::cout << "***Got a connection***\n";
 
-      _connlist.push_back(std::unique_ptr<TCPConn>(new_conn));
+      initConn(new_conn);
+      addConn(new_conn);
 
       // Get their IP Address string to use in logging
       std::string ipaddr_str;
@@ -136,89 +174,229 @@ TCPConn *TCPServer::handleSocket() {
          msg += "' not on whitelist. Disconnecting.";
          _server_log.writeLog(msg);
 
-         return NULL;
+         continue;
       }
 
       std::string msg = "Connection from IP address '";
       msg += ipaddr_str;
       msg += "'.";
       _server_log.writeLog(msg);
-
-      // Send an authentication string in cleartext
-            
-
-      return new_conn;
    }
-   return NULL;
+   return count;
 }
 
 /**********************************************************************************************
- * handleConnections - Loops through the list of clients, running their functions to handle the
- *                     clients input/output.
+ * addConn - puts a new connection in the table and has its timers mark it active when they fire
  *
- *    Returns: number of new connections accepted
+ *    Returns: the connection's handle
+ **********************************************************************************************/
+
+conn_handle TCPServer::addConn(TCPConn *conn) {
+   conn_handle handle = _conns.insert(conn);
+   conn->setWakeup([this, handle]() { _conns.markActive(handle); });
+   return handle;
+}
+
+/**********************************************************************************************
+ * handleConnections - Loops through the active connections, running their functions to handle
+ *                     the clients input/output. Any that made progress or still have work to
+ *                     do without input stay active for the next pass.
  *
  *    Throws: socket_error for recoverable errors, runtime_error for unrecoverable types
  **********************************************************************************************/
 
 void TCPServer::handleConnections() {
+   // Pick up input the ring has for us since the poll
+   reapRing();
+
+   // Fire any reconnect or timeout that has come due, so this pass acts on it
+   _timers.advance(SimClock::monoNow());
+
+   std::vector<conn_handle> active;
+   _conns.takeActive(active);
+
    // Loop through our connections, handling them
-   std::list<std::unique_ptr<TCPConn>>::iterator tptr = _connlist.begin();
-   while (tptr != _connlist.end())
-   {
+   for (conn_handle handle : active) {
+      TCPConn *conn = _conns.get(handle);
+      if (conn == NULL)
+         continue;
+
       // If the client is not connected, then either reconnect or drop 
-      if ((!(*tptr)->isConnected()) || ((*tptr)->getStatus() == TCPConn::s_none)) {
+      if ((!conn->isConnected()) || (conn->getStatus() == TCPConn::s_none)) {
          // Might be trying to connect
-         if ((*tptr)->getStatus() == TCPConn::s_connecting) {
+         if (conn->getStatus() == TCPConn::s_connecting) {
 
-            // If our retry timer hasn't expired....skip
-            if ((*tptr)->reconnect > time(NULL)) {
-               tptr++;
+            // If our retry timer hasn't expired....skip (it wakes us when it does)
+            if (!conn->isRetryDue())
                continue;
-            }
 
-            unsigned long ip_addr = (*tptr)->getIPAddr();
-            unsigned short port = (*tptr)->getPort();
+            // connect wants both in network format, getPort gives host format
+            unsigned long ip_addr = conn->getIPAddr();
+            unsigned short port = htons(conn->getPort());
+            if (_metrics != NULL)
+               _metrics->reconnects++;
             
             // Try to connect and handle failure
             try {
-               (*tptr)->connect(ip_addr, port);
+               conn->connect(ip_addr, port);
+               _conns.indexFD(handle);
             } catch (socket_error &e) {
+               if (_metrics != NULL)
+                  _metrics->connect_failures++;
                std::stringstream msg;
-               msg << "Connect to SID " << (*tptr)->getNodeID() << 
+               msg << "Connect to SID " << conn->getNodeID() << 
                         " failed when trying to send data. Msg: " << e.what();
                if (_verbosity >= 2)
                   std::cout << msg.str() << "\n";
                _server_log.writeLog(msg.str().c_str());
-               (*tptr)->disconnect();
-               (*tptr)->reconnect = time(NULL) + reconnect_delay;
-               tptr++;
+               conn->retryLater();
                continue;
             }
          // Else we're in a different state and there's not data waiting to be read
-         } else if (!(*tptr)->isInputDataReady()) {
+         } else if (!conn->isInputDataReady()) {
          // Log it
             std::string msg = "Node ID '";
-            msg += (*tptr)->getNodeID();
+            msg += conn->getNodeID();
             msg += "' lost connection.";
             _server_log.writeLog(msg);
 
             // Remove them from the connect list
-            tptr = _connlist.erase(tptr);
+            _conns.erase(handle);
             std::cout << "Connection disconnected.\n";
             continue;
          }
-         tptr++;
+      } else {
+         // Process any user inputs
+         conn->handleConnection();
+      }
+
+      // Anything already buffered was handled before the protocol suspended, so only a
+      // connection with work to do that needs no input stays active
+      if (!isIdle(conn))
+         _conns.markActive(handle);
+   }
+
+   if (_metrics != NULL)
+      _metrics->connections = _conns.size();
+}
+
+/**********************************************************************************************
+ * handleEvents - after a poll over the fds from addPollFDs (plus any others), marks each
+ *                connection whose socket has input, room for a queued send, hung up or errored
+ *                as active
+ *
+ **********************************************************************************************/
+
+void TCPServer::handleEvents(const std::vector<struct pollfd> &fds) {
+   for (auto &pfd : fds) {
+      if (pfd.revents == 0)
          continue;
-      } 
 
-      // Process any user inputs
-      (*tptr)->handleConnection();
+      if (_ring && (pfd.fd == _ring->getFD())) {
+         reapRing();
+         continue;
+      }
+
+      if (pfd.fd == _sockfd.getFD()) {
+         _accept_ready = true;
+         continue;
+      }
+
+      conn_handle handle = _conns.findFD(pfd.fd);
+      if (handle != no_conn)
+         _conns.markActive(handle);
+   }
+}
+
+void TCPServer::reapRing() {
+   if (!_ring)
+      return;
+
+   _ring->reap();
+   _ring->takeReady(_ring_ready);
+   for (int fd : _ring_ready) {
+      if (fd == _sockfd.getFD()) {
+         _accept_ready = true;
+         continue;
+      }
+
+      conn_handle handle = _conns.findFD(fd);
+      if (handle != no_conn)
+         _conns.markActive(handle);
+   }
+}
+
+bool TCPServer::isIdle(TCPConn *conn) {
+   if (conn->isWaitingForInput())
+      return true;
+
+   return !conn->isConnected() && (conn->getStatus() == TCPConn::s_connecting) &&
+                                                                     !conn->isRetryDue();
+}
 
-      // Increment our iterator
-      tptr++;
+/**********************************************************************************************
+ * addPollFDs - Lets the owner's event loop sleep until something here can make progress. On a
+ *              ring this is where everything the pass queued is submitted
+ *
+ *    Params:  fds - the listening socket and connections waiting on their sockets are appended
+ *                   (POLLIN, and POLLOUT for queued sends), or just the ring
+ *             max_wait - the longest the caller would wait anyway
+ *
+ *    Returns: real nanoseconds until the next connection timer is due, 0 if a connection is
+ *             active already
+ **********************************************************************************************/
+
+simtime_t TCPServer::addPollFDs(std::vector<struct pollfd> &fds, simtime_t max_wait) {
+   if (_ring) {
+      if ((_ring->submit() < 0) && (errno != EINTR) && (errno != EAGAIN) && (errno != EBUSY))
+         _server_log.strerrLog("Submitting to the io_uring failed");
+      fds.push_back({_ring->getFD(), POLLIN, 0});
+   } else {
+      fds.push_back({_sockfd.getFD(), POLLIN, 0});
+
+      for (size_t i=0; i<_conns.size(); i++) {
+         TCPConn *conn = _conns.at(i);
+         if (conn->isWaitingForInput())
+            fds.push_back({conn->getFD(), conn->getPollEvents(), 0});
+      }
    }
 
+   if (_conns.hasActive())
+      return 0;
+   return _timers.getWait(SimClock::monoNow(), max_wait);
+}
+
+unsigned int TCPServer::getNumSending() {
+   unsigned int count = 0;
+   for (size_t i=0; i<_conns.size(); i++) {
+      TCPConn *conn = _conns.at(i);
+      if (!conn->isConnected())
+         continue;
+
+      switch (conn->getStatus()) {
+         case TCPConn::s_connecting:
+         case TCPConn::s_clientauth1:
+         case TCPConn::s_clientauth2:
+         case TCPConn::s_datatx:
+         case TCPConn::s_waitack:
+            count++;
+            break;
+
+         default:
+            break;
+      }
+   }
+   return count;
+}
+
+/*********************************************************************************************
+ * getConnStates - lists the node ID (empty until the peer identifies itself) and status of
+ *                 each connection
+ *********************************************************************************************/
+void TCPServer::getConnStates(std::vector<std::pair<std::string, TCPConn::statustype>> &states) {
+   states.clear();
+   for (size_t i=0; i<_conns.size(); i++)
+      states.emplace_back(_conns.at(i)->getNodeID(), _conns.at(i)->getStatus());
 }
 
 /*********************************************************************************************
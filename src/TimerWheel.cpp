@@ -0,0 +1,173 @@
+#include <algorithm>
+#include "TimerWheel.h"
+
+TimerWheel::Timer::~Timer() {
+   if (_wheel != NULL)
+      _wheel->cancel(*this);
+}
+
+TimerWheel::TimerWheel(simtime_t start, simtime_t tick):
+                                 _tick(tick),
+                                 _now_tick(start / tick),
+                                 _count(0)
+{
+}
+
+// Anything still armed is just forgotten, so its destructor has nothing to unhook from
+TimerWheel::~TimerWheel() {
+   for (unsigned int l=0; l<wheel_levels; l++) {
+      for (unsigned int s=0; s<wheel_slots; s++) {
+         link *head = &_slots[l][s];
+         while (head->next != head) {
+            Timer *timer = static_cast<Timer *>(head->next);
+            unlink(*timer);
+         }
+      }
+   }
+}
+
+/*****************************************************************************************
+ * arm - (re)schedules a timer. Times already past fire on the next tick
+ *****************************************************************************************/
+void TimerWheel::arm(Timer &timer, simtime_t expires) {
+   if (timer._wheel != NULL)
+      timer._wheel->cancel(timer);
+
+   timer._expires = expires;
+   timer._wheel = this;
+   _count++;
+   insert(timer, _now_tick + 1);
+}
+
+void TimerWheel::cancel(Timer &timer) {
+   if (timer._wheel != this)
+      return;
+
+   unlink(timer);
+}
+
+/*****************************************************************************************
+ * insert - places an armed timer in the slot for its expiry tick. The level is picked by
+ *          how far away that tick is, so the slot index at each level is just the tick's
+ *          bits for that level. Nothing goes in before earliest, the first tick not yet run
+ *****************************************************************************************/
+void TimerWheel::insert(Timer &timer, uint64_t earliest) {
+   uint64_t when = (timer._expires + _tick - 1) / _tick;
+   when = std::max(when, earliest);
+
+   uint64_t delta = when - _now_tick;
+   unsigned int level = 0;
+   while ((level < wheel_levels - 1) && (delta >= (uint64_t(1) << (wheel_bits * (level + 1)))))
+      level++;
+
+   // Past the top of the wheel--park it in the furthest slot, it gets re-placed on cascade
+   if (delta >= (uint64_t(1) << (wheel_bits * wheel_levels)))
+      when = _now_tick + (uint64_t(1) << (wheel_bits * wheel_levels)) - 1;
+
+   link *head = &_slots[level][(when >> (wheel_bits * level)) & (wheel_slots - 1)];
+   timer.prev = head->prev;
+   timer.next = head;
+   head->prev->next = &timer;
+   head->prev = &timer;
+}
+
+void TimerWheel::unlink(Timer &timer) {
+   timer.prev->next = timer.next;
+   timer.next->prev = timer.prev;
+   timer.prev = timer.next = &timer;
+   timer._wheel = NULL;
+   _count--;
+}
+
+/*****************************************************************************************
+ * cascade - the wheel reached this level's current slot, so re-place its timers, which now
+ *           all fall within the span of the level below. Called before the current tick's
+ *           level 0 slot is run, so timers due right now still make it in
+ *****************************************************************************************/
+void TimerWheel::cascade(unsigned int level) {
+   link *head = &_slots[level][(_now_tick >> (wheel_bits * level)) & (wheel_slots - 1)];
+
+   link pending;
+   if (head->next == head)
+      return;
+
+   // Move the whole slot aside first, since re-placing could land back in this slot
+   pending.next = head->next;
+   pending.prev = head->prev;
+   pending.next->prev = &pending;
+   pending.prev->next = &pending;
+   head->next = head->prev = head;
+
+   while (pending.next != &pending) {
+      Timer *timer = static_cast<Timer *>(pending.next);
+      pending.next = timer->next;
+      timer->next->prev = &pending;
+      insert(*timer, _now_tick);
+   }
+}
+
+/*****************************************************************************************
+ * advance - runs the wheel tick by tick up to now. With nothing armed it simply jumps, so
+ *           an idle wheel costs nothing no matter how long it was left alone
+ *****************************************************************************************/
+void TimerWheel::advance(simtime_t now) {
+   uint64_t target = now / _tick;
+
+   while (_now_tick < target) {
+      if (_count == 0) {
+         _now_tick = target;
+         return;
+      }
+
+      _now_tick++;
+
+      // Crossing a level's boundary pulls down the next slot above, and so on up the levels
+      for (unsigned int level = 1; level < wheel_levels; level++) {
+         if ((_now_tick & ((uint64_t(1) << (wheel_bits * level)) - 1)) != 0)
+            break;
+         cascade(level);
+      }
+
+      // Everything left in this level 0 slot is due. Take them off one at a time, since a
+      // callback may cancel or re-arm a timer that has not run yet
+      link *head = &_slots[0][_now_tick & (wheel_slots - 1)];
+      link due;
+      if (head->next == head)
+         continue;
+
+      due.next = head->next;
+      due.prev = head->prev;
+      due.next->prev = &due;
+      due.prev->next = &due;
+      head->next = head->prev = head;
+
+      while (due.next != &due) {
+         Timer *timer = static_cast<Timer *>(due.next);
+         unlink(*timer);
+         if (timer->_callback)
+            timer->_callback();
+      }
+   }
+}
+
+/*****************************************************************************************
+ * getWait - finds the next level 0 slot with timers in it. Timers in higher levels cannot
+ *           come due before the next level boundary, so the search never looks further
+ *           than one trip around level 0
+ *
+ *    Returns: nanoseconds from now, 0 if advance is already behind
+ *****************************************************************************************/
+simtime_t TimerWheel::getWait(simtime_t now, simtime_t max_wait) {
+   if (_count == 0)
+      return max_wait;
+
+   if (_now_tick < uint64_t(now / _tick))
+      return 0;
+
+   for (uint64_t t = _now_tick + 1; t <= _now_tick + wheel_slots; t++) {
+      link *head = &_slots[0][t & (wheel_slots - 1)];
+      if ((head->next != head) || ((t & (wheel_slots - 1)) == 0))
+         return std::min(max_wait, std::max(simtime_t(0), simtime_t(t) * _tick - now));
+   }
+   return max_wait;
+}
@@ -8,14 +8,20 @@
 
 #include <stdexcept>
 #include <iostream>
+#include <cstring>
 #include "FileDesc.h"
 #include "DronePlotDB.h"
+#include "PlotArchive.h"
 #include "strfuncts.h"
 
 using namespace std; 
 
 void displayHelp(const char *execname) {
-   std::cout << execname << " <input file> <output file> <NodeID>\n";
+   std::cout << execname << " <input file> <output file> <NodeID> [<start secs> <end secs>]\n";
+   std::cout << "   The input can be a CSV file or a plot archive (.pda). Archives only decode\n";
+   std::cout << "   the blocks holding NodeID plots in the [start, end) time window.\n";
+   std::cout << "   An output file ending in .pda is written as a compressed plot archive,\n";
+   std::cout << "   anything else in the raw .bin format\n";
 //   std::cout << "   t: maximum number of threads to use\n";
 //   std::cout << "   n: calculate primes up to the given range\n";
 //   std::cout << "   s: only run in single process mode\n";
@@ -38,21 +44,44 @@ int main(int argc, char *argv[]) {
    
    unsigned long node_id = strtol(argv[3], NULL, 10);
 
-   std::cout << "Filtering to only node: " << node_id << "\n";
+   // Optional time window
+   simtime_t start_time = simtime_min, end_time = simtime_max;
+   if (argc >= 6) {
+      if (!parseSimTime(argv[4], argv[4] + strlen(argv[4]), start_time) ||
+                                 !parseSimTime(argv[5], argv[5] + strlen(argv[5]), end_time)) {
+         std::cerr << "Invalid time window.\n";
+         exit(-1);
+      }
+   }
 
-   std::cout << "Reading in the CSV file.";
+   std::cout << "Filtering to only node: " << node_id << "\n";
 
    DronePlotDB db;
    int count = 0;
-   if ((count = db.loadCSVFile(input_file.c_str())) < 0) {
-      std::cerr << "Either failed opening file for reading or file was corrupted.\n";
-      exit(-1);
+   if (PlotArchive::isArchive(input_file.c_str())) {
+      std::cout << "Reading in the plot archive.";
+
+      std::set<unsigned int> nodes = { (unsigned int) node_id };
+      count = db.loadArchiveFile(input_file.c_str(), start_time, end_time, nodes);
+   } else {
+      std::cout << "Reading in the CSV file.";
+
+      count = db.loadCSVFile(input_file.c_str());
+
+      // Filter by NodeID and time
+      auto dpit = db.begin();
+      while (dpit != db.end()) {
+         if ((dpit->node_id != node_id) || (dpit->timestamp < start_time) ||
+                                           (dpit->timestamp >= end_time))
+            dpit = db.erase(dpit);
+         else
+            dpit++;
+      }
    }
 
-   // Filter by NodeID
-   for (unsigned int i=1; i<=3; i++) {
-      if (i != node_id)
-         db.removeNodeID(i);
+   if (count < 0) {
+      std::cerr << "Either failed opening file for reading or file was corrupted.\n";
+      exit(-1);
    }
 
    if (count == 0) {
@@ -63,8 +92,14 @@ int main(int argc, char *argv[]) {
    std::cout << "Read in " << count << " drone data points successfully.\n";
    std::cout << "Size: " << db.size() << "\n";
 
+   // Pick the output format from the extension
+   bool archive = (output_file.size() > 4) &&
+                  (output_file.compare(output_file.size() - 4, 4, ".pda") == 0);
+
    std::cout << "Writing to: " << output_file.c_str() << "\n";
-   if (db.writeBinaryFile(output_file.c_str()) < 0) {
+   int results = archive ? db.writeArchiveFile(output_file.c_str()) :
+                           db.writeBinaryFile(output_file.c_str());
+   if (results < 0) {
       std::cerr << "Unable to open output file for writing.\n";
       exit(-1);
    }
@@ -73,7 +108,10 @@ int main(int argc, char *argv[]) {
    db.clear();
 
    // Test the functions
-   db.loadBinaryFile(output_file.c_str());
+   if (archive)
+      db.loadArchiveFile(output_file.c_str());
+   else
+      db.loadBinaryFile(output_file.c_str());
 
    std::cout << "Num: " << db.size() << "\n";
    db.writeCSVFile("diditwork.csv");
@@ -0,0 +1,625 @@
+/****************************************************************************************
+ * microbench_main - Microbenchmarks for the hot paths: plot serialization, database
+ *                   inserts under contention, sorting, file loading, the connection crypto
+ *                   and tag parsing, the replication payload codec and connection timers.
+ *                   Each benchmark runs once per parameter (batch, database, buffer or
+ *                   timer count, or thread count),
+ *                   repeating until it has run for at least the minimum time, and reports
+ *                   ns per iteration and items or bytes per second.
+ *
+ *                   Compare output from before and after a change on the same machine--the
+ *                   absolute numbers mean little on their own.
+ *
+ ****************************************************************************************/
+
+#include <stdexcept>
+#include <iostream>
+#include <sstream>
+#include <fstream>
+#include <memory>
+#include <iomanip>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <getopt.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <string.h>
+#include <crypto++/secblock.h>
+#include "DronePlotDB.h"
+#include "TCPConn.h"
+#include "ReplServer.h"
+#include "LZ4Block.h"
+#include "SimClock.h"
+#include "TimerWheel.h"
+
+using namespace std;
+
+/*****************************************************************************************
+ * bench_state - passed to each benchmark. It should do its work iterations times, and can
+ *               stop the timer around per-iteration setup it does not want measured
+ *****************************************************************************************/
+struct bench_state {
+    unsigned long iterations;
+    unsigned long param;
+    uint64_t items = 0;           // Items (plots, calls) processed in total, 0 if not relevant
+    uint64_t bytes = 0;           // Bytes processed in total, 0 if not relevant
+
+    simtime_t elapsed = 0;
+    simtime_t started = 0;
+
+    void pauseTiming() { elapsed += SimClock::monoNow() - started; };
+    void resumeTiming() { started = SimClock::monoNow(); };
+};
+
+typedef void (*bench_fn)(bench_state &state);
+
+struct bench_def {
+    const char *name;
+    bench_fn fn;
+    std::vector<unsigned long> params;
+};
+
+// Fixed seed so every run measures the same data
+std::mt19937 rng(689);
+
+/*****************************************************************************************
+ * makePlots - fills plots with count plots from a handful of drones, in time order
+ *****************************************************************************************/
+
+void makePlots(std::vector<DronePlot> &plots, unsigned long count) {
+    std::uniform_real_distribution<float> step(-0.0005f, 0.0005f);
+    plots.clear();
+    plots.reserve(count);
+
+    float lat = 39.78f, lon = -84.05f;
+    for (unsigned long i=0; i<count; i++) {
+        lat += step(rng);
+        lon += step(rng);
+        plots.emplace_back(i % 16 + 1, 1, (simtime_t) (i / 16 + 1) * simtime_per_sec, lat, lon);
+    }
+}
+
+void fillDB(DronePlotDB &db, unsigned long count) {
+    std::vector<DronePlot> plots;
+    makePlots(plots, count);
+    for (auto &plot : plots)
+        db.addPlot(plot.drone_id, plot.node_id, plot.timestamp, plot.latitude, plot.longitude);
+}
+
+/*****************************************************************************************
+ * DronePlot serialization - param is the batch size
+ *****************************************************************************************/
+
+void benchSerialize(bench_state &state) {
+    std::vector<DronePlot> plots;
+    makePlots(plots, state.param);
+
+    std::vector<uint8_t> buf;
+    for (unsigned long i=0; i<state.iterations; i++) {
+        buf.clear();
+        for (auto &plot : plots)
+            plot.serialize(buf);
+    }
+    state.items = state.iterations * state.param;
+    state.bytes = state.iterations * buf.size();
+}
+
+void benchDeserialize(bench_state &state) {
+    std::vector<DronePlot> plots;
+    makePlots(plots, state.param);
+
+    std::vector<uint8_t> buf;
+    for (auto &plot : plots)
+        plot.serialize(buf);
+
+    DronePlot plot;
+    for (unsigned long i=0; i<state.iterations; i++) {
+        for (unsigned int pos=0; pos<buf.size(); pos += DronePlot::getDataSize())
+            plot.deserialize(buf, pos);
+    }
+    state.items = state.iterations * state.param;
+    state.bytes = state.iterations * buf.size();
+}
+
+/*****************************************************************************************
+ * DronePlotDB::addPlot - param threads adding plots to one database at once
+ *****************************************************************************************/
+
+const unsigned int plots_per_thread = 1000;
+
+struct add_args {
+    DronePlotDB *db;
+    unsigned int drone_id;
+};
+
+void *t_addPlots(void *data) {
+    add_args *args = static_cast<add_args *>(data);
+    for (unsigned int i=0; i<plots_per_thread; i++)
+        args->db->addPlot(args->drone_id, 1, (simtime_t) i * simtime_per_sec, 39.78f, -84.05f);
+    return NULL;
+}
+
+void benchAddPlot(bench_state &state) {
+    DronePlotDB db;
+    std::vector<pthread_t> threads(state.param);
+    std::vector<add_args> args(state.param);
+
+    for (unsigned long i=0; i<state.iterations; i++) {
+        for (unsigned long t=0; t<state.param; t++) {
+            args[t].db = &db;
+            args[t].drone_id = t + 1;
+            if (pthread_create(&threads[t], NULL, t_addPlots, &args[t]) != 0)
+                throw std::runtime_error("Unable to create addPlot thread");
+        }
+        for (unsigned long t=0; t<state.param; t++)
+            pthread_join(threads[t], NULL);
+
+        state.pauseTiming();
+        db.clear();
+        state.resumeTiming();
+    }
+    state.items = state.iterations * state.param * plots_per_thread;
+}
+
+/*****************************************************************************************
+ * DronePlotDB::addPlots - param is the batch size, added with one call
+ *****************************************************************************************/
+
+void benchAddPlots(bench_state &state) {
+    std::vector<DronePlot> plots;
+    makePlots(plots, state.param);
+
+    DronePlotDB db;
+    for (unsigned long i=0; i<state.iterations; i++) {
+        db.addPlots(plots, DBFLAG_NEW);
+
+        state.pauseTiming();
+        db.clear();
+        state.resumeTiming();
+    }
+    state.items = state.iterations * state.param;
+}
+
+/*****************************************************************************************
+ * DronePlotDB::sortByTime - param is the database size, shuffled before each sort
+ *****************************************************************************************/
+
+void benchSortByTime(bench_state &state) {
+    std::vector<DronePlot> plots;
+    makePlots(plots, state.param);
+
+    DronePlotDB db;
+    for (unsigned long i=0; i<state.iterations; i++) {
+        state.pauseTiming();
+        db.clear();
+        std::shuffle(plots.begin(), plots.end(), rng);
+        for (auto &plot : plots)
+            db.addPlot(plot.drone_id, plot.node_id, plot.timestamp, plot.latitude, plot.longitude);
+        state.resumeTiming();
+
+        db.sortByTime();
+    }
+    state.items = state.iterations * state.param;
+}
+
+/*****************************************************************************************
+ * DronePlotDB file loads - param is the number of plots in the file
+ *****************************************************************************************/
+
+void benchLoadFile(bench_state &state, bool binary) {
+    char filename[] = "/tmp/microbench.XXXXXX";
+    int fd = mkstemp(filename);
+    if (fd < 0)
+        throw std::runtime_error("Unable to create a temp file");
+    close(fd);
+
+    DronePlotDB db;
+    fillDB(db, state.param);
+
+    // The binary writer reports its progress on stdout, which would break up the results
+    std::stringstream discard;
+    std::streambuf *cout_buf = std::cout.rdbuf(discard.rdbuf());
+    int written = binary ? db.writeBinaryFile(filename) : db.writeCSVFile(filename);
+    std::cout.rdbuf(cout_buf);
+    if (written < 0) {
+        unlink(filename);
+        throw std::runtime_error("Unable to write the temp file");
+    }
+
+    for (unsigned long i=0; i<state.iterations; i++) {
+        state.pauseTiming();
+        db.clear();
+        state.resumeTiming();
+
+        if ((binary ? db.loadBinaryFile(filename) : db.loadCSVFile(filename)) < 0) {
+            unlink(filename);
+            throw std::runtime_error("Unable to load the temp file");
+        }
+    }
+    unlink(filename);
+    state.items = state.iterations * state.param;
+}
+
+void benchLoadBinaryFile(bench_state &state) {
+    benchLoadFile(state, true);
+}
+
+void benchLoadCSVFile(bench_state &state) {
+    benchLoadFile(state, false);
+}
+
+/*****************************************************************************************
+ * TCPConn crypto and framing - param is the payload size in bytes. BenchConn opens up the
+ *                              protected tag parsing functions
+ *****************************************************************************************/
+
+class BenchConn : public TCPConn
+{
+public:
+    BenchConn(LogMgr &log, CryptoPP::SecByteBlock &key):TCPConn(log, key, 0) {};
+
+    using TCPConn::findCmd;
+    using TCPConn::getCmdData;
+    using TCPConn::wrapCmd;
+};
+
+CryptoPP::SecByteBlock bench_key(16);
+LogMgr bench_log("/dev/null", 0);
+
+void makePayload(std::vector<uint8_t> &buf, unsigned long size) {
+    std::uniform_int_distribution<int> byte(0, 255);
+    buf.resize(size);
+    for (auto &b : buf)
+        b = (uint8_t) byte(rng);
+}
+
+void benchEncrypt(bench_state &state) {
+    BenchConn conn(bench_log, bench_key);
+    std::vector<uint8_t> payload, buf;
+    makePayload(payload, state.param);
+
+    for (unsigned long i=0; i<state.iterations; i++) {
+        buf = payload;
+        conn.encryptData(buf);
+    }
+    state.bytes = state.iterations * state.param;
+}
+
+void benchDecrypt(bench_state &state) {
+    BenchConn conn(bench_log, bench_key);
+    std::vector<uint8_t> encrypted, buf;
+    makePayload(encrypted, state.param);
+    conn.encryptData(encrypted);
+
+    for (unsigned long i=0; i<state.iterations; i++) {
+        buf = encrypted;
+        conn.decryptData(buf);
+    }
+    state.bytes = state.iterations * state.param;
+}
+
+std::vector<uint8_t> c_startrep = {'<', 'R', 'E', 'P', '>'};
+std::vector<uint8_t> c_endrep = {'<', '/', 'R', 'E', 'P', '>'};
+
+void benchFindCmd(bench_state &state) {
+    BenchConn conn(bench_log, bench_key);
+    std::vector<uint8_t> buf;
+    makePayload(buf, state.param);
+    conn.wrapCmd(buf, c_startrep, c_endrep);
+
+    size_t found = 0;
+    for (unsigned long i=0; i<state.iterations; i++)
+        found += conn.findCmd(buf, c_endrep) - buf.begin();
+
+    if (found != state.iterations * (buf.size() - c_endrep.size()))
+        throw std::runtime_error("findCmd found the wrong tag");
+    state.bytes = state.iterations * buf.size();
+}
+
+void benchGetCmdData(bench_state &state) {
+    BenchConn conn(bench_log, bench_key);
+    std::vector<uint8_t> wrapped, buf;
+    makePayload(wrapped, state.param);
+    conn.wrapCmd(wrapped, c_startrep, c_endrep);
+
+    for (unsigned long i=0; i<state.iterations; i++) {
+        buf = wrapped;
+        if (!conn.getCmdData(buf, c_startrep, c_endrep))
+            throw std::runtime_error("getCmdData failed to find the tags");
+    }
+    state.bytes = state.iterations * wrapped.size();
+}
+
+/*****************************************************************************************
+ * Replication payload codec - param is the plots in the batch. Builds the same rm_plots
+ *                             batch ReplServer::queueNewPlots does
+ *****************************************************************************************/
+
+void makePlotMsg(std::vector<uint8_t> &msg, unsigned long count) {
+    const char *origin = "ds1";
+    uint64_t epoch = 1;
+    uint32_t seq = 1, num = count;
+
+    msg.clear();
+    msg.push_back(1);                  // rm_plots
+    msg.push_back((uint8_t) strlen(origin));
+    msg.insert(msg.end(), origin, origin + strlen(origin));
+    msg.insert(msg.end(), (uint8_t *) &epoch, (uint8_t *) &epoch + sizeof(epoch));
+    msg.insert(msg.end(), (uint8_t *) &seq, (uint8_t *) &seq + sizeof(seq));
+    msg.insert(msg.end(), (uint8_t *) &num, (uint8_t *) &num + sizeof(num));
+
+    std::vector<DronePlot> plots;
+    makePlots(plots, count);
+    for (auto &plot : plots)
+        plot.serialize(msg);
+}
+
+/*****************************************************************************************
+ * getCodec - a ReplServer to use as the codec. Its QueueMgr reads servers.txt and
+ *            sharedkey.bin from the working directory, so it is built in a scratch one
+ *****************************************************************************************/
+
+ReplServer &getCodec() {
+    static DronePlotDB db;
+    static SimClock clock(1.0);
+    static std::unique_ptr<ReplServer> codec;
+
+    if (codec)
+        return *codec;
+
+    char dirtemplate[] = "/tmp/microbench.XXXXXX";
+    char origdir[4096];
+    if ((mkdtemp(dirtemplate) == NULL) || (getcwd(origdir, sizeof(origdir)) == NULL) ||
+        (chdir(dirtemplate) != 0))
+        throw std::runtime_error("Unable to set up a working directory for the codec");
+    std::string workdir(dirtemplate);
+
+    {
+        std::ofstream servers("servers.txt");
+        servers << "ds1, 127.0.0.1, 9999\n";
+        std::ofstream key("sharedkey.bin", std::ios::binary);
+        for (unsigned int i=0; i<16; i++)
+            key.put((char) 0);
+    }
+    codec.reset(new ReplServer(db, clock));
+
+    unlink((workdir + "/servers.txt").c_str());
+    unlink((workdir + "/sharedkey.bin").c_str());
+    if ((chdir(origdir) != 0) || (rmdir(workdir.c_str()) != 0))
+        throw std::runtime_error("Unable to clean up the codec's working directory");
+    return *codec;
+}
+
+void benchCodec(bench_state &state, uint32_t caps, bool decode) {
+    ReplServer &codec = getCodec();
+
+    std::vector<uint8_t> msg, buf;
+    makePlotMsg(msg, state.param);
+    if (decode)
+        codec.encodePayload(msg, caps);
+
+    for (unsigned long i=0; i<state.iterations; i++) {
+        buf = msg;
+        if (decode)
+            codec.decodePayload(buf);
+        else
+            codec.encodePayload(buf, caps);
+    }
+    state.items = state.iterations * state.param;
+}
+
+void benchEncodeCompact(bench_state &state) {
+    benchCodec(state, cap_compact_plots, false);
+}
+
+void benchDecodeCompact(bench_state &state) {
+    benchCodec(state, cap_compact_plots, true);
+}
+
+void benchEncodeCompactLZ4(bench_state &state) {
+    benchCodec(state, cap_compact_plots | cap_lz4, false);
+}
+
+void benchDecodeCompactLZ4(bench_state &state) {
+    benchCodec(state, cap_compact_plots | cap_lz4, true);
+}
+
+/*****************************************************************************************
+ * LZ4Block - param is the input size, serialized plots so it compresses like real traffic
+ *****************************************************************************************/
+
+void makeLZ4Input(std::vector<uint8_t> &buf, unsigned long size) {
+    std::vector<DronePlot> plots;
+    makePlots(plots, size / DronePlot::getDataSize() + 1);
+    buf.clear();
+    for (auto &plot : plots)
+        plot.serialize(buf);
+    buf.resize(size);
+}
+
+void benchLZ4Compress(bench_state &state) {
+    std::vector<uint8_t> input, buf;
+    makeLZ4Input(input, state.param);
+
+    for (unsigned long i=0; i<state.iterations; i++) {
+        buf.clear();
+        LZ4Block::compress(input.data(), input.size(), buf);
+    }
+    state.bytes = state.iterations * state.param;
+}
+
+void benchLZ4Decompress(bench_state &state) {
+    std::vector<uint8_t> input, compressed, buf;
+    makeLZ4Input(input, state.param);
+    LZ4Block::compress(input.data(), input.size(), compressed);
+
+    for (unsigned long i=0; i<state.iterations; i++) {
+        buf.clear();
+        LZ4Block::decompress(compressed.data(), compressed.size(), input.size(), buf);
+    }
+    state.bytes = state.iterations * state.param;
+}
+
+/*****************************************************************************************
+ * TimerWheel - param is how many other timers are armed. Each iteration moves one timer
+ *              to a new deadline (as a connection does between handshake and ACK) while
+ *              the wheel ticks along, so cascades are included
+ *****************************************************************************************/
+
+void benchTimerRearm(bench_state &state) {
+    simtime_t now = 0;
+    TimerWheel wheel(now);
+    std::vector<std::unique_ptr<TimerWheel::Timer>> timers;
+    std::uniform_int_distribution<simtime_t> delay(1, 60 * simtime_per_sec);
+
+    for (unsigned long i=0; i<state.param + 1; i++) {
+        timers.emplace_back(new TimerWheel::Timer([]() {}));
+        wheel.arm(*timers.back(), delay(rng));
+    }
+
+    for (unsigned long i=0; i<state.iterations; i++) {
+        now += default_timer_tick / 4;
+        wheel.arm(*timers[i % timers.size()], now + delay(rng));
+        wheel.advance(now);
+    }
+    state.items = state.iterations;
+}
+
+std::vector<bench_def> benchmarks = {
+    {"serialize",            benchSerialize,        {1, 100, 10000}},
+    {"deserialize",          benchDeserialize,      {1, 100, 10000}},
+    {"addPlot_threads",      benchAddPlot,          {1, 2, 4, 8}},
+    {"addPlots",             benchAddPlots,         {100, 10000}},
+    {"sortByTime",           benchSortByTime,       {1000, 10000, 100000}},
+    {"loadBinaryFile",       benchLoadBinaryFile,   {1000, 10000, 100000}},
+    {"loadCSVFile",          benchLoadCSVFile,      {1000, 10000, 100000}},
+    {"encryptData",          benchEncrypt,          {64, 4096, 65536}},
+    {"decryptData",          benchDecrypt,          {64, 4096, 65536}},
+    {"findCmd",              benchFindCmd,          {64, 4096, 65536}},
+    {"getCmdData",           benchGetCmdData,       {64, 4096, 65536}},
+    {"encode_compact",       benchEncodeCompact,    {10, 100, 10000}},
+    {"decode_compact",       benchDecodeCompact,    {10, 100, 10000}},
+    {"encode_compact_lz4",   benchEncodeCompactLZ4, {10, 100, 10000}},
+    {"decode_compact_lz4",   benchDecodeCompactLZ4, {10, 100, 10000}},
+    {"lz4_compress",         benchLZ4Compress,      {1024, 65536, 1048576}},
+    {"lz4_decompress",       benchLZ4Decompress,    {1024, 65536, 1048576}},
+    {"timer_rearm",          benchTimerRearm,       {10, 1000, 100000}},
+};
+
+/*****************************************************************************************
+ * runBench - runs fn with param, growing the iteration count until a run takes at least
+ *            min_time, and returns the state from that final run
+ *****************************************************************************************/
+
+bench_state runBench(bench_fn fn, unsigned long param, simtime_t min_time) {
+    const unsigned long max_iterations = 1000000000;
+
+    unsigned long iterations = 1;
+    while (true) {
+        bench_state state;
+        state.iterations = iterations;
+        state.param = param;
+        state.resumeTiming();
+        fn(state);
+        state.pauseTiming();
+
+        if ((state.elapsed >= min_time) || (iterations >= max_iterations))
+            return state;
+
+        // Aim a little past min_time, but never grow more than 10x from one try
+        double scale = (state.elapsed > 0) ? 1.4 * (double) min_time / (double) state.elapsed : 10.0;
+        scale = std::min(std::max(scale, 2.0), 10.0);
+        iterations = std::min((unsigned long) (iterations * scale), max_iterations);
+    }
+}
+
+/*****************************************************************************************
+ * displayHelp - Shows command line parameters to the user.
+ *****************************************************************************************/
+
+void displayHelp(const char *execname) {
+    std::cout << execname << " [-f <filter>] [-t <secs>] [-j] [-l]\n";
+    std::cout << "   f: only run benchmarks whose name contains this string\n";
+    std::cout << "   t: minimum time (real seconds) to run each benchmark for (default: 0.5)\n";
+    std::cout << "   j: write results as JSON lines instead of a table\n";
+    std::cout << "   l: list the benchmarks and exit\n";
+}
+
+
+int main(int argc, char *argv[]) {
+
+    std::string filter;
+    double min_time = 0.5;
+    bool json = false;
+    bool list = false;
+
+    int c = 0;
+    while ((c = getopt(argc, argv, "f:t:jlh")) != -1) {
+        switch (c) {
+            case 'f':
+                filter = optarg;
+                break;
+            case 't':
+                min_time = strtod(optarg, NULL);
+                break;
+            case 'j':
+                json = true;
+                break;
+            case 'l':
+                list = true;
+                break;
+            default:
+                displayHelp(argv[0]);
+                exit(0);
+        }
+    }
+
+    if (!json && !list) {
+        std::cout << std::left << std::setw(32) << "benchmark" << std::right <<
+                     std::setw(10) << "iters" << std::setw(16) << "ns/iter" <<
+                     std::setw(16) << "items/s" << std::setw(12) << "MB/s" << "\n";
+    }
+
+    try {
+        for (auto &bench : benchmarks) {
+            if ((filter.size() > 0) && (strstr(bench.name, filter.c_str()) == NULL))
+                continue;
+
+            for (unsigned long param : bench.params) {
+                std::stringstream name;
+                name << bench.name << "/" << param;
+                if (list) {
+                    std::cout << name.str() << "\n";
+                    continue;
+                }
+
+                bench_state state = runBench(bench.fn, param, secsToSimTime(min_time));
+
+                double ns_per_iter = (double) state.elapsed / state.iterations;
+                double secs = simTimeToSecs(state.elapsed);
+                double items_per_sec = (state.items > 0) ? state.items / secs : 0.0;
+                double mb_per_sec = (state.bytes > 0) ? state.bytes / secs / 1e6 : 0.0;
+
+                if (json) {
+                    std::cout << "{\"name\": \"" << name.str() << "\", \"iterations\": " <<
+                                 state.iterations << ", \"ns_per_iter\": " << ns_per_iter <<
+                                 ", \"items_per_sec\": " << items_per_sec <<
+                                 ", \"mb_per_sec\": " << mb_per_sec << "}\n";
+                } else {
+                    std::cout << std::left << std::setw(32) << name.str() << std::right <<
+                                 std::setw(10) << state.iterations << std::fixed <<
+                                 std::setprecision(1) << std::setw(16) << ns_per_iter <<
+                                 std::setprecision(0) << std::setw(16) << items_per_sec <<
+                                 std::setprecision(1) << std::setw(12) << mb_per_sec << "\n";
+                }
+                std::cout.flush();
+            }
+        }
+    } catch (std::exception &e) {
+        std::cerr << "Benchmark failed: " << e.what() << "\n";
+        return -1;
+    }
+
+    return 0;
+}
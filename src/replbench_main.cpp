@@ -0,0 +1,432 @@
+/****************************************************************************************
+ * replbench_main - End-to-end replication benchmark. Starts N replication servers in this
+ *                  process on loopback ports, feeds each one synthetic drone plots at a set
+ *                  rate, then waits for every server to hold every plot. Reports how long
+ *                  that took, replication latency percentiles, bytes on the wire and CPU
+ *                  time per plot as one line of JSON so runs can be compared by script.
+ *
+ *                  Each run works in a fresh temp directory with its own servers.txt,
+ *                  whitelist and random sharedkey.bin, so it does not touch the real ones.
+ *
+ ****************************************************************************************/
+
+#include <stdexcept>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <memory>
+#include <random>
+#include <atomic>
+#include <getopt.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/resource.h>
+#include "DronePlotDB.h"
+#include "ReplServer.h"
+#include "SimClock.h"
+#include "strfuncts.h"
+
+using namespace std;
+
+// One replication server and the database it serves
+struct bench_node {
+    unsigned int index;
+    DronePlotDB db;
+    std::unique_ptr<ReplServer> server;
+    pthread_t repl_thread;
+    pthread_t feed_thread;
+};
+
+// Settings shared by the feeder threads
+struct bench_config {
+    SimClock *clock;
+    double rate;                  // Plots per real second per node
+    simtime_t duration;           // Real nanoseconds to inject for
+    unsigned int drones;          // Drones per node
+    std::atomic<unsigned long> injected{0};
+};
+
+struct feed_args {
+    bench_node *node;
+    bench_config *config;
+};
+
+/*****************************************************************************************
+ * t_replserver - runs a node's replication loop until it is shut down
+ *****************************************************************************************/
+
+void *t_replserver(void *data) {
+    bench_node *node = static_cast<bench_node *>(data);
+
+    try {
+        node->server->replicate();
+    } catch (std::exception &e) {
+        std::cerr << "Node " << node->index + 1 << " replication failed: " << e.what() << "\n";
+    }
+    return NULL;
+}
+
+/*****************************************************************************************
+ * t_feeder - injects plots into one node's database at the configured rate, in a burst
+ *            every few milliseconds. Each drone wanders from a random start point so
+ *            consecutive plots look like a real track
+ *****************************************************************************************/
+
+void *t_feeder(void *data) {
+    feed_args *args = static_cast<feed_args *>(data);
+    bench_node *node = args->node;
+    bench_config *config = args->config;
+
+    const simtime_t burst_interval = 5 * simtime_per_ms;
+
+    std::mt19937 rng(node->index + 1);
+    std::uniform_real_distribution<float> start_lat(39.0f, 40.0f), start_lon(-85.0f, -84.0f);
+    std::uniform_real_distribution<float> step(-0.0005f, 0.0005f);
+
+    std::vector<float> lat(config->drones), lon(config->drones);
+    std::vector<simtime_t> last_time(config->drones, simtime_min);
+    for (unsigned int i=0; i<config->drones; i++) {
+        lat[i] = start_lat(rng);
+        lon[i] = start_lon(rng);
+    }
+
+    std::vector<DronePlot> burst;
+    simtime_t start = SimClock::monoNow();
+    unsigned long sent = 0;
+    unsigned int drone = 0;
+    while (true) {
+        simtime_t elapsed = SimClock::monoNow() - start;
+        if (elapsed > config->duration)
+            elapsed = config->duration;
+
+        unsigned long due = (unsigned long) (config->rate * simTimeToSecs(elapsed));
+        unsigned long burst_start = sent;
+        for ( ; sent < due; sent++) {
+
+            // Drone IDs are unique across nodes, and each track's timestamps strictly increase
+            simtime_t now = config->clock->now();
+            if (now <= last_time[drone])
+                now = last_time[drone] + 1;
+            last_time[drone] = now;
+            lat[drone] += step(rng);
+            lon[drone] += step(rng);
+
+            burst.emplace_back(node->index * config->drones + drone + 1, node->index + 1, now,
+                               lat[drone], lon[drone]);
+
+            drone = (drone + 1) % config->drones;
+        }
+        node->db.addPlots(burst, DBFLAG_NEW);
+        burst.clear();
+        config->injected += sent - burst_start;
+
+        if (elapsed >= config->duration)
+            break;
+        usleep(burst_interval / 1000);
+    }
+    return NULL;
+}
+
+/*****************************************************************************************
+ * writeBenchFiles - creates the config files the servers read from the working directory
+ *****************************************************************************************/
+
+void writeBenchFiles(unsigned int nodes, unsigned short base_port) {
+    std::ofstream servers("servers.txt");
+    for (unsigned int i=0; i<nodes; i++)
+        servers << "ds" << i + 1 << ", 127.0.0.1, " << base_port + i << "\n";
+
+    std::ofstream whitelist("whitelist");
+    whitelist << "127.0.0.1\n";
+
+    std::random_device rd;
+    std::ofstream key("sharedkey.bin", std::ios::binary);
+    for (unsigned int i=0; i<16; i++)
+        key.put((char) (rd() & 0xFF));
+
+    if (!servers.good() || !whitelist.good() || !key.good())
+        throw std::runtime_error("Unable to write benchmark config files");
+}
+
+/*****************************************************************************************
+ * removeDir - deletes the files in a (flat) directory and then the directory
+ *****************************************************************************************/
+
+void removeDir(const std::string &dir) {
+    DIR *dp = opendir(dir.c_str());
+    if (dp == NULL)
+        return;
+
+    struct dirent *entry;
+    while ((entry = readdir(dp)) != NULL) {
+        std::string name = entry->d_name;
+        if ((name != ".") && (name != ".."))
+            unlink((dir + "/" + name).c_str());
+    }
+    closedir(dp);
+    rmdir(dir.c_str());
+}
+
+simtime_t cpuTime() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (simtime_t) (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * simtime_per_sec +
+           (simtime_t) (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000;
+}
+
+/*****************************************************************************************
+ * displayHelp - Shows command line parameters to the user.
+ *****************************************************************************************/
+
+void displayHelp(const char *execname) {
+    std::cout << execname << " [options]\n";
+    std::cout << "   n: number of replication servers (default: 3)\n";
+    std::cout << "   p: port of the first server, the rest count up from it (default: 9900)\n";
+    std::cout << "   r: plots per second (real time) injected into each server (default: 100)\n";
+    std::cout << "   d: seconds (real time) to inject for (default: 5)\n";
+    std::cout << "   D: drones per server (default: 10)\n";
+    std::cout << "   t: time multiplier for the servers' sim clock (default: 10)\n";
+    std::cout << "   w: seconds to wait for convergence after injection ends (default: 60)\n";
+    std::cout << "   g: gossip fanout (default: 0, send to every server directly)\n";
+    std::cout << "   z: compression threshold in bytes (default: server default, 0 = off)\n";
+    std::cout << "   B: listen backlog of each server (default: " << default_backlog << ")\n";
+    std::cout << "   T: TCP only - servers do not replicate to each other through shared memory\n";
+    std::cout << "   M: multicast group:port the servers send plot batches to (default: none)\n";
+    std::cout << "   U: servers run their peer sockets on io_uring\n";
+    std::cout << "   F: servers send to each other with the one round-trip handshake\n";
+    std::cout << "   o: file to write the JSON results to (default: stdout)\n";
+    std::cout << "   v: server verbosity (default: 0, server output is discarded)\n";
+}
+
+
+int main(int argc, char *argv[]) {
+
+    unsigned int num_nodes = 3;
+    unsigned short base_port = 9900;
+    double rate = 100.0;
+    double duration = 5.0;
+    unsigned int drones = 10;
+    double time_mult = 10.0;
+    double max_wait = 60.0;
+    unsigned int gossip_fanout = 0;
+    long compress_min = -1;
+    int backlog = default_backlog;
+    bool use_shm = true;
+    bool use_ring = false;
+    bool fast_handshake = false;
+    std::string mcast_group;
+    unsigned short mcast_port = 0;
+    unsigned int verbosity = 0;
+    std::string outfile;
+
+    int c = 0;
+    while ((c = getopt(argc, argv, "n:p:r:d:D:t:w:g:z:B:TM:UFo:v:h")) != -1) {
+        switch (c) {
+            case 'n':
+                num_nodes = (unsigned int) strtol(optarg, NULL, 10);
+                break;
+            case 'p':
+                base_port = (unsigned short) strtol(optarg, NULL, 10);
+                break;
+            case 'r':
+                rate = strtod(optarg, NULL);
+                break;
+            case 'd':
+                duration = strtod(optarg, NULL);
+                break;
+            case 'D':
+                drones = (unsigned int) strtol(optarg, NULL, 10);
+                break;
+            case 't':
+                time_mult = strtod(optarg, NULL);
+                break;
+            case 'w':
+                max_wait = strtod(optarg, NULL);
+                break;
+            case 'g':
+                gossip_fanout = (unsigned int) strtol(optarg, NULL, 10);
+                break;
+            case 'z':
+                compress_min = strtol(optarg, NULL, 10);
+                break;
+            case 'B':
+                backlog = (int) strtol(optarg, NULL, 10);
+                break;
+            case 'T':
+                use_shm = false;
+                break;
+            case 'U':
+                use_ring = true;
+                break;
+            case 'F':
+                fast_handshake = true;
+                break;
+            case 'M':
+                {
+                    std::string arg = optarg, port_str;
+                    if (split(arg, mcast_group, port_str, ':'))
+                        mcast_port = (unsigned short) strtol(port_str.c_str(), NULL, 10);
+                }
+                break;
+            case 'o':
+                outfile = optarg;
+                break;
+            case 'v':
+                verbosity = (unsigned int) strtol(optarg, NULL, 10);
+                break;
+            default:
+                displayHelp(argv[0]);
+                exit(0);
+        }
+    }
+
+    if ((num_nodes < 2) || (rate <= 0.0) || (duration <= 0.0) || (drones == 0) ||
+        (time_mult <= 0.0) || (backlog <= 0) || ((mcast_group.size() > 0) && (mcast_port == 0))) {
+        std::cerr << "Need at least 2 servers and positive rate, duration, drones and time multiplier.\n";
+        displayHelp(argv[0]);
+        exit(0);
+    }
+
+    // Work in a scratch directory so the servers find our config files
+    char dirtemplate[] = "/tmp/replbench.XXXXXX";
+    if (mkdtemp(dirtemplate) == NULL) {
+        std::cerr << "Unable to create a working directory.\n";
+        exit(-1);
+    }
+    std::string workdir(dirtemplate);
+    char origdir[4096];
+    if ((getcwd(origdir, sizeof(origdir)) == NULL) || (chdir(workdir.c_str()) != 0)) {
+        std::cerr << "Unable to change to the working directory.\n";
+        exit(-1);
+    }
+    writeBenchFiles(num_nodes, base_port);
+
+    // Keep the servers' console chatter out of the results unless asked for it
+    std::ofstream devnull("/dev/null");
+    std::streambuf *cout_buf = std::cout.rdbuf();
+    if (verbosity == 0)
+        std::cout.rdbuf(devnull.rdbuf());
+
+    // All servers share one clock, so skew estimation settles at once
+    SimClock clock(time_mult);
+
+    bench_config config;
+    config.clock = &clock;
+    config.rate = rate;
+    config.duration = secsToSimTime(duration);
+    config.drones = drones;
+
+    std::vector<std::unique_ptr<bench_node>> nodes;
+    for (unsigned int i=0; i<num_nodes; i++) {
+        std::unique_ptr<bench_node> node(new bench_node());
+        node->index = i;
+        node->server.reset(new ReplServer(node->db, "127.0.0.1", base_port + i, clock, verbosity));
+        node->server->setGossipFanout(gossip_fanout);
+        if (compress_min >= 0)
+            node->server->setCompression((unsigned int) compress_min);
+        node->server->setListenBacklog(backlog);
+        node->server->setSharedMemory(use_shm);
+        node->server->setIOUring(use_ring);
+        node->server->setFastHandshake(fast_handshake);
+        if (mcast_group.size() > 0)
+            node->server->setMulticast(mcast_group.c_str(), mcast_port);
+        nodes.push_back(std::move(node));
+    }
+
+    for (unsigned int i=0; i<num_nodes; i++) {
+        if (pthread_create(&nodes[i]->repl_thread, NULL, t_replserver, nodes[i].get()) != 0)
+            throw std::runtime_error("Unable to create replication server thread");
+    }
+
+    // Give the servers a moment to bind and measure each other's clocks
+    sleep(1);
+
+    simtime_t cpu_start = cpuTime();
+    simtime_t start = SimClock::monoNow();
+
+    std::vector<feed_args> args(num_nodes);
+    for (unsigned int i=0; i<num_nodes; i++) {
+        args[i].node = nodes[i].get();
+        args[i].config = &config;
+        if (pthread_create(&nodes[i]->feed_thread, NULL, t_feeder, &args[i]) != 0)
+            throw std::runtime_error("Unable to create feeder thread");
+    }
+    for (unsigned int i=0; i<num_nodes; i++)
+        pthread_join(nodes[i]->feed_thread, NULL);
+
+    simtime_t inject_end = SimClock::monoNow();
+
+    // Converged once every server holds every plot
+    size_t total = config.injected.load();
+
+    bool converged = false;
+    simtime_t deadline = inject_end + secsToSimTime(max_wait);
+    while (SimClock::monoNow() < deadline) {
+        converged = true;
+        for (unsigned int i=0; i<num_nodes; i++) {
+            if (nodes[i]->db.size() < total)
+                converged = false;
+        }
+        if (converged)
+            break;
+        usleep(1000);
+    }
+    simtime_t end = SimClock::monoNow();
+    simtime_t cpu_used = cpuTime() - cpu_start;
+
+    for (unsigned int i=0; i<num_nodes; i++)
+        nodes[i]->server->shutdown();
+    for (unsigned int i=0; i<num_nodes; i++)
+        pthread_join(nodes[i]->repl_thread, NULL);
+
+    std::cout.rdbuf(cout_buf);
+
+    // Combine every server's view of replication latency and traffic
+    Histogram latency;
+    uint64_t bytes_sent = 0;
+    for (unsigned int i=0; i<num_nodes; i++) {
+        latency.merge(nodes[i]->server->getMetrics().repl_latency);
+        bytes_sent += nodes[i]->server->getMetrics().getTotalBytesSent();
+    }
+
+    std::stringstream results;
+    results << "{\"nodes\": " << num_nodes <<
+               ", \"rate_per_node\": " << rate <<
+               ", \"inject_secs\": " << simTimeToSecs(inject_end - start) <<
+               ", \"time_mult\": " << time_mult <<
+               ", \"gossip_fanout\": " << gossip_fanout <<
+               ", \"shared_memory\": " << (use_shm ? "true" : "false") <<
+               ", \"multicast\": " << ((mcast_group.size() > 0) ? "true" : "false") <<
+               ", \"io_uring\": " << (use_ring ? "true" : "false") <<
+               ", \"fast_handshake\": " << (fast_handshake ? "true" : "false") <<
+               ", \"plots\": " << total <<
+               ", \"converged\": " << (converged ? "true" : "false") <<
+               ", \"convergence_secs\": " << simTimeToSecs(end - inject_end) <<
+               ", \"repl_latency_p50_ms\": " << (double) latency.getPercentile(50.0) / 1e6 <<
+               ", \"repl_latency_p99_ms\": " << (double) latency.getPercentile(99.0) / 1e6 <<
+               ", \"repl_latency_max_ms\": " << (double) latency.getMax() / 1e6 <<
+               ", \"bytes_sent\": " << bytes_sent <<
+               ", \"bytes_per_plot\": " << ((total > 0) ? (double) bytes_sent / total : 0.0) <<
+               ", \"cpu_us_per_plot\": " <<
+                     ((total > 0) ? (double) cpu_used / 1000.0 / total : 0.0) << "}\n";
+
+    nodes.clear();
+    if (chdir(origdir) != 0)
+        std::cerr << "Unable to return to " << origdir << "\n";
+    removeDir(workdir);
+
+    if (outfile.size() > 0) {
+        std::ofstream out(outfile);
+        out << results.str();
+        if (!out.good()) {
+            std::cerr << "Unable to write results to " << outfile << "\n";
+            return -1;
+        }
+    } else {
+        std::cout << results.str();
+    }
+
+    return converged ? 0 : 1;
+}
@@ -10,6 +10,7 @@
 
 #include <stdexcept>
 #include <iostream>
+#include <memory>
 #include <getopt.h>
 #include <pthread.h>
 #include <signal.h>
@@ -53,18 +54,54 @@ void *t_replserver(void *data) {
     return NULL;
 }
 
+/*****************************************************************************************
+ * onDumpSignal - SIGUSR1 handler, asks the replication server to write out its metrics
+ *
+ *****************************************************************************************/
+
+void onDumpSignal(int signum) {
+    (void) signum;
+    Metrics::requestDump();
+}
+
 /*****************************************************************************************
  * displayHelp - Shows command line parameters to the user.
  *****************************************************************************************/
 
 void displayHelp(const char *execname) {
     std::cout << execname << " <sim_data>\n";
+    std::cout << "   sim_data: raw .bin file or plot archive (.pda) to replay (not needed with -l)\n";
     std::cout << "   a: IP address to bind the server to (default: 127.0.0.1)\n";
     std::cout << "   p: Port to bind the server to (default: 9999)\n";
     std::cout << "   t: time multiplier - t=2.0 runs the sim at 2x speed\n";
     std::cout << "   o: the file to write the DB dump CSV to (default: replication_db.cv)\n";
     std::cout << "   d: duration - seconds in \"sim time\" to run the sim\n";
     std::cout << "   v: verbosity - how much information to send to stdout (0-3, 3=max)\n";
+    std::cout << "   g: gossip fanout - send batches to this many random servers, which forward\n";
+    std::cout << "      them on (default: 0, send to every server directly)\n";
+    std::cout << "   z: compress payloads of at least this many bytes to peers that support it\n";
+    std::cout << "      (default: 512, 0 = never compress)\n";
+    std::cout << "   m: file to append metrics reports to (sent to stdout if not set). A report\n";
+    std::cout << "      is also written on SIGUSR1 and when the server exits\n";
+    std::cout << "   i: seconds (real time) between metrics reports (default: 0, only on\n";
+    std::cout << "      SIGUSR1 and exit)\n";
+    std::cout << "   s: localhost port to serve live stats on for Prometheus scrapers\n";
+    std::cout << "      (default: 0, disabled)\n";
+    std::cout << "   l: synthetic load - generate this many plots per second (sim time) from\n";
+    std::cout << "      synthetic drones instead of replaying sim_data\n";
+    std::cout << "   n: number of synthetic drones (default: 1000)\n";
+    std::cout << "   b: milliseconds (real time) between synthetic injection bursts (default: 100)\n";
+    std::cout << "   N: node ID for synthetic plots, also keeps drone IDs unique per node\n";
+    std::cout << "      (default: 1)\n";
+    std::cout << "   B: listen backlog - peer connections the kernel holds for us before refusing\n";
+    std::cout << "      more (default: " << default_backlog << ")\n";
+    std::cout << "   T: TCP only - do not use shared memory for servers on this host\n";
+    std::cout << "   M: multicast group:port - send plot batches once to this group, e.g.\n";
+    std::cout << "      239.255.42.99:47000 (every server must use the same one)\n";
+    std::cout << "   U: run peer sockets and the CSV dump on io_uring (falls back to poll and\n";
+    std::cout << "      plain writes if the kernel has none)\n";
+    std::cout << "   F: send to peers with the one round-trip handshake (every server must\n";
+    std::cout << "      support it, and host clocks must be within 30 seconds of each other)\n";
 }
 
 
@@ -72,11 +109,24 @@ int main(int argc, char *argv[]) {
 
     // ****** Initialization variables ******
     // time_mult - speeds up the simulation by the multiplier (2.0 runs twice as fast)
-    float time_mult = 1.0;
+    double time_mult = 1.0;
     unsigned int verbosity = 0;
     int sim_time = 900; // Default 900 seconds
     std::string ip_addr = "127.0.0.1";
     unsigned short port = 9999;
+    unsigned int gossip_fanout = 0;
+    long compress_min = -1;     // Leave the server's default
+    std::string metrics_file;
+    double metrics_interval = 0.0;
+    unsigned short stats_port = 0;
+    int backlog = default_backlog;
+    bool use_shm = true;
+    bool use_ring = false;
+    bool fast_handshake = false;
+    std::string mcast_group;
+    unsigned short mcast_port = 0;
+    synth_config synth;
+    synth.plots_per_sec = 0.0;  // Replay sim_data unless -l is given
 
     // Filename to write the replication output
     std::string outfile("replication_db.csv");
@@ -87,7 +137,7 @@ int main(int argc, char *argv[]) {
     // will appear in case 1
     unsigned long portval;
     int c = 0;
-    while ((c = getopt(argc, argv, "-o:t:v:d:p:a:")) != -1) {
+    while ((c = getopt(argc, argv, "-o:t:v:d:p:a:g:z:m:i:s:l:n:b:N:B:TM:UF")) != -1) {
         switch (c) {
 
             // The inject database file specified in the command line
@@ -113,7 +163,7 @@ int main(int argc, char *argv[]) {
 
                 // time multiplier
             case 't':
-                time_mult = strtof(optarg, NULL);
+                time_mult = strtod(optarg, NULL);
                 if (time_mult <= 0.0) {
                     std::cerr << "Invalid time multiplier. Must be > 0.\n";
                     exit(0);
@@ -138,6 +188,116 @@ int main(int argc, char *argv[]) {
                 }
                 break;
 
+                // Gossip fanout (0 = disabled)
+            case 'g':
+                gossip_fanout = (unsigned int) strtol(optarg, NULL, 10);
+                break;
+
+                // Compression threshold (0 = disabled)
+            case 'z':
+                compress_min = strtol(optarg, NULL, 10);
+                if (compress_min < 0) {
+                    std::cerr << "Invalid compression threshold. Must be >= 0.\n";
+                    exit(0);
+                }
+                break;
+
+                // Metrics report file
+            case 'm':
+                metrics_file = optarg;
+                break;
+
+                // Seconds between metrics reports
+            case 'i':
+                metrics_interval = strtod(optarg, NULL);
+                if (metrics_interval < 0.0) {
+                    std::cerr << "Invalid metrics interval. Must be >= 0.\n";
+                    exit(0);
+                }
+                break;
+
+                // Stats port (0 = disabled)
+            case 's':
+                portval = strtol(optarg, NULL, 10);
+                if (portval > 65535) {
+                    std::cerr << "Invalid stats port. Value must be between 0 and 65535\n";
+                    exit(0);
+                }
+                stats_port = (unsigned short) portval;
+                break;
+
+                // Synthetic load rate (plots/sec)
+            case 'l':
+                synth.plots_per_sec = strtod(optarg, NULL);
+                if (synth.plots_per_sec <= 0.0) {
+                    std::cerr << "Invalid synthetic load rate. Must be > 0.\n";
+                    exit(0);
+                }
+                break;
+
+                // Number of synthetic drones
+            case 'n':
+                synth.num_drones = (unsigned int) strtol(optarg, NULL, 10);
+                if (synth.num_drones == 0) {
+                    std::cerr << "Invalid number of synthetic drones. Must be > 0.\n";
+                    exit(0);
+                }
+                break;
+
+                // Milliseconds between synthetic bursts
+            case 'b':
+                synth.burst_interval = strtol(optarg, NULL, 10) * simtime_per_ms;
+                if (synth.burst_interval <= 0) {
+                    std::cerr << "Invalid burst interval. Must be > 0.\n";
+                    exit(0);
+                }
+                break;
+
+                // Node ID for synthetic plots
+            case 'N':
+                synth.node_id = (unsigned int) strtol(optarg, NULL, 10);
+                if (synth.node_id == 0) {
+                    std::cerr << "Invalid node ID. Must be > 0.\n";
+                    exit(0);
+                }
+                break;
+
+                // Listen backlog
+            case 'B':
+                backlog = (int) strtol(optarg, NULL, 10);
+                if (backlog <= 0) {
+                    std::cerr << "Invalid listen backlog. Must be > 0.\n";
+                    exit(0);
+                }
+                break;
+
+                // TCP only, even to servers on this host
+            case 'T':
+                use_shm = false;
+                break;
+
+                // Sockets and file writes through io_uring
+            case 'U':
+                use_ring = true;
+                break;
+
+                // Send to peers with the one round-trip handshake
+            case 'F':
+                fast_handshake = true;
+                break;
+
+                // Multicast group for plot batches
+            case 'M':
+                {
+                    std::string arg = optarg, port_str;
+                    if (!split(arg, mcast_group, port_str, ':') ||
+                            ((mcast_port = (unsigned short) strtol(port_str.c_str(), NULL, 10)) == 0)) {
+                        std::cerr << "Invalid multicast group. Must be <group address>:<port>.\n";
+                        exit(0);
+                    }
+                }
+                break;
+
                 // IP address to attempt to bind to
             case 'o':
                 outfile = optarg;
@@ -155,38 +315,60 @@ int main(int argc, char *argv[]) {
 
     }
 
-    if (simdata_file.size() == 0) {
-        std::cerr << "You must specify the sim_data inject database file.\n";
+    if ((simdata_file.size() == 0) && (synth.plots_per_sec <= 0.0)) {
+        std::cerr << "You must specify the sim_data inject database file or a synthetic load.\n";
         displayHelp(argv[0]);
         exit(0);
     }
 
     DronePlotDB db;
 
+    // The simulation clock, shared by the simulator and the replication server
+    SimClock clock(time_mult);
+
     // Kick off the simulation thread by creating the sim management object
     // This will raise a runtime_exception if the simdata database load fails
-    AntennaSim sim(db, simdata_file.c_str(), time_mult, verbosity);
+    std::unique_ptr<AntennaSim> sim;
+    if (synth.plots_per_sec > 0.0)
+        sim.reset(new AntennaSim(db, synth, clock, verbosity));
+    else
+        // Plots due exactly as the run ends still get injected, so the window takes them too
+        sim.reset(new AntennaSim(db, simdata_file.c_str(), clock, verbosity,
+                                 sim_time * simtime_per_sec + 1));
 
     // Launch the thread
     pthread_t simthread;
-    if (pthread_create(&simthread, NULL, t_simulator, (void *) &sim) != 0)
+    if (pthread_create(&simthread, NULL, t_simulator, (void *) sim.get()) != 0)
         throw std::runtime_error("Unable to create simulator thread");
 
     // Start the replication server
-    ReplServer repl_server(db, ip_addr.c_str(), port, sim.getOffset(), time_mult, verbosity);
+    ReplServer repl_server(db, ip_addr.c_str(), port, clock, verbosity);
+    repl_server.setGossipFanout(gossip_fanout);
+    if (compress_min >= 0)
+        repl_server.setCompression((unsigned int) compress_min);
+    if ((metrics_file.size() > 0) || (metrics_interval > 0.0))
+        repl_server.setMetricsFile(metrics_file.c_str(), secsToSimTime(metrics_interval));
+    repl_server.setStatsPort(stats_port);
+    repl_server.setListenBacklog(backlog);
+    repl_server.setSharedMemory(use_shm);
+    repl_server.setIOUring(use_ring);
+    repl_server.setFastHandshake(fast_handshake);
+    if (mcast_group.size() > 0)
+        repl_server.setMulticast(mcast_group.c_str(), mcast_port);
+    signal(SIGUSR1, onDumpSignal);
 
     pthread_t replthread;
     if (pthread_create(&replthread, NULL, t_replserver, (void *) &repl_server) != 0)
         throw std::runtime_error("Unable to create replication server thread");
 
-    // Sleep the duration of the simulation
-    sleep(sim_time / time_mult);
+    // Sleep the duration of the simulation (in sim time, which started at the sim's offset)
+    clock.sleepUntil(sim->getOffset() + sim_time * simtime_per_sec);
 
     // Stop the replication server
     repl_server.shutdown();
 
     // Stop the thread
-    sim.terminate();
+    sim->terminate();
 
     // Wait until the thread has exited
     pthread_join(simthread, NULL);
@@ -195,6 +377,7 @@ int main(int argc, char *argv[]) {
     // Write the replication database to a CSV file
     std::cout << "Writing results to: " << outfile << "\n";
     db.sortByTime();
+    db.setIOUring(use_ring);
     db.writeCSVFile(outfile.c_str());
 
     return 0;
@@ -8,6 +8,17 @@
 #include <chrono>
 #include "strfuncts.h"
 
+// Value of a hex digit, -1 if it is not one
+static int hexDigit(char c) {
+   if ((c >= '0') && (c <= '9'))
+      return c - '0';
+   if ((c >= 'a') && (c <= 'f'))
+      return c - 'a' + 10;
+   if ((c >= 'A') && (c <= 'F'))
+      return c - 'A' + 10;
+   return -1;
+}
+
 /*******************************************************************************************
  * clrNewlines - removes \r and \n from the string passed into buf
  *******************************************************************************************/
@@ -94,4 +105,39 @@ void genRandString(std::string &buf, size_t n) {
       buf += char_gen();
 }
 
+/*******************************************************************************************
+ * toHex - writes len bytes from data into hex as lowercase hex digits
+ *
+ *******************************************************************************************/
+
+void toHex(const uint8_t *data, size_t len, std::string &hex) {
+   static const char digits[] = "0123456789abcdef";
+
+   hex.clear();
+   hex.reserve(len * 2);
+   for (size_t i=0; i<len; i++) {
+      hex += digits[data[i] >> 4];
+      hex += digits[data[i] & 0xf];
+   }
+}
+
+/*******************************************************************************************
+ * fromHex - turns hex digits (either case) back into bytes
+ *
+ *    Returns: false if hex has an odd length or anything that is not a hex digit
+ *******************************************************************************************/
+
+bool fromHex(const std::string &hex, std::vector<uint8_t> &data) {
+   if (hex.size() % 2 != 0)
+      return false;
 
+   data.clear();
+   data.reserve(hex.size() / 2);
+   for (size_t i=0; i<hex.size(); i+=2) {
+      int hi = hexDigit(hex[i]), lo = hexDigit(hex[i + 1]);
+      if ((hi < 0) || (lo < 0))
+         return false;
+      data.push_back((uint8_t) ((hi << 4) | lo));
+   }
+   return true;
+}